@@ -7,6 +7,7 @@
 #include <cmath>
 #include <sstream>
 #include "clutil.h"
+#include "host_gemm.h"
 
 #ifdef USE_DOUBLE
 typedef double real_t;
@@ -25,22 +26,14 @@ std::vector< real_t > create_matrix(int cols, int rows) {
 
 
 //------------------------------------------------------------------------------
+//reference result computed by the cache blocked, multi-threaded host_gemm
 void host_matmul(const std::vector< real_t >& A,
 	             const std::vector< real_t >& B,
 	             std::vector< real_t >& C, 
+	             int a_rows,
 	             int a_columns,
 	             int b_columns) {
-	const int rows = a_columns;
-	const int columns = b_columns;
-	for(int r = 0; r != rows; ++r) {
-		for(int c = 0; c != columns; ++c) {
-			C[r*b_columns + c] = 0;
-			for(int ic = 0; ic != a_columns; ++ic) {
-				C[r*b_columns + c] += A[r*a_columns + ic]
-				                      * B[ic*b_columns + c];
-			}
-		}
-	}
+	host_gemm(a_rows, a_columns, b_columns, &A[0], &B[0], &C[0]);
 }
 
 //------------------------------------------------------------------------------
@@ -63,8 +56,11 @@ int main(int argc, char** argv) {
                   << std::endl;
         exit(EXIT_FAILURE);   
     }
-    const int SIZE = 16; //16 x 16
-    const size_t BYTE_SIZE = SIZE * SIZE * sizeof(real_t);
+    //C (M x N) = A (M x K) x B (K x N); sizes need not be multiples of
+    //the block size
+    const int M = 18;
+    const int K = 13;
+    const int N = 22;
     const int BLOCK_SIZE = 4; //4 x 4 tiles
     //setup text header that will be prefixed to opencl code
     std::ostringstream clheaderStream;
@@ -80,10 +76,11 @@ int main(int argc, char** argv) {
    
     cl_int status;
     //create input and output matrices
-    std::vector<real_t> A = create_matrix(SIZE, SIZE);
-    std::vector<real_t> B = create_matrix(SIZE, SIZE);
-    std::vector<real_t> C(SIZE * SIZE,real_t(0));
-    std::vector<real_t> refC(SIZE * SIZE,real_t(0));        
+    std::vector<real_t> A = create_matrix(K, M);
+    std::vector<real_t> B = create_matrix(N, K);
+    std::vector<real_t> C(M * N,real_t(0));
+    std::vector<real_t> refC(M * N,real_t(0));        
+    const size_t BYTE_SIZE = C.size() * sizeof(real_t);
     
     //allocate output buffer on OpenCL device
     cl_mem devC = clCreateBuffer(clenv.context,
@@ -96,13 +93,13 @@ int main(int argc, char** argv) {
     //allocate input buffers on OpenCL devices and copy data
     cl_mem devA = clCreateBuffer(clenv.context,
                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                 BYTE_SIZE,
+                                 A.size() * sizeof(real_t),
                                  &A[0], //<-- copy data from A
                                  &status);
     check_cl_error(status, "clCreateBuffer");                              
     cl_mem devB = clCreateBuffer(clenv.context,
                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                 BYTE_SIZE,
+                                 B.size() * sizeof(real_t),
                                  &B[0], //<-- copy data from B
                                  &status);
     check_cl_error(status, "clCreateBuffer");                              
@@ -126,13 +123,20 @@ int main(int argc, char** argv) {
     status = clSetKernelArg(clenv.kernel, //kernel
                             3,      //parameter id
                             sizeof(int), //size of parameter
-                            &SIZE); //pointer to parameter
-    check_cl_error(status, "clSetKernelArg(SIZE)");
+                            &M); //pointer to parameter
+    check_cl_error(status, "clSetKernelArg(a_rows)");
+    status = clSetKernelArg(clenv.kernel, 4, sizeof(int), &K);
+    check_cl_error(status, "clSetKernelArg(a_columns)");
+    status = clSetKernelArg(clenv.kernel, 5, sizeof(int), &N);
+    check_cl_error(status, "clSetKernelArg(b_columns)");
 
 
     //setup kernel launch configuration
-    //total number of threads == number of array elements
-    const size_t globalWorkSize[2] = {SIZE, SIZE};
+    //total number of threads == number of array elements rounded up to
+    //a multiple of the workgroup size; work items outside C do not write
+    const size_t globalWorkSize[2] = {
+        size_t((N + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE),
+        size_t((M + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE)};
     //number of per-workgroup local threads
     const size_t localWorkSize[2] = {BLOCK_SIZE, BLOCK_SIZE}; 
 
@@ -166,7 +170,7 @@ int main(int argc, char** argv) {
                                  0); //event identifying this specific operation
     check_cl_error(status, "clEnqueueReadBuffer");
     
-    host_matmul(A, B, refC, SIZE, SIZE);
+    host_matmul(A, B, refC, M, K, N);
 
     if(check_result(refC, C, EPS)) {
     	std::cout << "PASSED" << std::endl;
@@ -28,32 +28,157 @@ std::vector< real_t > create_vector(int size) {
 }
 
 //------------------------------------------------------------------------------
-real_t host_dot_product(const std::vector< real_t >& v1,
+//accumulates in double precision: with millions of elements the result is
+//beyond the range of integers exactly representable as float
+double host_dot_product(const std::vector< real_t >& v1,
                         const std::vector< real_t >& v2) {
-   return std::inner_product(v1.begin(), v1.end(), v2.begin(), real_t(0));
+   return std::inner_product(v1.begin(), v1.end(), v2.begin(), double(0));
 }
 
 //------------------------------------------------------------------------------
-bool check_result(real_t v1, real_t v2, double eps) {
+bool check_result(double v1, double v2, double eps) {
     if(double(std::fabs(v1 - v2)) > eps) return false;
     else return true; 
 }
 
+//------------------------------------------------------------------------------
+//computes the partial dot products of a chunk of the input vectors; errors
+//are reported through exceptions so that the chunk can be processed again
+//in smaller pieces when device resources are exhausted
+class DotChunk : public ChunkWork {
+public:
+    DotChunk(const CLEnv& clenv,
+             const std::vector< real_t >& V1,
+             const std::vector< real_t >& V2,
+             std::vector< real_t >& partialDot,
+             int blockSize)
+        : clenv_(clenv), V1_(V1), V2_(V2), partialDot_(partialDot),
+          blockSize_(blockSize) {}
+    void process(size_t offset, size_t count) {
+        const size_t BYTE_SIZE = count * sizeof(real_t);
+        const size_t REDUCED_SIZE = count / blockSize_;
+        const size_t REDUCED_BYTE_SIZE = REDUCED_SIZE * sizeof(real_t);
+        cl_int status;
+        //memory objects are released when leaving the function, also in
+        //case of errors
+        CLMemGuard guard;
+        //allocate output buffer on OpenCL device
+        //the partialReduction array contains a sequence of dot products
+        //computed on sub-arrays of size BLOCK_SIZE
+        cl_mem partialReduction = guard.add(clCreateBuffer(clenv_.context,
+                                                 CL_MEM_WRITE_ONLY,
+                                                 REDUCED_BYTE_SIZE,
+                                                 0,
+                                                 &status));
+        throw_cl_error(status, "clCreateBuffer");
+
+        //allocate input buffers on OpenCL devices and copy data
+        cl_mem devV1 = guard.add(clCreateBuffer(clenv_.context,
+                                      CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                      BYTE_SIZE,
+                                      //copy data from V1
+                                      const_cast< real_t* >(&V1_[offset]),
+                                      &status));
+        throw_cl_error(status, "clCreateBuffer");
+        cl_mem devV2 = guard.add(clCreateBuffer(clenv_.context,
+                                      CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                      BYTE_SIZE,
+                                      //copy data from V2
+                                      const_cast< real_t* >(&V2_[offset]),
+                                      &status));
+        throw_cl_error(status, "clCreateBuffer");
+
+        //set kernel parameters
+        status = clSetKernelArg(clenv_.kernel, //kernel
+                                0,      //parameter id
+                                sizeof(cl_mem), //size of parameter
+                                &devV1); //pointer to parameter
+        throw_cl_error(status, "clSetKernelArg(V1)");
+        status = clSetKernelArg(clenv_.kernel, //kernel
+                                1,      //parameter id
+                                sizeof(cl_mem), //size of parameter
+                                &devV2); //pointer to parameter
+        throw_cl_error(status, "clSetKernelArg(V2)");
+        status = clSetKernelArg(clenv_.kernel, //kernel
+                                2,      //parameter id
+                                sizeof(cl_mem), //size of parameter
+                                &partialReduction); //pointer to parameter
+        throw_cl_error(status, "clSetKernelArg(devOut)");
+
+        //setup kernel launch configuration
+        //total number of threads == number of array elements in chunk
+        const size_t globalWorkSize[1] = {count};
+        //number of per-workgroup local threads
+        const size_t localWorkSize[1] = {blockSize_}; 
+
+        //launch kernel
+        status = clEnqueueNDRangeKernel(clenv_.commandQueue, //queue
+                                        clenv_.kernel, //kernel
+                                        1, //number of dimensions for work-items
+                                        0, //global work offset
+                                        globalWorkSize, //total number of threads
+                                        localWorkSize, //threads per workgroup
+                                        0, //number of events that need to
+                                           //complete before kernel executed
+                                        0, //list of events that need to
+                                           //complete before kernel executed
+                                        0); //event object identifying this
+                                            //particular kernel execution
+                                            //instance
+        throw_cl_error(status, "clEnqueueNDRangeKernel");
+        
+        //read back results into the part of the output corresponding
+        //to this chunk; allocation failures might only be reported here
+        status = clEnqueueReadBuffer(clenv_.commandQueue,
+                                     partialReduction,
+                                     CL_TRUE, //blocking read
+                                     0, //offset
+                                     REDUCED_BYTE_SIZE, //byte size of data
+                                     //destination buffer in host memory
+                                     &partialDot_[offset / blockSize_],
+                                     0, //number of events that need to
+                                        //complete before transfer executed
+                                     0, //list of events that need to complete
+                                        //before transfer executed
+                                     0); //event identifying this specific
+                                         //operation
+        throw_cl_error(status, "clEnqueueReadBuffer");
+    }
+private:
+    const CLEnv& clenv_;
+    const std::vector< real_t >& V1_;
+    const std::vector< real_t >& V2_;
+    std::vector< real_t >& partialDot_;
+    size_t blockSize_;
+};
+
 //------------------------------------------------------------------------------
 int main(int argc, char** argv) {
     if(argc < 6) {
         std::cerr << "usage: " << argv[0]
                   << " <platform name> <device type = default | cpu | gpu "
-                     "| acc | all>  <device num> <OpenCL source file path>"
-                     " <kernel name>"
+                     "| acc | all | fastest | fastest-for:<kernel>>"
+                     "  <device num>"
+                     " <OpenCL source file path>"
+                     " <kernel name> [size, default 256]"
+                     " [initial chunk size, default size]\n"
+                     "  the input is processed in chunks: in case of"
+                     " allocation failures or lack of resources the chunk"
+                     " size is halved; size and chunk size must be evenly"
+                     " divisible by the workgroup size(16)"
                   << std::endl;
         exit(EXIT_FAILURE);   
     }
-    const int SIZE = 256;
-    const size_t BYTE_SIZE = SIZE * sizeof(real_t);
+    const int SIZE = argc > 6 ? atoi(argv[6]) : 256;
     const int BLOCK_SIZE = 16; 
+    const int CHUNK_SIZE = argc > 7 ? atoi(argv[7]) : SIZE;
     const int REDUCED_SIZE = SIZE / BLOCK_SIZE;
-    const int REDUCED_BYTE_SIZE = REDUCED_SIZE * sizeof(real_t);
+    if(SIZE < BLOCK_SIZE || SIZE % BLOCK_SIZE != 0
+       || CHUNK_SIZE < BLOCK_SIZE || CHUNK_SIZE % BLOCK_SIZE != 0) {
+        std::cerr << "ERROR - size and chunk size must be evenly divisible by "
+                  << BLOCK_SIZE << std::endl;
+        exit(EXIT_FAILURE);
+    }
     //setup text header that will be prefixed to opencl code
     std::ostringstream clheaderStream;
     clheaderStream << "#define BLOCK_SIZE " << BLOCK_SIZE << '\n';
@@ -66,108 +191,40 @@ int main(int argc, char** argv) {
     CLEnv clenv = create_clenv(argv[1], argv[2], atoi(argv[3]), false,
                                argv[4], argv[5], clheaderStream.str());
    
-    cl_int status;
     //create input and output matrices
     std::vector<real_t> V1 = create_vector(SIZE);
     std::vector<real_t> V2 = create_vector(SIZE);
-    real_t hostDot = std::numeric_limits< real_t >::quiet_NaN();
-    real_t deviceDot = std::numeric_limits< real_t >::quiet_NaN();      
+    double hostDot = std::numeric_limits< double >::quiet_NaN();
+    double deviceDot = std::numeric_limits< double >::quiet_NaN();      
     
-    //allocate output buffer on OpenCL device
-    //the partialReduction array contains a sequence of dot products
-    //computed on sub-arrays of size BLOCK_SIZE
-    cl_mem partialReduction = clCreateBuffer(clenv.context,
-                                             CL_MEM_WRITE_ONLY,
-                                             REDUCED_BYTE_SIZE,
-                                             0,
-                                             &status);
-    check_cl_error(status, "clCreateBuffer");
-
-    //allocate input buffers on OpenCL devices and copy data
-    cl_mem devV1 = clCreateBuffer(clenv.context,
-                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                  BYTE_SIZE,
-                                  &V1[0], //<-- copy data from V1
-                                  &status);
-    check_cl_error(status, "clCreateBuffer");                              
-    cl_mem devV2 = clCreateBuffer(clenv.context,
-                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                  BYTE_SIZE,
-                                  &V2[0], //<-- copy data from V2
-                                  &status);
-    check_cl_error(status, "clCreateBuffer");                              
-
-    //set kernel parameters
-    status = clSetKernelArg(clenv.kernel, //kernel
-                            0,      //parameter id
-                            sizeof(cl_mem), //size of parameter
-                            &devV1); //pointer to parameter
-    check_cl_error(status, "clSetKernelArg(V1)");
-    status = clSetKernelArg(clenv.kernel, //kernel
-                            1,      //parameter id
-                            sizeof(cl_mem), //size of parameter
-                            &devV2); //pointer to parameter
-    check_cl_error(status, "clSetKernelArg(V2)");
-    status = clSetKernelArg(clenv.kernel, //kernel
-                            2,      //parameter id
-                            sizeof(cl_mem), //size of parameter
-                            &partialReduction); //pointer to parameter
-    check_cl_error(status, "clSetKernelArg(devOut)");
-   
-
-    //setup kernel launch configuration
-    //total number of threads == number of array elements
-    const size_t globalWorkSize[1] = {SIZE};
-    //number of per-workgroup local threads
-    const size_t localWorkSize[1] = {BLOCK_SIZE}; 
-
-    //launch kernel
-    status = clEnqueueNDRangeKernel(clenv.commandQueue, //queue
-                                    clenv.kernel, //kernel                                   
-                                    1, //number of dimensions for work-items
-                                    0, //global work offset
-                                    globalWorkSize, //total number of threads
-                                    localWorkSize, //threads per workgroup
-                                    0, //number of events that need to
-                                       //complete before kernel executed
-                                    0, //list of events that need to complete
-                                       //before kernel executed
-                                    0); //event object identifying this
-                                        //particular kernel execution instance
-
-    check_cl_error(status, "clEnqueueNDRangeKernel");
-    
-    //read back and print results
+    //compute partial dot products on the device, one per workgroup
     std::vector< real_t > partialDot(REDUCED_SIZE); 
-    status = clEnqueueReadBuffer(clenv.commandQueue,
-                                 partialReduction,
-                                 CL_TRUE, //blocking read
-                                 0, //offset
-                                 REDUCED_BYTE_SIZE, //byte size of data
-                                 &partialDot[0], //destination buffer in host memory
-                                 0, //number of events that need to
-                                    //complete before transfer executed
-                                 0, //list of events that need to complete
-                                    //before transfer executed
-                                 0); //event identifying this specific operation
-    check_cl_error(status, "clEnqueueReadBuffer");
+    DotChunk work(clenv, V1, V2, partialDot, BLOCK_SIZE);
+    size_t finalChunkSize = 0;
+    try {
+        finalChunkSize = process_in_chunks(SIZE, CHUNK_SIZE, BLOCK_SIZE, work);
+    } catch(const CLError& e) {
+        std::cerr << e.what() << std::endl;
+        release_clenv(clenv);
+        exit(EXIT_FAILURE);
+    }
     
+    //partial dot products are summed in double precision, as in
+    //host_dot_product
     deviceDot = std::accumulate(partialDot.begin(),
-                                partialDot.end(), real_t(0));
+                                partialDot.end(), double(0));
     hostDot = host_dot_product(V1, V2);
 
     std::cout << deviceDot << ' ' << hostDot << std::endl;
 
     if(check_result(hostDot, deviceDot, EPS)) {
         std::cout << "PASSED" << std::endl;
+        std::cout << "chunk size: " << finalChunkSize << std::endl;
     } else {
         std::cout << "FAILED" << std::endl;
     }   
 
-    check_cl_error(clReleaseMemObject(devV1), "clReleaseMemObject");
-    check_cl_error(clReleaseMemObject(devV2), "clReleaseMemObject");
-    check_cl_error(clReleaseMemObject(partialReduction), "clReleaseMemObject");
     release_clenv(clenv);
    
     return 0;
-}
\ No newline at end of file
+}
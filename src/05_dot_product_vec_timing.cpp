@@ -3,11 +3,16 @@
 //kernel, in case vector data types such as double4 are used the
 //CL_ELEMENT_SIZE constant must be initialized with the vector size e.g. 4
 //for 4-element vectors: pass '4' as the last element on the command line.
-//TO HAVE CORRECT RESULTS ALWAYS #define USE_DOUBLE
+//TO HAVE CORRECT RESULTS ALWAYS #define USE_DOUBLE, or see --compensated for
+//single precision with compensated summation
 //
 // using monotonic clock to compute time intervals: link with librt (-lrt)
 // compilation:
-// c++ 05_dot_product_vec_timing.cpp clutil.cpp -lOpenCL -lrt -DUSE_DOUBLE
+// c++ -DUSE_DOUBLE 05_dot_product_vec_timing.cpp clutil.cpp -lOpenCL -lrt
+//  -pthread
+// add -DCLUTIL_ENABLE_TRACE -ldl and run with CLUTIL_TRACE=<file.json> to
+// record a timeline of transfers, kernel and host reduction viewable in
+// chrome://tracing
 // run without arguments to see a list of supported options
 //
 // sample execution with
@@ -15,12 +20,16 @@
 // 64 thread group
 // 4-component elements (double4)  
 //
-// ('aprun' on Cray) ./a.out "Intel(R) OpenCL" default 0 \
+// ('aprun' on Cray) ./a.out "Intel(R) OpenCL" default 0
 // ./src/kernels/05_dot_product_vec.cl dotprod 268435456 1024 8
 //
 // The host version of the dot product is either std::inner_product or
 // a block version in case the size is a multiple of 16ki which
 // usually result in a 3 to 4x speedup on most systems.
+// The multi-threaded host baseline, enabled with --host-pool, uses the
+// reduction engine in host_reduce.h: one pinned thread per available CPU,
+// first-touch placement of the input and AVX2/AVX-512 code selected at run
+// time; the reported time is the best of several runs.
 //
 // Note: with icc 13.1.3 on SandyBridge 'serial' code is typically only
 // 2x slower than OpenCL with no need for explicit caching, with gcc 4.8.1
@@ -36,8 +45,11 @@
 #include <algorithm>
 #include <numeric>
 #include <ctime>
+#include <iomanip>
+#include <utility>
 
 #include "clutil.h"
+#include "host_reduce.h"
 
 #ifdef USE_DOUBLE
 typedef double real_t;
@@ -61,8 +73,9 @@ std::vector< real_t > create_vector(int size) {
 }
 
 //------------------------------------------------------------------------------
-real_t host_dot(const real_t* v1, const real_t* v2, int N) {
-    real_t s = 0;
+template < typename T >
+T host_dot(const T* v1, const T* v2, int N) {
+    T s = 0;
     for( int i = 0; i != N; ++i ) {
         s += v1[ i ] * v2[ i ];
     }
@@ -81,6 +94,81 @@ real_t host_dot_block(const real_t* v1, const real_t* v2, int N,
     return s;
 }
 
+//------------------------------------------------------------------------------
+//compensated arithmetic, see dotprod_compensated in 05_dot_product_vec.cl;
+//requires strict IEEE semantics: do not compile with -ffast-math
+//s + e == a + b; s can be the same variable as a or b
+template < typename T >
+void two_sum(T a, T b, T& s, T& e) {
+    const T sum = a + b;
+    const T z = sum - a;
+    e = (a - (sum - z)) + (b - z);
+    s = sum;
+}
+
+//p + e == a * b: the product of two floats is exact in double precision
+void two_product(float a, float b, float& p, float& e) {
+    const double exact = double(a) * b;
+    p = float(exact);
+    e = float(exact - p);
+}
+
+//------------------------------------------------------------------------------
+//single precision dot product with compensated summation (Dot2 algorithm):
+//the rounding errors of products and sums are accumulated separately, as if
+//computed in twice the working precision; the error bound grows with the
+//number of elements times the unit roundoff, which is close to one for
+//hundreds of millions of floats: large inputs are split in halves
+//recursively and the (sum, compensation) pairs of the halves are added with
+//compensated summation, as in the device tree reduction
+std::pair< float, float > host_dot_compensated_pair(const float* v1,
+                                                    const float* v2,
+                                                    int N) {
+    const int LEAF_SIZE = 1024;
+    float s = 0;
+    float c = 0;
+    if(N <= LEAF_SIZE) {
+        for(int i = 0; i != N; ++i) {
+            float p;
+            float pe;
+            float se;
+            two_product(v1[i], v2[i], p, pe);
+            two_sum(s, p, s, se);
+            c += pe + se;
+        }
+    } else {
+        const int H = N / 2;
+        const std::pair< float, float > l =
+            host_dot_compensated_pair(v1, v2, H);
+        const std::pair< float, float > r =
+            host_dot_compensated_pair(v1 + H, v2 + H, N - H);
+        float e;
+        two_sum(l.first, r.first, s, e);
+        c = l.second + r.second + e;
+    }
+    return std::make_pair(s, c);
+}
+
+//returns the sum of the result and of the accumulated error
+double host_dot_compensated(const float* v1, const float* v2, int N) {
+    const std::pair< float, float > d = host_dot_compensated_pair(v1, v2, N);
+    return double(d.first) + d.second;
+}
+
+//------------------------------------------------------------------------------
+//compensated sum of the (sum, compensation) pairs computed by
+//dotprod_compensated
+double sum_compensated(const std::vector< float >& pairs) {
+    float s = 0;
+    float c = 0;
+    for(size_t i = 0; i < pairs.size(); i += 2) {
+        float e;
+        two_sum(s, pairs[i], s, e);
+        c += pairs[i + 1] + e;
+    }
+    return double(s) + c;
+}
+
 //------------------------------------------------------------------------------
 real_t host_dot_product(const std::vector< real_t >& v1,
                         const std::vector< real_t >& v2) {
@@ -93,41 +181,733 @@ bool check_result(real_t v1, real_t v2, double eps) {
     else return true; 
 }
 
+//------------------------------------------------------------------------------
+//dot product: the local work size must match BLOCK_SIZE and the number of
+//vector elements must be evenly divisible by the local work size
+class DotTunable : public Tunable {
+public:
+    DotTunable(cl_mem v1, cl_mem v2, cl_mem reduced, int size)
+        : v1_(v1), v2_(v2), reduced_(reduced), size_(size) {}
+    bool configure(cl_kernel kernel, const TuneConfig& cfg,
+                   size_t globalWorkSize[3]) {
+        const int blockSize = cfg.value("BLOCK_SIZE", 1);
+        const int vecWidth = cfg.value("VEC_WIDTH", 1);
+        if(cfg.local[0] != size_t(blockSize)
+           || size_ % (blockSize * vecWidth) != 0) return false;
+        check_cl_error(clSetKernelArg(kernel, 0, sizeof(cl_mem), &v1_),
+                       "clSetKernelArg(V1)");
+        check_cl_error(clSetKernelArg(kernel, 1, sizeof(cl_mem), &v2_),
+                       "clSetKernelArg(V2)");
+        check_cl_error(clSetKernelArg(kernel, 2, sizeof(cl_mem), &reduced_),
+                       "clSetKernelArg(devOut)");
+        globalWorkSize[0] = size_ / vecWidth;
+        return true;
+    }
+private:
+    cl_mem v1_;
+    cl_mem v2_;
+    cl_mem reduced_;
+    int size_;
+};
+
+//------------------------------------------------------------------------------
+//returns the BLOCK_SIZE and VEC_WIDTH stored in the tuning database,
+//running the autotuner if not found; arguments not equal to "auto" are
+//not tuned
+TuneConfig tuned_dot_config(const char* platformName,
+                            const char* deviceType,
+                            int deviceNum,
+                            const char* clSourcePath,
+                            const char* kernelName,
+                            const std::string& clheader,
+                            int SIZE,
+                            const std::string& blockSize,
+                            const std::string& vecWidth) {
+    CLEnv clenv = create_clenv(platformName, deviceType, deviceNum, true);
+    std::vector< TuneParam > params(2);
+    params[0].name = "BLOCK_SIZE";
+    if(blockSize == "auto") {
+        for(int b = 16; b <= 1024; b *= 2) params[0].values.push_back(b);
+    } else params[0].values.push_back(atoi(blockSize.c_str()));
+    params[1].name = "VEC_WIDTH";
+    if(vecWidth == "auto") {
+        const int widths[] = {1, 4, 8, 16};
+        params[1].values.assign(widths, widths + 4);
+    } else params[1].values.push_back(atoi(vecWidth.c_str()));
+    const int MIN_BLOCK_SIZE = *std::min_element(params[0].values.begin(),
+                                                 params[0].values.end());
+    const size_t BYTE_SIZE = SIZE * sizeof(real_t);
+    std::vector<real_t> V = create_vector(SIZE);
+    cl_int status;
+    cl_mem devV1 = clCreateBuffer(clenv.context,
+                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                  BYTE_SIZE, &V[0], &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devV2 = clCreateBuffer(clenv.context,
+                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                  BYTE_SIZE, &V[0], &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem reduced = clCreateBuffer(clenv.context, CL_MEM_WRITE_ONLY,
+                                    BYTE_SIZE / MIN_BLOCK_SIZE, 0, &status);
+    check_cl_error(status, "clCreateBuffer");
+    std::ostringstream shape;
+    shape << SIZE;
+    DotTunable tunable(devV1, devV2, reduced, SIZE);
+    const TuneConfig cfg = get_tuned_config(clenv, clSourcePath, kernelName,
+                                            clheader, "", params, 1,
+                                            shape.str(), tunable);
+    check_cl_error(clReleaseMemObject(devV1), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devV2), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(reduced), "clReleaseMemObject");
+    release_clenv(clenv);
+    std::cout << "BLOCK_SIZE: " << cfg.value("BLOCK_SIZE")
+              << ", VEC_WIDTH: " << cfg.value("VEC_WIDTH") << std::endl;
+    return cfg;
+}
+
+//------------------------------------------------------------------------------
+//pipelined dot product: the vectors are split into chunks and each chunk goes
+//through three stages: upload, kernel and read back of the partial results,
+//issued on different queues (the same queue if a single out-of-order queue
+//is available); each command only waits for the previous stage of the same
+//chunk, so that e.g. the upload of a chunk overlaps the kernel execution
+//on the previous chunk; returns the dot product
+real_t pipelined_dot(const CLEnv& clenv,
+                     const std::vector< real_t >& V1,
+                     const std::vector< real_t >& V2,
+                     int chunks,
+                     int blockSize,
+                     int vecWidth,
+                     ProfilingSession& session) {
+    const int CHUNK_SIZE = int(V1.size()) / chunks;
+    const size_t CHUNK_BYTE_SIZE = CHUNK_SIZE * sizeof(real_t);
+    const int REDUCED_CHUNK_SIZE = CHUNK_SIZE / (blockSize * vecWidth);
+    const size_t REDUCED_CHUNK_BYTE_SIZE = REDUCED_CHUNK_SIZE * sizeof(real_t);
+    const size_t NQ = clenv.queues.size();
+    cl_command_queue uploadQueue = clenv.queues[0];
+    cl_command_queue kernelQueue = clenv.queues[1 % NQ];
+    cl_command_queue readQueue = clenv.queues[2 % NQ];
+    std::vector< real_t > partialDot(REDUCED_CHUNK_SIZE * chunks);
+    std::vector< cl_mem > buffers;
+    CLEventList uploads;
+    CLEventList kernels;
+    CLEventList reads;
+    const size_t globalWorkSize[1] = {size_t(CHUNK_SIZE / vecWidth)};
+    const size_t localWorkSize[1] = {size_t(blockSize)};
+    cl_int status;
+    for(int c = 0; c != chunks; ++c) {
+        cl_mem devV1 = clCreateBuffer(clenv.context, CL_MEM_READ_ONLY,
+                                      CHUNK_BYTE_SIZE, 0, &status);
+        check_cl_error(status, "clCreateBuffer");
+        cl_mem devV2 = clCreateBuffer(clenv.context, CL_MEM_READ_ONLY,
+                                      CHUNK_BYTE_SIZE, 0, &status);
+        check_cl_error(status, "clCreateBuffer");
+        cl_mem devOut = clCreateBuffer(clenv.context, CL_MEM_WRITE_ONLY,
+                                       REDUCED_CHUNK_BYTE_SIZE, 0, &status);
+        check_cl_error(status, "clCreateBuffer");
+        buffers.push_back(devV1);
+        buffers.push_back(devV2);
+        buffers.push_back(devOut);
+        //upload: the second write waits for the first one, so that the
+        //kernel only needs to wait for the second write also on an
+        //out-of-order queue
+        status = clEnqueueWriteBuffer(uploadQueue, devV1, CL_FALSE, 0,
+                                      CHUNK_BYTE_SIZE, &V1[c * CHUNK_SIZE],
+                                      0, 0, uploads.next());
+        check_cl_error(status, "clEnqueueWriteBuffer");
+        session.attach(uploads.back(), "upload");
+        const cl_event v1Uploaded = uploads.back();
+        status = clEnqueueWriteBuffer(uploadQueue, devV2, CL_FALSE, 0,
+                                      CHUNK_BYTE_SIZE, &V2[c * CHUNK_SIZE],
+                                      1, &v1Uploaded, uploads.next());
+        check_cl_error(status, "clEnqueueWriteBuffer");
+        session.attach(uploads.back(), "upload");
+        //kernel
+        check_cl_error(clSetKernelArg(clenv.kernel, 0, sizeof(cl_mem), &devV1),
+                       "clSetKernelArg(V1)");
+        check_cl_error(clSetKernelArg(clenv.kernel, 1, sizeof(cl_mem), &devV2),
+                       "clSetKernelArg(V2)");
+        check_cl_error(clSetKernelArg(clenv.kernel, 2, sizeof(cl_mem), &devOut),
+                       "clSetKernelArg(devOut)");
+        status = clEnqueueNDRangeKernel(kernelQueue, clenv.kernel, 1, 0,
+                                        globalWorkSize, localWorkSize,
+                                        1, &uploads.back(), kernels.next());
+        check_cl_error(status, "clEnqueueNDRangeKernel");
+        session.attach(kernels.back(), "kernel");
+        //read back
+        status = clEnqueueReadBuffer(readQueue, devOut, CL_FALSE, 0,
+                                     REDUCED_CHUNK_BYTE_SIZE,
+                                     &partialDot[c * REDUCED_CHUNK_SIZE],
+                                     1, &kernels.back(), reads.next());
+        check_cl_error(status, "clEnqueueReadBuffer");
+        session.attach(reads.back(), "read");
+    }
+    for(size_t q = 0; q != NQ; ++q) {
+        check_cl_error(clFlush(clenv.queues[q]), "clFlush");
+    }
+    reads.wait();
+    for(std::vector< cl_mem >::iterator b = buffers.begin();
+        b != buffers.end(); ++b) {
+        check_cl_error(clReleaseMemObject(*b), "clReleaseMemObject");
+    }
+    return std::accumulate(partialDot.begin(), partialDot.end(), real_t(0));
+}
+
+//------------------------------------------------------------------------------
+//end-to-end latency(ms) of a device dot product, best of 'runs': time from
+//the kernel launch to the dot product available on the host; the outSize
+//elements of devOut are read back and summed on the host, i.e. the
+//partial dot products for dotprod and the final result for
+//dotprod_single_pass; kernel arguments must be already set
+double dot_latency(const CLEnv& clenv,
+                   cl_kernel kernel,
+                   const size_t* globalWorkSize,
+                   const size_t* localWorkSize,
+                   cl_mem devOut,
+                   size_t outSize,
+                   int runs,
+                   real_t& dot) {
+    std::vector< real_t > out(outSize);
+    double best = std::numeric_limits< double >::max();
+    for(int r = 0; r != runs; ++r) {
+        timespec start = {0, 0};
+        timespec end = {0, 0};
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        check_cl_error(clEnqueueNDRangeKernel(clenv.commandQueue, kernel, 1, 0,
+                                              globalWorkSize, localWorkSize,
+                                              0, 0, 0),
+                       "clEnqueueNDRangeKernel");
+        check_cl_error(clEnqueueReadBuffer(clenv.commandQueue, devOut, CL_TRUE,
+                                           0, outSize * sizeof(real_t),
+                                           &out[0], 0, 0, 0),
+                       "clEnqueueReadBuffer");
+        dot = std::accumulate(out.begin(), out.end(), real_t(0));
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        best = std::min(best, time_diff_ms(start, end));
+    }
+    return best;
+}
+
+//------------------------------------------------------------------------------
+//compares dotprod, one work item per vector element, with
+//dotprod_grid_stride, launched with the number of compute units times
+//groupsPerCU workgroups, on the first n elements of V1 and V2 for
+//n = size, size / 4, size / 16...; reports the median kernel time and the
+//end-to-end latency, which includes the read back and the host reduction of
+//the partial dot products; returns true if all the results are correct
+bool grid_stride_benchmark(const CLEnv& clenv,
+                           const std::vector< real_t >& V1,
+                           const std::vector< real_t >& V2,
+                           int blockSize,
+                           int vecWidth,
+                           int groupsPerCU,
+                           double eps) {
+    cl_uint computeUnits = 0;
+    check_cl_error(clGetDeviceInfo(get_device_id(clenv.context),
+                                   CL_DEVICE_MAX_COMPUTE_UNITS,
+                                   sizeof(cl_uint), &computeUnits, 0),
+                   "clGetDeviceInfo");
+    const int MAX_GROUPS = int(computeUnits) * groupsPerCU;
+    bool allPassed = true;
+    const int SIZE = int(V1.size());
+    const size_t BYTE_SIZE = SIZE * sizeof(real_t);
+    const int REDUCED_SIZE = std::max(SIZE / (blockSize * vecWidth),
+                                      MAX_GROUPS);
+    cl_int status;
+    cl_kernel gridStride = clCreateKernel(clenv.program,
+                                          "dotprod_grid_stride", &status);
+    check_cl_error(status, "clCreateKernel");
+    cl_mem devV1 = clCreateBuffer(clenv.context,
+                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                  BYTE_SIZE, const_cast< real_t* >(&V1[0]),
+                                  &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devV2 = clCreateBuffer(clenv.context,
+                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                  BYTE_SIZE, const_cast< real_t* >(&V2[0]),
+                                  &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devOut = clCreateBuffer(clenv.context, CL_MEM_WRITE_ONLY,
+                                   REDUCED_SIZE * sizeof(real_t), 0, &status);
+    check_cl_error(status, "clCreateBuffer");
+    const cl_kernel kernels[] = {clenv.kernel, gridStride};
+    for(int k = 0; k != 2; ++k) {
+        check_cl_error(clSetKernelArg(kernels[k], 0, sizeof(cl_mem), &devV1),
+                       "clSetKernelArg(V1)");
+        check_cl_error(clSetKernelArg(kernels[k], 1, sizeof(cl_mem), &devV2),
+                       "clSetKernelArg(V2)");
+        check_cl_error(clSetKernelArg(kernels[k], 2, sizeof(cl_mem), &devOut),
+                       "clSetKernelArg(devOut)");
+    }
+    const int RUNS = 10;
+    std::cout << "compute units: " << computeUnits
+              << ", grid stride workgroups: " << MAX_GROUPS
+              << ", median kernel time and best end-to-end latency of "
+              << RUNS << " runs (ms)\n"
+              << std::setw(12) << "size"
+              << std::setw(12) << "groups"
+              << std::setw(12) << "kernel"
+              << std::setw(12) << "latency"
+              << std::setw(12) << "gs groups"
+              << std::setw(12) << "gs kernel"
+              << std::setw(12) << "gs latency"
+              << std::setw(8) << "check" << std::endl;
+    for(int n = SIZE; n >= blockSize * vecWidth
+                      && n % (blockSize * vecWidth) == 0; n /= 4) {
+        const int vecSize = n / vecWidth;
+        const int groups = std::min(MAX_GROUPS,
+                                    (vecSize + blockSize - 1) / blockSize);
+        const size_t dotGlobalWorkSize[1] = {size_t(vecSize)};
+        const size_t gridGlobalWorkSize[1] = {size_t(groups * blockSize)};
+        const size_t localWorkSize[1] = {size_t(blockSize)};
+        check_cl_error(clSetKernelArg(gridStride, 3, sizeof(int), &vecSize),
+                       "clSetKernelArg(n)");
+        ProfilingSession session;
+        for(int r = 0; r != RUNS; ++r) {
+            check_cl_error(enqueue_ndrange_profiled(session,
+                                                    clenv.commandQueue,
+                                                    clenv.kernel, 1, 0,
+                                                    dotGlobalWorkSize,
+                                                    localWorkSize),
+                           "clEnqueueNDRangeKernel");
+            check_cl_error(enqueue_ndrange_profiled(session,
+                                                    clenv.commandQueue,
+                                                    gridStride, 1, 0,
+                                                    gridGlobalWorkSize,
+                                                    localWorkSize),
+                           "clEnqueueNDRangeKernel");
+        }
+        check_cl_error(clFlush(clenv.commandQueue), "clFlush");
+        session.wait();
+        real_t dot = 0;
+        real_t gridDot = 0;
+        const double latency = dot_latency(clenv, clenv.kernel,
+                                           dotGlobalWorkSize, localWorkSize,
+                                           devOut, vecSize / blockSize, RUNS,
+                                           dot);
+        const double gridLatency = dot_latency(clenv, gridStride,
+                                               gridGlobalWorkSize,
+                                               localWorkSize, devOut, groups,
+                                               RUNS, gridDot);
+        const real_t hostDot = std::inner_product(V1.begin(), V1.begin() + n,
+                                                  V2.begin(), real_t(0));
+        const bool passed = check_result(hostDot, dot, eps)
+                            && check_result(hostDot, gridDot, eps);
+        std::cout << std::setw(12) << n
+                  << std::setw(12) << vecSize / blockSize
+                  << std::setw(12) << session.stats("dotprod").median
+                  << std::setw(12) << latency
+                  << std::setw(12) << groups
+                  << std::setw(12)
+                  << session.stats("dotprod_grid_stride").median
+                  << std::setw(12) << gridLatency
+                  << std::setw(8) << (passed ? "PASSED" : "FAILED")
+                  << std::endl;
+        allPassed = allPassed && passed;
+    }
+    check_cl_error(clReleaseMemObject(devV1), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devV2), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devOut), "clReleaseMemObject");
+    check_cl_error(clReleaseKernel(gridStride), "clReleaseKernel");
+    return allPassed;
+}
+
+//------------------------------------------------------------------------------
+//runs the grid stride kernel 'runs' times on the first n elements of V1 and
+//V2 and returns the median kernel time(ms); partial receives the
+//outputs of the last run, one per workgroup, two for dotprod_compensated
+template < typename T >
+double run_grid_stride(const CLEnv& clenv,
+                       cl_kernel kernel,
+                       const std::vector< T >& V1,
+                       const std::vector< T >& V2,
+                       int blockSize,
+                       int vecWidth,
+                       int groups,
+                       int runs,
+                       std::vector< T >& partial) {
+    const size_t BYTE_SIZE = V1.size() * sizeof(T);
+    const int vecSize = int(V1.size()) / vecWidth;
+    cl_int status;
+    cl_mem devV1 = clCreateBuffer(clenv.context,
+                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                  BYTE_SIZE, const_cast< T* >(&V1[0]),
+                                  &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devV2 = clCreateBuffer(clenv.context,
+                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                  BYTE_SIZE, const_cast< T* >(&V2[0]),
+                                  &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devOut = clCreateBuffer(clenv.context, CL_MEM_WRITE_ONLY,
+                                   partial.size() * sizeof(T), 0, &status);
+    check_cl_error(status, "clCreateBuffer");
+    check_cl_error(clSetKernelArg(kernel, 0, sizeof(cl_mem), &devV1),
+                   "clSetKernelArg(V1)");
+    check_cl_error(clSetKernelArg(kernel, 1, sizeof(cl_mem), &devV2),
+                   "clSetKernelArg(V2)");
+    check_cl_error(clSetKernelArg(kernel, 2, sizeof(cl_mem), &devOut),
+                   "clSetKernelArg(devOut)");
+    check_cl_error(clSetKernelArg(kernel, 3, sizeof(int), &vecSize),
+                   "clSetKernelArg(n)");
+    const size_t globalWorkSize[1] = {size_t(groups * blockSize)};
+    const size_t localWorkSize[1] = {size_t(blockSize)};
+    ProfilingSession session;
+    for(int r = 0; r != runs; ++r) {
+        check_cl_error(enqueue_ndrange_profiled(session, clenv.commandQueue,
+                                                kernel, 1, 0, globalWorkSize,
+                                                localWorkSize),
+                       "clEnqueueNDRangeKernel");
+    }
+    check_cl_error(clEnqueueReadBuffer(clenv.commandQueue, devOut, CL_TRUE,
+                                       0, partial.size() * sizeof(T),
+                                       &partial[0], 0, 0, 0),
+                   "clEnqueueReadBuffer");
+    session.wait();
+    check_cl_error(clReleaseMemObject(devV1), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devV2), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devOut), "clReleaseMemObject");
+    const std::vector< ProfilingSession::Sample > samples = session.samples();
+    return session.stats(samples.front().label).median;
+}
+
+//------------------------------------------------------------------------------
+//builds 05_dot_product_vec.cl in single or double precision and returns
+//the requested kernel, the program is released with the kernel
+cl_kernel create_dot_kernel(const CLEnv& clenv,
+                            const std::string& source,
+                            bool doublePrecision,
+                            int blockSize,
+                            int vecWidth,
+                            const char* kernelName) {
+    std::ostringstream prefix;
+    if(doublePrecision) prefix << "#define DOUBLE\n";
+    prefix << "#define BLOCK_SIZE " << blockSize << '\n'
+           << "#define VEC_WIDTH " << vecWidth << '\n';
+    cl_program program = build_program(clenv.context,
+                                       get_device_id(clenv.context),
+                                       prefix.str() + source);
+    cl_int status;
+    cl_kernel kernel = clCreateKernel(program, kernelName, &status);
+    check_cl_error(status, "clCreateKernel");
+    check_cl_error(clReleaseProgram(program), "clReleaseProgram");
+    return kernel;
+}
+
+//------------------------------------------------------------------------------
+//relative error
+double relative_error(long double ref, double v) {
+    return double(std::fabs((v - ref) / ref));
+}
+
+//------------------------------------------------------------------------------
+//accuracy and bandwidth of the dot product on the device and on the host in
+//single precision, single precision with compensated summation and double
+//precision; inputs are random numbers in [0, 1) representable in single
+//precision, the reference is computed in long double precision; returns
+//false if a device result exceeds the error bound of recursive summation,
+//size times the machine epsilon (inputs are positive)
+bool precision_study(const CLEnv& clenv,
+                     const char* clSourcePath,
+                     int size,
+                     int blockSize,
+                     int vecWidth,
+                     int groupsPerCU) {
+    const cl_device_id device = get_device_id(clenv.context);
+    cl_uint computeUnits = 0;
+    check_cl_error(clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS,
+                                   sizeof(cl_uint), &computeUnits, 0),
+                   "clGetDeviceInfo");
+    size_t extSize = 0;
+    check_cl_error(clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, 0,
+                                   &extSize), "clGetDeviceInfo");
+    std::vector< char > ext(extSize + 1, '\0');
+    check_cl_error(clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, extSize,
+                                   &ext[0], 0), "clGetDeviceInfo");
+    const bool fp64 = std::string(&ext[0]).find("cl_khr_fp64")
+                      != std::string::npos;
+    const int vecSize = size / vecWidth;
+    const int groups = std::max(1, std::min(int(computeUnits) * groupsPerCU,
+                                            vecSize / blockSize));
+    const std::string source = load_text(clSourcePath);
+    std::vector< float > F1(size);
+    std::vector< float > F2(size);
+    srand(1);
+    for(int i = 0; i != size; ++i) {
+        F1[i] = float(rand()) / (float(RAND_MAX) + 1);
+        F2[i] = float(rand()) / (float(RAND_MAX) + 1);
+    }
+    long double ref = 0;
+    for(int i = 0; i != size; ++i) ref += double(F1[i]) * F2[i];
+    const int RUNS = 10;
+    //GB/s from elapsed time in ms
+    const double GB = 2. * size / 1E6;
+    const double floatBound = size * std::numeric_limits< float >::epsilon();
+    bool passed = true;
+    std::cout << "compensated summation: " << size << " elements, "
+              << groups << " workgroups\n"
+              << std::setw(20) << "precision"
+              << std::setw(14) << "device error"
+              << std::setw(12) << "device GB/s"
+              << std::setw(14) << "host error"
+              << std::setw(12) << "host GB/s" << std::endl;
+    //single precision
+    std::vector< float > partial(groups);
+    cl_kernel kernel = create_dot_kernel(clenv, source, false, blockSize,
+                                         vecWidth, "dotprod_grid_stride");
+    double ms = run_grid_stride(clenv, kernel, F1, F2, blockSize, vecWidth,
+                                groups, RUNS, partial);
+    check_cl_error(clReleaseKernel(kernel), "clReleaseKernel");
+    double devDot = std::accumulate(partial.begin(), partial.end(), 0.f);
+    passed = passed && relative_error(ref, devDot) <= floatBound;
+    timespec start = {0, 0};
+    timespec end = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double hostDot = host_dot(&F1[0], &F2[0], size);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    std::cout << std::setw(20) << "float"
+              << std::setw(14) << relative_error(ref, devDot)
+              << std::setw(12) << GB * sizeof(float) / ms
+              << std::setw(14) << relative_error(ref, hostDot)
+              << std::setw(12) << GB * sizeof(float)
+                                  / time_diff_ms(start, end)
+              << std::endl;
+    //single precision, compensated
+    partial.resize(2 * groups);
+    kernel = create_dot_kernel(clenv, source, false, blockSize, vecWidth,
+                               "dotprod_compensated");
+    ms = run_grid_stride(clenv, kernel, F1, F2, blockSize, vecWidth, groups,
+                         RUNS, partial);
+    check_cl_error(clReleaseKernel(kernel), "clReleaseKernel");
+    devDot = sum_compensated(partial);
+    passed = passed && relative_error(ref, devDot) <= floatBound;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    hostDot = host_dot_compensated(&F1[0], &F2[0], size);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    std::cout << std::setw(20) << "float compensated"
+              << std::setw(14) << relative_error(ref, devDot)
+              << std::setw(12) << GB * sizeof(float) / ms
+              << std::setw(14) << relative_error(ref, hostDot)
+              << std::setw(12) << GB * sizeof(float)
+                                  / time_diff_ms(start, end)
+              << std::endl;
+    //double precision
+    if(!fp64) {
+        std::cout << std::setw(20) << "double"
+                  << " not supported by the device" << std::endl;
+        std::cout << (passed ? "PASSED" : "FAILED") << std::endl;
+        return passed;
+    }
+    const std::vector< double > D1(F1.begin(), F1.end());
+    const std::vector< double > D2(F2.begin(), F2.end());
+    std::vector< double > partialD(groups);
+    kernel = create_dot_kernel(clenv, source, true, blockSize, vecWidth,
+                               "dotprod_grid_stride");
+    ms = run_grid_stride(clenv, kernel, D1, D2, blockSize, vecWidth, groups,
+                         RUNS, partialD);
+    check_cl_error(clReleaseKernel(kernel), "clReleaseKernel");
+    devDot = std::accumulate(partialD.begin(), partialD.end(), 0.);
+    passed = passed && relative_error(ref, devDot)
+                       <= size * std::numeric_limits< double >::epsilon();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    hostDot = host_dot(&D1[0], &D2[0], size);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    std::cout << std::setw(20) << "double"
+              << std::setw(14) << relative_error(ref, devDot)
+              << std::setw(12) << GB * sizeof(double) / ms
+              << std::setw(14) << relative_error(ref, hostDot)
+              << std::setw(12) << GB * sizeof(double)
+                                  / time_diff_ms(start, end)
+              << std::endl;
+    std::cout << (passed ? "PASSED" : "FAILED") << std::endl;
+    return passed;
+}
+
+//------------------------------------------------------------------------------
+//final reduction performed by a host node of the task graph
+struct HostReduction {
+    const std::vector< real_t >* partialDot;
+    real_t result;
+};
+
+void host_reduction(void* data) {
+    HostReduction* r = static_cast< HostReduction* >(data);
+    r->result = std::accumulate(r->partialDot->begin(),
+                                r->partialDot->end(), real_t(0));
+}
+
+//------------------------------------------------------------------------------
+//dot product expressed as a task graph: the two uploads are independent
+//and run on separate queues, the kernel waits for both, the read back
+//waits for the kernel and the final reduction runs on the host when the
+//read back completes; returns the dot product
+real_t task_graph_dot(const CLEnv& clenv,
+                      const std::vector< real_t >& V1,
+                      const std::vector< real_t >& V2,
+                      int blockSize,
+                      int vecWidth) {
+    const int SIZE = int(V1.size());
+    const size_t BYTE_SIZE = SIZE * sizeof(real_t);
+    const int REDUCED_SIZE = SIZE / (blockSize * vecWidth);
+    std::vector< real_t > partialDot(REDUCED_SIZE);
+    cl_int status;
+    cl_mem devV1 = clCreateBuffer(clenv.context, CL_MEM_READ_ONLY,
+                                  BYTE_SIZE, 0, &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devV2 = clCreateBuffer(clenv.context, CL_MEM_READ_ONLY,
+                                  BYTE_SIZE, 0, &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devOut = clCreateBuffer(clenv.context, CL_MEM_WRITE_ONLY,
+                                   REDUCED_SIZE * sizeof(real_t), 0, &status);
+    check_cl_error(status, "clCreateBuffer");
+    const size_t globalWorkSize[1] = {size_t(SIZE / vecWidth)};
+    const size_t localWorkSize[1] = {size_t(blockSize)};
+    HostReduction reduction = {&partialDot, real_t(0)};
+    TaskGraph graph(clenv);
+    std::vector< TaskGraph::Node > deps;
+    deps.push_back(graph.add_write("upload V1", devV1, 0, BYTE_SIZE, &V1[0]));
+    deps.push_back(graph.add_write("upload V2", devV2, 0, BYTE_SIZE, &V2[0]));
+    const TaskGraph::Node kernel = graph.add_kernel("dotprod", clenv.kernel, 1,
+                                                    globalWorkSize,
+                                                    localWorkSize, deps);
+    graph.set_arg(kernel, 0, sizeof(cl_mem), &devV1);
+    graph.set_arg(kernel, 1, sizeof(cl_mem), &devV2);
+    graph.set_arg(kernel, 2, sizeof(cl_mem), &devOut);
+    const TaskGraph::Node read = 
+        graph.add_read("read partial dot", devOut, 0,
+                       REDUCED_SIZE * sizeof(real_t), &partialDot[0],
+                       std::vector< TaskGraph::Node >(1, kernel));
+    graph.add_host("host reduction", host_reduction, &reduction,
+                   std::vector< TaskGraph::Node >(1, read));
+    graph.submit();
+    const double elapsed = graph.wait();
+    std::cout << "task graph elapsed: " << elapsed << "ms" << std::endl;
+    graph.report(std::cout);
+    std::cout << std::endl;
+    check_cl_error(clReleaseMemObject(devV1), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devV2), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devOut), "clReleaseMemObject");
+    return reduction.result;
+}
+
 //------------------------------------------------------------------------------
 int main(int argc, char** argv) {
 
     if(argc < 9) {
         std::cerr << "usage: " << argv[0]
                   << " <platform name> <device type = default | cpu | gpu "
-                     "| acc | all>  <device num> <OpenCL source file path>"
-                     " <kernel name> <size> <local size> <vec element width>"
+                     "| acc | all | fastest | fastest-for:<kernel>>"
+                     "  <device num>"
+                     " <OpenCL source file path>"
+                     " <kernel name> <size> <local size | auto>"
+                     " <vec element width | auto>"
+                     " [--pipeline=<number of chunks>] [--out-of-order]"
+                     " [--graph] [--single-pass]"
+                     " [--grid-stride[=<groups per compute unit>]]"
+                     " [--compensated] [--host-pool]\n"
+                     "  'auto' selects the value from the tuning database"
+                     " running the autotuner if no entry is found\n"
+                     "  --pipeline splits the vectors into chunks and overlaps"
+                     " uploads, kernels and read backs on three queues or on"
+                     " a single out-of-order queue if --out-of-order is"
+                     " specified\n"
+                     "  --graph executes transfers, kernel and host reduction"
+                     " as a task graph and reports its critical path\n"
+                     "  --single-pass also runs dotprod_single_pass, which"
+                     " completes the reduction on the device, and reports"
+                     " the end-to-end latency with host and device final"
+                     " reduction; the kernel name must be dotprod; devices"
+                     " without global atomics only report the host final"
+                     " reduction\n"
+                     "  --grid-stride benchmarks dotprod against"
+                     " dotprod_grid_stride, launched with a fixed number of"
+                     " workgroups per compute unit (default 4), at several"
+                     " sizes up to <size>; the kernel name must be dotprod\n"
+                     "  --compensated reports error and GB/s of the grid"
+                     " stride dot product in single precision, single"
+                     " precision with compensated summation and double"
+                     " precision, on the device and on the host; the"
+                     " number of workgroups per compute unit is set by"
+                     " --grid-stride=<n> (default 4)\n"
+                     "  --host-pool also times the dot product on a pool of"
+                     " host threads, one per core, with the input placed on"
+                     " the NUMA node of the thread that reads it"
                   << std::endl;
         exit(EXIT_FAILURE);   
     }
-    const int SIZE = atoi(argv[argc - 3]); // number of elements
-    const int CL_ELEMENT_SIZE = atoi(argv[argc - 1]); // number of per-element
-                                                      // components
-    const int CPU_BLOCK_SIZE = 16384; //use block dot product if SIZE divisible
-                                  //by this value
-    const size_t BYTE_SIZE = SIZE * sizeof(real_t);
-    const int BLOCK_SIZE = atoi(argv[argc - 2]); //local cache for reduction
-                                                 //equal to local workgroup size
-    const int REDUCED_SIZE = SIZE / BLOCK_SIZE;
-    const int REDUCED_BYTE_SIZE = REDUCED_SIZE * sizeof(real_t);
+    int PIPELINE_CHUNKS = 0;
+    bool outOfOrder = false;
+    bool taskGraph = false;
+    bool singlePass = false;
+    int GRID_STRIDE_GROUPS_PER_CU = 0;
+    bool compensated = false;
+    bool hostBaseline = false;
+    for(int a = 9; a < argc; ++a) {
+        const std::string arg = argv[a];
+        if(arg.find("--pipeline=") == 0) {
+            PIPELINE_CHUNKS =
+                atoi(arg.c_str() + std::string("--pipeline=").size());
+            if(PIPELINE_CHUNKS < 1) {
+                std::cerr << "ERROR - invalid number of chunks: " << arg
+                          << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        } else if(arg == "--out-of-order") outOfOrder = true;
+        else if(arg == "--graph") taskGraph = true;
+        else if(arg == "--single-pass") singlePass = true;
+        else if(arg == "--grid-stride") GRID_STRIDE_GROUPS_PER_CU = 4;
+        else if(arg == "--compensated") compensated = true;
+        else if(arg == "--host-pool") hostBaseline = true;
+        else if(arg.find("--grid-stride=") == 0) {
+            GRID_STRIDE_GROUPS_PER_CU =
+                atoi(arg.c_str() + std::string("--grid-stride=").size());
+            if(GRID_STRIDE_GROUPS_PER_CU < 1) {
+                std::cerr << "ERROR - invalid number of groups per compute"
+                             " unit: " << arg << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else {
+            std::cerr << "ERROR - unknown option " << arg << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    const int SIZE = atoi(argv[6]); // number of elements
     //setup text header that will be prefixed to opencl code
     std::ostringstream clheaderStream;
-    clheaderStream << "#define BLOCK_SIZE " << BLOCK_SIZE      << '\n';
-    clheaderStream << "#define VEC_WIDTH "  << CL_ELEMENT_SIZE << '\n';
 #ifdef USE_DOUBLE    
     clheaderStream << "#define DOUBLE\n";
     const double EPS = 0.000000001;
 #else
     const float EPS = 0.00001;
 #endif
+    TuneConfig tuned;
+    if(std::string(argv[7]) == "auto"
+       || std::string(argv[8]) == "auto") {
+        tuned = tuned_dot_config(argv[1], argv[2], atoi(argv[3]), argv[4],
+                                 argv[5], clheaderStream.str(), SIZE,
+                                 argv[7], argv[8]);
+    }
+    // number of per-element components
+    const int CL_ELEMENT_SIZE = tuned.value("VEC_WIDTH",
+                                            atoi(argv[8]));
+    const int CPU_BLOCK_SIZE = 16384; //use block dot product if SIZE divisible
+                                  //by this value
+    const size_t BYTE_SIZE = SIZE * sizeof(real_t);
+    //local cache for reduction equal to local workgroup size
+    const int BLOCK_SIZE = tuned.value("BLOCK_SIZE", atoi(argv[7]));
+    //one partial dot product per workgroup
+    const int REDUCED_SIZE = SIZE / (BLOCK_SIZE * CL_ELEMENT_SIZE);
+    const int REDUCED_BYTE_SIZE = REDUCED_SIZE * sizeof(real_t);
+    clheaderStream << "#define BLOCK_SIZE " << BLOCK_SIZE      << '\n';
+    clheaderStream << "#define VEC_WIDTH "  << CL_ELEMENT_SIZE << '\n';
     const bool PROFILE_ENABLE_OPTION = true;    
     CLEnv clenv = create_clenv(argv[1], argv[2], atoi(argv[3]),
                                PROFILE_ENABLE_OPTION,
-                               argv[4], argv[5], clheaderStream.str());
+                               argv[4], argv[5], clheaderStream.str(), "",
+                               outOfOrder ? 1 : PIPELINE_CHUNKS > 0 ? 3
+                                              : taskGraph ? 2 : 1,
+                               outOfOrder);
    
     cl_int status;
     //create input and output matrices
@@ -135,6 +915,67 @@ int main(int argc, char** argv) {
     std::vector<real_t> V2 = create_vector(SIZE);
     real_t hostDot = std::numeric_limits< real_t >::quiet_NaN();
     real_t deviceDot = std::numeric_limits< real_t >::quiet_NaN();      
+//TASK GRAPH EXECUTION
+    if(taskGraph) {
+        deviceDot = task_graph_dot(clenv, V1, V2, BLOCK_SIZE, CL_ELEMENT_SIZE);
+        hostDot = host_dot_product(V1, V2);
+        std::cout << deviceDot << ' ' << hostDot << std::endl;
+        const bool passed = check_result(hostDot, deviceDot, EPS);
+        std::cout << (passed ? "PASSED" : "FAILED") << std::endl;
+        release_clenv(clenv);
+        return passed ? 0 : EXIT_FAILURE;
+    }
+//COMPENSATED SUMMATION: ACCURACY AND BANDWIDTH
+    if(compensated) {
+        const bool passed =
+            precision_study(clenv, argv[4], SIZE, BLOCK_SIZE,
+                            CL_ELEMENT_SIZE, GRID_STRIDE_GROUPS_PER_CU > 0
+                                             ? GRID_STRIDE_GROUPS_PER_CU : 4);
+        release_clenv(clenv);
+        return passed ? 0 : EXIT_FAILURE;
+    }
+//GRID STRIDE BENCHMARK
+    if(GRID_STRIDE_GROUPS_PER_CU > 0) {
+        const bool passed =
+            grid_stride_benchmark(clenv, V1, V2, BLOCK_SIZE, CL_ELEMENT_SIZE,
+                                  GRID_STRIDE_GROUPS_PER_CU, EPS);
+        release_clenv(clenv);
+        return passed ? 0 : EXIT_FAILURE;
+    }
+//PIPELINED EXECUTION
+    if(PIPELINE_CHUNKS > 0) {
+        if(SIZE % (PIPELINE_CHUNKS * BLOCK_SIZE * CL_ELEMENT_SIZE) != 0) {
+            std::cerr << "ERROR - size must be evenly divisible by "
+                         "chunks x local size x vec element width"
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        ProfilingSession session;
+        deviceDot = pipelined_dot(clenv, V1, V2, PIPELINE_CHUNKS, BLOCK_SIZE,
+                                  CL_ELEMENT_SIZE, session);
+        session.wait();
+        hostDot = host_dot_product(V1, V2);
+        std::cout << deviceDot << ' ' << hostDot << std::endl;
+        if(check_result(hostDot, deviceDot, EPS)) {
+            std::cout << "PASSED" << std::endl;
+            const double serial = session.stats("upload").total
+                                  + session.stats("kernel").total
+                                  + session.stats("read").total;
+            const double elapsed = session.elapsed();
+            std::cout << "pipelined:      " << PIPELINE_CHUNKS << " chunks, "
+                      << (outOfOrder ? "1 out-of-order queue"
+                                     : "3 in-order queues") << '\n'
+                      << "elapsed:        " << elapsed << "ms\n"
+                      << "sum of commands:" << serial << "ms\n"
+                      << "overlap:        " << (serial - elapsed) << "ms\n"
+                      << std::endl;
+            session.report(std::cout);
+        } else {
+            std::cout << "FAILED" << std::endl;
+        }
+        release_clenv(clenv);
+        return check_result(hostDot, deviceDot, EPS) ? 0 : EXIT_FAILURE;
+    }
 //ALLOCATE DATA AND COPY TO DEVICE    
     //allocate output buffer on OpenCL device
     //the partialReduction array contains a sequence of dot products
@@ -184,42 +1025,22 @@ int main(int argc, char** argv) {
     //number of per-workgroup local threads
     const size_t localWorkSize[1] = {BLOCK_SIZE}; 
 //LAUNCH KERNEL
-    // make sure all work on the OpenCL device is finished
-    status = clFinish(clenv.commandQueue);
-    check_cl_error(status, "clFinish");
-    cl_event profilingEvent;
-    timespec kernelStart = {0,  0};
-    timespec kernelEnd = {0, 0};
-    clock_gettime(CLOCK_MONOTONIC, &kernelStart);
+    //kernel and transfer timings are collected through event callbacks
+    //by the profiling session, with no need to drain the queue
+    ProfilingSession session;
     //launch kernel
-    status = clEnqueueNDRangeKernel(clenv.commandQueue, //queue
-                                    clenv.kernel, //kernel                                   
-                                    1, //number of dimensions for work-items
-                                    0, //global work offset
-                                    globalWorkSize, //total number of threads
-                                    localWorkSize, //threads per workgroup
-                                    0, //number of events that need to
-                                       //complete before kernel executed
-                                    0, //list of events that need to complete
-                                       //before kernel executed
-                                    &profilingEvent); //event object associated
-                                                      // with this particular
-                                                      // kernel execution
-                                                      // instance
-
+    status = enqueue_ndrange_profiled(session,
+                                      clenv.commandQueue, //queue
+                                      clenv.kernel, //kernel
+                                      1, //number of dimensions for work-items
+                                      0, //global work offset
+                                      globalWorkSize, //total number of threads
+                                      localWorkSize); //threads per workgroup
     check_cl_error(status, "clEnqueueNDRangeKernel");
-    status = clFinish(clenv.commandQueue); //ensure kernel execution is
-    //terminated; used for timing purposes only; there is no need to enforce
-    //termination when issuing a subsequent blocking data transfer operation
-    check_cl_error(status, "clFinish");
-    status = clWaitForEvents(1, &profilingEvent);
-    clock_gettime(CLOCK_MONOTONIC, &kernelEnd);
-    check_cl_error(status, "clWaitForEvents");
-    //get_cl_time(profilingEvent);  //gives similar results to the following 
-    const double kernelElapsedTime_ms = time_diff_ms(kernelStart, kernelEnd);
 //READ DATA FROM DEVICE
     //read back and print results
     std::vector< real_t > partialDot(REDUCED_SIZE); 
+    cl_event readEvent;
     status = clEnqueueReadBuffer(clenv.commandQueue,
                                  partialReduction,
                                  CL_TRUE, //blocking read
@@ -231,11 +1052,14 @@ int main(int argc, char** argv) {
                                     //complete before transfer executed
                                  0, //list of events that need to complete
                                     //before transfer executed
-                                 &profilingEvent); //event identifying this
-                                                   //specific operation
+                                 &readEvent); //event identifying this
+                                              //specific operation
     check_cl_error(status, "clEnqueueReadBuffer");
-
-    const double dataTransferTime_ms = get_cl_time(profilingEvent);
+    session.attach(readEvent, "transfer");
+    check_cl_error(clReleaseEvent(readEvent), "clReleaseEvent");
+    session.wait();
+    const double kernelElapsedTime_ms = session.stats(argv[5]).total;
+    const double dataTransferTime_ms = session.stats("transfer").total;
 
     timespec accStart = {0, 0};
     timespec accEnd   = {0, 0};
@@ -246,6 +1070,9 @@ int main(int argc, char** argv) {
                                 partialDot.end(), real_t(0));
     clock_gettime(CLOCK_MONOTONIC, &accEnd);
     const double accTime_ms = time_diff_ms(accStart, accEnd);
+    trace_host_span("host reduction",
+                    accStart.tv_sec * 1000000000ULL + accStart.tv_nsec,
+                    accEnd.tv_sec * 1000000000ULL + accEnd.tv_nsec);
 
 //COMPUTE DOT PRODUCT ON HOST
     timespec hostStart = {0, 0};
@@ -255,6 +1082,39 @@ int main(int argc, char** argv) {
     else hostDot = host_dot_block(&V1[0], &V2[0], SIZE, CPU_BLOCK_SIZE);
     clock_gettime(CLOCK_MONOTONIC, &hostEnd);
     const double host_time = time_diff_ms(hostStart, hostEnd);
+    trace_host_span("host dot",
+                    hostStart.tv_sec * 1000000000ULL + hostStart.tv_nsec,
+                    hostEnd.tv_sec * 1000000000ULL + hostEnd.tv_nsec);
+    //multi-threaded host baseline, on request: the copies of the input are
+    //placed on the NUMA node of the thread that reads them; one warm-up
+    //call, best of HOST_POOL_RUNS timed calls
+    const int HOST_POOL_RUNS = 10;
+    HostReduce* hostPool = 0;
+    real_t poolDot = 0;
+    double poolTime = 0;
+    if(hostBaseline) {
+        hostPool = new HostReduce;
+        real_t* poolV1 = HostReduce::allocate< real_t >(SIZE);
+        real_t* poolV2 = HostReduce::allocate< real_t >(SIZE);
+        if(poolV1 == 0 || poolV2 == 0) {
+            std::cerr << "ERROR - cannot allocate host memory" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        hostPool->first_touch(poolV1, SIZE);
+        hostPool->first_touch(poolV2, SIZE);
+        std::copy(V1.begin(), V1.end(), poolV1);
+        std::copy(V2.begin(), V2.end(), poolV2);
+        poolDot = hostPool->dot(poolV1, poolV2, SIZE);
+        poolTime = std::numeric_limits< double >::max();
+        for(int r = 0; r != HOST_POOL_RUNS; ++r) {
+            clock_gettime(CLOCK_MONOTONIC, &hostStart);
+            poolDot = hostPool->dot(poolV1, poolV2, SIZE);
+            clock_gettime(CLOCK_MONOTONIC, &hostEnd);
+            poolTime = std::min(poolTime, time_diff_ms(hostStart, hostEnd));
+        }
+        HostReduce::deallocate(poolV1);
+        HostReduce::deallocate(poolV2);
+    }
 //PRINT RESULTS
     std::cout << deviceDot << ' ' << hostDot << std::endl;
 
@@ -266,19 +1126,94 @@ int main(int argc, char** argv) {
                   << "ms" << std::endl;
         std::cout << "transfer:       " << dataTransferTime_ms 
                   << "ms\n" << std::endl;
+        session.report(std::cout);
+        std::cout << std::endl;
         if(true || SIZE % CPU_BLOCK_SIZE != 0) {         
             std::cout << "host:              " << host_time << "ms" << std::endl;
         } else {
             std::cout << "host (16k blocks): " << host_time << "ms" << std::endl; 
         }    
+        if(hostBaseline) {
+            std::cout << "host (" << hostPool->threads() << " threads, "
+                      << hostPool->isa() << ", best of " << HOST_POOL_RUNS
+                      << "): " << poolTime << "ms "
+                      << (check_result(hostDot, poolDot, EPS) ? "PASSED"
+                                                              : "FAILED")
+                      << std::endl;
+        }
        
     } else {
         std::cout << "FAILED" << std::endl;
     }   
 
+//END-TO-END LATENCY WITH HOST AND DEVICE FINAL REDUCTION
+    if(singlePass) {
+        const int RUNS = 10;
+        real_t twoStageDot = 0;
+        const double twoStage = dot_latency(clenv, clenv.kernel,
+                                            globalWorkSize, localWorkSize,
+                                            partialReduction, REDUCED_SIZE,
+                                            RUNS, twoStageDot);
+        std::cout << "\nend-to-end latency, best of " << RUNS << " runs\n"
+                  << "partial dot products + host reduction: " << twoStage
+                  << "ms" << std::endl;
+        //dotprod_single_pass is only compiled if the device supports global
+        //atomics: fall back to the two-launch reduction above
+        cl_kernel singlePassKernel = clCreateKernel(clenv.program,
+                                                    "dotprod_single_pass",
+                                                    &status);
+        if(status == CL_INVALID_KERNEL_NAME) {
+            std::cout << "single pass device reduction: not available, no"
+                         " global atomics" << std::endl;
+        } else {
+            check_cl_error(status, "clCreateKernel");
+            //the partial dot products are read by the last workgroup
+            cl_mem devPartial = clCreateBuffer(clenv.context,
+                                               CL_MEM_READ_WRITE,
+                                               REDUCED_BYTE_SIZE, 0, &status);
+            check_cl_error(status, "clCreateBuffer");
+            cl_mem devResult = clCreateBuffer(clenv.context, CL_MEM_WRITE_ONLY,
+                                              sizeof(real_t), 0, &status);
+            check_cl_error(status, "clCreateBuffer");
+            int counter = 0;
+            cl_mem devCounter = clCreateBuffer(clenv.context,
+                                               CL_MEM_READ_WRITE
+                                               | CL_MEM_COPY_HOST_PTR,
+                                               sizeof(int), &counter, &status);
+            check_cl_error(status, "clCreateBuffer");
+            const cl_mem args[] = {devV1, devV2, devPartial, devResult,
+                                   devCounter};
+            for(int i = 0; i != 5; ++i) {
+                check_cl_error(clSetKernelArg(singlePassKernel, i,
+                                              sizeof(cl_mem), &args[i]),
+                               "clSetKernelArg");
+            }
+            real_t singlePassDot = 0;
+            const double onDevice = dot_latency(clenv, singlePassKernel,
+                                                globalWorkSize, localWorkSize,
+                                                devResult, 1, RUNS,
+                                                singlePassDot);
+            std::cout << "single pass device reduction:          "
+                      << onDevice << "ms" << std::endl;
+            std::cout << "single pass: " << singlePassDot << ' ' << hostDot
+                      << (check_result(hostDot, singlePassDot, EPS)
+                          ? " PASSED" : " FAILED")
+                      << std::endl;
+            check_cl_error(clReleaseMemObject(devPartial),
+                           "clReleaseMemObject");
+            check_cl_error(clReleaseMemObject(devResult),
+                           "clReleaseMemObject");
+            check_cl_error(clReleaseMemObject(devCounter),
+                           "clReleaseMemObject");
+            check_cl_error(clReleaseKernel(singlePassKernel),
+                           "clReleaseKernel");
+        }
+    }
+
     check_cl_error(clReleaseMemObject(devV1), "clReleaseMemObject");
     check_cl_error(clReleaseMemObject(devV2), "clReleaseMemObject");
     check_cl_error(clReleaseMemObject(partialReduction), "clReleaseMemObject");
+    delete hostPool;
     release_clenv(clenv);
    
     return 0;
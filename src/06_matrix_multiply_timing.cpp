@@ -6,7 +6,11 @@
 #include <vector>
 #include <cmath>
 #include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
 #include "clutil.h"
+#include "host_gemm.h"
 
 #ifdef USE_DOUBLE
 typedef double real_t;
@@ -15,9 +19,12 @@ typedef float real_t;
 #endif
 
 //------------------------------------------------------------------------------
-std::vector< real_t > create_matrix(int cols, int rows) {
+//the default seed makes every run different, benchmark mode uses a fixed
+//seed for repeatable inputs
+std::vector< real_t > create_matrix(int cols, int rows,
+                                    unsigned int seed = unsigned(time(0))) {
 	std::vector< real_t > m(cols * rows);
-	srand(time(0));
+	srand(seed);
 	for(std::vector<real_t>::iterator i = m.begin();
 	    i != m.end(); ++i) *i = rand() % 10; 
 	return m;
@@ -25,22 +32,32 @@ std::vector< real_t > create_matrix(int cols, int rows) {
 
 
 //------------------------------------------------------------------------------
+//reference result computed by the cache blocked, multi-threaded host_gemm
 void host_matmul(const std::vector< real_t >& A,
 	             const std::vector< real_t >& B,
 	             std::vector< real_t >& C, 
+	             int a_rows,
 	             int a_columns,
 	             int b_columns) {
-	const int rows = a_columns;
-	const int columns = b_columns;
-	for(int r = 0; r != rows; ++r) {
-		for(int c = 0; c != columns; ++c) {
-			C[r*b_columns + c] = 0;
-			for(int ic = 0; ic != a_columns; ++ic) {
-				C[r*b_columns + c] += A[r*a_columns + ic]
-				                      * B[ic*b_columns + c];
-			}
-		}
-	}
+	host_gemm(a_rows, a_columns, b_columns, &A[0], &B[0], &C[0]);
+}
+
+//------------------------------------------------------------------------------
+//returns the columns x rows transpose of m
+std::vector< real_t > transpose_matrix(const std::vector< real_t >& m,
+                                       int rows,
+                                       int columns) {
+    std::vector< real_t > t(m.size());
+    for(int r = 0; r != rows; ++r) {
+        for(int c = 0; c != columns; ++c) t[c * rows + r] = m[r * columns + c];
+    }
+    return t;
+}
+
+//------------------------------------------------------------------------------
+//true if the kernel reads B transposed
+bool transposed_b(const char* kernelName) {
+    return std::string(kernelName) == "block_matmul_tn";
 }
 
 //------------------------------------------------------------------------------
@@ -53,44 +70,1172 @@ bool check_result(const std::vector< real_t >& v1,
     return true;
 }
 
+//------------------------------------------------------------------------------
+//GFLOP/s of a (rows x inner) x (inner x columns) matrix multiply
+double gflops(int rows, int inner, int columns, double ms) {
+    return 2 * double(rows) * inner * columns / (ms * 1E6);
+}
+
+//------------------------------------------------------------------------------
+//M x K times K x N matrix multiply
+struct MatmulSize {
+    int M;
+    int K;
+    int N;
+};
+
+//------------------------------------------------------------------------------
+//parses "size" (square matrices) or "MxKxN"; returns false if the format is
+//invalid
+bool parse_matmul_size(const std::string& s, MatmulSize& size) {
+    const int dims = sscanf(s.c_str(), "%dx%dx%d", &size.M, &size.K, &size.N);
+    if(dims == 1) size.K = size.N = size.M;
+    return dims == 1 || dims == 3;
+}
+
+//------------------------------------------------------------------------------
+//rounds n up to a multiple of m
+size_t round_up(size_t n, size_t m) {
+    return (n + m - 1) / m * m;
+}
+
+//------------------------------------------------------------------------------
+//multi-device matrix multiply: each device computes a horizontal slice of
+//C from the corresponding rows of A and all of B; A is rows x inner, B is
+//inner x columns; tm and tn are the register tile sizes of block_matmul_reg,
+//1 for the other kernels
+class MatmulSplit : public SplitWork {
+public:
+    MatmulSplit(const std::vector< real_t >& A,
+                const std::vector< real_t >& B,
+                std::vector< real_t >& C,
+                int rows,
+                int inner,
+                int columns,
+                int blockSize,
+                int tm = 1,
+                int tn = 1) 
+        : A_(A), B_(B), C_(C), rows_(rows), inner_(inner), columns_(columns),
+          blockSize_(blockSize), tm_(tm), tn_(tn) {}
+    cl_event enqueue(int /*device*/, const CLEnv& clenv,
+                     size_t offset, size_t count) {
+        cl_int status;
+        const size_t A_ROW_BYTE_SIZE = inner_ * sizeof(real_t);
+        const size_t C_ROW_BYTE_SIZE = columns_ * sizeof(real_t);
+        cl_mem devA = clCreateBuffer(clenv.context,
+                                     CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                     count * A_ROW_BYTE_SIZE,
+                                     const_cast< real_t* >(&A_[offset * inner_]),
+                                     &status);
+        check_cl_error(status, "clCreateBuffer");
+        cl_mem devB = clCreateBuffer(clenv.context,
+                                     CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                     inner_ * C_ROW_BYTE_SIZE,
+                                     const_cast< real_t* >(&B_[0]),
+                                     &status);
+        check_cl_error(status, "clCreateBuffer");
+        cl_mem devC = clCreateBuffer(clenv.context,
+                                     CL_MEM_WRITE_ONLY,
+                                     count * C_ROW_BYTE_SIZE,
+                                     0,
+                                     &status);
+        check_cl_error(status, "clCreateBuffer");
+        buffers_.push_back(devA);
+        buffers_.push_back(devB);
+        buffers_.push_back(devC);
+        check_cl_error(clSetKernelArg(clenv.kernel, 0, sizeof(cl_mem), &devA),
+                       "clSetKernelArg(A)");
+        check_cl_error(clSetKernelArg(clenv.kernel, 1, sizeof(cl_mem), &devB),
+                       "clSetKernelArg(B)");
+        check_cl_error(clSetKernelArg(clenv.kernel, 2, sizeof(cl_mem), &devC),
+                       "clSetKernelArg(C)");
+        const int sliceRows = int(count);
+        check_cl_error(clSetKernelArg(clenv.kernel, 3, sizeof(int),
+                                      &sliceRows), "clSetKernelArg(a_rows)");
+        check_cl_error(clSetKernelArg(clenv.kernel, 4, sizeof(int), &inner_),
+                       "clSetKernelArg(a_columns)");
+        check_cl_error(clSetKernelArg(clenv.kernel, 5, sizeof(int), &columns_),
+                       "clSetKernelArg(b_columns)");
+        //the grid is rounded up to whole work groups, the kernel ignores
+        //out of bounds elements
+        const size_t globalWorkSize[2] =
+            {round_up(columns_, blockSize_ * tn_) / tn_,
+             round_up(count, blockSize_ * tm_) / tm_};
+        const size_t localWorkSize[2] = {size_t(blockSize_),
+                                         size_t(blockSize_)};
+        cl_event kernelEvent;
+        status = clEnqueueNDRangeKernel(clenv.commandQueue, clenv.kernel, 2, 0,
+                                        globalWorkSize, localWorkSize,
+                                        0, 0, &kernelEvent);
+        check_cl_error(status, "clEnqueueNDRangeKernel");
+        //non-blocking read of the slice into its final position in C
+        status = clEnqueueReadBuffer(clenv.commandQueue, devC, CL_FALSE, 0,
+                                     count * C_ROW_BYTE_SIZE,
+                                     &C_[offset * columns_],
+                                     0, 0, 0);
+        check_cl_error(status, "clEnqueueReadBuffer");
+        return kernelEvent;
+    }
+    ~MatmulSplit() {
+        for(std::vector< cl_mem >::iterator i = buffers_.begin();
+            i != buffers_.end(); ++i) {
+            check_cl_error(clReleaseMemObject(*i), "clReleaseMemObject");
+        }
+    }
+private:
+    const std::vector< real_t >& A_;
+    const std::vector< real_t >& B_;
+    std::vector< real_t >& C_;
+    int rows_;
+    int inner_;
+    int columns_;
+    int blockSize_;
+    int tm_;
+    int tn_;
+    std::vector< cl_mem > buffers_;
+};
+
+//------------------------------------------------------------------------------
+//runs the matrix multiply on all the devices selected through deviceNums,
+//with the rows of C split among devices in multiples of the number of rows
+//computed by a work group;
+//if adaptive is true a first run is used to measure the throughput of each
+//device and the timed run uses the measured values to split the work
+int multi_device_matmul(const char* platformName,
+                        const char* deviceType,
+                        const char* deviceNums,
+                        const char* clSourcePath,
+                        const char* kernelName,
+                        const std::string& clheader,
+                        int M, int K, int N, int BLOCK_SIZE, int TM, int TN,
+                        double EPS, bool adaptive) {
+    CLMultiEnv clenv = create_clmultienv(platformName, deviceType, deviceNums,
+                                         true, clSourcePath, kernelName,
+                                         clheader);
+    std::vector<real_t> A = create_matrix(K, M);
+    std::vector<real_t> B = create_matrix(N, K);
+    std::vector<real_t> C(M * N,real_t(0));
+    std::vector<real_t> refC(M * N,real_t(0));
+    //B is transposed on the host since each device receives the whole
+    //matrix
+    const std::vector<real_t> devInputB = transposed_b(kernelName) ?
+                                          transpose_matrix(B, K, N) : B;
+    if(adaptive) {
+        MatmulSplit calibration(A, devInputB, C, M, K, N, BLOCK_SIZE, TM, TN);
+        enqueue_split(clenv, M, BLOCK_SIZE * TM, calibration, true);
+    }
+    MatmulSplit work(A, devInputB, C, M, K, N, BLOCK_SIZE, TM, TN);
+    const double elapsed = enqueue_split(clenv, M, BLOCK_SIZE * TM, work);
+    host_matmul(A, B, refC, M, K, N);
+    const bool passed = check_result(refC, C, EPS);
+    if(passed) {
+        std::cout << "PASSED" << std::endl;
+        for(size_t d = 0; d != clenv.envs.size(); ++d) {
+            std::cout << "Device " << d << ": " << clenv.counts[d] << " rows, "
+                      << clenv.times[d] << " ms" << std::endl;
+        }
+        std::cout << "Elapsed time(ms): " << elapsed << std::endl;
+        std::cout << "GFLOP/s: " << gflops(M, K, N, elapsed) << std::endl;
+    } else {
+        std::cout << "FAILED" << std::endl;
+    }
+    release_clmultienv(clenv);
+    return passed ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+//out-of-core matrix multiply: C is computed one TILE x TILE tile at a time,
+//accumulating the products of the TILE x TILE tiles of A and B along the
+//inner dimension; only two A, B and C tiles are allocated on the device,
+//so the problem size is not limited by device memory.
+//Three queues are used: tile uploads, kernels and C read backs; the uploads
+//of step s go to buffer slot s % 2 and only wait for the kernel of step s - 2
+//which used the same slot, so they overlap the kernel of step s - 1.
+//The first kernel of each C tile overwrites C, the following ones are
+//built with ACCUMULATE defined and add their contribution.
+int out_of_core_matmul(const char* platformName,
+                       const char* deviceType,
+                       int deviceNum,
+                       const char* clSourcePath,
+                       const char* kernelName,
+                       const std::string& clheader,
+                       int M, int K, int N, int BLOCK_SIZE, int TM, int TN,
+                       int TILE, double EPS) {
+    CLEnv clenv = create_clenv(platformName, deviceType, deviceNum, true,
+                               clSourcePath, kernelName, clheader, "", 3);
+    cl_command_queue uploadQueue = clenv.queues[0];
+    cl_command_queue kernelQueue = clenv.queues[1];
+    cl_command_queue readQueue = clenv.queues[2];
+    cl_int status;
+    cl_program accProgram =
+        build_program(clenv.context, get_device_id(clenv.context),
+                      clheader + "#define ACCUMULATE\n\n"
+                      + load_text(clSourcePath));
+    cl_kernel accKernel = clCreateKernel(accProgram, kernelName, &status);
+    check_cl_error(status, "clCreateKernel");
+    std::vector<real_t> A = create_matrix(K, M);
+    std::vector<real_t> B = create_matrix(N, K);
+    std::vector<real_t> C(M * N,real_t(0));
+    std::vector<real_t> refC(M * N,real_t(0));
+    const size_t TILE_BYTE_SIZE = size_t(TILE) * TILE * sizeof(real_t);
+    cl_mem devA[2], devB[2], devC[2];
+    for(int i = 0; i != 2; ++i) {
+        devA[i] = clCreateBuffer(clenv.context, CL_MEM_READ_ONLY,
+                                 TILE_BYTE_SIZE, 0, &status);
+        check_cl_error(status, "clCreateBuffer");
+        devB[i] = clCreateBuffer(clenv.context, CL_MEM_READ_ONLY,
+                                 TILE_BYTE_SIZE, 0, &status);
+        check_cl_error(status, "clCreateBuffer");
+        devC[i] = clCreateBuffer(clenv.context, CL_MEM_READ_WRITE,
+                                 TILE_BYTE_SIZE, 0, &status);
+        check_cl_error(status, "clCreateBuffer");
+    }
+    ProfilingSession session;
+    CLEventList uploads; //two per step: A and B tiles
+    CLEventList kernels; //one per step
+    CLEventList reads;   //one per C tile
+    const size_t localWorkSize[2] = {size_t(BLOCK_SIZE), size_t(BLOCK_SIZE)};
+    int step = 0;
+    int tile = 0;
+    for(int ti = 0; ti < M; ti += TILE) {
+        const int mt = std::min(TILE, M - ti);
+        for(int tj = 0; tj < N; tj += TILE, ++tile) {
+            const int nt = std::min(TILE, N - tj);
+            const int cslot = tile % 2;
+            for(int tk = 0; tk < K; tk += TILE, ++step) {
+                const int kt = std::min(TILE, K - tk);
+                const int slot = step % 2;
+                //1) upload A(ti, tk) and B(tk, tj) after the kernel which
+                //last used the slot has completed
+                const cl_uint nwait = step >= 2 ? 1 : 0;
+                const cl_event* slotFree = step >= 2 ?
+                                           &kernels.data()[step - 2] : 0;
+                const size_t origin[3] = {0, 0, 0};
+                const size_t aOrigin[3] = {tk * sizeof(real_t), size_t(ti), 0};
+                const size_t aRegion[3] = {kt * sizeof(real_t), size_t(mt), 1};
+                status = clEnqueueWriteBufferRect(uploadQueue, devA[slot],
+                                                  CL_FALSE, origin, aOrigin,
+                                                  aRegion, kt * sizeof(real_t),
+                                                  0, K * sizeof(real_t), 0,
+                                                  &A[0], nwait, slotFree,
+                                                  uploads.next());
+                check_cl_error(status, "clEnqueueWriteBufferRect");
+                session.attach(uploads.back(), "upload");
+                const size_t bOrigin[3] = {tj * sizeof(real_t), size_t(tk), 0};
+                const size_t bRegion[3] = {nt * sizeof(real_t), size_t(kt), 1};
+                status = clEnqueueWriteBufferRect(uploadQueue, devB[slot],
+                                                  CL_FALSE, origin, bOrigin,
+                                                  bRegion, nt * sizeof(real_t),
+                                                  0, N * sizeof(real_t), 0,
+                                                  &B[0], nwait, slotFree,
+                                                  uploads.next());
+                check_cl_error(status, "clEnqueueWriteBufferRect");
+                session.attach(uploads.back(), "upload");
+                //2) multiply; the first step of a C tile also waits for the
+                //read back of the tile which last used the C buffer
+                cl_event waitList[3] = {uploads.data()[2 * step],
+                                        uploads.data()[2 * step + 1], 0};
+                cl_uint nkwait = 2;
+                if(tk == 0 && tile >= 2) {
+                    waitList[nkwait++] = reads.data()[tile - 2];
+                }
+                cl_kernel k = tk == 0 ? clenv.kernel : accKernel;
+                check_cl_error(clSetKernelArg(k, 0, sizeof(cl_mem),
+                                              &devA[slot]),
+                               "clSetKernelArg(A)");
+                check_cl_error(clSetKernelArg(k, 1, sizeof(cl_mem),
+                                              &devB[slot]),
+                               "clSetKernelArg(B)");
+                check_cl_error(clSetKernelArg(k, 2, sizeof(cl_mem),
+                                              &devC[cslot]),
+                               "clSetKernelArg(C)");
+                check_cl_error(clSetKernelArg(k, 3, sizeof(int), &mt),
+                               "clSetKernelArg(a_rows)");
+                check_cl_error(clSetKernelArg(k, 4, sizeof(int), &kt),
+                               "clSetKernelArg(a_columns)");
+                check_cl_error(clSetKernelArg(k, 5, sizeof(int), &nt),
+                               "clSetKernelArg(b_columns)");
+                const size_t globalWorkSize[2] =
+                    {round_up(nt, BLOCK_SIZE * TN) / TN,
+                     round_up(mt, BLOCK_SIZE * TM) / TM};
+                status = enqueue_ndrange_profiled(session, kernelQueue, k, 2,
+                                                  0, globalWorkSize,
+                                                  localWorkSize, nkwait,
+                                                  waitList, kernels.next());
+                check_cl_error(status, "clEnqueueNDRangeKernel");
+            }
+            //3) read back the C tile into its position in C
+            const size_t origin[3] = {0, 0, 0};
+            const size_t cOrigin[3] = {tj * sizeof(real_t), size_t(ti), 0};
+            const size_t cRegion[3] = {nt * sizeof(real_t), size_t(mt), 1};
+            status = clEnqueueReadBufferRect(readQueue, devC[cslot], CL_FALSE,
+                                             origin, cOrigin, cRegion,
+                                             nt * sizeof(real_t), 0,
+                                             N * sizeof(real_t), 0, &C[0],
+                                             1, &kernels.back(), reads.next());
+            check_cl_error(status, "clEnqueueReadBufferRect");
+            session.attach(reads.back(), "read");
+        }
+    }
+    for(size_t q = 0; q != clenv.queues.size(); ++q) {
+        check_cl_error(clFlush(clenv.queues[q]), "clFlush");
+    }
+    reads.wait();
+    session.wait();
+    host_matmul(A, B, refC, M, K, N);
+    const bool passed = check_result(refC, C, EPS);
+    if(passed) {
+        //transfer time hidden behind kernel execution: the part of the sum
+        //of transfer and kernel times exceeding the elapsed time
+        const double transfer = session.stats("upload").total
+                                + session.stats("read").total;
+        const double compute = session.stats(kernelName).total;
+        const double elapsed = session.elapsed();
+        const double hidden = std::max(0.0, transfer + compute - elapsed);
+        std::cout << "PASSED" << std::endl;
+        std::cout << "Tiles: " << tile << " C tiles, " << step << " steps, "
+                  << "device memory: " << 6 * TILE_BYTE_SIZE << " bytes"
+                  << std::endl;
+        std::cout << "Transfer time(ms): " << transfer << std::endl;
+        std::cout << "Kernel time(ms): " << compute << std::endl;
+        std::cout << "Elapsed time(ms): " << elapsed << std::endl;
+        std::cout << "Transfer time hidden behind compute: "
+                  << (transfer > 0 ? 100 * std::min(1.0, hidden / transfer)
+                                   : 0.0) << '%' << std::endl;
+        std::cout << "GFLOP/s: " << gflops(M, K, N, elapsed) << std::endl;
+    } else {
+        std::cout << "FAILED" << std::endl;
+    }
+    for(int i = 0; i != 2; ++i) {
+        check_cl_error(clReleaseMemObject(devA[i]), "clReleaseMemObject");
+        check_cl_error(clReleaseMemObject(devB[i]), "clReleaseMemObject");
+        check_cl_error(clReleaseMemObject(devC[i]), "clReleaseMemObject");
+    }
+    check_cl_error(clReleaseKernel(accKernel), "clReleaseKernel");
+    check_cl_error(clReleaseProgram(accProgram), "clReleaseProgram");
+    release_clenv(clenv);
+    return passed ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+//CPU baseline: times host_gemm and checks a subset of the rows of C against
+//a naive triple loop
+int host_backend_matmul(int M, int K, int N, double EPS) {
+    std::vector<real_t> A = create_matrix(K, M);
+    std::vector<real_t> B = create_matrix(N, K);
+    std::vector<real_t> C(M * N,real_t(0));
+    timespec start = {0, 0};
+    timespec end = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    host_gemm(M, K, N, &A[0], &B[0], &C[0]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const double elapsed = end.tv_sec * 1E3 + end.tv_nsec / 1E6
+                           - (start.tv_sec * 1E3 + start.tv_nsec / 1E6);
+    bool passed = true;
+    for(int r = 0; r < M && passed; r += std::max(1, M / 16)) {
+        for(int c = 0; c != N; ++c) {
+            real_t e = 0;
+            for(int k = 0; k != K; ++k) e += A[r * K + k] * B[k * N + c];
+            if(std::fabs(double(e - C[r * N + c])) > EPS) passed = false;
+        }
+    }
+    if(passed) {
+        std::cout << "PASSED" << std::endl;
+        std::cout << "Host threads: " << host_gemm_threads() << std::endl;
+        std::cout << "Elapsed time(ms): " << elapsed << std::endl;
+        std::cout << "GFLOP/s: " << gflops(M, K, N, elapsed) << std::endl;
+    } else {
+        std::cout << "FAILED" << std::endl;
+    }
+    return passed ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+//float to IEEE 754 half precision conversion with round to nearest even,
+//the default rounding mode of vstore_half
+cl_half float_to_half(float f) {
+    unsigned int x = 0;
+    std::memcpy(&x, &f, sizeof(x));
+    const unsigned int sign = (x >> 16) & 0x8000;
+    const unsigned int biased = (x >> 23) & 0xff;
+    unsigned int mantissa = x & 0x7fffff;
+    //infinity and NaN
+    if(biased == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    const int exponent = int(biased) - 127 + 15;
+    //overflow: infinity
+    if(exponent >= 31) return sign | 0x7c00;
+    //denormalized numbers; values below half of the smallest one are
+    //flushed to zero
+    int shift = 13;
+    unsigned int h = 0;
+    if(exponent <= 0) {
+        if(exponent < -10) return sign;
+        mantissa |= 0x800000;
+        shift = 14 - exponent;
+    } else h = unsigned(exponent) << 10;
+    h |= mantissa >> shift;
+    //round to nearest even; a carry from the mantissa correctly increments
+    //the exponent
+    const unsigned int rest = mantissa & ((1u << shift) - 1);
+    const unsigned int halfway = 1u << (shift - 1);
+    if(rest > halfway || (rest == halfway && (h & 1))) ++h;
+    return sign | h;
+}
+
+//------------------------------------------------------------------------------
+//launches kernel warmup times, then reps times attached to session with the
+//given label; 2d grid for tm x tn register tiles as in the single device case
+void timed_matmul(ProfilingSession& session,
+                  const std::string& label,
+                  const CLEnv& clenv,
+                  cl_kernel kernel,
+                  cl_mem A, cl_mem B, cl_mem C,
+                  int M, int K, int N, int BLOCK_SIZE, int TM, int TN,
+                  int warmup = 1, int reps = 1) {
+    check_cl_error(clSetKernelArg(kernel, 0, sizeof(cl_mem), &A),
+                   "clSetKernelArg(A)");
+    check_cl_error(clSetKernelArg(kernel, 1, sizeof(cl_mem), &B),
+                   "clSetKernelArg(B)");
+    check_cl_error(clSetKernelArg(kernel, 2, sizeof(cl_mem), &C),
+                   "clSetKernelArg(C)");
+    check_cl_error(clSetKernelArg(kernel, 3, sizeof(int), &M),
+                   "clSetKernelArg(a_rows)");
+    check_cl_error(clSetKernelArg(kernel, 4, sizeof(int), &K),
+                   "clSetKernelArg(a_columns)");
+    check_cl_error(clSetKernelArg(kernel, 5, sizeof(int), &N),
+                   "clSetKernelArg(b_columns)");
+    const size_t globalWorkSize[2] = {round_up(N, BLOCK_SIZE * TN) / TN,
+                                      round_up(M, BLOCK_SIZE * TM) / TM};
+    const size_t localWorkSize[2] = {size_t(BLOCK_SIZE), size_t(BLOCK_SIZE)};
+    for(int i = 0; i != warmup + reps; ++i) {
+        cl_event ev;
+        check_cl_error(clEnqueueNDRangeKernel(clenv.commandQueue, kernel, 2, 0,
+                                              globalWorkSize, localWorkSize,
+                                              0, 0, &ev),
+                       "clEnqueueNDRangeKernel");
+        if(i >= warmup) session.attach(ev, label);
+        check_cl_error(clReleaseEvent(ev), "clReleaseEvent");
+    }
+}
+
+//------------------------------------------------------------------------------
+//maximum absolute difference between v and ref divided by the largest
+//absolute value in ref
+double relative_error(const std::vector< real_t >& ref,
+                      const std::vector< real_t >& v) {
+    double err = 0;
+    double norm = 0;
+    for(size_t i = 0; i != ref.size(); ++i) {
+        err = std::max(err, std::fabs(double(v[i]) - double(ref[i])));
+        norm = std::max(norm, std::fabs(double(ref[i])));
+    }
+    return norm > 0 ? err / norm : err;
+}
+
+//------------------------------------------------------------------------------
+//half storage, single precision accumulation: A and B are converted to half
+//on the host and multiplied by the kernel built with HALF defined, the same
+//kernel built without HALF multiplies the original single precision matrices.
+//Inputs are random values in [0, 1), which are in general not representable
+//in half precision: the error of both results with respect to the host
+//reference and the throughput gain of half storage are reported.
+int half_storage_matmul(const char* platformName,
+                        const char* deviceType,
+                        int deviceNum,
+                        const char* clSourcePath,
+                        const char* kernelName,
+                        const std::string& clheader,
+                        int M, int K, int N, int BLOCK_SIZE, int TM, int TN) {
+    //tolerances on the relative error: inputs rounded to 11 significant
+    //bits in half precision, 24 in single precision
+    const double HALF_TOLERANCE = 1E-2;
+    const double FLOAT_TOLERANCE = 1E-4;
+    CLEnv clenv = create_clenv(platformName, deviceType, deviceNum, true,
+                               clSourcePath, kernelName, clheader);
+    cl_int status;
+    cl_program halfProgram =
+        build_program(clenv.context, get_device_id(clenv.context),
+                      clheader + "#define HALF\n\n" + load_text(clSourcePath));
+    cl_kernel halfKernel = clCreateKernel(halfProgram, kernelName, &status);
+    check_cl_error(status, "clCreateKernel");
+    std::vector<real_t> A(size_t(M) * K);
+    std::vector<real_t> B(size_t(K) * N);
+    srand(time(0));
+    for(size_t i = 0; i != A.size(); ++i) A[i] = real_t(rand()) / RAND_MAX;
+    for(size_t i = 0; i != B.size(); ++i) B[i] = real_t(rand()) / RAND_MAX;
+    //block_matmul_tn: B transposed on the host
+    const std::vector<real_t> devInputB = transposed_b(kernelName) ?
+                                          transpose_matrix(B, K, N) : B;
+    std::vector<cl_half> halfA(A.size());
+    std::vector<cl_half> halfB(B.size());
+    std::transform(A.begin(), A.end(), halfA.begin(), float_to_half);
+    std::transform(devInputB.begin(), devInputB.end(), halfB.begin(),
+                   float_to_half);
+    std::vector<real_t> floatC(size_t(M) * N, real_t(0));
+    std::vector<real_t> halfC(size_t(M) * N, real_t(0));
+    std::vector<real_t> refC(size_t(M) * N, real_t(0));
+    const size_t C_BYTE_SIZE = floatC.size() * sizeof(real_t);
+    cl_mem devA = clCreateBuffer(clenv.context,
+                                 CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                 A.size() * sizeof(real_t), &A[0], &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devB = clCreateBuffer(clenv.context,
+                                 CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                 devInputB.size() * sizeof(real_t),
+                                 const_cast< real_t* >(&devInputB[0]),
+                                 &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devHalfA = clCreateBuffer(clenv.context,
+                                     CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                     halfA.size() * sizeof(cl_half),
+                                     &halfA[0], &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devHalfB = clCreateBuffer(clenv.context,
+                                     CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                     halfB.size() * sizeof(cl_half),
+                                     &halfB[0], &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devC = clCreateBuffer(clenv.context, CL_MEM_WRITE_ONLY,
+                                 C_BYTE_SIZE, 0, &status);
+    check_cl_error(status, "clCreateBuffer");
+    ProfilingSession session;
+    timed_matmul(session, "float", clenv, clenv.kernel, devA, devB, devC,
+                 M, K, N, BLOCK_SIZE, TM, TN);
+    check_cl_error(clEnqueueReadBuffer(clenv.commandQueue, devC, CL_TRUE, 0,
+                                       C_BYTE_SIZE, &floatC[0], 0, 0, 0),
+                   "clEnqueueReadBuffer");
+    timed_matmul(session, "half", clenv, halfKernel, devHalfA, devHalfB, devC,
+                 M, K, N, BLOCK_SIZE, TM, TN);
+    check_cl_error(clEnqueueReadBuffer(clenv.commandQueue, devC, CL_TRUE, 0,
+                                       C_BYTE_SIZE, &halfC[0], 0, 0, 0),
+                   "clEnqueueReadBuffer");
+    host_matmul(A, B, refC, M, K, N);
+    session.wait();
+    const double floatError = relative_error(refC, floatC);
+    const double halfError = relative_error(refC, halfC);
+    const bool passed = floatError <= FLOAT_TOLERANCE
+                        && halfError <= HALF_TOLERANCE;
+    const double floatTime = session.stats("float").total;
+    const double halfTime = session.stats("half").total;
+    std::cout << (passed ? "PASSED" : "FAILED") << std::endl;
+    std::cout << "Max error relative to max |C|, single precision: "
+              << floatError << ", half storage: " << halfError << std::endl;
+    std::cout << "Input size(bytes), single precision: "
+              << (A.size() + B.size()) * sizeof(real_t) << ", half storage: "
+              << (halfA.size() + halfB.size()) * sizeof(cl_half)
+              << std::endl;
+    std::cout << "Single precision time(ms): " << floatTime
+              << ", GFLOP/s: " << gflops(M, K, N, floatTime) << std::endl;
+    std::cout << "Half storage time(ms): " << halfTime
+              << ", GFLOP/s: " << gflops(M, K, N, halfTime) << std::endl;
+    std::cout << "Half storage speedup: " << floatTime / halfTime << std::endl;
+    check_cl_error(clReleaseMemObject(devA), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devB), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devHalfA), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devHalfB), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devC), "clReleaseMemObject");
+    check_cl_error(clReleaseKernel(halfKernel), "clReleaseKernel");
+    check_cl_error(clReleaseProgram(halfProgram), "clReleaseProgram");
+    release_clenv(clenv);
+    return passed ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+//bytes of local memory allocated by the most demanding kernel of
+//04_matrix_multiply.cl: block_matmul_async allocates four tiles,
+//block_matmul_reg TM + TN tiles
+size_t matmul_local_mem_size(int blockSize, int tm, int tn) {
+    const size_t tile = size_t(blockSize) * blockSize * sizeof(real_t);
+    return tile * std::max(4, tm + tn);
+}
+
+//------------------------------------------------------------------------------
+//true if work groups of blockSize x blockSize work items and the local
+//memory tiles fit the device limits; checked before building the program
+//since compilers reject programs whose local arrays exceed the local memory
+bool block_fits_device(cl_device_id device, int blockSize, int tm, int tn) {
+    size_t maxGroupSize = 0;
+    check_cl_error(clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+                                   sizeof(size_t), &maxGroupSize, 0),
+                   "clGetDeviceInfo(CL_DEVICE_MAX_WORK_GROUP_SIZE)");
+    cl_ulong localMem = 0;
+    check_cl_error(clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE,
+                                   sizeof(cl_ulong), &localMem, 0),
+                   "clGetDeviceInfo(CL_DEVICE_LOCAL_MEM_SIZE)");
+    return size_t(blockSize) * blockSize <= maxGroupSize
+           && matmul_local_mem_size(blockSize, tm, tn) <= localMem;
+}
+
+//------------------------------------------------------------------------------
+//true if kernel can be launched with work groups of blockSize x blockSize
+//work items on device: work group size and local memory limits are checked
+bool fits_device(cl_kernel kernel, cl_device_id device, int blockSize) {
+    size_t maxGroupSize = 0;
+    check_cl_error(clGetKernelWorkGroupInfo(kernel, device,
+                                            CL_KERNEL_WORK_GROUP_SIZE,
+                                            sizeof(size_t), &maxGroupSize, 0),
+                   "clGetKernelWorkGroupInfo(CL_KERNEL_WORK_GROUP_SIZE)");
+    cl_ulong kernelLocalMem = 0;
+    check_cl_error(clGetKernelWorkGroupInfo(kernel, device,
+                                            CL_KERNEL_LOCAL_MEM_SIZE,
+                                            sizeof(cl_ulong), &kernelLocalMem,
+                                            0),
+                   "clGetKernelWorkGroupInfo(CL_KERNEL_LOCAL_MEM_SIZE)");
+    cl_ulong localMem = 0;
+    check_cl_error(clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE,
+                                   sizeof(cl_ulong), &localMem, 0),
+                   "clGetDeviceInfo(CL_DEVICE_LOCAL_MEM_SIZE)");
+    return size_t(blockSize) * blockSize <= maxGroupSize
+           && kernelLocalMem <= localMem;
+}
+
+//------------------------------------------------------------------------------
+//block size sweep: the selected kernel and block_matmul are built and timed
+//with block sizes 2, 4, 8, ... up to maxBlockSize; sizes exceeding the
+//device limits are skipped. Used to compare block_matmul_async, which
+//overlaps the copies into local memory with computation, and the other
+//kernels with the synchronous block_matmul.
+int block_size_sweep(const char* platformName,
+                     const char* deviceType,
+                     int deviceNum,
+                     const char* clSourcePath,
+                     const char* kernelName,
+                     const std::string& clheader,
+                     int M, int K, int N, int maxBlockSize, int TM, int TN,
+                     double EPS) {
+    CLEnv clenv = create_clenv(platformName, deviceType, deviceNum, true);
+    const cl_device_id device = get_device_id(clenv.context);
+    const std::string source = load_text(clSourcePath);
+    cl_int status;
+    std::vector<real_t> A = create_matrix(K, M);
+    std::vector<real_t> B = create_matrix(N, K);
+    std::vector<real_t> C(M * N,real_t(0));
+    std::vector<real_t> refC(M * N,real_t(0));
+    host_matmul(A, B, refC, M, K, N);
+    //B for block_matmul and for the selected kernel, transposed on the host
+    //for block_matmul_tn
+    const std::vector<real_t> inputB[2] = {
+        B, transposed_b(kernelName) ? transpose_matrix(B, K, N) : B};
+    cl_mem devA = clCreateBuffer(clenv.context,
+                                 CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                 A.size() * sizeof(real_t), &A[0], &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devB[2];
+    for(int i = 0; i != 2; ++i) {
+        devB[i] = clCreateBuffer(clenv.context,
+                                 CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                 B.size() * sizeof(real_t),
+                                 const_cast< real_t* >(&inputB[i][0]),
+                                 &status);
+        check_cl_error(status, "clCreateBuffer");
+    }
+    cl_mem devC = clCreateBuffer(clenv.context, CL_MEM_WRITE_ONLY,
+                                 C.size() * sizeof(real_t), 0, &status);
+    check_cl_error(status, "clCreateBuffer");
+    const char* names[2] = {"block_matmul", kernelName};
+    const char* labels[2] = {"reference", "kernel"};
+    const int tm[2] = {1, TM};
+    const int tn[2] = {1, TN};
+    std::cout << "block size, block_matmul (ms), block_matmul GFLOP/s, "
+              << kernelName << " (ms), " << kernelName << " GFLOP/s, speedup"
+              << std::endl;
+    bool passed = true;
+    for(int bs = 2; bs <= maxBlockSize; bs *= 2) {
+        //the local memory tiles are checked before building: compilers
+        //reject programs exceeding the local memory size
+        if(!block_fits_device(device, bs, TM, TN)) {
+            std::cout << bs << ", block size exceeds device limits"
+                      << std::endl;
+            continue;
+        }
+        std::ostringstream header;
+        header << clheader << "#define BLOCK_SIZE " << bs << '\n'
+               << "#define TM " << TM << '\n' << "#define TN " << TN << "\n\n";
+        cl_program program = try_build_program(clenv.context, device,
+                                               header.str() + source);
+        if(program == 0) {
+            std::cout << bs << ", build failed" << std::endl;
+            continue;
+        }
+        cl_kernel kernels[2];
+        bool fits = true;
+        for(int i = 0; i != 2; ++i) {
+            kernels[i] = clCreateKernel(program, names[i], &status);
+            check_cl_error(status, "clCreateKernel");
+            fits = fits && fits_device(kernels[i], device, bs);
+        }
+        if(fits) {
+            ProfilingSession session;
+            for(int i = 0; i != 2; ++i) {
+                timed_matmul(session, labels[i], clenv, kernels[i], devA,
+                             devB[i], devC, M, K, N, bs, tm[i], tn[i]);
+                check_cl_error(clEnqueueReadBuffer(clenv.commandQueue, devC,
+                                                   CL_TRUE, 0,
+                                                   C.size() * sizeof(real_t),
+                                                   &C[0], 0, 0, 0),
+                               "clEnqueueReadBuffer");
+                passed = passed && check_result(refC, C, EPS);
+            }
+            session.wait();
+            const double t0 = session.stats(labels[0]).total;
+            const double t1 = session.stats(labels[1]).total;
+            std::cout << bs << ", " << t0 << ", " << gflops(M, K, N, t0)
+                      << ", " << t1 << ", " << gflops(M, K, N, t1) << ", "
+                      << t0 / t1 << std::endl;
+        } else {
+            std::cout << bs << ", block size exceeds device limits"
+                      << std::endl;
+        }
+        for(int i = 0; i != 2; ++i) {
+            check_cl_error(clReleaseKernel(kernels[i]), "clReleaseKernel");
+        }
+        check_cl_error(clReleaseProgram(program), "clReleaseProgram");
+    }
+    std::cout << (passed ? "PASSED" : "FAILED") << std::endl;
+    check_cl_error(clReleaseMemObject(devA), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devB[0]), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devB[1]), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devC), "clReleaseMemObject");
+    release_clenv(clenv);
+    return passed ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+//escapes quotes, backslashes and control characters for output as a JSON
+//string
+std::string json_escape(const std::string& s) {
+    std::ostringstream os;
+    for(std::string::const_iterator c = s.begin(); c != s.end(); ++c) {
+        if(*c == '"' || *c == '\\') os << '\\' << *c;
+        else if((unsigned char)(*c) < 0x20) {
+            char code[8];
+            sprintf(code, "\\u%04x", (unsigned char)(*c));
+            os << code;
+        } else os << *c;
+    }
+    return os.str();
+}
+
+//------------------------------------------------------------------------------
+//benchmark mode: for each size the kernel is launched warmup times untimed,
+//then reps times timed from START to END, excluding queueing latency;
+//inputs are generated from a fixed seed so that runs are repeatable.
+//Reports min, median and max time, GFLOP/s at the median and min time and
+//the effective bandwidth at the median time, computed from the size of A, B
+//and C i.e. the minimum global memory traffic; the output is CSV or JSON
+int benchmark_matmul(const char* platformName,
+                     const char* deviceType,
+                     int deviceNum,
+                     const char* clSourcePath,
+                     const char* kernelName,
+                     const std::string& clheader,
+                     const std::vector< MatmulSize >& sizes,
+                     int BLOCK_SIZE, int TM, int TN,
+                     int warmup, int reps, unsigned int seed, bool json,
+                     double EPS) {
+    CLEnv clenv = create_clenv(platformName, deviceType, deviceNum, true,
+                               clSourcePath, kernelName, clheader);
+    const std::string device = get_device_key(get_device_id(clenv.context));
+    cl_int status;
+    bool passed = true;
+    if(json) std::cout << "[" << std::endl;
+    else {
+        std::cout << "kernel,device,M,K,N,block_size,tm,tn,warmup,reps,"
+                     "min_ms,median_ms,max_ms,gflops,gflops_best,"
+                     "bandwidth_gbs,check" << std::endl;
+    }
+    for(size_t s = 0; s != sizes.size(); ++s) {
+        const int M = sizes[s].M;
+        const int K = sizes[s].K;
+        const int N = sizes[s].N;
+        std::vector<real_t> A = create_matrix(K, M, seed);
+        std::vector<real_t> B = create_matrix(N, K, seed + 1);
+        std::vector<real_t> C(M * N,real_t(0));
+        std::vector<real_t> refC(M * N,real_t(0));
+        //block_matmul_tn: B transposed on the host
+        const std::vector<real_t> devInputB = transposed_b(kernelName) ?
+                                              transpose_matrix(B, K, N) : B;
+        cl_mem devA = clCreateBuffer(clenv.context,
+                                     CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                     A.size() * sizeof(real_t), &A[0],
+                                     &status);
+        check_cl_error(status, "clCreateBuffer");
+        cl_mem devB = clCreateBuffer(clenv.context,
+                                     CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                     devInputB.size() * sizeof(real_t),
+                                     const_cast< real_t* >(&devInputB[0]),
+                                     &status);
+        check_cl_error(status, "clCreateBuffer");
+        cl_mem devC = clCreateBuffer(clenv.context, CL_MEM_WRITE_ONLY,
+                                     C.size() * sizeof(real_t), 0, &status);
+        check_cl_error(status, "clCreateBuffer");
+        ProfilingSession session;
+        timed_matmul(session, kernelName, clenv, clenv.kernel, devA, devB,
+                     devC, M, K, N, BLOCK_SIZE, TM, TN, warmup, reps);
+        check_cl_error(clEnqueueReadBuffer(clenv.commandQueue, devC, CL_TRUE,
+                                           0, C.size() * sizeof(real_t),
+                                           &C[0], 0, 0, 0),
+                       "clEnqueueReadBuffer");
+        session.wait();
+        host_matmul(A, B, refC, M, K, N);
+        const bool ok = check_result(refC, C, EPS);
+        passed = passed && ok;
+        const ProfilingSession::Stats st = session.stats(kernelName);
+        const double bytes = (double(M) * K + double(K) * N + double(M) * N)
+                             * sizeof(real_t);
+        const double bandwidth = bytes / (st.median * 1E6);
+        const char* check = ok ? "PASSED" : "FAILED";
+        if(json) {
+            std::cout << "  {\"kernel\": \"" << json_escape(kernelName)
+                      << "\", \"device\": \"" << json_escape(device) << "\", "
+                      << "\"M\": " << M << ", \"K\": " << K
+                      << ", \"N\": " << N << ", \"block_size\": "
+                      << BLOCK_SIZE << ", \"tm\": " << TM << ", \"tn\": "
+                      << TN << ", \"warmup\": " << warmup << ", \"reps\": "
+                      << reps << ", \"min_ms\": " << st.min
+                      << ", \"median_ms\": " << st.median
+                      << ", \"max_ms\": " << st.max << ", \"gflops\": "
+                      << gflops(M, K, N, st.median) << ", \"gflops_best\": "
+                      << gflops(M, K, N, st.min) << ", \"bandwidth_gbs\": "
+                      << bandwidth << ", \"check\": \"" << check << "\"}"
+                      << (s + 1 != sizes.size() ? "," : "") << std::endl;
+        } else {
+            //device keys contain commas: quoted field
+            std::string quoted = device;
+            for(size_t q = quoted.find('"'); q != std::string::npos;
+                q = quoted.find('"', q + 2)) quoted.insert(q, 1, '"');
+            std::cout << kernelName << ",\"" << quoted << "\"," << M << ','
+                      << K << ',' << N << ',' << BLOCK_SIZE << ',' << TM
+                      << ',' << TN << ',' << warmup << ',' << reps << ','
+                      << st.min << ',' << st.median << ',' << st.max << ','
+                      << gflops(M, K, N, st.median) << ','
+                      << gflops(M, K, N, st.min) << ',' << bandwidth << ','
+                      << check << std::endl;
+        }
+        check_cl_error(clReleaseMemObject(devA), "clReleaseMemObject");
+        check_cl_error(clReleaseMemObject(devB), "clReleaseMemObject");
+        check_cl_error(clReleaseMemObject(devC), "clReleaseMemObject");
+    }
+    if(json) std::cout << "]" << std::endl;
+    release_clenv(clenv);
+    return passed ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+//block matrix multiply: the local work size must match BLOCK_SIZE in both
+//dimensions
+class MatmulTunable : public Tunable {
+public:
+    MatmulTunable(cl_device_id device, cl_mem A, cl_mem B, cl_mem C,
+                  int rows, int inner, int columns)
+        : device_(device), A_(A), B_(B), C_(C), rows_(rows), inner_(inner),
+          columns_(columns) {}
+    bool accept(const TuneConfig& cfg) {
+        return block_fits_device(device_, cfg.value("BLOCK_SIZE", 1),
+                                 cfg.value("TM", 1), cfg.value("TN", 1));
+    }
+    bool configure(cl_kernel kernel, const TuneConfig& cfg,
+                   size_t globalWorkSize[3]) {
+        const size_t blockSize = cfg.value("BLOCK_SIZE", 1);
+        const int tm = cfg.value("TM", 1);
+        const int tn = cfg.value("TN", 1);
+        if(cfg.local[0] != blockSize || cfg.local[1] != blockSize) return false;
+        check_cl_error(clSetKernelArg(kernel, 0, sizeof(cl_mem), &A_),
+                       "clSetKernelArg(A)");
+        check_cl_error(clSetKernelArg(kernel, 1, sizeof(cl_mem), &B_),
+                       "clSetKernelArg(B)");
+        check_cl_error(clSetKernelArg(kernel, 2, sizeof(cl_mem), &C_),
+                       "clSetKernelArg(C)");
+        check_cl_error(clSetKernelArg(kernel, 3, sizeof(int), &rows_),
+                       "clSetKernelArg(a_rows)");
+        check_cl_error(clSetKernelArg(kernel, 4, sizeof(int), &inner_),
+                       "clSetKernelArg(a_columns)");
+        check_cl_error(clSetKernelArg(kernel, 5, sizeof(int), &columns_),
+                       "clSetKernelArg(b_columns)");
+        globalWorkSize[0] = round_up(columns_, blockSize * tn) / tn;
+        globalWorkSize[1] = round_up(rows_, blockSize * tm) / tm;
+        return true;
+    }
+private:
+    cl_device_id device_;
+    cl_mem A_;
+    cl_mem B_;
+    cl_mem C_;
+    int rows_;
+    int inner_;
+    int columns_;
+};
+
+//------------------------------------------------------------------------------
+//returns the BLOCK_SIZE (and TM, TN for block_matmul_reg) stored in the
+//tuning database for the device and matrix size, running the autotuner if
+//not found
+TuneConfig tuned_matmul_config(const char* platformName,
+                               const char* deviceType,
+                               int deviceNum,
+                               const char* clSourcePath,
+                               const char* kernelName,
+                               const std::string& clheader,
+                               int M, int K, int N) {
+    CLEnv clenv = create_clenv(platformName, deviceType, deviceNum, true);
+    std::vector<real_t> A = create_matrix(K, M);
+    //only the shape of B matters, no need to transpose for block_matmul_tn
+    std::vector<real_t> B = create_matrix(N, K);
+    cl_int status;
+    cl_mem devA = clCreateBuffer(clenv.context,
+                                 CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                 A.size() * sizeof(real_t), &A[0], &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devB = clCreateBuffer(clenv.context,
+                                 CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                 B.size() * sizeof(real_t), &B[0], &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devC = clCreateBuffer(clenv.context, CL_MEM_WRITE_ONLY,
+                                 M * N * sizeof(real_t), 0, &status);
+    check_cl_error(status, "clCreateBuffer");
+    std::vector< TuneParam > params(1);
+    params[0].name = "BLOCK_SIZE";
+    for(int b = 1; b <= 64; b *= 2) params[0].values.push_back(b);
+    if(std::string(kernelName) == "block_matmul_reg") {
+        params.resize(3);
+        params[1].name = "TM";
+        params[2].name = "TN";
+        for(int t = 1; t <= 8; t *= 2) {
+            params[1].values.push_back(t);
+            params[2].values.push_back(t);
+        }
+    }
+    std::ostringstream shape;
+    shape << M << 'x' << K << 'x' << N;
+    //block sizes and register tiles exceeding the device limits are
+    //skipped before building
+    MatmulTunable tunable(get_device_id(clenv.context), devA, devB, devC,
+                          M, K, N);
+    const TuneConfig cfg = get_tuned_config(clenv, clSourcePath, kernelName,
+                                            clheader, "", params, 2,
+                                            shape.str(), tunable);
+    check_cl_error(clReleaseMemObject(devA), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devB), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devC), "clReleaseMemObject");
+    release_clenv(clenv);
+    std::cout << "BLOCK_SIZE: " << cfg.value("BLOCK_SIZE");
+    if(params.size() > 1) {
+        std::cout << ", TM: " << cfg.value("TM") << ", TN: " << cfg.value("TN");
+    }
+    std::cout << std::endl;
+    return cfg;
+}
+
 //------------------------------------------------------------------------------
 int main(int argc, char** argv) {
     if(argc < 8) {
         std::cerr << "usage: " << argv[0]
-                  << " <platform name> <device type = default | cpu | gpu "
-                     "| acc | all>  <device num> <OpenCL source file path>"
-                     " <kernel name> <matrix size> <workgroup size>"
+                  << " <platform name | all> <device type = default | cpu "
+                     "| gpu | acc | all | fastest | fastest-for:<kernel>>"
+                     "  <device num | all | comma separated list of device"
+                     " nums> <OpenCL source file path>"
+                     " <kernel name> <matrix size | MxKxN>"
+                     " <workgroup size | auto>"
+                     " [--adaptive] [--tm=<rows per work item>]"
+                     " [--tn=<columns per work item>]"
+                     " [--out-of-core=<tile size>] [--half]"
+                     " [--block-sweep] [--benchmark] [--warmup=<n>]"
+                     " [--reps=<n>] [--sizes=<comma separated sizes>]"
+                     " [--seed=<n>] [--json]\n"
+                     "  MxKxN multiplies a M x K matrix by a K x N matrix,"
+                     " sizes need not be multiples of the workgroup size\n"
+                     "  'auto' selects the block size from the tuning database"
+                     " running the autotuner if no entry is found\n"
+                     "  with multiple devices the rows are split evenly among"
+                     " devices unless --adaptive is specified, in which case"
+                     " the split is proportional to the measured throughput\n"
+                     "  'fastest' selects the device through the cached"
+                     " micro-benchmark ranking, a single device num is"
+                     " required and ignored\n"
+                     "  --tm and --tn set the register tile computed by each"
+                     " work item of block_matmul_reg, default 1\n"
+                     "  --out-of-core streams tiles of A and B through"
+                     " double buffered device tiles and reports the fraction"
+                     " of transfer time hidden behind kernel execution\n"
+                     "  'host' as the kernel name runs the multi-threaded host"
+                     " matrix multiply (host_gemm.h), platform, device and"
+                     " workgroup size are ignored\n"
+                     "  block_matmul_tn reads B transposed: B is packed on the"
+                     " device by the transpose kernel and the pack time is"
+                     " reported separately\n"
+                     "  --half stores A and B in half precision and"
+                     " accumulates in single precision; error and speedup"
+                     " are reported against the single precision kernel\n"
+                     "  --block-sweep times the kernel and block_matmul with"
+                     " block sizes 2, 4, 8, ... up to the workgroup size;"
+                     " e.g. compare block_matmul_async, which prefetches"
+                     " blocks with async_work_group_copy, with block_matmul\n"
+                     "  --benchmark runs --warmup untimed launches (default 3)"
+                     " and --reps timed launches (default 10) for each of"
+                     " the --sizes (default: matrix size) with inputs"
+                     " generated from --seed (default 1), and prints"
+                     " min/median/max time, GFLOP/s and effective bandwidth"
+                     " as CSV or, with --json, as JSON"
                   << std::endl;
         exit(EXIT_FAILURE);   
     }
-    const int SIZE = atoi(argv[6]);
-    const size_t BYTE_SIZE = SIZE * SIZE * sizeof(real_t);
-    const int BLOCK_SIZE = atoi(argv[7]); //4 x 4 tiles
-    if( SIZE < 1 || BLOCK_SIZE < 1 || (SIZE % BLOCK_SIZE) != 0) {
-    	std::cerr << "ERROR - size and block size *must* be greater than zero "
-    	             "and size *must* be evenly divsible by block size"
-    	          << std::endl;
-    	exit(EXIT_FAILURE);
+    //M x K times K x N; a single value is used for all three sizes
+    MatmulSize size = {0, 0, 0};
+    if(!parse_matmul_size(argv[6], size)) {
+        std::cerr << "ERROR - invalid matrix size " << argv[6] << std::endl;
+        exit(EXIT_FAILURE);
     }
+    int M = size.M, K = size.K, N = size.N;
     //setup text header that will be prefixed to opencl code
     std::ostringstream clheaderStream;
-    clheaderStream << "#define BLOCK_SIZE " << BLOCK_SIZE << '\n';
 #ifdef USE_DOUBLE    
     clheaderStream << "#define DOUBLE\n";
     const double EPS = 0.000000001;
 #else
     const double EPS = 0.00001;
 #endif
+    bool adaptive = false;
+    int TM = 1;
+    int TN = 1;
+    int outOfCoreTile = 0;
+    bool half = false;
+    bool blockSweep = false;
+    bool benchmark = false;
+    bool json = false;
+    int warmup = 3;
+    int reps = 10;
+    unsigned int seed = 1;
+    std::vector< MatmulSize > sizes;
+    for(int a = 8; a < argc; ++a) {
+        const std::string arg = argv[a];
+        if(arg == "--adaptive") adaptive = true;
+        else if(arg.find("--out-of-core=") == 0)
+            outOfCoreTile = atoi(arg.c_str() + 14);
+        else if(arg == "--half") half = true;
+        else if(arg == "--block-sweep") blockSweep = true;
+        else if(arg == "--benchmark") benchmark = true;
+        else if(arg == "--json") json = true;
+        else if(arg.find("--warmup=") == 0) warmup = atoi(arg.c_str() + 9);
+        else if(arg.find("--reps=") == 0) reps = atoi(arg.c_str() + 7);
+        else if(arg.find("--seed=") == 0) seed = atoi(arg.c_str() + 7);
+        else if(arg.find("--sizes=") == 0) {
+            std::istringstream is(arg.substr(8));
+            std::string sz;
+            while(std::getline(is, sz, ',')) {
+                MatmulSize ms = {0, 0, 0};
+                if(!parse_matmul_size(sz, ms) || ms.M < 1 || ms.K < 1
+                   || ms.N < 1) {
+                    std::cerr << "ERROR - invalid matrix size " << sz
+                              << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                sizes.push_back(ms);
+            }
+        }
+        else if(arg.find("--tm=") == 0) TM = atoi(arg.c_str() + 5);
+        else if(arg.find("--tn=") == 0) TN = atoi(arg.c_str() + 5);
+        else {
+            std::cerr << "ERROR - unknown option " << arg << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    const std::string deviceNums = argv[3];
+    const bool multiDevice = deviceNums == "all"
+                             || deviceNums.find(',') != std::string::npos;
+    if(multiDevice && is_fastest_device_type(argv[2])) {
+        std::cerr << "ERROR - 'fastest' selects a single device and cannot be"
+                     " combined with a list of device numbers or 'all'"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    //CPU baseline, no OpenCL device used
+    if(std::string(argv[5]) == "host") return host_backend_matmul(M, K, N, EPS);
+    //with multiple devices tuning is performed on the first device
+    int BLOCK_SIZE = atoi(argv[7]); //4 x 4 tiles
+    if(std::string(argv[7]) == "auto") {
+        const TuneConfig cfg = tuned_matmul_config(argv[1], argv[2],
+                                                   atoi(argv[3]), argv[4],
+                                                   argv[5],
+                                                   clheaderStream.str(),
+                                                   M, K, N);
+        BLOCK_SIZE = cfg.value("BLOCK_SIZE");
+        TM = cfg.value("TM", 1);
+        TN = cfg.value("TN", 1);
+    }
+    //register tiles are only used by block_matmul_reg
+    if(std::string(argv[5]) != "block_matmul_reg") TM = TN = 1;
+    if( M < 1 || K < 1 || N < 1 || BLOCK_SIZE < 1 || TM < 1 || TN < 1) {
+    	std::cerr << "ERROR - matrix sizes, block size and tile sizes *must*"
+    	             " be greater than zero"
+    	          << std::endl;
+    	exit(EXIT_FAILURE);
+    }
+    if(blockSweep) {
+        return block_size_sweep(argv[1], argv[2], atoi(argv[3]), argv[4],
+                                argv[5], clheaderStream.str(), M, K, N,
+                                BLOCK_SIZE, TM, TN, EPS);
+    }
+    clheaderStream << "#define BLOCK_SIZE " << BLOCK_SIZE << '\n'
+                   << "#define TM " << TM << '\n'
+                   << "#define TN " << TN << '\n';
+    if(benchmark) {
+        if(outOfCoreTile > 0 || half || multiDevice) {
+            std::cerr << "ERROR - --benchmark cannot be combined with"
+                         " multiple devices, --out-of-core or --half"
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if(warmup < 0 || reps < 1) {
+            std::cerr << "ERROR - invalid number of warmup or timed"
+                         " iterations" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if(sizes.empty()) sizes.push_back(size);
+        return benchmark_matmul(argv[1], argv[2], atoi(argv[3]), argv[4],
+                                argv[5], clheaderStream.str(), sizes,
+                                BLOCK_SIZE, TM, TN, warmup, reps, seed, json,
+                                EPS);
+    }
+    if(outOfCoreTile > 0) {
+        if(half) {
+            std::cerr << "ERROR - --half not supported in out-of-core mode"
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if(transposed_b(argv[5])) {
+            std::cerr << "ERROR - block_matmul_tn not supported in"
+                         " out-of-core mode" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return out_of_core_matmul(argv[1], argv[2], atoi(argv[3]), argv[4],
+                                  argv[5], clheaderStream.str(), M, K, N,
+                                  BLOCK_SIZE, TM, TN, outOfCoreTile, EPS);
+    }
+    if(half) {
+#ifdef USE_DOUBLE
+        std::cerr << "ERROR - --half requires single precision" << std::endl;
+        exit(EXIT_FAILURE);
+#endif
+        return half_storage_matmul(argv[1], argv[2], atoi(argv[3]), argv[4],
+                                   argv[5], clheaderStream.str(), M, K, N,
+                                   BLOCK_SIZE, TM, TN);
+    }
+    if(multiDevice) {
+        return multi_device_matmul(argv[1], argv[2], argv[3], argv[4], argv[5],
+                                   clheaderStream.str(), M, K, N, BLOCK_SIZE,
+                                   TM, TN, EPS, adaptive);
+    }
     //enable profiling on queue    
     CLEnv clenv = create_clenv(argv[1], argv[2], atoi(argv[3]), true,
                                argv[4], argv[5], clheaderStream.str());
    
     cl_int status;
     //create input and output matrices
-    std::vector<real_t> A = create_matrix(SIZE, SIZE);
-    std::vector<real_t> B = create_matrix(SIZE, SIZE);
-    std::vector<real_t> C(SIZE * SIZE,real_t(0));
-    std::vector<real_t> refC(SIZE * SIZE,real_t(0));        
+    std::vector<real_t> A = create_matrix(K, M);
+    std::vector<real_t> B = create_matrix(N, K);
+    std::vector<real_t> C(M * N,real_t(0));
+    std::vector<real_t> refC(M * N,real_t(0));        
+    const size_t BYTE_SIZE = C.size() * sizeof(real_t);
     
     //allocate output buffer on OpenCL device
     cl_mem devC = clCreateBuffer(clenv.context,
@@ -103,17 +1248,46 @@ int main(int argc, char** argv) {
     //allocate input buffers on OpenCL devices and copy data
     cl_mem devA = clCreateBuffer(clenv.context,
                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                 BYTE_SIZE,
+                                 A.size() * sizeof(real_t),
                                  &A[0], //<-- copy data from A
                                  &status);
     check_cl_error(status, "clCreateBuffer");                              
     cl_mem devB = clCreateBuffer(clenv.context,
                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                 BYTE_SIZE,
+                                 B.size() * sizeof(real_t),
                                  &B[0], //<-- copy data from B
                                  &status);
     check_cl_error(status, "clCreateBuffer");                              
 
+    //the profiling session collects the kernel timestamps through an event
+    //callback: no need to drain the queue before or after the launch
+    ProfilingSession session;
+    //block_matmul_tn: pack B into its transpose on the device with the
+    //transpose kernel of the same program; the packed matrix replaces B
+    cl_mem devBt = 0;
+    if(transposed_b(argv[5])) {
+        devBt = clCreateBuffer(clenv.context, CL_MEM_READ_WRITE,
+                               B.size() * sizeof(real_t), 0, &status);
+        check_cl_error(status, "clCreateBuffer");
+        cl_kernel pack = clCreateKernel(clenv.program, "transpose", &status);
+        check_cl_error(status, "clCreateKernel");
+        check_cl_error(clSetKernelArg(pack, 0, sizeof(cl_mem), &devB),
+                       "clSetKernelArg(in)");
+        check_cl_error(clSetKernelArg(pack, 1, sizeof(cl_mem), &devBt),
+                       "clSetKernelArg(out)");
+        check_cl_error(clSetKernelArg(pack, 2, sizeof(int), &K),
+                       "clSetKernelArg(rows)");
+        check_cl_error(clSetKernelArg(pack, 3, sizeof(int), &N),
+                       "clSetKernelArg(columns)");
+        const size_t packGlobal[2] = {round_up(N, BLOCK_SIZE),
+                                      round_up(K, BLOCK_SIZE)};
+        const size_t packLocal[2] = {size_t(BLOCK_SIZE), size_t(BLOCK_SIZE)};
+        status = enqueue_ndrange_profiled(session, clenv.commandQueue, pack,
+                                          2, 0, packGlobal, packLocal);
+        check_cl_error(status, "clEnqueueNDRangeKernel");
+        check_cl_error(clReleaseKernel(pack), "clReleaseKernel");
+    }
+
     //set kernel parameters
     status = clSetKernelArg(clenv.kernel, //kernel
                             0,      //parameter id
@@ -123,7 +1297,7 @@ int main(int argc, char** argv) {
     status = clSetKernelArg(clenv.kernel, //kernel
                             1,      //parameter id
                             sizeof(cl_mem), //size of parameter
-                            &devB); //pointer to parameter
+                            devBt != 0 ? &devBt : &devB); //pointer to parameter
     check_cl_error(status, "clSetKernelArg(B)");
     status = clSetKernelArg(clenv.kernel, //kernel
                             2,      //parameter id
@@ -133,61 +1307,32 @@ int main(int argc, char** argv) {
     status = clSetKernelArg(clenv.kernel, //kernel
                             3,      //parameter id
                             sizeof(int), //size of parameter
-                            &SIZE); //pointer to parameter
-    check_cl_error(status, "clSetKernelArg(SIZE)");
+                            &M); //pointer to parameter
+    check_cl_error(status, "clSetKernelArg(a_rows)");
+    status = clSetKernelArg(clenv.kernel, 4, sizeof(int), &K);
+    check_cl_error(status, "clSetKernelArg(a_columns)");
+    status = clSetKernelArg(clenv.kernel, 5, sizeof(int), &N);
+    check_cl_error(status, "clSetKernelArg(b_columns)");
 
 
     //setup kernel launch configuration
-    //total number of threads == number of array elements
-    const size_t globalWorkSize[2] = {SIZE, SIZE};
+    //total number of threads == number of array elements, divided by the
+    //register tile size for block_matmul_reg and rounded up to a multiple
+    //of the workgroup size: work items outside C do not write
+    const size_t globalWorkSize[2] = {round_up(N, BLOCK_SIZE * TN) / TN,
+                                      round_up(M, BLOCK_SIZE * TM) / TM};
     //number of per-workgroup local threads
     const size_t localWorkSize[2] = {BLOCK_SIZE, BLOCK_SIZE}; 
 
     //launch kernel
-    //to make sure there are no pending commands in the queue do wait
-    //for any commands to finish execution
-    status = clFinish(clenv.commandQueue);
-    check_cl_error(status, "clFinish");
-    cl_event profilingEvent;
-    status = clEnqueueNDRangeKernel(clenv.commandQueue, //queue
-                                    clenv.kernel, //kernel                                   
-                                    2, //number of dimensions for work-items
-                                    0, //global work offset
-                                    globalWorkSize, //total number of threads
-                                    localWorkSize, //threads per workgroup
-                                    0, //number of events that need to
-                                       //complete before kernel executed
-                                    0, //list of events that need to complete
-                                       //before kernel executed
-                                    &profilingEvent); //event object 
-                                                     //identifying this
-                                                     //particular kernel
-                                                     //execution instance
+    status = enqueue_ndrange_profiled(session,
+                                      clenv.commandQueue, //queue
+                                      clenv.kernel, //kernel
+                                      2, //number of dimensions for work-items
+                                      0, //global work offset
+                                      globalWorkSize, //total number of threads
+                                      localWorkSize); //threads per workgroup
     check_cl_error(status, "clEnqueueNDRangeKernel");
-    status = clFinish(clenv.commandQueue); //ensure kernel execution is
-    //terminated; used for timing purposes only; there is no need to enforce
-    //termination when issuing a subsequent blocking data transfer operation
-    check_cl_error(status, "clFinish");
-    status = clWaitForEvents(1, &profilingEvent);
-    check_cl_error(status, "clWaitForEvents");
-    cl_ulong kernelStartTime = cl_ulong(0);
-    cl_ulong kernelEndTime   = cl_ulong(0);
-    size_t retBytes = size_t(0);
-    double kernelElapsedTime_ms = double(0); 
-   
-    status = clGetEventProfilingInfo(profilingEvent,
-									 CL_PROFILING_COMMAND_QUEUED,
-									 sizeof(cl_ulong),
-                                     &kernelStartTime, &retBytes);
-    check_cl_error(status, "clGetEventProfilingInfo");
-    status = clGetEventProfilingInfo(profilingEvent,
-									 CL_PROFILING_COMMAND_END,
-									 sizeof(cl_ulong),
-                                     &kernelEndTime, &retBytes);
-    check_cl_error(status, "clGetEventProfilingInfo");
-    //event timing is reported in nano seconds: divide by 1e6 to get
-    //time in milliseconds
-    kernelElapsedTime_ms =  (double)(kernelEndTime - kernelStartTime) / 1E6;
     //read back and check results
     status = clEnqueueReadBuffer(clenv.commandQueue,
                                  devC,
@@ -202,11 +1347,28 @@ int main(int argc, char** argv) {
                                  0); //event identifying this specific operation
     check_cl_error(status, "clEnqueueReadBuffer");
     
-    host_matmul(A, B, refC, SIZE, SIZE);
+    host_matmul(A, B, refC, M, K, N);
 
+    //the blocking read guarantees the kernel has completed, wait
+    //for the callback to record the timing information
+    session.wait();
+    const double kernelElapsedTime_ms = session.stats(argv[5]).total;
     if(check_result(refC, C, EPS)) {
     	std::cout << "PASSED" << std::endl;
     	std::cout << "Elapsed time(ms): " << kernelElapsedTime_ms << std::endl;
+    	std::cout << "GFLOP/s: " << gflops(M, K, N, kernelElapsedTime_ms)
+    	          << std::endl;
+    	if(devBt != 0) {
+    	    //pack pays off if multiply + pack time is lower than the time
+    	    //of block_matmul on the same problem
+    	    const double packTime_ms = session.stats("transpose").total;
+    	    std::cout << "Pack time(ms): " << packTime_ms << std::endl;
+    	    std::cout << "Pack + multiply time(ms): "
+    	              << packTime_ms + kernelElapsedTime_ms << std::endl;
+    	    std::cout << "GFLOP/s including pack: "
+    	              << gflops(M, K, N, packTime_ms + kernelElapsedTime_ms)
+    	              << std::endl;
+    	}
     } else {
     	std::cout << "FAILED" << std::endl;
     }	
@@ -214,6 +1376,8 @@ int main(int argc, char** argv) {
     check_cl_error(clReleaseMemObject(devA), "clReleaseMemObject");
     check_cl_error(clReleaseMemObject(devB), "clReleaseMemObject");
     check_cl_error(clReleaseMemObject(devC), "clReleaseMemObject");
+    if(devBt != 0)
+        check_cl_error(clReleaseMemObject(devBt), "clReleaseMemObject");
     release_clenv(clenv);
    
     return 0;
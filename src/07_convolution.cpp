@@ -61,14 +61,16 @@ void host_apply_stencil(const std::vector< real_t >& in,
 }
 
 //------------------------------------------------------------------------------
-double device_apply_stencil(const std::vector< real_t >& in,
-                            int size, 
-                            const std::vector< real_t >& filter,
-                            int filterSize,
-                            std::vector< real_t >& out,
-                            const CLEnv& clenv,
-                            const size_t globalWorkSize[2],
-                            const size_t localWorkSize[2]) {
+void device_apply_stencil(const std::vector< real_t >& in,
+                          int size, 
+                          const std::vector< real_t >& filter,
+                          int filterSize,
+                          std::vector< real_t >& out,
+                          const CLEnv& clenv,
+                          const size_t globalWorkSize[2],
+                          const size_t localWorkSize[2],
+                          ProfilingSession& session,
+                          CLBufferPool& pool) {
 
     const int FILTER_SIZE = filterSize;
     const int FILTER_BYTE_SIZE = sizeof(real_t) * FILTER_SIZE * FILTER_SIZE;
@@ -76,27 +78,24 @@ double device_apply_stencil(const std::vector< real_t >& in,
     const size_t BYTE_SIZE = SIZE * SIZE * sizeof(real_t);
 
     cl_int status;
-    //allocate output buffer on OpenCL device
-    cl_mem devOut = clCreateBuffer(clenv.context,
-                                   CL_MEM_WRITE_ONLY | CL_MEM_COPY_HOST_PTR,
-                                   BYTE_SIZE,
-                                   const_cast< real_t* >(&out[0]),
-                                   &status);
-    check_cl_error(status, "clCreateBuffer");
-
-    //allocate input buffers on OpenCL devices and copy data
-    cl_mem devIn = clCreateBuffer(clenv.context,
-                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                  BYTE_SIZE,
-                                  const_cast< real_t* >(&in[0]),
-                                  &status);
-    check_cl_error(status, "clCreateBuffer");
-    cl_mem devFilter = clCreateBuffer(clenv.context,
-                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                  FILTER_BYTE_SIZE,
-                                  const_cast< real_t* >(&filter[0]),
-                                  &status);
-    check_cl_error(status, "clCreateBuffer");
+    //get buffers from pool: buffers are only created the first time,
+    //subsequent calls reuse the buffers released at the end of the
+    //previous call; since the buffers are recycled the data have to be
+    //copied with explicit non-blocking writes
+    //output buffer is initialized with the content of 'out' to preserve
+    //the border
+    cl_mem devOut = pool.acquire(CL_MEM_WRITE_ONLY, BYTE_SIZE);
+    status = clEnqueueWriteBuffer(clenv.commandQueue, devOut, CL_FALSE, 0,
+                                  BYTE_SIZE, &out[0], 0, 0, 0);
+    check_cl_error(status, "clEnqueueWriteBuffer");
+    cl_mem devIn = pool.acquire(CL_MEM_READ_ONLY, BYTE_SIZE);
+    status = clEnqueueWriteBuffer(clenv.commandQueue, devIn, CL_FALSE, 0,
+                                  BYTE_SIZE, &in[0], 0, 0, 0);
+    check_cl_error(status, "clEnqueueWriteBuffer");
+    cl_mem devFilter = pool.acquire(CL_MEM_READ_ONLY, FILTER_BYTE_SIZE);
+    status = clEnqueueWriteBuffer(clenv.commandQueue, devFilter, CL_FALSE, 0,
+                                  FILTER_BYTE_SIZE, &filter[0], 0, 0, 0);
+    check_cl_error(status, "clEnqueueWriteBuffer");
 
 
     //set kernel parameters
@@ -127,18 +126,15 @@ double device_apply_stencil(const std::vector< real_t >& in,
     check_cl_error(status, "clSetKernelArg(out)");
 
 
-    //launch and time kernel
-    const double timems = timeEnqueueNDRangeKernel(
+    //launch kernel; timing information is recorded by the profiling session
+    status = enqueue_ndrange_profiled(
+                                    session, //profiling session
                                     clenv.commandQueue, //queue
                                     clenv.kernel, //kernel                                   
                                     2, //number of dimensions for work-items
                                     0, //global work offset
                                     globalWorkSize, //total number of threads
-                                    localWorkSize, //threads per workgroup
-                                    0, //number of events that need to
-                                       //complete before kernel executed
-                                    0); //list of events that need to complete
-                                        //before kernel executed
+                                    localWorkSize); //threads per workgroup
 
     check_cl_error(status, "clEnqueueNDRangeKernel");
     
@@ -155,22 +151,24 @@ double device_apply_stencil(const std::vector< real_t >& in,
                                     //before transfer executed
                                  0); //event identifying this specific operation
     check_cl_error(status, "clEnqueueReadBuffer");
-    check_cl_error(clReleaseMemObject(devIn), "clReleaseMemObject");
-    check_cl_error(clReleaseMemObject(devFilter), "clReleaseMemObject");
-    check_cl_error(clReleaseMemObject(devOut), "clReleaseMemObject");
-    return timems;
+    //return buffers to the pool for reuse by the next call
+    pool.release(devIn);
+    pool.release(devFilter);
+    pool.release(devOut);
 }
 
 
 //------------------------------------------------------------------------------
-double device_apply_stencil_image(const std::vector< real_t >& in,
-                                  int size, 
-                                  const std::vector< real_t >& filter,
-                                  int filterSize,
-                                  std::vector< real_t >& out,
-                                  const CLEnv& clenv,
-                                  const size_t globalWorkSize[2],
-                                  const size_t localWorkSize[2]) {
+void device_apply_stencil_image(const std::vector< real_t >& in,
+                                int size, 
+                                const std::vector< real_t >& filter,
+                                int filterSize,
+                                std::vector< real_t >& out,
+                                const CLEnv& clenv,
+                                const size_t globalWorkSize[2],
+                                const size_t localWorkSize[2],
+                                ProfilingSession& session,
+                                CLBufferPool& pool) {
 
     const int FILTER_SIZE = filterSize;
     const int FILTER_BYTE_SIZE = sizeof(real_t) * FILTER_SIZE * FILTER_SIZE;
@@ -181,49 +179,36 @@ double device_apply_stencil_image(const std::vector< real_t >& in,
     cl_image_format format;
     format.image_channel_order = CL_INTENSITY;
     format.image_channel_data_type = CL_FLOAT;
+    //images are recycled from the pool when format and size match
+    const size_t origin[3] = {0, 0, 0};
+    const size_t region[3] = {size_t(SIZE), size_t(SIZE), 1};
+    const size_t filterRegion[3] = {size_t(FILTER_SIZE), size_t(FILTER_SIZE), 1};
     //allocate output buffer on OpenCL device
 #ifdef WRITE_TO_IMAGE
-    cl_image devOut = clCreateImage2D(clenv.context,
-                                    CL_MEM_WRITE_ONLY | CL_MEM_COPY_HOST_PTR,
-                                    &format,
-                                    size,
-                                    size,
-                                    0, // row stride,
-                                       // if 0 = size * sizeof(element type)
-                                    const_cast< real_t* >(&out[0]),
-                                    &status);
-    check_cl_error(status, "clCreateImage2D");
+    cl_image devOut = pool.acquire_image2d(CL_MEM_WRITE_ONLY, format,
+                                           size, size);
+    status = clEnqueueWriteImage(clenv.commandQueue, devOut, CL_FALSE,
+                                 origin, region, 0, 0, &out[0], 0, 0, 0);
+    check_cl_error(status, "clEnqueueWriteImage");
 #else    
-    cl_mem devOut = clCreateBuffer(clenv.context,
-                                   CL_MEM_WRITE_ONLY | CL_MEM_COPY_HOST_PTR,
-                                   BYTE_SIZE,
-                                   const_cast< real_t* >(&out[0]),
-                                   &status);
-    check_cl_error(status, "clCreateBuffer");
+    cl_mem devOut = pool.acquire(CL_MEM_WRITE_ONLY, BYTE_SIZE);
+    status = clEnqueueWriteBuffer(clenv.commandQueue, devOut, CL_FALSE, 0,
+                                  BYTE_SIZE, &out[0], 0, 0, 0);
+    check_cl_error(status, "clEnqueueWriteBuffer");
 #endif    
 
     //allocate input buffers on OpenCL devices and copy data
-   
-    cl_image devIn = clCreateImage2D(clenv.context,
-                                     CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                     &format,
-                                     size,
-                                     size,
-                                     0, // row stride,
-                                        // if 0 = size * sizeof(element type)
-                                     const_cast< real_t* >(&in[0]),
-                                     &status);
-    check_cl_error(status, "clCreateImage2D");
-    cl_image devFilter = clCreateImage2D(clenv.context,
-                                    CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                    &format,
-                                    filterSize,
-                                    filterSize,
-                                    0, // row stride,
-                                       // if 0 = size * sizeof(element type)
-                                    const_cast< real_t* >(&filter[0]),
-                                    &status);
-    check_cl_error(status, "clCreateImage2D");
+    cl_image devIn = pool.acquire_image2d(CL_MEM_READ_ONLY, format,
+                                          size, size);
+    status = clEnqueueWriteImage(clenv.commandQueue, devIn, CL_FALSE,
+                                 origin, region, 0, 0, &in[0], 0, 0, 0);
+    check_cl_error(status, "clEnqueueWriteImage");
+    cl_image devFilter = pool.acquire_image2d(CL_MEM_READ_ONLY, format,
+                                              filterSize, filterSize);
+    status = clEnqueueWriteImage(clenv.commandQueue, devFilter, CL_FALSE,
+                                 origin, filterRegion, 0, 0, &filter[0],
+                                 0, 0, 0);
+    check_cl_error(status, "clEnqueueWriteImage");
 
 
     //set kernel parameters
@@ -244,25 +229,20 @@ double device_apply_stencil_image(const std::vector< real_t >& in,
     check_cl_error(status, "clSetKernelArg(out)");
 
 
-    //launch and time kernel
-    const double timems = timeEnqueueNDRangeKernel(
+    //launch kernel; timing information is recorded by the profiling session
+    status = enqueue_ndrange_profiled(
+                                    session, //profiling session
                                     clenv.commandQueue, //queue
                                     clenv.kernel, //kernel                                   
                                     2, //number of dimensions for work-items
                                     0, //global work offset
                                     globalWorkSize, //total number of threads
-                                    localWorkSize, //threads per workgroup
-                                    0, //number of events that need to
-                                       //complete before kernel executed
-                                    0); //list of events that need to complete
-                                        //before kernel executed
+                                    localWorkSize); //threads per workgroup
 
     check_cl_error(status, "clEnqueueNDRangeKernel");
 
 #ifdef WRITE_TO_IMAGE
     //read data from device
-    const size_t origin[3] = {0, 0, 0};
-    const size_t region[3] = {SIZE, SIZE, 1};
     //const size_t rowPitch = SIZE * sizeof(real_t);
 
     //not required for 2d
@@ -296,13 +276,441 @@ double device_apply_stencil_image(const std::vector< real_t >& in,
                                  0); //event identifying this specific operation
     check_cl_error(status, "clEnqueueReadBuffer");
 #endif    
-    check_cl_error(clReleaseMemObject(devOut), "clReleaseMemObject");
+    //return buffers to the pool for reuse by the next call
+    pool.release(devIn);
+    pool.release(devFilter);
+    pool.release(devOut);
+}
+
+//------------------------------------------------------------------------------
+//pipelined stencil: the core space is split into horizontal strips; for each
+//strip the upload of the input rows(including halo), the kernel and the read
+//back of the core region are issued on three different queues (or on the
+//same out-of-order queue) and chained through events, so that transfers
+//of one strip overlap the computation on another strip
+void device_apply_stencil_pipelined(const std::vector< real_t >& in,
+                                    int size,
+                                    const std::vector< real_t >& filter,
+                                    int filterSize,
+                                    std::vector< real_t >& out,
+                                    const CLEnv& clenv,
+                                    const size_t localWorkSize[2],
+                                    int strips,
+                                    ProfilingSession& session,
+                                    CLBufferPool& pool) {
+    const int halo = filterSize / 2;
+    const size_t CORE_SIZE = size - 2 * halo;
+    const size_t ROW_BYTE_SIZE = size * sizeof(real_t);
+    const size_t FILTER_BYTE_SIZE = sizeof(real_t) * filterSize * filterSize;
+    const size_t NQ = clenv.queues.size();
+    cl_command_queue uploadQueue = clenv.queues[0];
+    cl_command_queue kernelQueue = clenv.queues[1 % NQ];
+    cl_command_queue readQueue = clenv.queues[2 % NQ];
+    const std::vector< size_t > rows =
+        split_range(CORE_SIZE, localWorkSize[1],
+                    std::vector< double >(strips, 1.0));
+    CLEventList uploads;
+    CLEventList kernels;
+    CLEventList reads;
+    std::vector< cl_mem > buffers;
+    cl_int status;
+    cl_mem devFilter = pool.acquire(CL_MEM_READ_ONLY, FILTER_BYTE_SIZE);
+    buffers.push_back(devFilter);
+    status = clEnqueueWriteBuffer(uploadQueue, devFilter, CL_FALSE, 0,
+                                  FILTER_BYTE_SIZE, &filter[0], 0, 0,
+                                  uploads.next());
+    check_cl_error(status, "clEnqueueWriteBuffer");
+    const cl_event filterUploaded = uploads.back();
+    size_t offset = 0;
+    for(size_t s = 0; s != rows.size(); offset += rows[s], ++s) {
+        if(rows[s] == 0) continue;
+        const size_t BYTE_SIZE = (rows[s] + 2 * halo) * ROW_BYTE_SIZE;
+        cl_mem devIn = pool.acquire(CL_MEM_READ_ONLY, BYTE_SIZE);
+        cl_mem devOut = pool.acquire(CL_MEM_WRITE_ONLY, BYTE_SIZE);
+        buffers.push_back(devIn);
+        buffers.push_back(devOut);
+        //upload input rows including halo
+        status = clEnqueueWriteBuffer(uploadQueue, devIn, CL_FALSE, 0,
+                                      BYTE_SIZE, &in[offset * size], 0, 0,
+                                      uploads.next());
+        check_cl_error(status, "clEnqueueWriteBuffer");
+        session.attach(uploads.back(), "upload");
+        //kernel waits for filter and strip uploads
+        const cl_event kernelWaitList[] = {filterUploaded, uploads.back()};
+        check_cl_error(clSetKernelArg(clenv.kernel, 0, sizeof(cl_mem), &devIn),
+                       "clSetKernelArg(in)");
+        check_cl_error(clSetKernelArg(clenv.kernel, 1, sizeof(int), &size),
+                       "clSetKernelArg(size)");
+        check_cl_error(clSetKernelArg(clenv.kernel, 2, sizeof(cl_mem),
+                                      &devFilter), "clSetKernelArg(filter)");
+        check_cl_error(clSetKernelArg(clenv.kernel, 3, sizeof(int),
+                                      &filterSize), "clSetKernelArg(filterSize)");
+        check_cl_error(clSetKernelArg(clenv.kernel, 4, sizeof(cl_mem), &devOut),
+                       "clSetKernelArg(out)");
+        const size_t globalWorkSize[2] = {CORE_SIZE, rows[s]};
+        status = enqueue_ndrange_profiled(session, kernelQueue, clenv.kernel,
+                                          2, 0, globalWorkSize, localWorkSize,
+                                          2, kernelWaitList, kernels.next());
+        check_cl_error(status, "clEnqueueNDRangeKernel");
+        //read back the core region only: border columns and halo rows
+        //are not computed by the kernel
+        const size_t bufferOrigin[3] = {halo * sizeof(real_t), size_t(halo), 0};
+        const size_t hostOrigin[3] = {halo * sizeof(real_t), offset + halo, 0};
+        const size_t region[3] = {CORE_SIZE * sizeof(real_t), rows[s], 1};
+        status = clEnqueueReadBufferRect(readQueue, devOut, CL_FALSE,
+                                         bufferOrigin, hostOrigin, region,
+                                         ROW_BYTE_SIZE, 0,
+                                         ROW_BYTE_SIZE, 0,
+                                         &out[0], 1, &kernels.back(),
+                                         reads.next());
+        check_cl_error(status, "clEnqueueReadBufferRect");
+        session.attach(reads.back(), "read");
+    }
+    for(size_t q = 0; q != NQ; ++q) {
+        check_cl_error(clFlush(clenv.queues[q]), "clFlush");
+    }
+    reads.wait();
+    for(std::vector< cl_mem >::iterator b = buffers.begin();
+        b != buffers.end(); ++b) pool.release(*b);
+}
+
+//------------------------------------------------------------------------------
+//stencil applied to a horizontal strip of core rows; errors are reported
+//through exceptions so that the strip can be processed again in smaller
+//pieces when device resources are exhausted
+class StencilChunk : public ChunkWork {
+public:
+    StencilChunk(const std::vector< real_t >& in,
+                 int size,
+                 const std::vector< real_t >& filter,
+                 int filterSize,
+                 std::vector< real_t >& out,
+                 const CLEnv& clenv,
+                 const size_t localWorkSize[2],
+                 ProfilingSession& session)
+        : in_(in), size_(size), filter_(filter), filterSize_(filterSize),
+          out_(out), clenv_(clenv), session_(session) {
+        localWorkSize_[0] = localWorkSize[0];
+        localWorkSize_[1] = localWorkSize[1];
+    }
+    void process(size_t offset, size_t count) {
+        const int halo = filterSize_ / 2;
+        const size_t ROW_BYTE_SIZE = size_ * sizeof(real_t);
+        const size_t BYTE_SIZE = (count + 2 * halo) * ROW_BYTE_SIZE;
+        cl_int status;
+        //memory objects are released when leaving the function, also in
+        //case of errors
+        CLMemGuard guard;
+        cl_mem devIn = guard.add(clCreateBuffer(clenv_.context,
+                                   CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                   BYTE_SIZE,
+                                   const_cast< real_t* >(&in_[offset * size_]),
+                                   &status));
+        throw_cl_error(status, "clCreateBuffer");
+        cl_mem devFilter = guard.add(clCreateBuffer(clenv_.context,
+                                   CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                   sizeof(real_t) * filterSize_ * filterSize_,
+                                   const_cast< real_t* >(&filter_[0]),
+                                   &status));
+        throw_cl_error(status, "clCreateBuffer");
+        cl_mem devOut = guard.add(clCreateBuffer(clenv_.context,
+                                                 CL_MEM_WRITE_ONLY,
+                                                 BYTE_SIZE, 0, &status));
+        throw_cl_error(status, "clCreateBuffer");
+        throw_cl_error(clSetKernelArg(clenv_.kernel, 0, sizeof(cl_mem), &devIn),
+                       "clSetKernelArg(in)");
+        throw_cl_error(clSetKernelArg(clenv_.kernel, 1, sizeof(int), &size_),
+                       "clSetKernelArg(size)");
+        throw_cl_error(clSetKernelArg(clenv_.kernel, 2, sizeof(cl_mem),
+                                      &devFilter), "clSetKernelArg(filter)");
+        throw_cl_error(clSetKernelArg(clenv_.kernel, 3, sizeof(int),
+                                      &filterSize_),
+                       "clSetKernelArg(filterSize)");
+        throw_cl_error(clSetKernelArg(clenv_.kernel, 4, sizeof(cl_mem),
+                                      &devOut), "clSetKernelArg(out)");
+        const size_t globalWorkSize[2] = {size_t(size_ - 2 * halo), count};
+        status = enqueue_ndrange_profiled(session_, clenv_.commandQueue,
+                                          clenv_.kernel, 2, 0, globalWorkSize,
+                                          localWorkSize_);
+        throw_cl_error(status, "clEnqueueNDRangeKernel");
+        //read back the core region only; allocation failures might only
+        //be reported here
+        const size_t bufferOrigin[3] = {halo * sizeof(real_t), size_t(halo), 0};
+        const size_t hostOrigin[3] = {halo * sizeof(real_t), offset + halo, 0};
+        const size_t region[3] = {globalWorkSize[0] * sizeof(real_t), count, 1};
+        status = clEnqueueReadBufferRect(clenv_.commandQueue, devOut, CL_TRUE,
+                                         bufferOrigin, hostOrigin, region,
+                                         ROW_BYTE_SIZE, 0, ROW_BYTE_SIZE, 0,
+                                         &out_[0], 0, 0, 0);
+        throw_cl_error(status, "clEnqueueReadBufferRect");
+    }
+private:
+    const std::vector< real_t >& in_;
+    int size_;
+    const std::vector< real_t >& filter_;
+    int filterSize_;
+    std::vector< real_t >& out_;
+    const CLEnv& clenv_;
+    size_t localWorkSize_[2];
+    ProfilingSession& session_;
+};
+
+//------------------------------------------------------------------------------
+//multi-device stencil: each device processes a horizontal strip of the
+//core space; the strip assigned to a device includes the halo rows
+//above and below the strip
+class StencilSplit : public SplitWork {
+public:
+    StencilSplit(const std::vector< real_t >& in,
+                 int size,
+                 const std::vector< real_t >& filter,
+                 int filterSize,
+                 std::vector< real_t >& out,
+                 bool image,
+                 const size_t localWorkSize[2])
+        : in_(in), size_(size), filter_(filter), filterSize_(filterSize),
+          out_(out), image_(image) {
+        localWorkSize_[0] = localWorkSize[0];
+        localWorkSize_[1] = localWorkSize[1];
+    }
+    cl_event enqueue(int /*device*/, const CLEnv& clenv,
+                     size_t offset, size_t count) {
+        cl_int status;
+        const int halo = filterSize_ / 2;
+        //number of rows including halo
+        const size_t rows = count + 2 * halo;
+        const size_t BYTE_SIZE = rows * size_ * sizeof(real_t);
+        real_t* inRows = const_cast< real_t* >(&in_[offset * size_]);
+        real_t* outRows = &out_[offset * size_];
+        cl_mem devIn = 0;
+        cl_mem devFilter = 0;
+        cl_mem devOut = 0;
+        if(image_) {
+            cl_image_format format;
+            format.image_channel_order = CL_INTENSITY;
+            format.image_channel_data_type = CL_FLOAT;
+            devIn = clCreateImage2D(clenv.context,
+                                    CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                    &format, size_, rows, 0, inRows, &status);
+            check_cl_error(status, "clCreateImage2D");
+            devFilter = clCreateImage2D(clenv.context,
+                                    CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                    &format, filterSize_, filterSize_, 0,
+                                    const_cast< real_t* >(&filter_[0]),
+                                    &status);
+            check_cl_error(status, "clCreateImage2D");
+#ifdef WRITE_TO_IMAGE
+            devOut = clCreateImage2D(clenv.context,
+                                    CL_MEM_WRITE_ONLY | CL_MEM_COPY_HOST_PTR,
+                                    &format, size_, rows, 0, outRows, &status);
+            check_cl_error(status, "clCreateImage2D");
+#endif            
+        } else {
+            devIn = clCreateBuffer(clenv.context,
+                                   CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                   BYTE_SIZE, inRows, &status);
+            check_cl_error(status, "clCreateBuffer");
+            devFilter = clCreateBuffer(clenv.context,
+                                   CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                   sizeof(real_t) * filterSize_ * filterSize_,
+                                   const_cast< real_t* >(&filter_[0]),
+                                   &status);
+            check_cl_error(status, "clCreateBuffer");
+        }
+        if(devOut == 0) {
+            devOut = clCreateBuffer(clenv.context,
+                                    CL_MEM_WRITE_ONLY | CL_MEM_COPY_HOST_PTR,
+                                    BYTE_SIZE, outRows, &status);
+            check_cl_error(status, "clCreateBuffer");
+        }
+        buffers_.push_back(devIn);
+        buffers_.push_back(devFilter);
+        buffers_.push_back(devOut);
+        //set kernel parameters
+        if(image_) {
+            check_cl_error(clSetKernelArg(clenv.kernel, 0, sizeof(cl_mem),
+                                          &devIn), "clSetKernelArg(in)");
+            check_cl_error(clSetKernelArg(clenv.kernel, 1, sizeof(cl_mem),
+                                          &devFilter), "clSetKernelArg(filter)");
+            check_cl_error(clSetKernelArg(clenv.kernel, 2, sizeof(cl_mem),
+                                          &devOut), "clSetKernelArg(out)");
+        } else {
+            check_cl_error(clSetKernelArg(clenv.kernel, 0, sizeof(cl_mem),
+                                          &devIn), "clSetKernelArg(in)");
+            check_cl_error(clSetKernelArg(clenv.kernel, 1, sizeof(int),
+                                          &size_), "clSetKernelArg(size)");
+            check_cl_error(clSetKernelArg(clenv.kernel, 2, sizeof(cl_mem),
+                                          &devFilter), "clSetKernelArg(filter)");
+            check_cl_error(clSetKernelArg(clenv.kernel, 3, sizeof(int),
+                                          &filterSize_),
+                           "clSetKernelArg(filterSize)");
+            check_cl_error(clSetKernelArg(clenv.kernel, 4, sizeof(cl_mem),
+                                          &devOut), "clSetKernelArg(out)");
+        }
+        const size_t globalWorkSize[2] = {size_t(size_ - 2 * halo), count};
+        cl_event kernelEvent;
+        status = clEnqueueNDRangeKernel(clenv.commandQueue, clenv.kernel, 2, 0,
+                                        globalWorkSize, localWorkSize_,
+                                        0, 0, &kernelEvent);
+        check_cl_error(status, "clEnqueueNDRangeKernel");
+        //read back core rows only: halo rows belong to other strips
+        const size_t coreOffset = halo * size_;
+        const size_t coreSize = count * size_;
+#ifdef WRITE_TO_IMAGE
+        if(image_) {
+            const size_t origin[3] = {0, size_t(halo), 0};
+            const size_t region[3] = {size_t(size_), count, 1};
+            status = clEnqueueReadImage(clenv.commandQueue, devOut, CL_FALSE,
+                                        origin, region, 0, 0,
+                                        outRows + coreOffset, 0, 0, 0);
+            check_cl_error(status, "clEnqueueReadImage");
+            return kernelEvent;
+        }
+#endif
+        status = clEnqueueReadBuffer(clenv.commandQueue, devOut, CL_FALSE,
+                                     coreOffset * sizeof(real_t),
+                                     coreSize * sizeof(real_t),
+                                     outRows + coreOffset, 0, 0, 0);
+        check_cl_error(status, "clEnqueueReadBuffer");
+        return kernelEvent;
+    }
+    ~StencilSplit() {
+        for(std::vector< cl_mem >::iterator i = buffers_.begin();
+            i != buffers_.end(); ++i) {
+            check_cl_error(clReleaseMemObject(*i), "clReleaseMemObject");
+        }
+    }
+private:
+    const std::vector< real_t >& in_;
+    int size_;
+    const std::vector< real_t >& filter_;
+    int filterSize_;
+    std::vector< real_t >& out_;
+    bool image_;
+    size_t localWorkSize_[2];
+    std::vector< cl_mem > buffers_;
+};
+
+//------------------------------------------------------------------------------
+//stencil: the local work size must evenly divide the core space in each
+//dimension; memory objects are either buffers or images depending on the
+//kernel
+class StencilTunable : public Tunable {
+public:
+    StencilTunable(cl_mem in, int size, cl_mem filter, int filterSize,
+                   cl_mem out, bool image)
+        : in_(in), size_(size), filter_(filter), filterSize_(filterSize),
+          out_(out), image_(image) {}
+    bool configure(cl_kernel kernel, const TuneConfig& cfg,
+                   size_t globalWorkSize[3]) {
+        const size_t core = size_ - 2 * (filterSize_ / 2);
+        if(core % cfg.local[0] != 0 || core % cfg.local[1] != 0) return false;
+        if(image_) {
+            check_cl_error(clSetKernelArg(kernel, 0, sizeof(cl_mem), &in_),
+                           "clSetKernelArg(in)");
+            check_cl_error(clSetKernelArg(kernel, 1, sizeof(cl_mem), &filter_),
+                           "clSetKernelArg(filter)");
+            check_cl_error(clSetKernelArg(kernel, 2, sizeof(cl_mem), &out_),
+                           "clSetKernelArg(out)");
+        } else {
+            check_cl_error(clSetKernelArg(kernel, 0, sizeof(cl_mem), &in_),
+                           "clSetKernelArg(in)");
+            check_cl_error(clSetKernelArg(kernel, 1, sizeof(int), &size_),
+                           "clSetKernelArg(size)");
+            check_cl_error(clSetKernelArg(kernel, 2, sizeof(cl_mem), &filter_),
+                           "clSetKernelArg(filter)");
+            check_cl_error(clSetKernelArg(kernel, 3, sizeof(int),
+                                          &filterSize_),
+                           "clSetKernelArg(filterSize)");
+            check_cl_error(clSetKernelArg(kernel, 4, sizeof(cl_mem), &out_),
+                           "clSetKernelArg(out)");
+        }
+        globalWorkSize[0] = core;
+        globalWorkSize[1] = core;
+        return true;
+    }
+private:
+    cl_mem in_;
+    int size_;
+    cl_mem filter_;
+    int filterSize_;
+    cl_mem out_;
+    bool image_;
+};
+
+//------------------------------------------------------------------------------
+//fills localWorkSize with the workgroup size stored in the tuning database,
+//running the autotuner if not found
+void tuned_local_size(const char* platformName,
+                      const char* deviceType,
+                      int deviceNum,
+                      const char* clSourcePath,
+                      const char* kernelName,
+                      const std::string& clheader,
+                      const std::string& options,
+                      int size,
+                      int filterSize,
+                      bool image,
+                      size_t localWorkSize[2]) {
+    CLEnv clenv = create_clenv(platformName, deviceType, deviceNum, true);
+    std::vector< real_t > grid(size * size, real_t(0));
+    std::vector< real_t > filter = create_filter();
+    cl_int status;
+    cl_mem devIn = 0;
+    cl_mem devFilter = 0;
+    cl_mem devOut = 0;
+    if(image) {
+        cl_image_format format;
+        format.image_channel_order = CL_INTENSITY;
+        format.image_channel_data_type = CL_FLOAT;
+        devIn = clCreateImage2D(clenv.context,
+                                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                &format, size, size, 0, &grid[0], &status);
+        check_cl_error(status, "clCreateImage2D");
+        devFilter = clCreateImage2D(clenv.context,
+                                    CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                    &format, filterSize, filterSize, 0,
+                                    &filter[0], &status);
+        check_cl_error(status, "clCreateImage2D");
+#ifdef WRITE_TO_IMAGE
+        devOut = clCreateImage2D(clenv.context, CL_MEM_WRITE_ONLY,
+                                 &format, size, size, 0, 0, &status);
+        check_cl_error(status, "clCreateImage2D");
+#endif
+    } else {
+        devIn = clCreateBuffer(clenv.context,
+                               CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                               grid.size() * sizeof(real_t), &grid[0],
+                               &status);
+        check_cl_error(status, "clCreateBuffer");
+        devFilter = clCreateBuffer(clenv.context,
+                                   CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                   filter.size() * sizeof(real_t), &filter[0],
+                                   &status);
+        check_cl_error(status, "clCreateBuffer");
+    }
+    if(devOut == 0) {
+        devOut = clCreateBuffer(clenv.context, CL_MEM_WRITE_ONLY,
+                                grid.size() * sizeof(real_t), 0, &status);
+        check_cl_error(status, "clCreateBuffer");
+    }
+    std::ostringstream shape;
+    shape << size << 'x' << size << '/' << filterSize << 'x' << filterSize;
+    StencilTunable tunable(devIn, size, devFilter, filterSize, devOut, image);
+    const TuneConfig cfg = get_tuned_config(clenv, clSourcePath, kernelName,
+                                            clheader, options,
+                                            std::vector< TuneParam >(), 2,
+                                            shape.str(), tunable);
     check_cl_error(clReleaseMemObject(devIn), "clReleaseMemObject");
     check_cl_error(clReleaseMemObject(devFilter), "clReleaseMemObject");
-    return timems;
+    check_cl_error(clReleaseMemObject(devOut), "clReleaseMemObject");
+    release_clenv(clenv);
+    localWorkSize[0] = cfg.local[0];
+    localWorkSize[1] = cfg.local[1];
+    std::cout << "Workgroup size: " << localWorkSize[0] << 'x'
+              << localWorkSize[1] << std::endl;
 }
 
-
 //------------------------------------------------------------------------------
 bool check_result(const std::vector< real_t >& v1,
 	              const std::vector< real_t >& v2,
@@ -317,17 +725,41 @@ bool check_result(const std::vector< real_t >& v1,
 int main(int argc, char** argv) {
     if(argc < 9) {
         std::cerr << "usage:\n" << argv[0] << '\n'
-                  << "  <platform name>\n"
-                     "  <device type = default | cpu | gpu | acc | all>\n"
-                     "  <device num>\n"
+                  << "  <platform name | all>\n"
+                     "  <device type = default | cpu | gpu | acc | all | fastest |"
+                     " fastest-for:<kernel>>\n"
+                     "  <device num | all | comma separated device nums>\n"
                      "  <OpenCL source file path>\n"
                      "  <kernel name>\n"
                      "  <size>\n"
-                     "  <workgroup size>\n"
+                     "  <workgroup size | auto>\n"
                      "  <std|image>\n"
                      "  [build parameters passed to the OpenCL compiler]\n"
+                     "  [--adaptive]\n"
+                     "  [--iterations=<number of times the stencil is"
+                     " applied, default 1>]\n"
+                     "  [--pool-limit=<max bytes held by the buffer pool,"
+                     " default unlimited>]\n"
+                     "  [--pipeline=<number of strips>]\n"
+                     "  [--chunked[=<initial number of rows per chunk>]]\n"
+                     "  [--out-of-order]\n"
                      "  filter size is 3x3; size - halo region size must be"
-                     " evenly divisible by the workgroup size"
+                     " evenly divisible by the workgroup size\n"
+                     "  with multiple devices the core rows are split evenly"
+                     " among devices unless --adaptive is specified, in which"
+                     " case the split is proportional to the throughput"
+                     " measured in a first run\n"
+                     "  'auto' selects the workgroup size from the tuning"
+                     " database running the autotuner if no entry is found;"
+                     " with multiple devices tuning is performed on the"
+                     " first device\n"
+                     "  --pipeline splits the grid into horizontal strips and"
+                     " overlaps uploads, kernels and read backs on three"
+                     " queues, or on a single out-of-order queue if"
+                     " --out-of-order is specified; std only\n"
+                     "  --chunked processes the grid in strips of rows, halving"
+                     " the number of rows in case of allocation failures or"
+                     " lack of resources; std only"
                   << std::endl;
         exit(EXIT_FAILURE);   
     }
@@ -341,19 +773,81 @@ int main(int argc, char** argv) {
         image = true; 
     }
     std::string options;
+    bool adaptive = false;
+    int iterations = 1;
+    size_t poolLimit = 0;
+    int pipelineStrips = 0;
+    bool outOfOrder = false;
+    //0: no chunking, -1: start with all the rows
+    int chunkRows = 0;
     for(int a = 9; a < argc; ++a) {
-        options += argv[a];
+        //arguments starting with "--" are options for this program,
+        //all the others are passed to the OpenCL compiler
+        const std::string arg = argv[a];
+        if(arg == "--adaptive") adaptive = true;
+        else if(arg.find("--iterations=") == 0) {
+            iterations = atoi(arg.c_str() + std::string("--iterations=").size());
+        } else if(arg.find("--pool-limit=") == 0) {
+            poolLimit = strtoull(arg.c_str() + std::string("--pool-limit=").size(),
+                                 0, 10);
+        } else if(arg.find("--pipeline=") == 0) {
+            pipelineStrips = atoi(arg.c_str() + std::string("--pipeline=").size());
+            if(pipelineStrips < 1) {
+                std::cerr << "ERROR - invalid number of strips: " << arg
+                          << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        } else if(arg == "--out-of-order") outOfOrder = true;
+        else if(arg == "--chunked") chunkRows = -1;
+        else if(arg.find("--chunked=") == 0) {
+            chunkRows = atoi(arg.c_str() + std::string("--chunked=").size());
+        }
+        else if(arg.find("--") == 0) {
+            std::cerr << "ERROR - unknown option " << arg << std::endl;
+            exit(EXIT_FAILURE);
+        } else options += arg;
     }
 #ifdef WRITE_TO_IMAGE
     options += " -DWRITE_TO_IMAGE";
 #endif
+    if((pipelineStrips > 0 || chunkRows != 0) && image) {
+        std::cerr << "ERROR - pipelined and chunked modes not supported with"
+                     " images" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    const std::string deviceNums = argv[3];
+    const bool multiDevice = deviceNums == "all"
+                             || deviceNums.find(',') != std::string::npos;
+    if(multiDevice && is_fastest_device_type(argv[2])) {
+        std::cerr << "ERROR - 'fastest' selects a single device and cannot be"
+                     " combined with a list of device numbers or 'all'"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
     const int FILTER_SIZE = 3; //3x3
     const int SIZE = atoi(argv[6]);
-    const int BLOCK_SIZE = atoi(argv[7]);
-    if((SIZE - (2 * (FILTER_SIZE / 2))) % BLOCK_SIZE != 0) {
+    //setup text header that will be prefixed to opencl code
+    std::ostringstream clheaderStream;
+#ifdef USE_DOUBLE    
+    clheaderStream << "#define DOUBLE\n";
+    const double EPS = 0.000000001;
+#else
+    const double EPS = 0.00001;
+#endif    
+    //number of per-workgroup local threads
+    size_t localWorkSize[2]  = {size_t(atoi(argv[7])),
+                                size_t(atoi(argv[7]))}; 
+    if(std::string(argv[7]) == "auto") {
+        tuned_local_size(argv[1], argv[2], atoi(argv[3]), argv[4], argv[5],
+                         clheaderStream.str(), options, SIZE, FILTER_SIZE,
+                         image, localWorkSize);
+    }
+    if(localWorkSize[0] < 1
+       || (SIZE - (2 * (FILTER_SIZE / 2))) % localWorkSize[0] != 0
+       || (SIZE - (2 * (FILTER_SIZE / 2))) % localWorkSize[1] != 0) {
         std::cerr << "size(" << SIZE << ") - " << (2 * (FILTER_SIZE / 2))
                   << " must be evenly divisible by the workgroup size("
-                  << BLOCK_SIZE << ")" << std::endl;
+                  << argv[7] << ")" << std::endl;
         exit(EXIT_FAILURE);          
     }   
     //setup kernel launch configuration
@@ -361,24 +855,53 @@ int main(int argc, char** argv) {
     //image - border (= 2 x (filter size DIV 2) != filter size)
     const size_t globalWorkSize[2] = {SIZE - 2 * (FILTER_SIZE / 2), 
                                       SIZE - 2 * (FILTER_SIZE / 2)};
-    //number of per-workgroup local threads
-    const size_t localWorkSize[2]  = {BLOCK_SIZE, BLOCK_SIZE}; 
-    //setup text header that will be prefixed to opencl code
-    std::ostringstream clheaderStream;
-#ifdef USE_DOUBLE    
-    clheaderStream << "#define DOUBLE\n";
-    const double EPS = 0.000000001;
-#else
-    const double EPS = 0.00001;
-#endif    
+    if(multiDevice) {
+        CLMultiEnv clenv = create_clmultienv(argv[1], argv[2], argv[3], true,
+                                             argv[4], argv[5],
+                                             clheaderStream.str(),
+                                             options.c_str());
+        std::vector<real_t> in = create_2d_grid(SIZE, SIZE,
+                                              FILTER_SIZE / 2, FILTER_SIZE / 2);
+        std::vector<real_t> filter = create_filter();
+        std::vector<real_t> out(SIZE * SIZE,real_t(0));
+        std::vector<real_t> refOut(SIZE * SIZE,real_t(0));
+        const size_t CORE_ROWS = SIZE - 2 * (FILTER_SIZE / 2);
+        if(adaptive) {
+            StencilSplit calibration(in, SIZE, filter, FILTER_SIZE, out,
+                                     image, localWorkSize);
+            enqueue_split(clenv, CORE_ROWS, localWorkSize[1], calibration,
+                          true);
+        }
+        StencilSplit work(in, SIZE, filter, FILTER_SIZE, out,
+                          image, localWorkSize);
+        const double timems = enqueue_split(clenv, CORE_ROWS,
+                                            localWorkSize[1], work);
+        host_apply_stencil(in, SIZE, filter, FILTER_SIZE, refOut);
+        const bool passed = check_result(out, refOut, EPS);
+        if(passed) {
+            for(size_t d = 0; d != clenv.envs.size(); ++d) {
+                std::cout << "Device " << d << ": " << clenv.counts[d]
+                          << " rows, " << clenv.times[d] << " ms" << std::endl;
+            }
+            std::cout << "Elapsed time: " << timems << " ms" << std::endl;
+            std::cout << "PASSED" << std::endl;
+        } else {
+            std::cout << "FAILED" << std::endl;
+        }
+        release_clmultienv(clenv);
+        return passed ? 0 : EXIT_FAILURE;
+    }
     CLEnv clenv = create_clenv(argv[1], //platform name
                                argv[2], //device type
                                atoi(argv[3]), //device id
                                true, //profiling
                                argv[4], //cl source code
                                argv[5], //kernel name
-                               "", //source code prefix text
-                               options.c_str()); //compiler options
+                               clheaderStream.str(), //source code prefix text
+                               options.c_str(), //compiler options
+                               //upload, kernel and read back queues
+                               pipelineStrips > 0 && !outOfOrder ? 3 : 1,
+                               outOfOrder); //out-of-order execution
    
     cl_int status;
     //create input and output matrices
@@ -388,20 +911,68 @@ int main(int argc, char** argv) {
     std::vector<real_t> out(SIZE * SIZE,real_t(0));
     std::vector<real_t> refOut(SIZE * SIZE,real_t(0));        
     
-    //launch kernels and check results
-    double timems = 0;
-    if(image) {
-        timems = device_apply_stencil_image(in, SIZE, filter, FILTER_SIZE,
-                             out, clenv, globalWorkSize, localWorkSize);
-    } else {
-        timems = device_apply_stencil(in, SIZE, filter, FILTER_SIZE,
-                             out, clenv, globalWorkSize, localWorkSize);
+    //launch kernels and check results; in case of multiple iterations
+    //device memory is recycled through the buffer pool
+    ProfilingSession session;
+    CLBufferPool pool(clenv.context, poolLimit);
+    size_t finalChunkRows = 0;
+    for(int i = 0; i < iterations; ++i) {
+        if(chunkRows != 0) {
+            const size_t CORE_ROWS = SIZE - 2 * (FILTER_SIZE / 2);
+            StencilChunk work(in, SIZE, filter, FILTER_SIZE, out, clenv,
+                              localWorkSize, session);
+            try {
+                finalChunkRows = process_in_chunks(CORE_ROWS,
+                                      chunkRows < 0 ? CORE_ROWS : chunkRows,
+                                      localWorkSize[1], work);
+            } catch(const CLError& e) {
+                std::cerr << e.what() << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        } else if(pipelineStrips > 0) {
+            device_apply_stencil_pipelined(in, SIZE, filter, FILTER_SIZE,
+                                           out, clenv, localWorkSize,
+                                           pipelineStrips, session, pool);
+        } else if(image) {
+            device_apply_stencil_image(in, SIZE, filter, FILTER_SIZE,
+                                 out, clenv, globalWorkSize, localWorkSize,
+                                 session, pool);
+        } else {
+            device_apply_stencil(in, SIZE, filter, FILTER_SIZE,
+                                 out, clenv, globalWorkSize, localWorkSize,
+                                 session, pool);
+        }
     }
+    session.wait();
+    const double timems = session.stats(argv[5]).median;
     
     host_apply_stencil(in, SIZE, filter, FILTER_SIZE, refOut);
 
-    if(check_result(out, refOut, EPS)) {
+    if(check_result(out, refOut, EPS) && pipelineStrips > 0) {
+        //overlap: time saved with respect to serial execution of all
+        //the commands
+        const double serial = session.stats("upload").total
+                              + session.stats(argv[5]).total
+                              + session.stats("read").total;
+        const double elapsed = session.elapsed();
+        std::cout << "Pipelined: " << pipelineStrips << " strips, "
+                  << (outOfOrder ? "1 out-of-order queue" : "3 in-order queues")
+                  << std::endl;
+        std::cout << "Elapsed time: " << elapsed << " ms" << std::endl;
+        std::cout << "Sum of command times: " << serial << " ms" << std::endl;
+        std::cout << "Overlap: " << (serial - elapsed) << " ms" << std::endl;
+        session.report(std::cout);
+        if(iterations > 1) pool.report(std::cout);
+    	std::cout << "PASSED" << std::endl;
+    } else if(check_result(out, refOut, EPS)) {
         std::cout << "Elapsed time: " << timems << " ms" << std::endl;
+        if(chunkRows != 0) {
+            std::cout << "Rows per chunk: " << finalChunkRows << std::endl;
+        }
+        if(iterations > 1) {
+            session.report(std::cout);
+            pool.report(std::cout);
+        }
     	std::cout << "PASSED" << std::endl;
     } else {
     	std::cout << "FAILED" << std::endl;
@@ -2,6 +2,9 @@
 //Author: Ugo Varetto
 //Note: page-locked memory transfers might not work properly on systems
 //sharing the same memory for both host and device (e.g. CPU)
+//Link with clutil.cpp compiled with -DCLUTIL_ENABLE_TRACE (-pthread -ldl)
+//and run with CLUTIL_TRACE=<file.json> to record a timeline of all the
+//transfers
 #define __CL_ENABLE_EXCEPTIONS
 
 #include <vector>
@@ -0,0 +1,357 @@
+//Batched matrix multiply example: thousands of small matrices multiplied in
+//a single kernel launch, compared with one launch per work group
+//compilation:
+// c++ 14_batched_matmul.cpp clutil.cpp -lOpenCL -lrt -pthread
+//sample execution:
+// ./a.out "NVIDIA CUDA" default 0 ./src/kernels/14_batched_matmul.cl 16
+//   1,10,100,1000,10000
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <cmath>
+#include <sstream>
+#include <algorithm>
+#include <ctime>
+#include "clutil.h"
+
+#ifdef USE_DOUBLE
+typedef double real_t;
+#else
+typedef float real_t;
+#endif
+
+//------------------------------------------------------------------------------
+double get_time_ms() {
+    timespec t = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1E3 + t.tv_nsec / 1E6;
+}
+
+//------------------------------------------------------------------------------
+std::vector< real_t > create_matrices(int size) {
+    std::vector< real_t > m(size);
+    srand(1);
+    for(std::vector<real_t>::iterator i = m.begin();
+        i != m.end(); ++i) *i = rand() % 10;
+    return m;
+}
+
+//------------------------------------------------------------------------------
+//batched matrix multiply of rows x inner by inner x columns matrices: the
+//program is built for the matrix sizes, with the number of matrices per
+//work group and the use of local memory selected according to the device
+//limits
+class BatchedMatmul {
+public:
+    BatchedMatmul(const CLEnv& clenv,
+                  const char* clSourcePath,
+                  int rows,
+                  int inner,
+                  int columns)
+        : rows_(rows), inner_(inner), columns_(columns) {
+        const cl_device_id device = get_device_id(clenv.context);
+        size_t maxGroupSize = 1;
+        check_cl_error(clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+                                       sizeof(size_t), &maxGroupSize, 0),
+                       "clGetDeviceInfo(CL_DEVICE_MAX_WORK_GROUP_SIZE)");
+        cl_ulong localMem = 0;
+        check_cl_error(clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE,
+                                       sizeof(cl_ulong), &localMem, 0),
+                       "clGetDeviceInfo(CL_DEVICE_LOCAL_MEM_SIZE)");
+        //matrices small enough are packed into work groups of up to 256
+        //work items, one element per work item; larger matrices use a whole
+        //work group each
+        const size_t elements = size_t(rows) * columns;
+        const size_t groupSize = std::min(maxGroupSize, size_t(256));
+        matsPerGroup_ = std::max(size_t(1), groupSize / elements);
+        const size_t matrixBytes = (size_t(rows) * inner + size_t(inner)
+                                    * columns) * sizeof(real_t);
+        while(matsPerGroup_ > 1 && matsPerGroup_ * matrixBytes > localMem)
+            --matsPerGroup_;
+        const bool staging = matsPerGroup_ * matrixBytes <= localMem;
+        localSize_ = std::min(groupSize, matsPerGroup_ * elements);
+        std::ostringstream prefix;
+#ifdef USE_DOUBLE
+        prefix << "#define DOUBLE\n";
+#endif
+        prefix << "#define ROWS " << rows << '\n'
+               << "#define INNER " << inner << '\n'
+               << "#define COLUMNS " << columns << '\n'
+               << "#define MATS_PER_GROUP " << matsPerGroup_ << '\n';
+        if(staging) prefix << "#define LOCAL_STAGING\n";
+        program_ = build_program(clenv.context, device, prefix.str() + '\n'
+                                 + load_text(clSourcePath));
+        cl_int status;
+        strided_ = clCreateKernel(program_, "batched_matmul", &status);
+        check_cl_error(status, "clCreateKernel");
+        indexed_ = clCreateKernel(program_, "batched_matmul_indexed", &status);
+        check_cl_error(status, "clCreateKernel");
+        std::cout << "Matrices per work group: " << matsPerGroup_
+                  << ", work group size: " << localSize_
+                  << ", local memory staging: " << (staging ? "yes" : "no")
+                  << std::endl;
+    }
+    ~BatchedMatmul() {
+        check_cl_error(clReleaseKernel(strided_), "clReleaseKernel");
+        check_cl_error(clReleaseKernel(indexed_), "clReleaseKernel");
+        check_cl_error(clReleaseProgram(program_), "clReleaseProgram");
+    }
+    size_t groups(int batch) const {
+        return (batch + matsPerGroup_ - 1) / matsPerGroup_;
+    }
+    //strided batch: matrix i of A, B and C starts at element i * stride;
+    //the work groups in [firstGroup, firstGroup + numGroups) are launched,
+    //all if numGroups is zero; returns the kernel event
+    cl_event enqueue(cl_command_queue queue,
+                     cl_mem A, cl_mem B, cl_mem C,
+                     int batch,
+                     int strideA, int strideB, int strideC,
+                     size_t firstGroup = 0,
+                     size_t numGroups = 0) {
+        set_buffers(strided_, A, B, C);
+        const int args[] = {batch, strideA, strideB, strideC};
+        for(int i = 0; i != 4; ++i) {
+            check_cl_error(clSetKernelArg(strided_, 3 + i, sizeof(int),
+                                          &args[i]), "clSetKernelArg");
+        }
+        return launch(queue, strided_, batch, firstGroup, numGroups);
+    }
+    //indexed batch: element offsets of matrix i are stored at position i
+    //of the int buffers offsetsA, offsetsB and offsetsC
+    cl_event enqueue_indexed(cl_command_queue queue,
+                             cl_mem A, cl_mem B, cl_mem C,
+                             cl_mem offsetsA, cl_mem offsetsB,
+                             cl_mem offsetsC,
+                             int batch) {
+        set_buffers(indexed_, A, B, C);
+        const cl_mem offsets[] = {offsetsA, offsetsB, offsetsC};
+        for(int i = 0; i != 3; ++i) {
+            check_cl_error(clSetKernelArg(indexed_, 3 + i, sizeof(cl_mem),
+                                          &offsets[i]), "clSetKernelArg");
+        }
+        check_cl_error(clSetKernelArg(indexed_, 6, sizeof(int), &batch),
+                       "clSetKernelArg");
+        return launch(queue, indexed_, batch, 0, 0);
+    }
+private:
+    void set_buffers(cl_kernel k, cl_mem A, cl_mem B, cl_mem C) {
+        check_cl_error(clSetKernelArg(k, 0, sizeof(cl_mem), &A),
+                       "clSetKernelArg(A)");
+        check_cl_error(clSetKernelArg(k, 1, sizeof(cl_mem), &B),
+                       "clSetKernelArg(B)");
+        check_cl_error(clSetKernelArg(k, 2, sizeof(cl_mem), &C),
+                       "clSetKernelArg(C)");
+    }
+    cl_event launch(cl_command_queue queue, cl_kernel k, int batch,
+                    size_t firstGroup, size_t numGroups) {
+        if(numGroups == 0) numGroups = groups(batch) - firstGroup;
+        const size_t offset = firstGroup * localSize_;
+        const size_t global = numGroups * localSize_;
+        cl_event ev;
+        check_cl_error(clEnqueueNDRangeKernel(queue, k, 1, &offset, &global,
+                                              &localSize_, 0, 0, &ev),
+                       "clEnqueueNDRangeKernel");
+        return ev;
+    }
+private:
+    int rows_;
+    int inner_;
+    int columns_;
+    size_t matsPerGroup_;
+    size_t localSize_;
+    cl_program program_;
+    cl_kernel strided_;
+    cl_kernel indexed_;
+};
+
+//------------------------------------------------------------------------------
+//zeroes the first n elements of C, so that results left by a previous run
+//are not mistaken for the output of matrices skipped by the kernel
+void clear_matrices(cl_command_queue queue, cl_mem C, size_t n) {
+    const std::vector< real_t > zero(n, real_t(0));
+    check_cl_error(clEnqueueWriteBuffer(queue, C, CL_TRUE, 0,
+                                        n * sizeof(real_t), &zero[0],
+                                        0, 0, 0), "clEnqueueWriteBuffer");
+}
+
+//------------------------------------------------------------------------------
+//checks up to 100 matrices evenly spread in the batch
+bool check_batch(const std::vector< real_t >& A,
+                 const std::vector< real_t >& B,
+                 const std::vector< real_t >& C,
+                 int batch, int rows, int inner, int columns,
+                 double eps) {
+    const int step = std::max(1, batch / 100);
+    for(int m = 0; m < batch; m += step) {
+        const real_t* a = &A[size_t(m) * rows * inner];
+        const real_t* b = &B[size_t(m) * inner * columns];
+        const real_t* c = &C[size_t(m) * rows * columns];
+        for(int r = 0; r != rows; ++r) {
+            for(int col = 0; col != columns; ++col) {
+                real_t e = 0;
+                for(int k = 0; k != inner; ++k)
+                    e += a[r * inner + k] * b[k * columns + col];
+                if(std::fabs(double(e - c[r * columns + col])) > eps)
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+    if(argc < 6) {
+        std::cerr << "usage: " << argv[0]
+                  << " <platform name> <device type = default | cpu | gpu "
+                     "| acc | all | fastest | fastest-for:<kernel>>"
+                     "  <device num> <OpenCL source file path>"
+                     " <matrix size | RxKxC>"
+                     " [comma separated batch sizes,"
+                     " default 1,10,100,1000,10000] [--indexed]\n"
+                     "  multiplies batches of R x K by K x C matrices in a"
+                     " single launch and with one launch per work group\n"
+                     "  --indexed reads the position of each matrix from"
+                     " offset arrays instead of using a fixed stride"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    int R = 0, K = 0, C = 0;
+    const int dims = sscanf(argv[5], "%dx%dx%d", &R, &K, &C);
+    if(dims == 1) K = C = R;
+    if((dims != 1 && dims != 3) || R < 1 || K < 1 || C < 1) {
+        std::cerr << "ERROR - invalid matrix size " << argv[5] << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::vector< int > batches;
+    bool indexed = false;
+    for(int a = 6; a < argc; ++a) {
+        const std::string arg = argv[a];
+        if(arg == "--indexed") {
+            indexed = true;
+            continue;
+        }
+        std::istringstream is(arg);
+        std::string b;
+        while(std::getline(is, b, ',')) batches.push_back(atoi(b.c_str()));
+    }
+    if(batches.empty()) {
+        const int defaultBatches[] = {1, 10, 100, 1000, 10000};
+        batches.assign(defaultBatches, defaultBatches + 5);
+    }
+    if(*std::min_element(batches.begin(), batches.end()) < 1) {
+        std::cerr << "ERROR - batch sizes must be greater than zero"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+#ifdef USE_DOUBLE
+    const double EPS = 0.000000001;
+#else
+    const double EPS = 0.00001;
+#endif
+    CLEnv clenv = create_clenv(argv[1], argv[2], atoi(argv[3]), true);
+    BatchedMatmul batched(clenv, argv[4], R, K, C);
+
+    //all batches use the first matrices of the same buffers
+    const int MAX_BATCH = *std::max_element(batches.begin(), batches.end());
+    const int A_SIZE = R * K;
+    const int B_SIZE = K * C;
+    const int C_SIZE = R * C;
+    std::vector< real_t > A = create_matrices(MAX_BATCH * A_SIZE);
+    std::vector< real_t > B = create_matrices(MAX_BATCH * B_SIZE);
+    std::vector< real_t > Cout(size_t(MAX_BATCH) * C_SIZE, real_t(0));
+    cl_int status;
+    cl_mem devA = clCreateBuffer(clenv.context,
+                                 CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                 A.size() * sizeof(real_t), &A[0], &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devB = clCreateBuffer(clenv.context,
+                                 CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                 B.size() * sizeof(real_t), &B[0], &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devC = clCreateBuffer(clenv.context, CL_MEM_WRITE_ONLY,
+                                 Cout.size() * sizeof(real_t), 0, &status);
+    check_cl_error(status, "clCreateBuffer");
+    //offset arrays for the indexed version: contiguous matrices, which
+    //makes the results comparable with the strided version
+    cl_mem devOffsets[3] = {0, 0, 0};
+    if(indexed) {
+        const int sizes[] = {A_SIZE, B_SIZE, C_SIZE};
+        for(int i = 0; i != 3; ++i) {
+            std::vector< int > offsets(MAX_BATCH);
+            for(int m = 0; m != MAX_BATCH; ++m) offsets[m] = m * sizes[i];
+            devOffsets[i] = clCreateBuffer(clenv.context,
+                                           CL_MEM_READ_ONLY
+                                           | CL_MEM_COPY_HOST_PTR,
+                                           MAX_BATCH * sizeof(int),
+                                           &offsets[0], &status);
+            check_cl_error(status, "clCreateBuffer");
+        }
+    }
+
+    std::cout << "batch size, batched kernel (ms), batched (ms),"
+                 " batched (matrices/s), separate launches (ms),"
+                 " separate launches (matrices/s), GFLOP/s" << std::endl;
+    bool passed = true;
+    for(std::vector< int >::const_iterator b = batches.begin();
+        b != batches.end(); ++b) {
+        const int batch = *b;
+        const size_t OUT_SIZE = size_t(batch) * C_SIZE;
+        //1) single launch: kernel time and wall clock time including
+        //the launch overhead
+        clear_matrices(clenv.commandQueue, devC, OUT_SIZE);
+        double start = get_time_ms();
+        cl_event ev = indexed ?
+            batched.enqueue_indexed(clenv.commandQueue, devA, devB, devC,
+                                    devOffsets[0], devOffsets[1],
+                                    devOffsets[2], batch)
+            : batched.enqueue(clenv.commandQueue, devA, devB, devC, batch,
+                              A_SIZE, B_SIZE, C_SIZE);
+        check_cl_error(clFinish(clenv.commandQueue), "clFinish");
+        const double batchedWall = get_time_ms() - start;
+        const CLEventTimes t = get_cl_event_times(ev);
+        check_cl_error(clReleaseEvent(ev), "clReleaseEvent");
+        const double batchedKernel = double(t.end - t.start) / 1E6;
+        check_cl_error(clEnqueueReadBuffer(clenv.commandQueue, devC, CL_TRUE,
+                                           0, OUT_SIZE * sizeof(real_t),
+                                           &Cout[0], 0, 0, 0),
+                       "clEnqueueReadBuffer");
+        passed = passed && check_batch(A, B, Cout, batch, R, K, C, EPS);
+        //2) one launch per work group
+        clear_matrices(clenv.commandQueue, devC, OUT_SIZE);
+        start = get_time_ms();
+        for(size_t g = 0; g != batched.groups(batch); ++g) {
+            check_cl_error(clReleaseEvent(
+                               batched.enqueue(clenv.commandQueue, devA, devB,
+                                               devC, batch, A_SIZE, B_SIZE,
+                                               C_SIZE, g, 1)),
+                           "clReleaseEvent");
+        }
+        check_cl_error(clFinish(clenv.commandQueue), "clFinish");
+        const double separateWall = get_time_ms() - start;
+        check_cl_error(clEnqueueReadBuffer(clenv.commandQueue, devC, CL_TRUE,
+                                           0, OUT_SIZE * sizeof(real_t),
+                                           &Cout[0], 0, 0, 0),
+                       "clEnqueueReadBuffer");
+        passed = passed && check_batch(A, B, Cout, batch, R, K, C, EPS);
+        std::cout << batch << ", " << batchedKernel << ", " << batchedWall
+                  << ", " << batch / (batchedWall / 1000) << ", "
+                  << separateWall << ", " << batch / (separateWall / 1000)
+                  << ", " << 2 * double(R) * K * C * batch
+                             / (batchedKernel * 1E6)
+                  << std::endl;
+    }
+    std::cout << (passed ? "PASSED" : "FAILED") << std::endl;
+
+    for(int i = 0; i != 3; ++i) {
+        if(devOffsets[i] != 0)
+            check_cl_error(clReleaseMemObject(devOffsets[i]),
+                           "clReleaseMemObject");
+    }
+    check_cl_error(clReleaseMemObject(devA), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devB), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devC), "clReleaseMemObject");
+    release_clenv(clenv);
+    return passed ? 0 : 1;
+}
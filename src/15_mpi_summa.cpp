@@ -0,0 +1,390 @@
+//Distributed matrix multiply with MPI and OpenCL: SUMMA algorithm on a 2D
+//process grid, the local multiply is performed with block_matmul
+
+//1) the ranks are arranged into a pr x pc grid (MPI_Dims_create); A (M x K),
+//   B (K x N) and C (M x N) are split into pr x pc blocks, block (i, j) is
+//   owned by the rank with grid coordinates (i, j)
+//2) the inner dimension is processed in panels: at each step the ranks
+//   owning the current A panel broadcast it along their process row and the
+//   ranks owning the current B panel broadcast it along their process column
+//3) panels are packed/received directly into mapped CL_MEM_ALLOC_HOST_PTR
+//   buffers, unmapped and multiplied into the device resident C block with
+//   block_matmul compiled with ACCUMULATE; two sets of staging buffers and
+//   two command queues are used so that the broadcast of the next panel
+//   overlaps the multiplication of the current one
+//4) the C blocks are validated against host_gemm; compute, communication and
+//   staging (map/unmap) times are reported for each rank
+
+//compilation:
+// mpicxx -O3 -fopenmp 15_mpi_summa.cpp clutil.cpp -lOpenCL -lrt -pthread
+//execution on a single machine, 2 x 2 grid, device = rank % number of devices:
+// mpirun -np 4 ./a.out "NVIDIA CUDA" default rank
+//   ../src/kernels/04_matrix_multiply.cl 1024 16
+
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <mpi.h>
+#include "clutil.h"
+#include "host_gemm.h"
+
+#ifdef USE_DOUBLE
+typedef double real_t;
+#define MPI_REAL_T MPI_DOUBLE
+#else
+typedef float real_t;
+#define MPI_REAL_T MPI_FLOAT
+#endif
+
+//------------------------------------------------------------------------------
+//first index of block b when n elements are split into parts blocks; the
+//first n % parts blocks have one element more than the others
+int block_begin(int n, int parts, int b) {
+    return b * (n / parts) + std::min(b, n % parts);
+}
+
+//------------------------------------------------------------------------------
+//index of the block containing element i
+int block_owner(int n, int parts, int i) {
+    int b = 0;
+    while(block_begin(n, parts, b + 1) <= i) ++b;
+    return b;
+}
+
+//------------------------------------------------------------------------------
+//matrix elements are a function of the global row and column indices: each
+//rank generates its own blocks and the input of the reference computation;
+//small integer values make float results exact
+real_t a_element(int row, int column) { return real_t((row + 2 * column) % 5); }
+real_t b_element(int row, int column) { return real_t((3 * row + column) % 4); }
+
+//------------------------------------------------------------------------------
+size_t round_up(size_t n, size_t m) {
+    return (n + m - 1) / m * m;
+}
+
+//------------------------------------------------------------------------------
+//panel boundaries along the inner dimension: each panel is owned by a single
+//column of A blocks and a single row of B blocks and is not wider than
+//maxWidth
+std::vector< int > panel_boundaries(int K, int pr, int pc, int maxWidth) {
+    std::vector< int > splits;
+    for(int i = 0; i <= pr; ++i) splits.push_back(block_begin(K, pr, i));
+    for(int j = 0; j <= pc; ++j) splits.push_back(block_begin(K, pc, j));
+    std::sort(splits.begin(), splits.end());
+    splits.erase(std::unique(splits.begin(), splits.end()), splits.end());
+    std::vector< int > panels(1, 0);
+    for(size_t s = 1; s < splits.size(); ++s) {
+        for(int k = splits[s - 1] + maxWidth; k < splits[s]; k += maxWidth)
+            panels.push_back(k);
+        panels.push_back(splits[s]);
+    }
+    return panels;
+}
+
+//------------------------------------------------------------------------------
+//per-rank results gathered on rank 0
+enum {T_COMPUTE, T_COMM, T_STAGING, T_WALL, MAX_ERROR, NUM_RESULTS};
+
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+    MPI_Init(&argc, &argv);
+    int rank = -1;
+    int size = 0;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    if(argc < 7) {
+        if(rank == 0) {
+            std::cerr << "usage: " << argv[0]
+                      << " <platform name> <device type = default | cpu | gpu"
+                         " | acc | all | fastest | fastest-for:<kernel>>"
+                         " <device num | rank>"
+                         " <OpenCL source file path>"
+                         " <size | MxKxN> <block size> [panel width,"
+                         " default 256]\n"
+                         "  'rank' as the device number selects device"
+                         " rank % number of devices, for runs on a single"
+                         " node with multiple devices"
+                      << std::endl;
+        }
+        MPI_Finalize();
+        exit(EXIT_FAILURE);
+    }
+    int M = 0, K = 0, N = 0;
+    const int dims = sscanf(argv[5], "%dx%dx%d", &M, &K, &N);
+    if(dims == 1) K = N = M;
+    const int BLOCK_SIZE = atoi(argv[6]);
+    const int PANEL = argc > 7 ? atoi(argv[7]) : 256;
+    //process grid: as square as possible, any number of ranks is accepted
+    int grid[2] = {0, 0};
+    MPI_Dims_create(size, 2, grid);
+    const int pr = grid[0];
+    const int pc = grid[1];
+    if((dims != 1 && dims != 3) || M < pr || N < pc || K < 1
+       || BLOCK_SIZE < 1 || PANEL < 1) {
+        if(rank == 0) {
+            std::cerr << "ERROR - invalid arguments: matrix size must be"
+                         " at least " << pr << 'x' << 1 << 'x' << pc
+                      << " with " << size << " ranks" << std::endl;
+        }
+        MPI_Finalize();
+        exit(EXIT_FAILURE);
+    }
+    const int periodic[2] = {0, 0};
+    MPI_Comm gridComm;
+    MPI_Cart_create(MPI_COMM_WORLD, 2, grid, const_cast< int* >(periodic),
+                    0, &gridComm);
+    int coords[2] = {0, 0};
+    MPI_Cart_coords(gridComm, rank, 2, coords);
+    const int myRow = coords[0];
+    const int myCol = coords[1];
+    //row communicator: rank = grid column; column communicator: rank = grid
+    //row
+    MPI_Comm rowComm, colComm;
+    const int keepColumns[2] = {0, 1};
+    const int keepRows[2] = {1, 0};
+    MPI_Cart_sub(gridComm, const_cast< int* >(keepColumns), &rowComm);
+    MPI_Cart_sub(gridComm, const_cast< int* >(keepRows), &colComm);
+
+    //local blocks: A (rows x aColumns), B (bRows x columns),
+    //C (rows x columns)
+    const int rowBegin = block_begin(M, pr, myRow);
+    const int rows = block_begin(M, pr, myRow + 1) - rowBegin;
+    const int colBegin = block_begin(N, pc, myCol);
+    const int columns = block_begin(N, pc, myCol + 1) - colBegin;
+    const int aColBegin = block_begin(K, pc, myCol);
+    const int aColumns = block_begin(K, pc, myCol + 1) - aColBegin;
+    const int bRowBegin = block_begin(K, pr, myRow);
+    const int bRows = block_begin(K, pr, myRow + 1) - bRowBegin;
+    std::vector< real_t > A(size_t(rows) * aColumns);
+    for(int r = 0; r != rows; ++r)
+        for(int c = 0; c != aColumns; ++c)
+            A[size_t(r) * aColumns + c] = a_element(rowBegin + r,
+                                                    aColBegin + c);
+    std::vector< real_t > B(size_t(bRows) * columns);
+    for(int r = 0; r != bRows; ++r)
+        for(int c = 0; c != columns; ++c)
+            B[size_t(r) * columns + c] = b_element(bRowBegin + r,
+                                                   colBegin + c);
+
+    //OpenCL: block_matmul accumulating into C; second queue used for
+    //map/unmap of the staging buffers
+    int deviceNum = 0;
+    if(std::string(argv[3]) == "rank") {
+        const size_t numDevices = get_device_ids(argv[1], argv[2]).size();
+        deviceNum = numDevices > 0 ? int(rank % numDevices) : 0;
+    } else deviceNum = atoi(argv[3]);
+    std::ostringstream clheader;
+#ifdef USE_DOUBLE
+    clheader << "#define DOUBLE\n";
+#endif
+    clheader << "#define BLOCK_SIZE " << BLOCK_SIZE << '\n'
+             << "#define ACCUMULATE\n";
+    CLEnv clenv = create_clenv(argv[1], argv[2], deviceNum, true, argv[4],
+                               "block_matmul", clheader.str(),
+                               std::string(), 2);
+    cl_command_queue computeQueue = clenv.queues[0];
+    cl_command_queue stagingQueue = clenv.queues[1];
+    cl_int status;
+    std::vector< real_t > Cout(size_t(rows) * columns, real_t(0));
+    cl_mem devC = clCreateBuffer(clenv.context,
+                                 CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                 Cout.size() * sizeof(real_t), &Cout[0],
+                                 &status);
+    check_cl_error(status, "clCreateBuffer");
+    //double buffered panels in page locked memory: MPI reads from and writes
+    //into the mapped pointers
+    const int maxPanel = std::min(PANEL, K);
+    const size_t aPanelBytes = size_t(rows) * maxPanel * sizeof(real_t);
+    const size_t bPanelBytes = size_t(maxPanel) * columns * sizeof(real_t);
+    cl_mem devAPanel[2];
+    cl_mem devBPanel[2];
+    cl_event slotFree[2] = {0, 0};
+    for(int s = 0; s != 2; ++s) {
+        devAPanel[s] = clCreateBuffer(clenv.context,
+                                      CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
+                                      aPanelBytes, 0, &status);
+        check_cl_error(status, "clCreateBuffer");
+        devBPanel[s] = clCreateBuffer(clenv.context,
+                                      CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
+                                      bPanelBytes, 0, &status);
+        check_cl_error(status, "clCreateBuffer");
+    }
+    const size_t localWorkSize[2] = {size_t(BLOCK_SIZE), size_t(BLOCK_SIZE)};
+    const size_t globalWorkSize[2] = {round_up(columns, BLOCK_SIZE),
+                                      round_up(rows, BLOCK_SIZE)};
+
+    const std::vector< int > panels = panel_boundaries(K, pr, pc, maxPanel);
+    double results[NUM_RESULTS] = {0, 0, 0, 0, 0};
+    std::vector< cl_event > kernelEvents;
+    MPI_Barrier(MPI_COMM_WORLD);
+    const double start = MPI_Wtime();
+    for(size_t p = 0; p + 1 < panels.size(); ++p) {
+        const int k0 = panels[p];
+        const int width = panels[p + 1] - k0;
+        const int s = p % 2;
+        const int aOwner = block_owner(K, pc, k0);
+        const int bOwner = block_owner(K, pr, k0);
+        //1) map the staging buffers once the kernel which used them is done
+        double t = MPI_Wtime();
+        const cl_event* waitList = slotFree[s] ? &slotFree[s] : 0;
+        real_t* aPanel = reinterpret_cast< real_t* >(
+            clEnqueueMapBuffer(stagingQueue, devAPanel[s], CL_FALSE,
+                               CL_MAP_WRITE, 0, aPanelBytes,
+                               waitList ? 1 : 0, waitList, 0, &status));
+        check_cl_error(status, "clEnqueueMapBuffer");
+        real_t* bPanel = reinterpret_cast< real_t* >(
+            clEnqueueMapBuffer(stagingQueue, devBPanel[s], CL_TRUE,
+                               CL_MAP_WRITE, 0, bPanelBytes,
+                               waitList ? 1 : 0, waitList, 0, &status));
+        check_cl_error(status, "clEnqueueMapBuffer");
+        if(slotFree[s]) check_cl_error(clReleaseEvent(slotFree[s]),
+                                       "clReleaseEvent");
+        slotFree[s] = 0;
+        results[T_STAGING] += MPI_Wtime() - t;
+        //2) owners pack their panels into the mapped buffers, which are then
+        //   broadcast along process rows (A) and columns (B)
+        t = MPI_Wtime();
+        if(myCol == aOwner) {
+            for(int r = 0; r != rows; ++r)
+                std::copy(&A[size_t(r) * aColumns + k0 - aColBegin],
+                          &A[size_t(r) * aColumns + k0 - aColBegin] + width,
+                          aPanel + size_t(r) * width);
+        }
+        if(myRow == bOwner) {
+            std::copy(&B[size_t(k0 - bRowBegin) * columns],
+                      &B[size_t(k0 - bRowBegin) * columns]
+                      + size_t(width) * columns, bPanel);
+        }
+        MPI_Bcast(aPanel, rows * width, MPI_REAL_T, aOwner, rowComm);
+        MPI_Bcast(bPanel, width * columns, MPI_REAL_T, bOwner, colComm);
+        results[T_COMM] += MPI_Wtime() - t;
+        //3) unmap (transfer to device if required) and multiply: the kernel
+        //   waits for the unmap operations, the next panel is broadcast while
+        //   the kernel executes
+        t = MPI_Wtime();
+        cl_event unmapped[2];
+        check_cl_error(clEnqueueUnmapMemObject(stagingQueue, devAPanel[s],
+                                               aPanel, 0, 0, &unmapped[0]),
+                       "clEnqueueUnmapMemObject");
+        check_cl_error(clEnqueueUnmapMemObject(stagingQueue, devBPanel[s],
+                                               bPanel, 0, 0, &unmapped[1]),
+                       "clEnqueueUnmapMemObject");
+        check_cl_error(clFlush(stagingQueue), "clFlush");
+        results[T_STAGING] += MPI_Wtime() - t;
+        check_cl_error(clSetKernelArg(clenv.kernel, 0, sizeof(cl_mem),
+                                      &devAPanel[s]), "clSetKernelArg(A)");
+        check_cl_error(clSetKernelArg(clenv.kernel, 1, sizeof(cl_mem),
+                                      &devBPanel[s]), "clSetKernelArg(B)");
+        check_cl_error(clSetKernelArg(clenv.kernel, 2, sizeof(cl_mem), &devC),
+                       "clSetKernelArg(C)");
+        const int args[] = {rows, width, columns};
+        for(int i = 0; i != 3; ++i) {
+            check_cl_error(clSetKernelArg(clenv.kernel, 3 + i, sizeof(int),
+                                          &args[i]), "clSetKernelArg");
+        }
+        cl_event kernelEvent;
+        check_cl_error(clEnqueueNDRangeKernel(computeQueue, clenv.kernel, 2, 0,
+                                              globalWorkSize, localWorkSize,
+                                              2, unmapped, &kernelEvent),
+                       "clEnqueueNDRangeKernel");
+        check_cl_error(clFlush(computeQueue), "clFlush");
+        check_cl_error(clReleaseEvent(unmapped[0]), "clReleaseEvent");
+        check_cl_error(clReleaseEvent(unmapped[1]), "clReleaseEvent");
+        check_cl_error(clRetainEvent(kernelEvent), "clRetainEvent");
+        slotFree[s] = kernelEvent;
+        kernelEvents.push_back(kernelEvent);
+    }
+    check_cl_error(clEnqueueReadBuffer(computeQueue, devC, CL_TRUE, 0,
+                                       Cout.size() * sizeof(real_t), &Cout[0],
+                                       0, 0, 0), "clEnqueueReadBuffer");
+    results[T_WALL] = MPI_Wtime() - start;
+    for(std::vector< cl_event >::iterator e = kernelEvents.begin();
+        e != kernelEvents.end(); ++e) {
+        //start to end: the time spent waiting for the panels is not counted
+        const CLEventTimes t = get_cl_event_times(*e);
+        results[T_COMPUTE] += double(t.end - t.start) / 1E9;
+        check_cl_error(clReleaseEvent(*e), "clReleaseEvent");
+    }
+    for(int s = 0; s != 2; ++s) {
+        if(slotFree[s]) check_cl_error(clReleaseEvent(slotFree[s]),
+                                       "clReleaseEvent");
+    }
+
+    //validation: reference C block computed from the full row block of A
+    //and column block of B
+    std::vector< real_t > rowA(size_t(rows) * K);
+    for(int r = 0; r != rows; ++r)
+        for(int k = 0; k != K; ++k)
+            rowA[size_t(r) * K + k] = a_element(rowBegin + r, k);
+    std::vector< real_t > colB(size_t(K) * columns);
+    for(int k = 0; k != K; ++k)
+        for(int c = 0; c != columns; ++c)
+            colB[size_t(k) * columns + c] = b_element(k, colBegin + c);
+    std::vector< real_t > reference(Cout.size());
+    host_gemm(rows, K, columns, &rowA[0], &colB[0], &reference[0]);
+    for(size_t i = 0; i != Cout.size(); ++i) {
+        results[MAX_ERROR] = std::max(results[MAX_ERROR],
+                                  std::fabs(double(Cout[i] - reference[i])));
+    }
+
+    //report
+    std::vector< double > all(size_t(size) * NUM_RESULTS);
+    MPI_Gather(results, NUM_RESULTS, MPI_DOUBLE,
+               &all[0], NUM_RESULTS, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+#ifdef USE_DOUBLE
+    const double EPS = 0.000000001;
+#else
+    const double EPS = 0.00001;
+#endif
+    //the maximum error is shared so that all the processes return the same
+    //exit status
+    double maxError = 0;
+    MPI_Allreduce(&results[MAX_ERROR], &maxError, 1, MPI_DOUBLE, MPI_MAX,
+                  MPI_COMM_WORLD);
+    const bool passed = maxError <= EPS;
+    if(rank == 0) {
+        std::cout << "Process grid: " << pr << " x " << pc
+                  << ", matrix: " << M << " x " << K << " x " << N
+                  << ", panels: " << panels.size() - 1 << std::endl;
+        std::cout << "rank, grid row, grid column, block rows, block columns,"
+                     " compute (ms), communication (ms), staging (ms),"
+                     " wall (ms), max error" << std::endl;
+        double maxWall = 0;
+        for(int r = 0; r != size; ++r) {
+            const double* rr = &all[size_t(r) * NUM_RESULTS];
+            int c[2] = {0, 0};
+            MPI_Cart_coords(gridComm, r, 2, c);
+            std::cout << r << ", " << c[0] << ", " << c[1] << ", "
+                      << block_begin(M, pr, c[0] + 1) - block_begin(M, pr, c[0])
+                      << ", "
+                      << block_begin(N, pc, c[1] + 1) - block_begin(N, pc, c[1])
+                      << ", " << rr[T_COMPUTE] * 1E3 << ", "
+                      << rr[T_COMM] * 1E3 << ", " << rr[T_STAGING] * 1E3
+                      << ", " << rr[T_WALL] * 1E3 << ", " << rr[MAX_ERROR]
+                      << std::endl;
+            maxWall = std::max(maxWall, rr[T_WALL]);
+        }
+        std::cout << "GFLOP/s: " << 2 * double(M) * K * N / (maxWall * 1E9)
+                  << std::endl;
+        std::cout << (passed ? "PASSED" : "FAILED") << std::endl;
+    }
+
+    for(int s = 0; s != 2; ++s) {
+        check_cl_error(clReleaseMemObject(devAPanel[s]), "clReleaseMemObject");
+        check_cl_error(clReleaseMemObject(devBPanel[s]), "clReleaseMemObject");
+    }
+    check_cl_error(clReleaseMemObject(devC), "clReleaseMemObject");
+    release_clenv(clenv);
+    MPI_Comm_free(&rowComm);
+    MPI_Comm_free(&colComm);
+    MPI_Comm_free(&gridComm);
+    MPI_Finalize();
+    return passed ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,176 @@
+//Generic reductions computed on the device with CLReduce: sum, min, max,
+//argmin, argmax, dot product, L2 norm and a user defined operator (L1
+//distance), checked against the host; only the final result is read back
+//from the device
+//compilation:
+// c++ 16_reduce.cpp clutil.cpp -lOpenCL -lrt -pthread
+//sample execution:
+// ./a.out "NVIDIA CUDA" default 0 ./src/kernels/reduce.cl 16777216 4
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <vector>
+#include <cmath>
+#include <string>
+#include <limits>
+#include <algorithm>
+#include <numeric>
+#include <ctime>
+#include "clutil.h"
+
+#ifdef USE_DOUBLE
+typedef double real_t;
+#else
+typedef float real_t;
+#endif
+
+//------------------------------------------------------------------------------
+double get_time_ms() {
+    timespec t = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1E3 + t.tv_nsec / 1E6;
+}
+
+//------------------------------------------------------------------------------
+std::vector< real_t > create_vector(int size, unsigned seed) {
+    std::vector< real_t > v(size);
+    srand(seed);
+    for(std::vector< real_t >::iterator i = v.begin(); i != v.end(); ++i)
+        *i = real_t(rand() % 1000) / 1000;
+    return v;
+}
+
+//------------------------------------------------------------------------------
+//host reference results, accumulated in double precision
+struct HostResults {
+    double sum;
+    double min;
+    double max;
+    size_t argmin;
+    size_t argmax;
+    double dot;
+    double norm;
+    double l1;
+};
+
+HostResults host_reductions(const std::vector< real_t >& v1,
+                            const std::vector< real_t >& v2) {
+    HostResults r = {0, std::numeric_limits< double >::infinity(),
+                     -std::numeric_limits< double >::infinity(),
+                     0, 0, 0, 0, 0};
+    for(size_t i = 0; i != v1.size(); ++i) {
+        r.sum += v1[i];
+        if(v1[i] < r.min) {
+            r.min = v1[i];
+            r.argmin = i;
+        }
+        if(v1[i] > r.max) {
+            r.max = v1[i];
+            r.argmax = i;
+        }
+        r.dot += double(v1[i]) * v2[i];
+        r.norm += double(v1[i]) * v1[i];
+        r.l1 += std::fabs(double(v1[i]) - v2[i]);
+    }
+    r.norm = std::sqrt(r.norm);
+    return r;
+}
+
+//------------------------------------------------------------------------------
+//relative error, absolute if the reference value is zero
+double error(double ref, double v) {
+    return ref == 0 ? std::fabs(v) : std::fabs((v - ref) / ref);
+}
+
+//------------------------------------------------------------------------------
+void print_result(const std::string& name,
+                  double value,
+                  double ref,
+                  double timeMs,
+                  double eps) {
+    std::cout << std::setw(10) << name
+              << std::setw(16) << value
+              << std::setw(16) << ref
+              << std::setw(12) << timeMs
+              << "  " << (error(ref, value) <= eps ? "PASSED" : "FAILED")
+              << std::endl;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+    if(argc < 6) {
+        std::cerr << "usage: " << argv[0]
+                  << " <platform name> <device type = default | cpu | gpu "
+                     "| acc | all>  <device num>"
+                     " <path to reduce.cl> <size> [vec element width,"
+                     " default 4]" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    const int SIZE = atoi(argv[5]);
+    const int VEC_WIDTH = argc > 6 ? atoi(argv[6]) : 4;
+    const size_t BYTE_SIZE = SIZE * sizeof(real_t);
+#ifdef USE_DOUBLE
+    const bool DOUBLE_PRECISION = true;
+    const double EPS = 1E-9;
+#else
+    const bool DOUBLE_PRECISION = false;
+    const double EPS = 1E-4;
+#endif
+    CLEnv clenv = create_clenv(argv[1], argv[2], atoi(argv[3]));
+    CLReduce reduction(clenv, DOUBLE_PRECISION, VEC_WIDTH, 256, 4, argv[4]);
+    std::vector< real_t > V1 = create_vector(SIZE, 1);
+    std::vector< real_t > V2 = create_vector(SIZE, 2);
+    cl_int status;
+    cl_mem devV1 = clCreateBuffer(clenv.context,
+                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                  BYTE_SIZE, &V1[0], &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem devV2 = clCreateBuffer(clenv.context,
+                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                  BYTE_SIZE, &V2[0], &status);
+    check_cl_error(status, "clCreateBuffer");
+    const HostResults ref = host_reductions(V1, V2);
+    //user defined operator: L1 distance
+    const ReduceOp L1_DISTANCE = {"fabs(x - y)", "a + b", "0", true, false};
+    //warm up: builds all the programs
+    reduction.sum(devV1, SIZE);
+    reduction.min(devV1, SIZE);
+    reduction.max(devV1, SIZE);
+    reduction.argmin(devV1, SIZE);
+    reduction.argmax(devV1, SIZE);
+    reduction.dot(devV1, devV2, SIZE);
+    reduction.norm(devV1, SIZE);
+    reduction.reduce(L1_DISTANCE, devV1, devV2, SIZE);
+    std::cout << std::setw(10) << "operation"
+              << std::setw(16) << "device"
+              << std::setw(16) << "host"
+              << std::setw(12) << "time(ms)" << std::endl;
+    double start = get_time_ms();
+    double v = reduction.sum(devV1, SIZE);
+    print_result("sum", v, ref.sum, get_time_ms() - start, EPS);
+    start = get_time_ms();
+    v = reduction.min(devV1, SIZE);
+    print_result("min", v, ref.min, get_time_ms() - start, EPS);
+    start = get_time_ms();
+    v = reduction.max(devV1, SIZE);
+    print_result("max", v, ref.max, get_time_ms() - start, EPS);
+    start = get_time_ms();
+    v = double(reduction.argmin(devV1, SIZE));
+    print_result("argmin", v, double(ref.argmin), get_time_ms() - start, 0);
+    start = get_time_ms();
+    v = double(reduction.argmax(devV1, SIZE));
+    print_result("argmax", v, double(ref.argmax), get_time_ms() - start, 0);
+    start = get_time_ms();
+    v = reduction.dot(devV1, devV2, SIZE);
+    print_result("dot", v, ref.dot, get_time_ms() - start, EPS);
+    start = get_time_ms();
+    v = reduction.norm(devV1, SIZE);
+    print_result("norm", v, ref.norm, get_time_ms() - start, EPS);
+    start = get_time_ms();
+    v = reduction.reduce(L1_DISTANCE, devV1, devV2, SIZE);
+    print_result("L1 dist", v, ref.l1, get_time_ms() - start, EPS);
+    check_cl_error(clReleaseMemObject(devV1), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(devV2), "clReleaseMemObject");
+    release_clenv(clenv);
+    return 0;
+}
@@ -7,6 +7,17 @@
 #include <vector>
 #include <algorithm>
 #include <cstdlib>
+#include <numeric>
+#include <cstdio>
+#include <sstream>
+#include <ctime>
+#include <cmath>
+#include <limits>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef CLUTIL_ENABLE_TRACE
+#include <dlfcn.h>
+#endif
 
 //------------------------------------------------------------------------------
 void check_cl_error(cl_int status, const char* msg) {
@@ -17,23 +28,99 @@ void check_cl_error(cl_int status, const char* msg) {
 }
 
 //------------------------------------------------------------------------------
+CLError::CLError(cl_int status, const std::string& msg)
+    : std::runtime_error(msg), status_(status) {}
+
+//------------------------------------------------------------------------------
+bool CLError::resource_exhausted() const {
+    return status_ == CL_MEM_OBJECT_ALLOCATION_FAILURE
+           || status_ == CL_OUT_OF_RESOURCES
+           || status_ == CL_OUT_OF_HOST_MEMORY
+           || status_ == CL_INVALID_BUFFER_SIZE;
+}
+
+//------------------------------------------------------------------------------
+void throw_cl_error(cl_int status, const char* msg) {
+    if(status != CL_SUCCESS) {
+        std::ostringstream os;
+        os << "ERROR " << status << " -- " << msg;
+        throw CLError(status, os.str());
+    }
+}
+
+//------------------------------------------------------------------------------
+CLMemGuard::~CLMemGuard() {
+    //no check: must not throw or exit during stack unwinding
+    for(std::vector< cl_mem >::iterator m = mems_.begin();
+        m != mems_.end(); ++m) clReleaseMemObject(*m);
+}
+
+//------------------------------------------------------------------------------
+cl_mem CLMemGuard::add(cl_mem m) {
+    if(m != 0) mems_.push_back(m);
+    return m;
+}
+
+//------------------------------------------------------------------------------
+size_t process_in_chunks(size_t total,
+                         size_t chunkSize,
+                         size_t granularity,
+                         ChunkWork& work) {
+    granularity = std::max(granularity, size_t(1));
+    chunkSize = std::max(granularity, chunkSize - chunkSize % granularity);
+    size_t offset = 0;
+    while(offset < total) {
+        const size_t count = std::min(chunkSize, total - offset);
+        try {
+            work.process(offset, count);
+            offset += count;
+        } catch(const CLError& e) {
+            if(!e.resource_exhausted() || chunkSize <= granularity) throw;
+            chunkSize = std::max(granularity,
+                                 (chunkSize / 2) - (chunkSize / 2) % granularity);
+            std::cerr << "WARNING - " << e.what() << ": chunk size reduced to "
+                      << chunkSize << std::endl;
+        }
+    }
+    return chunkSize;
+}
+
+//------------------------------------------------------------------------------
+//errors are also returned by the failing function: exiting here would
+//prevent recovery through throw_cl_error
 void CL_CALLBACK context_callback(const char * errInfo,
                                   const void * private_info,
                                   size_t cb,
                                   void * user_data) {
     std::cerr << "ERROR - " << errInfo << std::endl;
-    exit(EXIT_FAILURE);
 }
 
 //------------------------------------------------------------------------------
-// returns context associated with single device only,
-// to make it support multiple devices, a list of
-// <device type, device num> pairs is required
-cl_context create_cl_context(const std::string& platformName,
-                             const std::string& deviceTypeName,
-                             int deviceNum) {
+static cl_device_type get_device_type(const std::string& deviceTypeName) {
+    cl_device_type deviceType;
+    if(deviceTypeName == "default") 
+        deviceType = CL_DEVICE_TYPE_DEFAULT;
+    else if(deviceTypeName == "cpu")
+        deviceType = CL_DEVICE_TYPE_CPU;
+    else if(deviceTypeName == "gpu")
+        deviceType = CL_DEVICE_TYPE_GPU;
+    else if(deviceTypeName == "acc")
+        deviceType = CL_DEVICE_TYPE_ACCELERATOR; 
+    else if(deviceTypeName == "all")
+        deviceType = CL_DEVICE_TYPE_ALL;
+    else {
+        std::cerr << "ERROR - device type " << deviceTypeName << " unknown"
+                  << std::endl;
+        exit(EXIT_FAILURE);          
+    }
+    return deviceType;
+}
+
+//------------------------------------------------------------------------------
+std::vector< cl_device_id > get_device_ids(const std::string& platformName,
+                                           const std::string& deviceTypeName) {
     cl_int status = 0;
-    //1) get platfors and search for platform matching platformName
+    //1) get platfors and search for platform(s) matching platformName
     cl_uint numPlatforms = 0;
     status = clGetPlatformIDs(0, 0, &numPlatforms);
     check_cl_error(status, "clGetPlatformIDs");
@@ -46,60 +133,52 @@ cl_context create_cl_context(const std::string& platformName,
     status = clGetPlatformIDs(numPlatforms, &platformIDs[0], 0);
     check_cl_error(status, "clGetPlatformIDs");
     std::vector< char > buf(0x10000, char(0));
-    cl_platform_id platformID;
-    PlatformIDs::const_iterator pi = platformIDs.begin();
-    for(; pi != platformIDs.end(); ++pi) {
+    PlatformIDs selected;
+    for(PlatformIDs::const_iterator pi = platformIDs.begin();
+        pi != platformIDs.end(); ++pi) {
         status = clGetPlatformInfo(*pi, CL_PLATFORM_NAME,
                                  buf.size(), &buf[0], 0);
         check_cl_error(status, "clGetPlatformInfo");
-        if(platformName == &buf[0]) {
-            platformID = *pi;
-            break; 
+        if(platformName == "all" || platformName == &buf[0]) {
+            selected.push_back(*pi);
         }
     } 
-    if(pi == platformIDs.end()) {
+    if(selected.empty()) {
         std::cerr << "ERROR - Couldn't find platform " 
                   << platformName << std::endl;
         exit(EXIT_FAILURE);
     }
-    //2) get devices of deviceTypeName type and store their ids into
-    //   an array then select device id at position deviceNum
-    cl_device_type deviceType;
-    if(deviceTypeName == "default") 
-        deviceType = CL_DEVICE_TYPE_DEFAULT;
-    else if(deviceTypeName == "cpu")
-        deviceType = CL_DEVICE_TYPE_CPU;
-    else if(deviceTypeName == "gpu")
-        deviceType = CL_DEVICE_TYPE_GPU;
-    else if(deviceTypeName == "acc")
-        deviceType = CL_DEVICE_TYPE_ACCELERATOR; 
-    else if(deviceTypeName == "all")
-        deviceType = CL_DEVICE_TYPE_CPU;
-    else {
-        std::cerr << "ERROR - device type " << deviceTypeName << " unknown"
-                  << std::endl;
-        exit(EXIT_FAILURE);          
-    }                      
-    cl_uint numDevices = 0; 
-    status = clGetDeviceIDs(platformID, deviceType, 0, 0, &numDevices);
-    check_cl_error(status, "clGetDeviceIDs");
-    if(numDevices < 1) {
+    //2) get devices of deviceTypeName type from each selected platform
+    const cl_device_type deviceType = get_device_type(deviceTypeName);
+    typedef std::vector< cl_device_id > DeviceIDs;
+    DeviceIDs deviceIDs;
+    for(PlatformIDs::const_iterator pi = selected.begin();
+        pi != selected.end(); ++pi) {
+        cl_uint numDevices = 0; 
+        status = clGetDeviceIDs(*pi, deviceType, 0, 0, &numDevices);
+        //platforms with no devices of the requested type are skipped
+        //when searching all platforms
+        if(status == CL_DEVICE_NOT_FOUND || numDevices < 1) continue;
+        check_cl_error(status, "clGetDeviceIDs");
+        DeviceIDs ids(numDevices);
+        status = clGetDeviceIDs(*pi, deviceType, numDevices, &ids[0], 0);
+        check_cl_error(status, "clGetDeviceIDs");
+        deviceIDs.insert(deviceIDs.end(), ids.begin(), ids.end());
+    }
+    if(deviceIDs.empty()) {
         std::cerr << "ERROR - Cannot find device of type " 
                   << deviceTypeName << std::endl;
         exit(EXIT_FAILURE);          
     }
-    typedef std::vector< cl_device_id > DeviceIDs;
-    DeviceIDs deviceIDs(numDevices);
-    status = clGetDeviceIDs(platformID, deviceType, numDevices,
-                            &deviceIDs[0], 0);
-    check_cl_error(status, "clGetDeviceIDs");
-    if(deviceNum < 0 || deviceNum >= numDevices) {
-        std::cerr << "ERROR - device number out of range: [0," 
-                  << (numDevices - 1) << ']' << std::endl;
-        exit(EXIT_FAILURE);
-    }
-    cl_device_id deviceID = deviceIDs[deviceNum]; 
-    //3) create and return context
+    return deviceIDs;
+}
+
+//------------------------------------------------------------------------------
+cl_context create_device_context(cl_device_id deviceID) {
+    cl_platform_id platformID;
+    cl_int status = clGetDeviceInfo(deviceID, CL_DEVICE_PLATFORM,
+                                    sizeof(cl_platform_id), &platformID, 0);
+    check_cl_error(status, "clGetDeviceInfo(CL_DEVICE_PLATFORM)");
     cl_context_properties ctxProps[] = {
         CL_CONTEXT_PLATFORM,
         cl_context_properties(platformID),
@@ -112,6 +191,28 @@ cl_context create_cl_context(const std::string& platformName,
     return ctx;
 }
 
+//------------------------------------------------------------------------------
+// returns context associated with single device only, use
+// create_clmultienv to access multiple devices
+cl_context create_cl_context(const std::string& platformName,
+                             const std::string& deviceTypeName,
+                             int deviceNum) {
+    if(is_fastest_device_type(deviceTypeName))
+        return create_device_context(fastest_device(platformName,
+                                                    deviceTypeName));
+    //select device id at position deviceNum among the devices of
+    //type deviceTypeName
+    typedef std::vector< cl_device_id > DeviceIDs;
+    const DeviceIDs deviceIDs = get_device_ids(platformName, deviceTypeName);
+    if(deviceNum < 0 || deviceNum >= int(deviceIDs.size())) {
+        std::cerr << "ERROR - device number out of range: [0," 
+                  << (deviceIDs.size() - 1) << ']' << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    //create and return context
+    return create_device_context(deviceIDs[deviceNum]);
+}
+
 
 //------------------------------------------------------------------------------
 std::string load_text(const char* filepath) {
@@ -354,87 +455,602 @@ void print_platforms() {
 }
 
 //------------------------------------------------------------------------------
-CLEnv create_clenv(const std::string& platformName,
-                   const std::string& deviceType,
-                   int deviceNum,
-                   bool enableProfiling,
-                   const char* clSourcePath,
-                   const char* kernelName, 
-                   const std::string& clSourcePrefix, 
-                   const std::string& buildOptions) {
+//monotonic wall clock time in milliseconds
+static double wall_time_ms() {
+    timespec t = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1E3 + t.tv_nsec / 1E6;
+}
 
-    CLEnv rt;
+//------------------------------------------------------------------------------
+static std::string get_device_info_string(cl_device_id deviceID,
+                                          cl_device_info info) {
+    std::vector< char > buf(0x10000, char(0));
+    cl_int status = clGetDeviceInfo(deviceID, info, buf.size(), &buf[0], 0);
+    check_cl_error(status, "clGetDeviceInfo");
+    return &buf[0];
+}
+
+//------------------------------------------------------------------------------
+std::string get_device_key(cl_device_id deviceID) {
+    cl_platform_id platformID;
+    cl_int status = clGetDeviceInfo(deviceID, CL_DEVICE_PLATFORM,
+                                    sizeof(cl_platform_id), &platformID, 0);
+    check_cl_error(status, "clGetDeviceInfo(CL_DEVICE_PLATFORM)");
+    std::vector< char > buf(0x10000, char(0));
+    status = clGetPlatformInfo(platformID, CL_PLATFORM_NAME,
+                               buf.size(), &buf[0], 0);
+    check_cl_error(status, "clGetPlatformInfo");
+    return std::string(&buf[0]) + '|'
+           + get_device_info_string(deviceID, CL_DEVICE_NAME) + '|'
+           + get_device_info_string(deviceID, CL_DRIVER_VERSION);
+}
+
+//------------------------------------------------------------------------------
+//64 bit FNV-1a hash, used to generate cache file names
+static std::string hash_text(const std::string& text) {
+    unsigned long long h = 14695981039346656037ULL;
+    for(std::string::const_iterator i = text.begin(); i != text.end(); ++i) {
+        h ^= (unsigned char)(*i);
+        h *= 1099511628211ULL;
+    }
+    char hex[17] = "";
+    snprintf(hex, sizeof(hex), "%016llx", h);
+    return hex;
+}
+
+//------------------------------------------------------------------------------
+//returns cache directory or empty string if caching is disabled
+static std::string program_cache_dir() {
+    const char* dir = getenv("CLUTIL_CACHE_DIR");
+    if(dir != 0) return dir;
+    const char* home = getenv("HOME");
+    if(home == 0) return std::string();
+    return std::string(home) + "/.clutil-cache";
+}
+
+//------------------------------------------------------------------------------
+//cache file layout:
+//  CLUTIL-PROGRAM-CACHE 1
+//  <key size>
+//  <key>
+//  <binary size>
+//  <binary>
+//the key is compared to the requested one to detect hash collisions
+static const char PROGRAM_CACHE_MAGIC[] = "CLUTIL-PROGRAM-CACHE 1";
+
+//------------------------------------------------------------------------------
+static bool load_cached_binary(const std::string& path,
+                               const std::string& key,
+                               std::vector< unsigned char >& binary) {
+    std::ifstream is(path.c_str(), std::ios::binary);
+    if(!is) return false;
+    std::string magic;
+    std::getline(is, magic);
+    if(magic != PROGRAM_CACHE_MAGIC) return false;
+    size_t keySize = 0;
+    is >> keySize;
+    is.get();
+    std::string k(keySize, '\0');
+    if(keySize > 0) is.read(&k[0], keySize);
+    if(!is || k != key) return false;
+    size_t binarySize = 0;
+    is >> binarySize;
+    is.get();
+    if(!is || binarySize == 0) return false;
+    binary.resize(binarySize);
+    is.read(reinterpret_cast< char* >(&binary[0]), binarySize);
+    return bool(is);
+}
+
+//------------------------------------------------------------------------------
+static void store_cached_binary(const std::string& dir,
+                                const std::string& path,
+                                const std::string& key,
+                                cl_program program) {
+    size_t binarySize = 0;
+    cl_int status = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
+                                     sizeof(size_t), &binarySize, 0);
+    if(status != CL_SUCCESS || binarySize == 0) return;
+    std::vector< unsigned char > binary(binarySize);
+    unsigned char* binaries[] = {&binary[0]};
+    status = clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+                              sizeof(binaries), binaries, 0);
+    if(status != CL_SUCCESS) return;
+    mkdir(dir.c_str(), 0755);
+    //write to temporary file and rename to avoid exposing partially
+    //written files to concurrent processes
+    std::ostringstream tmp;
+    tmp << path << '.' << getpid();
+    std::ofstream os(tmp.str().c_str(), std::ios::binary);
+    if(!os) return;
+    os << PROGRAM_CACHE_MAGIC << '\n' << key.size() << '\n' << key
+       << binarySize << '\n';
+    os.write(reinterpret_cast< const char* >(&binary[0]), binarySize);
+    os.close();
+    if(!os || rename(tmp.str().c_str(), path.c_str()) != 0) {
+        remove(tmp.str().c_str());
+    }
+}
+
+//------------------------------------------------------------------------------
+//builds program and prints build log if any; returns build status
+static cl_int build_and_log(cl_program program,
+                            cl_device_id deviceID,
+                            const std::string& buildOptions) {
+    cl_int buildStatus = buildOptions.size() ?
+                         clBuildProgram(program, 1, &deviceID,
+                            buildOptions.c_str(), 0, 0)
+                         : clBuildProgram(program, 1, &deviceID,
+                            0, 0, 0);
+    //log output if any
+    char buffer[0x10000] = "";
+    size_t len = 0;
+    cl_int status = clGetProgramBuildInfo(program,
+                                          deviceID,
+                                          CL_PROGRAM_BUILD_LOG,
+                                          sizeof(buffer),
+                                          buffer,
+                                          &len);
+    check_cl_error(status, "clBuildProgramInfo");
+    if(len > 1) std::cout << "Build output: " << buffer << std::endl;
+    return buildStatus;
+}
+
+//------------------------------------------------------------------------------
+//if exitOnError is false returns 0 if the program fails to build
+static cl_program build_program(cl_context context,
+                                cl_device_id deviceID,
+                                const std::string& programSource,
+                                const std::string& buildOptions,
+                                bool exitOnError) {
+    const double start = wall_time_ms();
     cl_int status;
-    cl_device_id deviceID;
+    const std::string dir = program_cache_dir();
+    const std::string key = get_device_key(deviceID) + '\n'
+                            + "options: " + buildOptions + '\n'
+                            + "source: " + hash_text(programSource) + '\n';
+    const std::string path = dir + '/' + hash_text(key) + ".bin";
+    //1)try to load binary from cache
+    std::vector< unsigned char > binary;
+    if(!dir.empty() && load_cached_binary(path, key, binary)) {
+        const unsigned char* bin = &binary[0];
+        const size_t binSize = binary.size();
+        cl_int binaryStatus = CL_SUCCESS;
+        cl_program program = clCreateProgramWithBinary(context,
+                                                       1,
+                                                       &deviceID,
+                                                       &binSize,
+                                                       &bin,
+                                                       &binaryStatus,
+                                                       &status);
+        if(status == CL_SUCCESS && binaryStatus == CL_SUCCESS
+           && build_and_log(program, deviceID, buildOptions) == CL_SUCCESS) {
+            std::cout << "Program cache: hit, build time: "
+                      << (wall_time_ms() - start) << " ms" << std::endl;
+            return program;
+        }
+        //invalid binary (e.g. driver upgrade with same version string):
+        //discard and rebuild from source
+        if(status == CL_SUCCESS) clReleaseProgram(program);
+        remove(path.c_str());
+    }
+    //2)build from source
+    const char* src = programSource.c_str();
+    const size_t sourceLength = programSource.length();
+    cl_program program = clCreateProgramWithSource(context, //context
+                                                   1,   //number of strings
+                                                   &src, //lines
+                                                   &sourceLength, // size 
+                                                   &status);  // status 
+    check_cl_error(status, "clCreateProgramWithSource");
+    status = build_and_log(program, deviceID, buildOptions);
+    if(status != CL_SUCCESS && !exitOnError) {
+        check_cl_error(clReleaseProgram(program), "clReleaseProgram");
+        return 0;
+    }
+    check_cl_error(status, "clBuildProgram");
+    //3)store binary in cache
+    if(!dir.empty()) store_cached_binary(dir, path, key, program);
+    std::cout << "Program cache: " << (dir.empty() ? "disabled" : "miss")
+              << ", build time: " << (wall_time_ms() - start) << " ms"
+              << std::endl;
+    return program;
+}
+
+//------------------------------------------------------------------------------
+cl_program build_program(cl_context context,
+                         cl_device_id deviceID,
+                         const std::string& programSource,
+                         const std::string& buildOptions) {
+    return build_program(context, deviceID, programSource, buildOptions,
+                         true);
+}
 
-    //1)create context
-    rt.context = create_cl_context(platformName, deviceType, deviceNum);
+//------------------------------------------------------------------------------
+cl_program try_build_program(cl_context context,
+                             cl_device_id deviceID,
+                             const std::string& programSource,
+                             const std::string& buildOptions) {
+    return build_program(context, deviceID, programSource, buildOptions,
+                         false);
+}
+
+//------------------------------------------------------------------------------
+//creates program, kernel and command queue for the single device in the
+//context
+static CLEnv init_clenv(cl_context context,
+                        bool enableProfiling,
+                        const char* clSourcePath,
+                        const char* kernelName, 
+                        const std::string& clSourcePrefix, 
+                        const std::string& buildOptions,
+                        int numQueues = 1,
+                        bool outOfOrder = false) {
+    CLEnv rt;
+    rt.context = context;
+    rt.program = 0;
+    rt.kernel = 0;
+    cl_int status;
     //only a single device was selected
     //retrieve actual device id from context
-    status = clGetContextInfo(rt.context,
-                              CL_CONTEXT_DEVICES,
-                              sizeof(cl_device_id),
-                              &deviceID, 0);
-    check_cl_error(status, "clGetContextInfo");
+    const cl_device_id deviceID = get_device_id(rt.context);
     
-    //2)load kernel source
+    //load kernel source
     if(clSourcePath != 0) {
         const std::string programSource = clSourcePrefix 
                                           + "\n" 
                                           + load_text(clSourcePath);
-        const char* src = programSource.c_str();
-        const size_t sourceLength = programSource.length();
 
-        //3)build program and create kernel
-        
-        rt.program = clCreateProgramWithSource(rt.context, //context
-                                               1,   //number of strings
-                                               &src, //lines
-                                               &sourceLength, // size 
-                                               &status);  // status 
-        check_cl_error(status, "clCreateProgramWithSource");
-        
-        cl_int buildStatus = buildOptions.size() ?
-                             clBuildProgram(rt.program, 1, &deviceID,
-                                buildOptions.c_str(), 0, 0)
-                             : clBuildProgram(rt.program, 1, &deviceID,
-                                0, 0, 0);
-        //log output if any
-        char buffer[0x10000] = "";
-        size_t len = 0;
-        status = clGetProgramBuildInfo(rt.program,
-                                       deviceID,
-                                       CL_PROGRAM_BUILD_LOG,
-                                       sizeof(buffer),
-                                       buffer,
-                                       &len);
-        check_cl_error(status, "clBuildProgramInfo");
-        if(len > 1) std::cout << "Build output: " << buffer << std::endl;
-        check_cl_error(buildStatus, "clBuildProgram");
+        //build program and create kernel
+        rt.program = build_program(rt.context, deviceID,
+                                   programSource, buildOptions);
         if(kernelName != 0) {
             rt.kernel = clCreateKernel(rt.program, kernelName, &status);
             check_cl_error(status, "clCreateKernel"); 
         }
     }
 
-    rt.commandQueue = enableProfiling ?
-                      clCreateCommandQueue(rt.context, deviceID,
-                                           CL_QUEUE_PROFILING_ENABLE, &status)
-                      : clCreateCommandQueue(rt.context, deviceID, 0, &status);
-    check_cl_error(status, "clCreateCommandQueue");
+    cl_command_queue_properties properties = 0;
+    if(enableProfiling) properties |= CL_QUEUE_PROFILING_ENABLE;
+    if(outOfOrder) properties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+    for(int q = 0; q < std::max(numQueues, 1); ++q) {
+        rt.queues.push_back(clCreateCommandQueue(rt.context, deviceID,
+                                                 properties, &status));
+        check_cl_error(status, "clCreateCommandQueue");
+    }
+    rt.commandQueue = rt.queues.front();
 
     return rt;
 }
 
+//------------------------------------------------------------------------------
+CLEnv create_clenv(const std::string& platformName,
+                   const std::string& deviceType,
+                   int deviceNum,
+                   bool enableProfiling,
+                   const char* clSourcePath,
+                   const char* kernelName, 
+                   const std::string& clSourcePrefix, 
+                   const std::string& buildOptions,
+                   int numQueues,
+                   bool outOfOrder) {
+    //the directory of the kernel source is searched for the kernel used
+    //by the device ranking benchmarks
+    std::string kernelDir;
+    if(clSourcePath != 0) {
+        kernelDir = clSourcePath;
+        const size_t slash = kernelDir.rfind('/');
+        kernelDir = slash == std::string::npos ? std::string(".")
+                                               : kernelDir.substr(0, slash);
+    }
+    cl_context context = is_fastest_device_type(deviceType)
+        ? create_device_context(fastest_device(platformName, deviceType,
+                                               kernelDir))
+        : create_cl_context(platformName, deviceType, deviceNum);
+    return init_clenv(context, enableProfiling, clSourcePath, kernelName,
+                      clSourcePrefix, buildOptions, numQueues, outOfOrder);
+}
+
 //------------------------------------------------------------------------------
 void release_clenv(CLEnv& e) {
-    check_cl_error(clReleaseCommandQueue(e.commandQueue),
-                                         "clReleaseCommandQueue");
-    check_cl_error(clReleaseKernel(e.kernel), "clReleaseKernel");
-    check_cl_error(clReleaseProgram(e.program), "clReleaseProgram");
+    for(std::vector< cl_command_queue >::iterator q = e.queues.begin();
+        q != e.queues.end(); ++q) {
+        check_cl_error(clReleaseCommandQueue(*q), "clReleaseCommandQueue");
+    }
+    e.queues.clear();
+    if(e.kernel != 0)
+        check_cl_error(clReleaseKernel(e.kernel), "clReleaseKernel");
+    if(e.program != 0)
+        check_cl_error(clReleaseProgram(e.program), "clReleaseProgram");
     check_cl_error(clReleaseContext(e.context), "clReleaseContext");
 }
 
+//------------------------------------------------------------------------------
+//DEVICE RANKING
+//------------------------------------------------------------------------------
+static std::string device_db_path() {
+    const char* path = getenv("CLUTIL_DEVICE_DB");
+    if(path != 0) return path;
+    const char* home = getenv("HOME");
+    return std::string(home != 0 ? home : ".") + "/.clutil-devices.db";
+}
+
+//------------------------------------------------------------------------------
+static std::string host_name() {
+    std::vector< char > buf(256, char(0));
+    if(gethostname(&buf[0], buf.size() - 1) != 0) return "localhost";
+    return &buf[0];
+}
+
+//------------------------------------------------------------------------------
+//database line format, tab separated:
+//<host name> <device key> <transfer GB/s> <copy GB/s> <GFLOP/s>
+static bool device_db_lookup(DeviceScore& s) {
+    std::ifstream is(device_db_path().c_str());
+    const std::string key = host_name() + '\t' + s.key + '\t';
+    std::string line;
+    while(std::getline(is, line)) {
+        if(line.compare(0, key.size(), key) != 0) continue;
+        std::istringstream fields(line.substr(key.size()));
+        if(fields >> s.transferGBs >> s.copyGBs >> s.gflops) return true;
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+static void device_db_store(const DeviceScore& s) {
+    const std::string path = device_db_path();
+    const std::string key = host_name() + '\t' + s.key + '\t';
+    std::vector< std::string > lines;
+    std::ifstream is(path.c_str());
+    std::string line;
+    while(std::getline(is, line)) {
+        if(line.compare(0, key.size(), key) != 0) lines.push_back(line);
+    }
+    is.close();
+    std::ostringstream entry;
+    entry << key << s.transferGBs << '\t' << s.copyGBs << '\t' << s.gflops;
+    lines.push_back(entry.str());
+    std::ostringstream tmp;
+    tmp << path << '.' << getpid();
+    std::ofstream os(tmp.str().c_str());
+    for(std::vector< std::string >::const_iterator i = lines.begin();
+        i != lines.end(); ++i) os << *i << '\n';
+    os.close();
+    if(!os || rename(tmp.str().c_str(), path.c_str()) != 0) {
+        std::cerr << "WARNING - cannot write device database " << path
+                  << std::endl;
+        remove(tmp.str().c_str());
+    }
+}
+
+//------------------------------------------------------------------------------
+//returns the path of a kernel source file distributed with the training,
+//e.g. the matrix multiply kernel used by the compute benchmark, or an empty
+//string if not found
+static std::string find_kernel_source(const std::string& fileName,
+                                      const std::string& kernelDir) {
+    std::vector< std::string > dirs;
+    const char* env = getenv("CLUTIL_KERNEL_DIR");
+    if(env != 0) dirs.push_back(env);
+    if(!kernelDir.empty()) dirs.push_back(kernelDir);
+    dirs.push_back("kernels");
+    dirs.push_back("src/kernels");
+    dirs.push_back("../src/kernels");
+    for(std::vector< std::string >::const_iterator d = dirs.begin();
+        d != dirs.end(); ++d) {
+        const std::string path = *d + '/' + fileName;
+        if(std::ifstream(path.c_str())) return path;
+    }
+    return std::string();
+}
+
+//------------------------------------------------------------------------------
+//best START to END time in milliseconds of the command returned by
+//enqueue over a few repetitions
+static const int RANK_REPS = 3;
+static double best_time_ms(const std::vector< cl_event >& events) {
+    double best = -1;
+    for(std::vector< cl_event >::const_iterator e = events.begin();
+        e != events.end(); ++e) {
+        const CLEventTimes t = get_cl_event_times(*e);
+        const double ms = double(t.end - t.start) / 1E6;
+        if(best < 0 || ms < best) best = ms;
+        clReleaseEvent(*e);
+    }
+    return best;
+}
+
+//------------------------------------------------------------------------------
+//runs the micro-benchmarks on a single device: host to device transfer and
+//device to device copy of the same buffer size used by 09_memcpy (capped by
+//the max allocation size) and the block matrix multiply kernel of
+//04_matrix_multiply.cl on 512x512 single precision matrices
+static void benchmark_device(DeviceScore& s, const std::string& matmulPath) {
+    cl_int status = CL_SUCCESS;
+    cl_context ctx = create_device_context(s.id);
+    cl_command_queue queue = clCreateCommandQueue(ctx, s.id,
+                                                  CL_QUEUE_PROFILING_ENABLE,
+                                                  &status);
+    check_cl_error(status, "clCreateCommandQueue");
+    cl_ulong maxAlloc = 0;
+    check_cl_error(clGetDeviceInfo(s.id, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+                                   sizeof(cl_ulong), &maxAlloc, 0),
+                   "clGetDeviceInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE)");
+    const size_t bytes = size_t(std::min(cl_ulong(0x4000000), maxAlloc / 2));
+    //1) bandwidth
+    std::vector< char > host(bytes, char(1));
+    cl_mem src = clCreateBuffer(ctx, CL_MEM_READ_WRITE, bytes, 0, &status);
+    check_cl_error(status, "clCreateBuffer");
+    cl_mem dest = clCreateBuffer(ctx, CL_MEM_READ_WRITE, bytes, 0, &status);
+    check_cl_error(status, "clCreateBuffer");
+    std::vector< cl_event > events(RANK_REPS);
+    for(int r = 0; r != RANK_REPS; ++r) {
+        check_cl_error(clEnqueueWriteBuffer(queue, src, CL_TRUE, 0, bytes,
+                                            &host[0], 0, 0, &events[r]),
+                       "clEnqueueWriteBuffer");
+    }
+    s.transferGBs = double(bytes) / (best_time_ms(events) * 1E6);
+    for(int r = 0; r != RANK_REPS; ++r) {
+        check_cl_error(clEnqueueCopyBuffer(queue, src, dest, 0, 0, bytes,
+                                           0, 0, &events[r]),
+                       "clEnqueueCopyBuffer");
+    }
+    check_cl_error(clFinish(queue), "clFinish");
+    //read + write
+    s.copyGBs = 2 * double(bytes) / (best_time_ms(events) * 1E6);
+    check_cl_error(clReleaseMemObject(src), "clReleaseMemObject");
+    check_cl_error(clReleaseMemObject(dest), "clReleaseMemObject");
+    //2) FLOP/s: largest power of two block size supported by the device,
+    //up to 16x16
+    size_t maxGroupSize = 1;
+    check_cl_error(clGetDeviceInfo(s.id, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+                                   sizeof(size_t), &maxGroupSize, 0),
+                   "clGetDeviceInfo(CL_DEVICE_MAX_WORK_GROUP_SIZE)");
+    int blockSize = 16;
+    while(blockSize > 1 && size_t(blockSize * blockSize) > maxGroupSize)
+        blockSize /= 2;
+    std::ostringstream prefix;
+    prefix << "#define BLOCK_SIZE " << blockSize << '\n';
+    cl_program program = build_program(ctx, s.id, prefix.str() + "\n"
+                                       + load_text(matmulPath.c_str()));
+    cl_kernel kernel = clCreateKernel(program, "block_matmul", &status);
+    check_cl_error(status, "clCreateKernel");
+    const int SIZE = 512;
+    const size_t matBytes = SIZE * SIZE * sizeof(float);
+    const std::vector< float > m(SIZE * SIZE, 1.0f);
+    cl_mem mats[3];
+    for(int i = 0; i != 3; ++i) {
+        mats[i] = clCreateBuffer(ctx, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                 matBytes, const_cast< float* >(&m[0]),
+                                 &status);
+        check_cl_error(status, "clCreateBuffer");
+        check_cl_error(clSetKernelArg(kernel, i, sizeof(cl_mem), &mats[i]),
+                       "clSetKernelArg");
+    }
+    for(int i = 3; i != 6; ++i) {
+        check_cl_error(clSetKernelArg(kernel, i, sizeof(int), &SIZE),
+                       "clSetKernelArg");
+    }
+    const size_t global[2] = {SIZE, SIZE};
+    const size_t local[2] = {size_t(blockSize), size_t(blockSize)};
+    //first launch not timed
+    check_cl_error(clEnqueueNDRangeKernel(queue, kernel, 2, 0, global, local,
+                                          0, 0, 0), "clEnqueueNDRangeKernel");
+    for(int r = 0; r != RANK_REPS; ++r) {
+        check_cl_error(clEnqueueNDRangeKernel(queue, kernel, 2, 0, global,
+                                              local, 0, 0, &events[r]),
+                       "clEnqueueNDRangeKernel");
+    }
+    check_cl_error(clFinish(queue), "clFinish");
+    s.gflops = 2 * double(SIZE) * SIZE * SIZE / (best_time_ms(events) * 1E6);
+    for(int i = 0; i != 3; ++i)
+        check_cl_error(clReleaseMemObject(mats[i]), "clReleaseMemObject");
+    check_cl_error(clReleaseKernel(kernel), "clReleaseKernel");
+    check_cl_error(clReleaseProgram(program), "clReleaseProgram");
+    check_cl_error(clReleaseCommandQueue(queue), "clReleaseCommandQueue");
+    check_cl_error(clReleaseContext(ctx), "clReleaseContext");
+}
+
+//------------------------------------------------------------------------------
+std::vector< DeviceScore > rank_devices(const std::string& platformName,
+                                        const std::string& kernelDir) {
+    const std::vector< cl_device_id > ids = get_device_ids(platformName,
+                                                           "all");
+    std::vector< DeviceScore > scores;
+    std::string matmulPath;
+    for(std::vector< cl_device_id >::const_iterator i = ids.begin();
+        i != ids.end(); ++i) {
+        DeviceScore s;
+        s.id = *i;
+        s.key = get_device_key(*i);
+        if(!device_db_lookup(s)) {
+            if(matmulPath.empty()) {
+                matmulPath = find_kernel_source("04_matrix_multiply.cl",
+                                                kernelDir);
+            }
+            if(matmulPath.empty()) {
+                std::cerr << "ERROR - cannot find 04_matrix_multiply.cl "
+                             "for device ranking, set CLUTIL_KERNEL_DIR"
+                          << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            benchmark_device(s, matmulPath);
+            device_db_store(s);
+        }
+        scores.push_back(s);
+    }
+    return scores;
+}
+
+//------------------------------------------------------------------------------
+//kernels of the training mapped to the benchmark which best predicts their
+//performance
+static std::string benchmark_for(const std::string& kernelName) {
+    if(kernelName == "matmul" || kernelName == "block_matmul")
+        return "matmul";
+    if(kernelName == "dotprod" || kernelName == "filter"
+       || kernelName == "filter_image" || kernelName == "copy")
+        return "copy";
+    if(kernelName == "memcpy" || kernelName == "transfer") return "transfer";
+    std::cerr << "ERROR - no benchmark for kernel " << kernelName
+              << ": use one of matmul, block_matmul, dotprod, filter, "
+                 "filter_image, copy, memcpy, transfer" << std::endl;
+    exit(EXIT_FAILURE);
+    return std::string();
+}
+
+//------------------------------------------------------------------------------
+static double device_score(const DeviceScore& s,
+                           const DeviceScore& max,
+                           const std::string& benchmark) {
+    if(benchmark == "matmul") return s.gflops;
+    if(benchmark == "copy") return s.copyGBs;
+    if(benchmark == "transfer") return s.transferGBs;
+    //geometric mean of the normalized scores
+    return std::pow(s.gflops / max.gflops * s.copyGBs / max.copyGBs
+                    * s.transferGBs / max.transferGBs, 1.0 / 3.0);
+}
+
+//------------------------------------------------------------------------------
+cl_device_id fastest_device(const std::string& platformName,
+                            const std::string& criterion,
+                            const std::string& kernelDir) {
+    const std::string prefix = "fastest-for:";
+    const std::string benchmark =
+        criterion.compare(0, prefix.size(), prefix) == 0
+        ? benchmark_for(criterion.substr(prefix.size())) : std::string();
+    const std::vector< DeviceScore > scores = rank_devices(platformName,
+                                                           kernelDir);
+    DeviceScore max;
+    max.transferGBs = max.copyGBs = max.gflops = 0;
+    for(std::vector< DeviceScore >::const_iterator s = scores.begin();
+        s != scores.end(); ++s) {
+        max.transferGBs = std::max(max.transferGBs, s->transferGBs);
+        max.copyGBs = std::max(max.copyGBs, s->copyGBs);
+        max.gflops = std::max(max.gflops, s->gflops);
+    }
+    size_t best = 0;
+    for(size_t i = 0; i != scores.size(); ++i) {
+        if(device_score(scores[i], max, benchmark)
+           > device_score(scores[best], max, benchmark)) best = i;
+    }
+    std::cout << "Device ranking (" << criterion << "):" << std::endl;
+    for(size_t i = 0; i != scores.size(); ++i) {
+        std::cout << (i == best ? " * " : "   ") << scores[i].key << ": "
+                  << scores[i].transferGBs << " GB/s transfer, "
+                  << scores[i].copyGBs << " GB/s copy, "
+                  << scores[i].gflops << " GFLOP/s" << std::endl;
+    }
+    return scores[best].id;
+}
+
+//------------------------------------------------------------------------------
+bool is_fastest_device_type(const std::string& deviceTypeName) {
+    return deviceTypeName.compare(0, 7, "fastest") == 0;
+}
+
 //------------------------------------------------------------------------------
 double timeEnqueueNDRangeKernel(cl_command_queue command_queue,
                                 cl_kernel kernel,
@@ -444,10 +1060,11 @@ double timeEnqueueNDRangeKernel(cl_command_queue command_queue,
                                 const size_t *local_work_size,
                                 cl_uint num_events_in_wait_list,
                                 const cl_event *event_wait_list) {
-    cl_int status = clFinish(command_queue);
-    check_cl_error(status, "clFinish");
+    //no need to clFinish before and after launching the kernel: the
+    //START and END timestamps do not include the time spent waiting for
+    //previously enqueued commands
     cl_event profilingEvent;
-    status = clEnqueueNDRangeKernel(command_queue,
+    cl_int status = clEnqueueNDRangeKernel(command_queue,
                                     kernel,              
                                     work_dim,
                                     global_work_offset,
@@ -457,49 +1074,2055 @@ double timeEnqueueNDRangeKernel(cl_command_queue command_queue,
                                     event_wait_list,
                                     &profilingEvent);
     check_cl_error(status, "clEnqueueNDRangeKernel");
-    status = clFinish(command_queue); //ensure kernel execution is
-    //terminated; used for timing purposes only; there is no need to enforce
-    //termination when issuing a subsequent blocking data transfer operation
-    check_cl_error(status, "clFinish");
     status = clWaitForEvents(1, &profilingEvent);
     check_cl_error(status, "clWaitForEvents");
-    cl_ulong kernelStartTime = cl_ulong(0);
-    cl_ulong kernelEndTime   = cl_ulong(0);
-    size_t retBytes = size_t(0);
-    double kernelElapsedTime_ms = double(0); 
-   
-    status = clGetEventProfilingInfo(profilingEvent,
-                                     CL_PROFILING_COMMAND_QUEUED,
-                                     sizeof(cl_ulong),
-                                     &kernelStartTime, &retBytes);
-    check_cl_error(status, "clGetEventProfilingInfo");
-    status = clGetEventProfilingInfo(profilingEvent,
-                                     CL_PROFILING_COMMAND_END,
-                                     sizeof(cl_ulong),
-                                     &kernelEndTime, &retBytes);
-    check_cl_error(status, "clGetEventProfilingInfo");
+    const CLEventTimes t = get_cl_event_times(profilingEvent);
+    check_cl_error(clReleaseEvent(profilingEvent), "clReleaseEvent");
     //event timing is reported in nano seconds: divide by 1e6 to get
     //time in milliseconds
-    kernelElapsedTime_ms =  (double)(kernelEndTime - kernelStartTime) / 1E6;
-    return kernelElapsedTime_ms;
+    return double(t.end - t.start) / 1E6;
+}
+
+//------------------------------------------------------------------------------
+//reads the profiling timestamps of ev into t; returns the first error, does
+//not exit so that it can be called from event callbacks
+static cl_int query_cl_event_times(cl_event ev, CLEventTimes& t) {
+    const cl_profiling_info info[] = {CL_PROFILING_COMMAND_QUEUED,
+                                      CL_PROFILING_COMMAND_SUBMIT,
+                                      CL_PROFILING_COMMAND_START,
+                                      CL_PROFILING_COMMAND_END};
+    cl_ulong* times[] = {&t.queued, &t.submit, &t.start, &t.end};
+    for(int i = 0; i != 4; ++i) {
+        const cl_int status = clGetEventProfilingInfo(ev, info[i],
+                                                      sizeof(cl_ulong),
+                                                      times[i], 0);
+        if(status != CL_SUCCESS) return status;
+    }
+    return CL_SUCCESS;
+}
+
+//------------------------------------------------------------------------------
+CLEventTimes get_cl_event_times(cl_event ev) {
+    CLEventTimes t = {0, 0, 0, 0};
+    check_cl_error(query_cl_event_times(ev, t), "clGetEventProfilingInfo");
+    return t;
 }
 
 //------------------------------------------------------------------------------
 double get_cl_time(cl_event ev) {
-    cl_ulong startTime = cl_ulong(0);
-    cl_ulong endTime   = cl_ulong(0);
-    size_t retBytes = size_t(0);
-    cl_int status = clGetEventProfilingInfo(ev,
-                   CL_PROFILING_COMMAND_QUEUED,
-                   sizeof(cl_ulong),
-                   &startTime, &retBytes);
-    check_cl_error(status, "clGetEventProfilingInfo");
-    status = clGetEventProfilingInfo(ev,
-                   CL_PROFILING_COMMAND_END,
-                   sizeof(cl_ulong),
-                   &endTime, &retBytes);
-    check_cl_error(status, "clGetEventProfilingInfo");
+    const CLEventTimes t = get_cl_event_times(ev);
     //event timing is reported in nanoseconds: divide by 1e6 to get
     //time in milliseconds
-    return double((endTime - startTime) / 1E6);    
-}
\ No newline at end of file
+    return double(t.end - t.queued) / 1E6;    
+}
+
+//------------------------------------------------------------------------------
+namespace {
+//data passed to event callback
+struct PendingSample {
+    ProfilingSession* session;
+    std::string label;
+};
+}
+
+//------------------------------------------------------------------------------
+CLEventList::~CLEventList() {
+    clear();
+}
+
+//------------------------------------------------------------------------------
+cl_event* CLEventList::next() {
+    events_.push_back(cl_event(0));
+    return &events_.back();
+}
+
+//------------------------------------------------------------------------------
+void CLEventList::add(cl_event ev) {
+    events_.push_back(ev);
+}
+
+//------------------------------------------------------------------------------
+void CLEventList::wait() const {
+    if(events_.empty()) return;
+    check_cl_error(clWaitForEvents(size(), data()), "clWaitForEvents");
+}
+
+//------------------------------------------------------------------------------
+void CLEventList::clear() {
+    for(std::vector< cl_event >::iterator i = events_.begin();
+        i != events_.end(); ++i) {
+        if(*i != 0) check_cl_error(clReleaseEvent(*i), "clReleaseEvent");
+    }
+    events_.clear();
+}
+
+//------------------------------------------------------------------------------
+void chain_queues(cl_command_queue from, cl_command_queue to) {
+    //the marker completes when all the commands enqueued before it
+    //are complete
+    cl_event marker;
+    check_cl_error(clEnqueueMarker(from, &marker), "clEnqueueMarker");
+    check_cl_error(clEnqueueWaitForEvents(to, 1, &marker),
+                   "clEnqueueWaitForEvents");
+    check_cl_error(clReleaseEvent(marker), "clReleaseEvent");
+}
+
+//------------------------------------------------------------------------------
+ProfilingSession::ProfilingSession() : pending_(0) {
+    pthread_mutex_init(&mutex_, 0);
+    pthread_cond_init(&completed_, 0);
+}
+
+//------------------------------------------------------------------------------
+ProfilingSession::~ProfilingSession() {
+    //callbacks must not access the session after it is destroyed
+    wait();
+    for(std::vector< cl_command_queue >::iterator i = queues_.begin();
+        i != queues_.end(); ++i) {
+        check_cl_error(clReleaseCommandQueue(*i), "clReleaseCommandQueue");
+    }
+    pthread_cond_destroy(&completed_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+//------------------------------------------------------------------------------
+void CL_CALLBACK ProfilingSession::event_callback(cl_event ev,
+                                                  cl_int status,
+                                                  void* data) {
+    PendingSample* p = reinterpret_cast< PendingSample* >(data);
+    Sample sample;
+    sample.label = p->label;
+    sample.status = status;
+    CLEventTimes t = {0, 0, 0, 0};
+    sample.times = t;
+    //cannot call check_cl_error from within a callback: in case of
+    //errors the sample is stored with zero timestamps
+    if(status == CL_COMPLETE
+       && query_cl_event_times(ev, sample.times) != CL_SUCCESS) {
+        sample.times = t;
+        sample.status = CL_PROFILING_INFO_NOT_AVAILABLE;
+    }
+    ProfilingSession* s = p->session;
+    delete p;
+    clReleaseEvent(ev);
+    pthread_mutex_lock(&s->mutex_);
+    s->samples_.push_back(sample);
+    --s->pending_;
+    pthread_cond_broadcast(&s->completed_);
+    pthread_mutex_unlock(&s->mutex_);
+}
+
+//------------------------------------------------------------------------------
+void ProfilingSession::attach(cl_event ev, const std::string& label) {
+    //the queue is flushed by wait(): callbacks are not invoked for commands
+    //that are never submitted; user events have no queue
+    cl_command_queue queue = 0;
+    check_cl_error(clGetEventInfo(ev, CL_EVENT_COMMAND_QUEUE,
+                                  sizeof(cl_command_queue), &queue, 0),
+                   "clGetEventInfo");
+    if(queue != 0 && std::find(queues_.begin(), queues_.end(), queue)
+                     == queues_.end()) {
+        check_cl_error(clRetainCommandQueue(queue), "clRetainCommandQueue");
+        queues_.push_back(queue);
+    }
+    check_cl_error(clRetainEvent(ev), "clRetainEvent");
+    PendingSample* p = new PendingSample;
+    p->session = this;
+    p->label = label;
+    pthread_mutex_lock(&mutex_);
+    ++pending_;
+    pthread_mutex_unlock(&mutex_);
+    cl_int status = clSetEventCallback(ev, CL_COMPLETE, &event_callback, p);
+    if(status != CL_SUCCESS) {
+        pthread_mutex_lock(&mutex_);
+        --pending_;
+        pthread_mutex_unlock(&mutex_);
+        delete p;
+        clReleaseEvent(ev);
+        check_cl_error(status, "clSetEventCallback");
+    }
+}
+
+//------------------------------------------------------------------------------
+void ProfilingSession::wait() {
+    for(std::vector< cl_command_queue >::iterator i = queues_.begin();
+        i != queues_.end(); ++i) {
+        check_cl_error(clFlush(*i), "clFlush");
+    }
+    pthread_mutex_lock(&mutex_);
+    while(pending_ > 0) pthread_cond_wait(&completed_, &mutex_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+//------------------------------------------------------------------------------
+size_t ProfilingSession::pending() const {
+    pthread_mutex_lock(&mutex_);
+    const size_t p = pending_;
+    pthread_mutex_unlock(&mutex_);
+    return p;
+}
+
+//------------------------------------------------------------------------------
+std::vector< ProfilingSession::Sample > ProfilingSession::samples() const {
+    pthread_mutex_lock(&mutex_);
+    const std::vector< Sample > s = samples_;
+    pthread_mutex_unlock(&mutex_);
+    return s;
+}
+
+//------------------------------------------------------------------------------
+void ProfilingSession::clear() {
+    pthread_mutex_lock(&mutex_);
+    samples_.clear();
+    pthread_mutex_unlock(&mutex_);
+}
+
+//------------------------------------------------------------------------------
+//nearest-rank percentile of sorted values
+static double percentile(const std::vector< double >& sorted, double p) {
+    size_t rank = size_t(std::ceil(p * sorted.size()));
+    if(rank > 0) --rank;
+    return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+//------------------------------------------------------------------------------
+ProfilingSession::Stats
+ProfilingSession::stats(const std::string& label) const {
+    std::vector< double > t;
+    const std::vector< Sample > s = samples();
+    for(std::vector< Sample >::const_iterator i = s.begin();
+        i != s.end(); ++i) {
+        if(i->label != label || i->status != CL_COMPLETE) continue;
+        t.push_back(double(i->times.end - i->times.start) / 1E6);
+    }
+    Stats st = {0, 0, 0, 0, 0, 0};
+    if(t.empty()) return st;
+    std::sort(t.begin(), t.end());
+    st.count = t.size();
+    st.min = t.front();
+    st.median = percentile(t, 0.5);
+    st.p95 = percentile(t, 0.95);
+    st.max = t.back();
+    st.total = std::accumulate(t.begin(), t.end(), 0.0);
+    return st;
+}
+
+//------------------------------------------------------------------------------
+double ProfilingSession::elapsed() const {
+    const std::vector< Sample > s = samples();
+    cl_ulong start = ~cl_ulong(0);
+    cl_ulong end = 0;
+    for(std::vector< Sample >::const_iterator i = s.begin();
+        i != s.end(); ++i) {
+        if(i->status != CL_COMPLETE) continue;
+        start = std::min(start, i->times.start);
+        end = std::max(end, i->times.end);
+    }
+    return end > start ? double(end - start) / 1E6 : 0;
+}
+
+//------------------------------------------------------------------------------
+void ProfilingSession::report(std::ostream& os) const {
+    const std::vector< Sample > s = samples();
+    std::vector< std::string > labels;
+    size_t errors = 0;
+    for(std::vector< Sample >::const_iterator i = s.begin();
+        i != s.end(); ++i) {
+        if(i->status != CL_COMPLETE) ++errors;
+        if(std::find(labels.begin(), labels.end(), i->label) == labels.end())
+            labels.push_back(i->label);
+    }
+    os << "label, count, min(ms), median(ms), p95(ms), max(ms), total(ms)\n";
+    for(std::vector< std::string >::const_iterator l = labels.begin();
+        l != labels.end(); ++l) {
+        const Stats st = stats(*l);
+        os << *l << ", " << st.count << ", " << st.min << ", " << st.median
+           << ", " << st.p95 << ", " << st.max << ", " << st.total << '\n';
+    }
+    if(errors > 0) os << errors << " commands failed or not profiled\n";
+    os.flush();
+}
+
+//------------------------------------------------------------------------------
+cl_int enqueue_ndrange_profiled(ProfilingSession& session,
+                                cl_command_queue command_queue,
+                                cl_kernel kernel,
+                                cl_uint work_dim,
+                                const size_t *global_work_offset,
+                                const size_t *global_work_size,
+                                const size_t *local_work_size,
+                                cl_uint num_events_in_wait_list,
+                                const cl_event *event_wait_list,
+                                cl_event* event) {
+    cl_event ev;
+    cl_int status = clEnqueueNDRangeKernel(command_queue,
+                                           kernel,
+                                           work_dim,
+                                           global_work_offset,
+                                           global_work_size,
+                                           local_work_size,
+                                           num_events_in_wait_list,
+                                           event_wait_list,
+                                           &ev);
+    if(status != CL_SUCCESS) return status;
+    char name[0x1000] = "";
+    status = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME,
+                             sizeof(name), name, 0);
+    check_cl_error(status, "clGetKernelInfo");
+    session.attach(ev, name);
+    if(event != 0) *event = ev;
+    else check_cl_error(clReleaseEvent(ev), "clReleaseEvent");
+    return CL_SUCCESS;
+}
+
+//------------------------------------------------------------------------------
+CLMultiEnv create_clmultienv(const std::string& platformName,
+                             const std::string& deviceType,
+                             const std::string& deviceNums,
+                             bool enableProfiling,
+                             const char* clSourcePath,
+                             const char* kernelName, 
+                             const std::string& clSourcePrefix,
+                             const std::string& buildOptions) {
+    if(is_fastest_device_type(deviceType)) {
+        std::cerr << "ERROR - create_clmultienv: '" << deviceType
+                  << "' selects a single device, use create_clenv"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    typedef std::vector< cl_device_id > DeviceIDs;
+    const DeviceIDs deviceIDs = get_device_ids(platformName, deviceType);
+    DeviceIDs selected;
+    if(deviceNums == "all") selected = deviceIDs;
+    else {
+        std::istringstream is(deviceNums);
+        std::string n;
+        while(std::getline(is, n, ',')) {
+            const int d = atoi(n.c_str());
+            if(d < 0 || d >= int(deviceIDs.size())) {
+                std::cerr << "ERROR - device number out of range: [0," 
+                          << (deviceIDs.size() - 1) << ']' << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            selected.push_back(deviceIDs[d]);
+        }
+    }
+    CLMultiEnv me;
+    for(DeviceIDs::const_iterator d = selected.begin();
+        d != selected.end(); ++d) {
+        std::cout << "Device " << (d - selected.begin()) << ": "
+                  << get_device_info_string(*d, CL_DEVICE_NAME) << std::endl;
+        me.envs.push_back(init_clenv(create_device_context(*d),
+                                     enableProfiling, clSourcePath,
+                                     kernelName, clSourcePrefix,
+                                     buildOptions));
+    }
+    me.weights.resize(me.envs.size(), 1.0);
+    me.counts.resize(me.envs.size(), 0);
+    me.times.resize(me.envs.size(), 0.0);
+    return me;
+}
+
+//------------------------------------------------------------------------------
+void release_clmultienv(CLMultiEnv& me) {
+    for(std::vector< CLEnv >::iterator e = me.envs.begin();
+        e != me.envs.end(); ++e) release_clenv(*e);
+    me.envs.clear();
+}
+
+//------------------------------------------------------------------------------
+std::vector< size_t > split_range(size_t total,
+                                  size_t granularity,
+                                  const std::vector< double >& weights) {
+    std::vector< size_t > counts(weights.size(), 0);
+    if(weights.empty()) return counts;
+    const double wsum = std::accumulate(weights.begin(), weights.end(), 0.0);
+    const size_t units = total / granularity; //number of granules
+    size_t assigned = 0;
+    for(size_t i = 0; i != weights.size(); ++i) {
+        counts[i] = size_t(units * (weights[i] / wsum)) * granularity;
+        assigned += counts[i];
+    }
+    //distribute granules lost to rounding to the devices with the highest
+    //weight and any remainder smaller than the granularity to the last one
+    const size_t best = std::max_element(weights.begin(), weights.end())
+                        - weights.begin();
+    counts[best] += (units * granularity - assigned);
+    counts.back() += total - units * granularity;
+    return counts;
+}
+
+//------------------------------------------------------------------------------
+double enqueue_split(CLMultiEnv& me,
+                     size_t total,
+                     size_t granularity,
+                     SplitWork& work,
+                     bool adaptive) {
+    me.counts = split_range(total, granularity, me.weights);
+    std::vector< cl_event > events(me.envs.size(), cl_event(0));
+    const double start = wall_time_ms();
+    size_t offset = 0;
+    for(size_t d = 0; d != me.envs.size(); ++d) {
+        if(me.counts[d] > 0) {
+            events[d] = work.enqueue(int(d), me.envs[d], offset, me.counts[d]);
+        }
+        offset += me.counts[d];
+    }
+    //submit to all devices before waiting on any of them
+    for(size_t d = 0; d != me.envs.size(); ++d) {
+        check_cl_error(clFlush(me.envs[d].commandQueue), "clFlush");
+    }
+    for(size_t d = 0; d != me.envs.size(); ++d) {
+        check_cl_error(clFinish(me.envs[d].commandQueue), "clFinish");
+    }
+    const double elapsed = wall_time_ms() - start;
+    for(size_t d = 0; d != me.envs.size(); ++d) {
+        me.times[d] = 0;
+        if(events[d] == 0) continue;
+        cl_ulong s = 0, e = 0;
+        if(clGetEventProfilingInfo(events[d], CL_PROFILING_COMMAND_START,
+                                   sizeof(cl_ulong), &s, 0) == CL_SUCCESS
+           && clGetEventProfilingInfo(events[d], CL_PROFILING_COMMAND_END,
+                                      sizeof(cl_ulong), &e, 0) == CL_SUCCESS) {
+            me.times[d] = double(e - s) / 1E6;
+        }
+        check_cl_error(clReleaseEvent(events[d]), "clReleaseEvent");
+        //new weight = measured throughput (work items per ms); requires
+        //queues created with profiling enabled
+        if(adaptive && me.times[d] > 0) {
+            me.weights[d] = double(me.counts[d]) / me.times[d];
+        }
+    }
+    return elapsed;
+}
+
+//------------------------------------------------------------------------------
+bool CLBufferPool::Key::operator==(const Key& k) const {
+    return type == k.type && flags == k.flags && size == k.size
+           && height == k.height
+           && format.image_channel_order == k.format.image_channel_order
+           && format.image_channel_data_type
+              == k.format.image_channel_data_type;
+}
+
+//------------------------------------------------------------------------------
+CLBufferPool::CLBufferPool(cl_context context, size_t maxBytes)
+    : context_(context), maxBytes_(maxBytes) {
+    const Stats s = {0, 0, 0, 0, 0, 0, 0};
+    stats_ = s;
+    check_cl_error(clRetainContext(context_), "clRetainContext");
+}
+
+//------------------------------------------------------------------------------
+CLBufferPool::~CLBufferPool() {
+    trim(0);
+    for(std::map< cl_mem, Entry >::iterator i = inUse_.begin();
+        i != inUse_.end(); ++i) {
+        check_cl_error(clReleaseMemObject(i->first), "clReleaseMemObject");
+    }
+    check_cl_error(clReleaseContext(context_), "clReleaseContext");
+}
+
+//------------------------------------------------------------------------------
+//four size classes per power of two: 2^k, 1.25 x 2^k, 1.5 x 2^k, 1.75 x 2^k;
+//minimum size 4 KiB
+static size_t size_class(size_t size) {
+    const size_t MIN_SIZE = 0x1000;
+    if(size <= MIN_SIZE) return MIN_SIZE;
+    size_t p = MIN_SIZE;
+    while(2 * p < size) p *= 2;
+    for(size_t q = p + p / 4; q <= 2 * p; q += p / 4) {
+        if(q >= size) return q;
+    }
+    return 2 * p;
+}
+
+//------------------------------------------------------------------------------
+//bytes per pixel of the OpenCL 1.1 and 1.2 image formats, 0 if unknown
+static size_t image_element_size(const cl_image_format& format) {
+    //packed formats: size independent of the channels
+    switch(format.image_channel_data_type) {
+    case CL_UNORM_SHORT_565:
+    case CL_UNORM_SHORT_555: return 2;
+    case CL_UNORM_INT_101010: return 4;
+    default: break;
+    }
+    size_t channels = 1;
+    switch(format.image_channel_order) {
+    case CL_R:
+    case CL_A:
+    case CL_Rx:
+    case CL_INTENSITY:
+    case CL_LUMINANCE: channels = 1; break;
+    case CL_RG:
+    case CL_RA:
+    case CL_RGx: channels = 2; break;
+    case CL_RGB:
+    case CL_RGBx: channels = 3; break;
+    case CL_RGBA:
+    case CL_BGRA:
+    case CL_ARGB: channels = 4; break;
+    default: return 0;
+    }
+    size_t bytes = 4;
+    switch(format.image_channel_data_type) {
+    case CL_SNORM_INT8:
+    case CL_UNORM_INT8:
+    case CL_SIGNED_INT8:
+    case CL_UNSIGNED_INT8: bytes = 1; break;
+    case CL_SNORM_INT16:
+    case CL_UNORM_INT16:
+    case CL_SIGNED_INT16:
+    case CL_UNSIGNED_INT16:
+    case CL_HALF_FLOAT: bytes = 2; break;
+    case CL_SIGNED_INT32:
+    case CL_UNSIGNED_INT32:
+    case CL_FLOAT: bytes = 4; break;
+    default: return 0;
+    }
+    return channels * bytes;
+}
+
+//------------------------------------------------------------------------------
+cl_mem CLBufferPool::acquire(const Key& key, size_t bytes) {
+    ++stats_.requests;
+    for(std::list< Entry >::iterator i = idle_.begin(); i != idle_.end(); ++i) {
+        if(i->key == key) {
+            ++stats_.hits;
+            stats_.bytesHeld -= i->bytes;
+            stats_.bytesInUse += i->bytes;
+            inUse_[i->mem] = *i;
+            cl_mem m = i->mem;
+            idle_.erase(i);
+            return m;
+        }
+    }
+    ++stats_.misses;
+    //make room for the new object
+    if(maxBytes_ > 0 && stats_.bytesHeld + stats_.bytesInUse + bytes
+                        > maxBytes_) {
+        trim(maxBytes_ > bytes ? maxBytes_ - bytes : 0);
+    }
+    cl_int status;
+    Entry e;
+    e.key = key;
+    e.bytes = bytes;
+    if(key.type == CL_MEM_OBJECT_BUFFER) {
+        e.mem = clCreateBuffer(context_, key.flags, key.size, 0, &status);
+        check_cl_error(status, "clCreateBuffer");
+    } else {
+        e.mem = clCreateImage2D(context_, key.flags, &key.format,
+                                key.size, key.height, 0, 0, &status);
+        check_cl_error(status, "clCreateImage2D");
+        //format not known by image_element_size: query the created image
+        if(e.bytes == 0) {
+            size_t elementSize = 0;
+            check_cl_error(clGetImageInfo(e.mem, CL_IMAGE_ELEMENT_SIZE,
+                                          sizeof(size_t), &elementSize, 0),
+                           "clGetImageInfo");
+            e.bytes = key.size * key.height * elementSize;
+            bytes = e.bytes;
+        }
+    }
+    inUse_[e.mem] = e;
+    stats_.bytesInUse += bytes;
+    stats_.peakBytes = std::max(stats_.peakBytes,
+                                stats_.bytesHeld + stats_.bytesInUse);
+    return e.mem;
+}
+
+//------------------------------------------------------------------------------
+static cl_mem_flags pooled_flags(cl_mem_flags flags) {
+    if(flags & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR)) {
+        std::cerr << "ERROR - CLBufferPool: host pointer flags not supported"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return flags;
+}
+
+//------------------------------------------------------------------------------
+cl_mem CLBufferPool::acquire(cl_mem_flags flags, size_t size) {
+    Key k;
+    k.type = CL_MEM_OBJECT_BUFFER;
+    k.flags = pooled_flags(flags);
+    k.size = size_class(size);
+    k.height = 0;
+    k.format.image_channel_order = 0;
+    k.format.image_channel_data_type = 0;
+    return acquire(k, k.size);
+}
+
+//------------------------------------------------------------------------------
+cl_mem CLBufferPool::acquire_image2d(cl_mem_flags flags,
+                                     const cl_image_format& format,
+                                     size_t width,
+                                     size_t height) {
+    Key k;
+    k.type = CL_MEM_OBJECT_IMAGE2D;
+    k.flags = pooled_flags(flags);
+    k.size = width;
+    k.height = height;
+    k.format = format;
+    return acquire(k, width * height * image_element_size(format));
+}
+
+//------------------------------------------------------------------------------
+void CLBufferPool::release(cl_mem m) {
+    std::map< cl_mem, Entry >::iterator i = inUse_.find(m);
+    if(i == inUse_.end()) {
+        std::cerr << "ERROR - CLBufferPool: memory object not from pool"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    stats_.bytesInUse -= i->second.bytes;
+    stats_.bytesHeld += i->second.bytes;
+    idle_.push_front(i->second);
+    inUse_.erase(i);
+    if(maxBytes_ > 0) trim(maxBytes_);
+}
+
+//------------------------------------------------------------------------------
+void CLBufferPool::trim(size_t maxBytes) {
+    while(!idle_.empty() && stats_.bytesHeld + stats_.bytesInUse > maxBytes) {
+        const Entry& e = idle_.back();
+        check_cl_error(clReleaseMemObject(e.mem), "clReleaseMemObject");
+        stats_.bytesHeld -= e.bytes;
+        ++stats_.trimmed;
+        idle_.pop_back();
+    }
+}
+
+//------------------------------------------------------------------------------
+void CLBufferPool::report(std::ostream& os) const {
+    os << "Buffer pool: " << stats_.requests << " requests, "
+       << stats_.hits << " hits ("
+       << (stats_.requests > 0 ? 100.0 * stats_.hits / stats_.requests : 0.0)
+       << "%), " << stats_.misses << " misses, " << stats_.trimmed
+       << " trimmed\n"
+       << "             " << stats_.bytesHeld << " bytes held, "
+       << stats_.bytesInUse << " bytes in use, " << stats_.peakBytes
+       << " bytes peak" << std::endl;
+}
+
+//------------------------------------------------------------------------------
+int TuneConfig::value(const std::string& name, int defaultValue) const {
+    for(std::vector< std::pair< std::string, int > >::const_iterator i =
+        defines.begin(); i != defines.end(); ++i) {
+        if(i->first == name) return i->second;
+    }
+    return defaultValue;
+}
+
+//------------------------------------------------------------------------------
+std::string TuneConfig::prefix() const {
+    std::ostringstream os;
+    for(std::vector< std::pair< std::string, int > >::const_iterator i =
+        defines.begin(); i != defines.end(); ++i) {
+        os << "#define " << i->first << ' ' << i->second << '\n';
+    }
+    return os.str();
+}
+
+//------------------------------------------------------------------------------
+//times one candidate; returns a negative value if the launch fails e.g.
+//because of insufficient resources
+static double time_candidate(const CLEnv& clenv,
+                             cl_kernel kernel,
+                             const TuneConfig& cfg,
+                             const size_t globalWorkSize[3],
+                             int repetitions) {
+    ProfilingSession session;
+    for(int r = 0; r <= repetitions; ++r) {
+        cl_event ev;
+        cl_int status = clEnqueueNDRangeKernel(clenv.commandQueue, kernel,
+                                               cfg.dims, 0, globalWorkSize,
+                                               cfg.local, 0, 0, &ev);
+        if(status != CL_SUCCESS) {
+            clFinish(clenv.commandQueue);
+            return -1;
+        }
+        //first launch is a warm-up
+        session.attach(ev, r == 0 ? "warm-up" : "candidate");
+        check_cl_error(clReleaseEvent(ev), "clReleaseEvent");
+    }
+    //callbacks are not invoked for commands that are never submitted
+    check_cl_error(clFlush(clenv.commandQueue), "clFlush");
+    session.wait();
+    const std::vector< ProfilingSession::Sample > s = session.samples();
+    for(std::vector< ProfilingSession::Sample >::const_iterator i = s.begin();
+        i != s.end(); ++i) {
+        if(i->status != CL_COMPLETE) return -1;
+    }
+    return session.stats("candidate").median;
+}
+
+//------------------------------------------------------------------------------
+TuneConfig autotune(const CLEnv& clenv,
+                    const char* clSourcePath,
+                    const char* kernelName,
+                    const std::string& clSourcePrefix,
+                    const std::string& buildOptions,
+                    const std::vector< TuneParam >& params,
+                    cl_uint dims,
+                    Tunable& tunable,
+                    int repetitions) {
+    const cl_device_id deviceID = get_device_id(clenv.context);
+    //the work item sizes buffer must hold one value per device dimension
+    cl_uint maxDims = 0;
+    cl_int status = clGetDeviceInfo(deviceID,
+                                    CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS,
+                                    sizeof(cl_uint), &maxDims, 0);
+    check_cl_error(status,
+                   "clGetDeviceInfo(CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS)");
+    std::vector< size_t > maxItemSizes(std::max(maxDims, cl_uint(3)), 1);
+    status = clGetDeviceInfo(deviceID, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+                             sizeof(size_t) * maxDims, &maxItemSizes[0], 0);
+    check_cl_error(status, "clGetDeviceInfo(CL_DEVICE_MAX_WORK_ITEM_SIZES)");
+    const std::string source = load_text(clSourcePath);
+    TuneConfig best;
+    best.dims = 0;
+    best.time = -1;
+    //iterate over all the combinations of define values: the i-th
+    //combination selects value (i / stride) % count for each param
+    size_t combinations = 1;
+    for(size_t p = 0; p != params.size(); ++p) {
+        combinations *= params[p].values.size();
+    }
+    for(size_t c = 0; c != combinations; ++c) {
+        TuneConfig cfg;
+        cfg.dims = dims;
+        cfg.time = -1;
+        size_t stride = 1;
+        for(size_t p = 0; p != params.size(); ++p) {
+            const size_t n = params[p].values.size();
+            cfg.defines.push_back(std::make_pair(params[p].name,
+                                  params[p].values[(c / stride) % n]));
+            stride *= n;
+        }
+        if(!tunable.accept(cfg)) continue;
+        //candidates which fail to compile, e.g. because they exceed the
+        //local memory size, are skipped
+        cl_program program = try_build_program(clenv.context, deviceID,
+                                               cfg.prefix() + clSourcePrefix
+                                               + "\n" + source, buildOptions);
+        if(program == 0) {
+            std::cout << "Autotune: " << kernelName;
+            for(size_t i = 0; i != cfg.defines.size(); ++i) {
+                std::cout << ' ' << cfg.defines[i].first << '='
+                          << cfg.defines[i].second;
+            }
+            std::cout << ": build failed, skipped" << std::endl;
+            continue;
+        }
+        cl_kernel kernel = clCreateKernel(program, kernelName, &status);
+        check_cl_error(status, "clCreateKernel");
+        size_t maxGroupSize = 0;
+        status = clGetKernelWorkGroupInfo(kernel, deviceID,
+                                          CL_KERNEL_WORK_GROUP_SIZE,
+                                          sizeof(size_t), &maxGroupSize, 0);
+        check_cl_error(status, "clGetKernelWorkGroupInfo");
+        //enumerate power of two local sizes
+        size_t local[3] = {1, 1, 1};
+        while(true) {
+            size_t groupSize = 1;
+            for(cl_uint d = 0; d != dims; ++d) groupSize *= local[d];
+            if(groupSize <= maxGroupSize) {
+                std::copy(local, local + 3, cfg.local);
+                size_t globalWorkSize[3] = {1, 1, 1};
+                if(tunable.configure(kernel, cfg, globalWorkSize)) {
+                    cfg.time = time_candidate(clenv, kernel, cfg,
+                                              globalWorkSize, repetitions);
+                    if(cfg.time >= 0) {
+                        std::cout << "Autotune: " << kernelName;
+                        for(size_t i = 0; i != cfg.defines.size(); ++i) {
+                            std::cout << ' ' << cfg.defines[i].first << '='
+                                      << cfg.defines[i].second;
+                        }
+                        std::cout << " local=" << cfg.local[0];
+                        for(cl_uint d = 1; d != dims; ++d) {
+                            std::cout << 'x' << cfg.local[d];
+                        }
+                        std::cout << ": " << cfg.time << " ms" << std::endl;
+                    }
+                    if(cfg.time >= 0 && (best.time < 0 || cfg.time < best.time))
+                        best = cfg;
+                }
+            }
+            //next local size
+            cl_uint d = 0;
+            for(; d != dims; ++d) {
+                local[d] *= 2;
+                if(local[d] <= std::min(maxItemSizes[d], maxGroupSize)) break;
+                local[d] = 1;
+            }
+            if(d == dims) break;
+        }
+        check_cl_error(clReleaseKernel(kernel), "clReleaseKernel");
+        check_cl_error(clReleaseProgram(program), "clReleaseProgram");
+    }
+    if(best.time < 0) {
+        std::cerr << "ERROR - autotune: no valid configuration found for "
+                  << kernelName << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return best;
+}
+
+//------------------------------------------------------------------------------
+static std::string tune_db_path() {
+    const char* path = getenv("CLUTIL_TUNE_DB");
+    if(path != 0) return path;
+    const char* home = getenv("HOME");
+    return std::string(home != 0 ? home : ".") + "/.clutil-tune.db";
+}
+
+//------------------------------------------------------------------------------
+//database line format, tab separated:
+//<device key> <kernel key> <shape> <dims> <local sizes> <defines> <time>
+//where local sizes are 'x' separated and defines are NAME=value pairs
+//separated by ','
+static std::string tune_db_entry_key(const std::string& deviceKey,
+                                     const std::string& kernelKey,
+                                     const std::string& shape) {
+    return deviceKey + '\t' + kernelKey + '\t' + shape + '\t';
+}
+
+//------------------------------------------------------------------------------
+bool tune_db_lookup(const std::string& deviceKey,
+                    const std::string& kernelKey,
+                    const std::string& shape,
+                    TuneConfig& cfg) {
+    std::ifstream is(tune_db_path().c_str());
+    const std::string key = tune_db_entry_key(deviceKey, kernelKey, shape);
+    std::string line;
+    while(std::getline(is, line)) {
+        if(line.compare(0, key.size(), key) != 0) continue;
+        std::istringstream fields(line.substr(key.size()));
+        std::string local, defines;
+        TuneConfig c;
+        if(!(fields >> c.dims >> local >> defines >> c.time)) continue;
+        std::fill(c.local, c.local + 3, size_t(1));
+        std::istringstream ls(local);
+        std::string v;
+        for(cl_uint d = 0; d != c.dims && std::getline(ls, v, 'x'); ++d) {
+            c.local[d] = strtoul(v.c_str(), 0, 10);
+        }
+        std::istringstream ds(defines);
+        while(std::getline(ds, v, ',')) {
+            const size_t eq = v.find('=');
+            if(eq == std::string::npos) continue;
+            c.defines.push_back(std::make_pair(v.substr(0, eq),
+                                               atoi(v.c_str() + eq + 1)));
+        }
+        cfg = c;
+        return true;
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+void tune_db_store(const std::string& deviceKey,
+                   const std::string& kernelKey,
+                   const std::string& shape,
+                   const TuneConfig& cfg) {
+    const std::string path = tune_db_path();
+    const std::string key = tune_db_entry_key(deviceKey, kernelKey, shape);
+    //copy all other entries and replace the one matching key
+    std::vector< std::string > lines;
+    std::ifstream is(path.c_str());
+    std::string line;
+    while(std::getline(is, line)) {
+        if(line.compare(0, key.size(), key) != 0) lines.push_back(line);
+    }
+    is.close();
+    std::ostringstream entry;
+    entry << key << cfg.dims << '\t' << cfg.local[0];
+    for(cl_uint d = 1; d < cfg.dims; ++d) entry << 'x' << cfg.local[d];
+    entry << '\t';
+    for(size_t i = 0; i != cfg.defines.size(); ++i) {
+        entry << (i > 0 ? "," : "") << cfg.defines[i].first << '='
+              << cfg.defines[i].second;
+    }
+    //empty define list
+    if(cfg.defines.empty()) entry << '-';
+    entry << '\t' << cfg.time;
+    lines.push_back(entry.str());
+    std::ostringstream tmp;
+    tmp << path << '.' << getpid();
+    std::ofstream os(tmp.str().c_str());
+    for(std::vector< std::string >::const_iterator i = lines.begin();
+        i != lines.end(); ++i) os << *i << '\n';
+    os.close();
+    if(!os || rename(tmp.str().c_str(), path.c_str()) != 0) {
+        std::cerr << "WARNING - cannot write tuning database " << path
+                  << std::endl;
+        remove(tmp.str().c_str());
+    }
+}
+
+//------------------------------------------------------------------------------
+TuneConfig get_tuned_config(const CLEnv& clenv,
+                            const char* clSourcePath,
+                            const char* kernelName,
+                            const std::string& clSourcePrefix,
+                            const std::string& buildOptions,
+                            const std::vector< TuneParam >& params,
+                            cl_uint dims,
+                            const std::string& shape,
+                            Tunable& tunable) {
+    const std::string deviceKey = get_device_key(get_device_id(clenv.context));
+    //kernel key includes the source code, prefix, options and tuning
+    //parameters: any change triggers a new tuning run
+    std::ostringstream space;
+    for(size_t p = 0; p != params.size(); ++p) {
+        space << params[p].name << ':';
+        for(size_t v = 0; v != params[p].values.size(); ++v) {
+            space << params[p].values[v] << ' ';
+        }
+    }
+    const std::string kernelKey = std::string(kernelName) + '|'
+                                  + hash_text(load_text(clSourcePath) + '\n'
+                                              + clSourcePrefix + '\n'
+                                              + buildOptions + '\n'
+                                              + space.str());
+    TuneConfig cfg;
+    if(tune_db_lookup(deviceKey, kernelKey, shape, cfg)) {
+        std::cout << "Autotune: using stored configuration for " << kernelName
+                  << ' ' << shape << std::endl;
+        return cfg;
+    }
+    cfg = autotune(clenv, clSourcePath, kernelName, clSourcePrefix,
+                   buildOptions, params, dims, tunable);
+    tune_db_store(deviceKey, kernelKey, shape, cfg);
+    return cfg;
+}
+
+//------------------------------------------------------------------------------
+//command tracing
+//------------------------------------------------------------------------------
+static cl_ulong monotonic_time_ns() {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return cl_ulong(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+namespace {
+//recorded command or host span; for host spans queue is -1 and the
+//start and end fields hold host times
+struct TraceRecord {
+    std::string name;
+    int queue;
+    int thread;
+    cl_ulong hostEnqueued; //host time right after the enqueue call
+    CLEventTimes times;
+};
+
+struct TraceQueue {
+    int id;
+    std::string device;
+};
+
+struct Tracer {
+    std::string path;
+    pthread_mutex_t mutex;
+    pthread_cond_t completed;
+    size_t pending;
+    std::vector< TraceRecord > records;
+    std::map< cl_command_queue, TraceQueue > queues;
+    std::map< pthread_t, int > threads;
+};
+
+Tracer* tracer = 0;
+pthread_once_t tracerOnce = PTHREAD_ONCE_INIT;
+}
+
+//------------------------------------------------------------------------------
+//returns a small integer identifying the calling thread; must be called
+//with the tracer mutex locked
+static int trace_thread_id() {
+    std::map< pthread_t, int >::iterator i = tracer->threads.find(pthread_self());
+    if(i != tracer->threads.end()) return i->second;
+    const int id = int(tracer->threads.size());
+    tracer->threads[pthread_self()] = id;
+    return id;
+}
+
+//------------------------------------------------------------------------------
+static void json_escape(std::ostream& os, const std::string& s) {
+    for(std::string::const_iterator c = s.begin(); c != s.end(); ++c) {
+        if(*c == '"' || *c == '\\') os << '\\' << *c;
+        else if(*c == '\n') os << "\\n";
+        else if((unsigned char)(*c) >= 0x20) os << *c;
+    }
+}
+
+//------------------------------------------------------------------------------
+//writes the trace at exit; device timestamps are converted to host time with
+//a per-queue offset estimated as the minimum over all the commands of
+//(host time after enqueue - QUEUED timestamp)
+static void write_trace() {
+    pthread_mutex_lock(&tracer->mutex);
+    //do not hang at exit if the runtime never completes some commands
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 10;
+    while(tracer->pending > 0) {
+        if(pthread_cond_timedwait(&tracer->completed, &tracer->mutex,
+                                  &deadline) != 0) break;
+    }
+    const std::vector< TraceRecord >& records = tracer->records;
+    std::map< int, cl_long > offsets;
+    cl_ulong origin = ~cl_ulong(0);
+    for(std::vector< TraceRecord >::const_iterator r = records.begin();
+        r != records.end(); ++r) {
+        if(r->queue < 0) {
+            origin = std::min(origin, r->times.start);
+            continue;
+        }
+        const cl_long offset = cl_long(r->hostEnqueued - r->times.queued);
+        if(offsets.find(r->queue) == offsets.end()
+           || offset < offsets[r->queue]) offsets[r->queue] = offset;
+    }
+    for(std::vector< TraceRecord >::const_iterator r = records.begin();
+        r != records.end(); ++r) {
+        if(r->queue >= 0) origin = std::min(origin,
+                                   cl_ulong(r->times.queued + offsets[r->queue]));
+    }
+    std::ofstream os(tracer->path.c_str());
+    os << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    os << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, "
+          "\"args\": {\"name\": \"host\"}},\n";
+    os << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+          "\"args\": {\"name\": \"OpenCL queues\"}}";
+    for(std::map< cl_command_queue, TraceQueue >::const_iterator q =
+        tracer->queues.begin(); q != tracer->queues.end(); ++q) {
+        os << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+           << "\"tid\": " << q->second.id << ", \"args\": {\"name\": \"queue "
+           << q->second.id << " - ";
+        json_escape(os, q->second.device);
+        os << "\"}}";
+    }
+    os.setf(std::ios::fixed);
+    os.precision(3);
+    for(std::vector< TraceRecord >::const_iterator r = records.begin();
+        r != records.end(); ++r) {
+        //microseconds relative to the first recorded event
+        const cl_long offset = r->queue < 0 ? 0 : offsets[r->queue];
+        const double ts = double(cl_long(r->times.start + offset - origin)) / 1E3;
+        const double dur = double(r->times.end - r->times.start) / 1E3;
+        os << ",\n{\"name\": \"";
+        json_escape(os, r->name);
+        os << "\", \"cat\": \"" << (r->queue < 0 ? "host" : "command")
+           << "\", \"ph\": \"X\", \"pid\": " << (r->queue < 0 ? 0 : 1)
+           << ", \"tid\": " << (r->queue < 0 ? r->thread : r->queue)
+           << ", \"ts\": " << ts << ", \"dur\": " << dur;
+        if(r->queue >= 0) {
+            os << ", \"args\": {\"queued_to_start_us\": "
+               << double(r->times.start - r->times.queued) / 1E3
+               << ", \"submit_to_start_us\": "
+               << double(r->times.start - r->times.submit) / 1E3
+               << ", \"host_thread\": " << r->thread << '}';
+        }
+        os << '}';
+    }
+    os << "\n]}\n";
+    os.close();
+    if(!os) std::cerr << "WARNING - cannot write trace file " << tracer->path
+                      << std::endl;
+    else std::cout << "Trace: " << records.size() << " events written to "
+                   << tracer->path << std::endl;
+    pthread_mutex_unlock(&tracer->mutex);
+}
+
+//------------------------------------------------------------------------------
+static void init_tracer() {
+    const char* path = getenv("CLUTIL_TRACE");
+    if(path == 0 || *path == '\0') return;
+#ifdef CLUTIL_ENABLE_TRACE
+    tracer = new Tracer;
+    tracer->path = path;
+    pthread_mutex_init(&tracer->mutex, 0);
+    pthread_cond_init(&tracer->completed, 0);
+    tracer->pending = 0;
+    atexit(write_trace);
+#else
+    std::cerr << "WARNING - CLUTIL_TRACE ignored: clutil.cpp compiled without"
+                 " -DCLUTIL_ENABLE_TRACE" << std::endl;
+#endif
+}
+
+//------------------------------------------------------------------------------
+bool trace_enabled() {
+    pthread_once(&tracerOnce, init_tracer);
+    return tracer != 0;
+}
+
+//------------------------------------------------------------------------------
+void trace_host_span(const std::string& name,
+                     cl_ulong startNs,
+                     cl_ulong endNs) {
+    if(!trace_enabled()) return;
+    TraceRecord r;
+    r.name = name;
+    r.queue = -1;
+    r.hostEnqueued = startNs;
+    r.times.queued = startNs;
+    r.times.submit = startNs;
+    r.times.start = startNs;
+    r.times.end = endNs;
+    pthread_mutex_lock(&tracer->mutex);
+    r.thread = trace_thread_id();
+    tracer->records.push_back(r);
+    pthread_mutex_unlock(&tracer->mutex);
+}
+
+//------------------------------------------------------------------------------
+TraceSpan::TraceSpan(const std::string& name)
+    : name_(name), start_(monotonic_time_ns()) {}
+
+//------------------------------------------------------------------------------
+TraceSpan::~TraceSpan() {
+    trace_host_span(name_, start_, monotonic_time_ns());
+}
+
+#ifdef CLUTIL_ENABLE_TRACE
+//------------------------------------------------------------------------------
+static void CL_CALLBACK trace_event_callback(cl_event ev,
+                                             cl_int status,
+                                             void* data) {
+    TraceRecord* r = static_cast< TraceRecord* >(data);
+    //commands on queues created without profiling (e.g. through OpenCL 2.0
+    //functions not interposed) have no timestamps and are dropped
+    const bool valid = status == CL_COMPLETE
+                       && clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_QUEUED,
+                              sizeof(cl_ulong), &r->times.queued, 0) == CL_SUCCESS
+                       && clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_SUBMIT,
+                              sizeof(cl_ulong), &r->times.submit, 0) == CL_SUCCESS
+                       && clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START,
+                              sizeof(cl_ulong), &r->times.start, 0) == CL_SUCCESS
+                       && clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END,
+                              sizeof(cl_ulong), &r->times.end, 0) == CL_SUCCESS;
+    clReleaseEvent(ev);
+    pthread_mutex_lock(&tracer->mutex);
+    if(valid) tracer->records.push_back(*r);
+    --tracer->pending;
+    pthread_cond_broadcast(&tracer->completed);
+    pthread_mutex_unlock(&tracer->mutex);
+    delete r;
+}
+
+//------------------------------------------------------------------------------
+//records the command associated with ev; if the caller did not request
+//the event (userEvent == NULL) the event is owned by the tracer
+static void trace_command(const std::string& name,
+                          cl_command_queue queue,
+                          cl_event ev,
+                          cl_event* userEvent) {
+    TraceRecord* r = new TraceRecord;
+    r->name = name;
+    r->hostEnqueued = monotonic_time_ns();
+    if(userEvent != 0) clRetainEvent(ev);
+    pthread_mutex_lock(&tracer->mutex);
+    std::map< cl_command_queue, TraceQueue >::iterator q =
+        tracer->queues.find(queue);
+    if(q == tracer->queues.end()) {
+        TraceQueue tq;
+        tq.id = int(tracer->queues.size());
+        cl_device_id deviceID = 0;
+        if(clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(cl_device_id),
+                                 &deviceID, 0) == CL_SUCCESS) {
+            tq.device = get_device_info_string(deviceID, CL_DEVICE_NAME);
+        }
+        q = tracer->queues.insert(std::make_pair(queue, tq)).first;
+    }
+    r->queue = q->second.id;
+    r->thread = trace_thread_id();
+    ++tracer->pending;
+    pthread_mutex_unlock(&tracer->mutex);
+    if(clSetEventCallback(ev, CL_COMPLETE, trace_event_callback, r)
+       != CL_SUCCESS) {
+        clReleaseEvent(ev);
+        pthread_mutex_lock(&tracer->mutex);
+        --tracer->pending;
+        pthread_mutex_unlock(&tracer->mutex);
+        delete r;
+    }
+}
+
+//------------------------------------------------------------------------------
+//returns the function with the same name in the next library in search
+//order i.e. the OpenCL implementation
+static void* next_cl_function(const char* name) {
+    void* f = dlsym(RTLD_NEXT, name);
+    if(f == 0) {
+        std::cerr << "ERROR - cannot find OpenCL function " << name
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return f;
+}
+
+//lookup is performed once per function
+#define NEXT_CL_FUNCTION(name, type) \
+    static type next_##name = 0; \
+    if(next_##name == 0) \
+        next_##name = reinterpret_cast< type >(next_cl_function(#name))
+
+//------------------------------------------------------------------------------
+//interposed OpenCL functions: when tracing is enabled an event is always
+//requested from the implementation
+//------------------------------------------------------------------------------
+CL_API_ENTRY cl_command_queue CL_API_CALL
+clCreateCommandQueue(cl_context context,
+                     cl_device_id device,
+                     cl_command_queue_properties properties,
+                     cl_int* errcode_ret) {
+    typedef cl_command_queue (CL_API_CALL *F)(cl_context, cl_device_id,
+                                              cl_command_queue_properties,
+                                              cl_int*);
+    NEXT_CL_FUNCTION(clCreateCommandQueue, F);
+    if(trace_enabled()) properties |= CL_QUEUE_PROFILING_ENABLE;
+    return next_clCreateCommandQueue(context, device, properties, errcode_ret);
+}
+
+//------------------------------------------------------------------------------
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueNDRangeKernel(cl_command_queue command_queue,
+                       cl_kernel kernel,
+                       cl_uint work_dim,
+                       const size_t* global_work_offset,
+                       const size_t* global_work_size,
+                       const size_t* local_work_size,
+                       cl_uint num_events_in_wait_list,
+                       const cl_event* event_wait_list,
+                       cl_event* event) {
+    typedef cl_int (CL_API_CALL *F)(cl_command_queue, cl_kernel, cl_uint,
+                                    const size_t*, const size_t*,
+                                    const size_t*, cl_uint, const cl_event*,
+                                    cl_event*);
+    NEXT_CL_FUNCTION(clEnqueueNDRangeKernel, F);
+    if(!trace_enabled()) {
+        return next_clEnqueueNDRangeKernel(command_queue, kernel, work_dim,
+                                           global_work_offset,
+                                           global_work_size, local_work_size,
+                                           num_events_in_wait_list,
+                                           event_wait_list, event);
+    }
+    cl_event ev = 0;
+    const cl_int status = next_clEnqueueNDRangeKernel(command_queue, kernel,
+                                           work_dim, global_work_offset,
+                                           global_work_size, local_work_size,
+                                           num_events_in_wait_list,
+                                           event_wait_list, &ev);
+    if(status != CL_SUCCESS) return status;
+    char name[256] = "";
+    clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name), name, 0);
+    trace_command(name, command_queue, ev, event);
+    if(event != 0) *event = ev;
+    return status;
+}
+
+//------------------------------------------------------------------------------
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueReadBuffer(cl_command_queue command_queue,
+                    cl_mem buffer,
+                    cl_bool blocking_read,
+                    size_t offset,
+                    size_t cb,
+                    void* ptr,
+                    cl_uint num_events_in_wait_list,
+                    const cl_event* event_wait_list,
+                    cl_event* event) {
+    typedef cl_int (CL_API_CALL *F)(cl_command_queue, cl_mem, cl_bool,
+                                    size_t, size_t, void*, cl_uint,
+                                    const cl_event*, cl_event*);
+    NEXT_CL_FUNCTION(clEnqueueReadBuffer, F);
+    if(!trace_enabled()) {
+        return next_clEnqueueReadBuffer(command_queue, buffer, blocking_read,
+                                        offset, cb, ptr,
+                                        num_events_in_wait_list,
+                                        event_wait_list, event);
+    }
+    cl_event ev = 0;
+    const cl_int status = next_clEnqueueReadBuffer(command_queue, buffer,
+                                                   blocking_read, offset, cb,
+                                                   ptr, num_events_in_wait_list,
+                                                   event_wait_list, &ev);
+    if(status != CL_SUCCESS) return status;
+    trace_command("read buffer", command_queue, ev, event);
+    if(event != 0) *event = ev;
+    return status;
+}
+
+//------------------------------------------------------------------------------
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueWriteBuffer(cl_command_queue command_queue,
+                     cl_mem buffer,
+                     cl_bool blocking_write,
+                     size_t offset,
+                     size_t cb,
+                     const void* ptr,
+                     cl_uint num_events_in_wait_list,
+                     const cl_event* event_wait_list,
+                     cl_event* event) {
+    typedef cl_int (CL_API_CALL *F)(cl_command_queue, cl_mem, cl_bool,
+                                    size_t, size_t, const void*, cl_uint,
+                                    const cl_event*, cl_event*);
+    NEXT_CL_FUNCTION(clEnqueueWriteBuffer, F);
+    if(!trace_enabled()) {
+        return next_clEnqueueWriteBuffer(command_queue, buffer, blocking_write,
+                                         offset, cb, ptr,
+                                         num_events_in_wait_list,
+                                         event_wait_list, event);
+    }
+    cl_event ev = 0;
+    const cl_int status = next_clEnqueueWriteBuffer(command_queue, buffer,
+                                                    blocking_write, offset, cb,
+                                                    ptr,
+                                                    num_events_in_wait_list,
+                                                    event_wait_list, &ev);
+    if(status != CL_SUCCESS) return status;
+    trace_command("write buffer", command_queue, ev, event);
+    if(event != 0) *event = ev;
+    return status;
+}
+
+//------------------------------------------------------------------------------
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueReadImage(cl_command_queue command_queue,
+                   cl_mem image,
+                   cl_bool blocking_read,
+                   const size_t* origin,
+                   const size_t* region,
+                   size_t row_pitch,
+                   size_t slice_pitch,
+                   void* ptr,
+                   cl_uint num_events_in_wait_list,
+                   const cl_event* event_wait_list,
+                   cl_event* event) {
+    typedef cl_int (CL_API_CALL *F)(cl_command_queue, cl_mem, cl_bool,
+                                    const size_t*, const size_t*, size_t,
+                                    size_t, void*, cl_uint, const cl_event*,
+                                    cl_event*);
+    NEXT_CL_FUNCTION(clEnqueueReadImage, F);
+    if(!trace_enabled()) {
+        return next_clEnqueueReadImage(command_queue, image, blocking_read,
+                                       origin, region, row_pitch, slice_pitch,
+                                       ptr, num_events_in_wait_list,
+                                       event_wait_list, event);
+    }
+    cl_event ev = 0;
+    const cl_int status = next_clEnqueueReadImage(command_queue, image,
+                                                  blocking_read, origin,
+                                                  region, row_pitch,
+                                                  slice_pitch, ptr,
+                                                  num_events_in_wait_list,
+                                                  event_wait_list, &ev);
+    if(status != CL_SUCCESS) return status;
+    trace_command("read image", command_queue, ev, event);
+    if(event != 0) *event = ev;
+    return status;
+}
+
+//------------------------------------------------------------------------------
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueWriteImage(cl_command_queue command_queue,
+                    cl_mem image,
+                    cl_bool blocking_write,
+                    const size_t* origin,
+                    const size_t* region,
+                    size_t input_row_pitch,
+                    size_t input_slice_pitch,
+                    const void* ptr,
+                    cl_uint num_events_in_wait_list,
+                    const cl_event* event_wait_list,
+                    cl_event* event) {
+    typedef cl_int (CL_API_CALL *F)(cl_command_queue, cl_mem, cl_bool,
+                                    const size_t*, const size_t*, size_t,
+                                    size_t, const void*, cl_uint,
+                                    const cl_event*, cl_event*);
+    NEXT_CL_FUNCTION(clEnqueueWriteImage, F);
+    if(!trace_enabled()) {
+        return next_clEnqueueWriteImage(command_queue, image, blocking_write,
+                                        origin, region, input_row_pitch,
+                                        input_slice_pitch, ptr,
+                                        num_events_in_wait_list,
+                                        event_wait_list, event);
+    }
+    cl_event ev = 0;
+    const cl_int status = next_clEnqueueWriteImage(command_queue, image,
+                                                   blocking_write, origin,
+                                                   region, input_row_pitch,
+                                                   input_slice_pitch, ptr,
+                                                   num_events_in_wait_list,
+                                                   event_wait_list, &ev);
+    if(status != CL_SUCCESS) return status;
+    trace_command("write image", command_queue, ev, event);
+    if(event != 0) *event = ev;
+    return status;
+}
+
+//------------------------------------------------------------------------------
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueCopyBuffer(cl_command_queue command_queue,
+                    cl_mem src_buffer,
+                    cl_mem dst_buffer,
+                    size_t src_offset,
+                    size_t dst_offset,
+                    size_t cb,
+                    cl_uint num_events_in_wait_list,
+                    const cl_event* event_wait_list,
+                    cl_event* event) {
+    typedef cl_int (CL_API_CALL *F)(cl_command_queue, cl_mem, cl_mem, size_t,
+                                    size_t, size_t, cl_uint, const cl_event*,
+                                    cl_event*);
+    NEXT_CL_FUNCTION(clEnqueueCopyBuffer, F);
+    if(!trace_enabled()) {
+        return next_clEnqueueCopyBuffer(command_queue, src_buffer, dst_buffer,
+                                        src_offset, dst_offset, cb,
+                                        num_events_in_wait_list,
+                                        event_wait_list, event);
+    }
+    cl_event ev = 0;
+    const cl_int status = next_clEnqueueCopyBuffer(command_queue, src_buffer,
+                                                   dst_buffer, src_offset,
+                                                   dst_offset, cb,
+                                                   num_events_in_wait_list,
+                                                   event_wait_list, &ev);
+    if(status != CL_SUCCESS) return status;
+    trace_command("copy buffer", command_queue, ev, event);
+    if(event != 0) *event = ev;
+    return status;
+}
+
+//------------------------------------------------------------------------------
+CL_API_ENTRY void* CL_API_CALL
+clEnqueueMapBuffer(cl_command_queue command_queue,
+                   cl_mem buffer,
+                   cl_bool blocking_map,
+                   cl_map_flags map_flags,
+                   size_t offset,
+                   size_t cb,
+                   cl_uint num_events_in_wait_list,
+                   const cl_event* event_wait_list,
+                   cl_event* event,
+                   cl_int* errcode_ret) {
+    typedef void* (CL_API_CALL *F)(cl_command_queue, cl_mem, cl_bool,
+                                   cl_map_flags, size_t, size_t, cl_uint,
+                                   const cl_event*, cl_event*, cl_int*);
+    NEXT_CL_FUNCTION(clEnqueueMapBuffer, F);
+    if(!trace_enabled()) {
+        return next_clEnqueueMapBuffer(command_queue, buffer, blocking_map,
+                                       map_flags, offset, cb,
+                                       num_events_in_wait_list,
+                                       event_wait_list, event, errcode_ret);
+    }
+    cl_event ev = 0;
+    cl_int status = CL_SUCCESS;
+    void* p = next_clEnqueueMapBuffer(command_queue, buffer, blocking_map,
+                                      map_flags, offset, cb,
+                                      num_events_in_wait_list,
+                                      event_wait_list, &ev, &status);
+    if(errcode_ret != 0) *errcode_ret = status;
+    if(status != CL_SUCCESS) return p;
+    trace_command("map buffer", command_queue, ev, event);
+    if(event != 0) *event = ev;
+    return p;
+}
+
+//------------------------------------------------------------------------------
+CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueUnmapMemObject(cl_command_queue command_queue,
+                        cl_mem memobj,
+                        void* mapped_ptr,
+                        cl_uint num_events_in_wait_list,
+                        const cl_event* event_wait_list,
+                        cl_event* event) {
+    typedef cl_int (CL_API_CALL *F)(cl_command_queue, cl_mem, void*, cl_uint,
+                                    const cl_event*, cl_event*);
+    NEXT_CL_FUNCTION(clEnqueueUnmapMemObject, F);
+    if(!trace_enabled()) {
+        return next_clEnqueueUnmapMemObject(command_queue, memobj, mapped_ptr,
+                                            num_events_in_wait_list,
+                                            event_wait_list, event);
+    }
+    cl_event ev = 0;
+    const cl_int status = next_clEnqueueUnmapMemObject(command_queue, memobj,
+                                                 mapped_ptr,
+                                                 num_events_in_wait_list,
+                                                 event_wait_list, &ev);
+    if(status != CL_SUCCESS) return status;
+    trace_command("unmap", command_queue, ev, event);
+    if(event != 0) *event = ev;
+    return status;
+}
+
+//------------------------------------------------------------------------------
+CL_API_ENTRY cl_int CL_API_CALL
+clFinish(cl_command_queue command_queue) {
+    typedef cl_int (CL_API_CALL *F)(cl_command_queue);
+    NEXT_CL_FUNCTION(clFinish, F);
+    if(!trace_enabled()) return next_clFinish(command_queue);
+    TraceSpan span("clFinish");
+    return next_clFinish(command_queue);
+}
+
+//------------------------------------------------------------------------------
+CL_API_ENTRY cl_int CL_API_CALL
+clWaitForEvents(cl_uint num_events,
+                const cl_event* event_list) {
+    typedef cl_int (CL_API_CALL *F)(cl_uint, const cl_event*);
+    NEXT_CL_FUNCTION(clWaitForEvents, F);
+    if(!trace_enabled()) return next_clWaitForEvents(num_events, event_list);
+    TraceSpan span("clWaitForEvents");
+    return next_clWaitForEvents(num_events, event_list);
+}
+#endif
+
+//------------------------------------------------------------------------------
+//task graph
+//------------------------------------------------------------------------------
+TaskGraph::TaskGraph(const CLEnv& clenv)
+    : clenv_(clenv), submitted_(false), completed_(false), submitTime_(0) {
+    pthread_mutex_init(&mutex_, 0);
+}
+
+//------------------------------------------------------------------------------
+TaskGraph::~TaskGraph() {
+    //callbacks must not access the graph after it is destroyed
+    if(submitted_ && !completed_) wait();
+    for(std::vector< Task >::iterator t = tasks_.begin();
+        t != tasks_.end(); ++t) {
+        if(t->event != 0) clReleaseEvent(t->event);
+    }
+    for(std::vector< HostContext* >::iterator h = hostContexts_.begin();
+        h != hostContexts_.end(); ++h) delete *h;
+    pthread_mutex_destroy(&mutex_);
+}
+
+//------------------------------------------------------------------------------
+TaskGraph::Node TaskGraph::add(const Task& t) {
+    if(submitted_) {
+        std::cerr << "ERROR - TaskGraph: cannot add nodes after submit"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    for(std::vector< Node >::const_iterator d = t.deps.begin();
+        d != t.deps.end(); ++d) {
+        if(*d >= tasks_.size()) {
+            std::cerr << "ERROR - TaskGraph: dependency of node '" << t.name
+                      << "' must be added before the node" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    tasks_.push_back(t);
+    Task& n = tasks_.back();
+    n.queue = -1;
+    n.event = 0;
+    n.start = 0;
+    n.end = 0;
+    n.pendingDeps = n.deps.size();
+    n.depStatus = CL_SUCCESS;
+    return tasks_.size() - 1;
+}
+
+//------------------------------------------------------------------------------
+TaskGraph::Node TaskGraph::add_kernel(const std::string& name,
+                                      cl_kernel kernel,
+                                      cl_uint workDim,
+                                      const size_t* globalWorkSize,
+                                      const size_t* localWorkSize,
+                                      const std::vector< Node >& deps) {
+    Task t = Task();
+    t.type = KERNEL;
+    t.name = name;
+    t.deps = deps;
+    t.kernel = kernel;
+    t.workDim = workDim;
+    t.hasLocal = localWorkSize != 0;
+    for(cl_uint d = 0; d != workDim; ++d) {
+        t.global[d] = globalWorkSize[d];
+        t.local[d] = localWorkSize != 0 ? localWorkSize[d] : 0;
+    }
+    return add(t);
+}
+
+//------------------------------------------------------------------------------
+void TaskGraph::set_arg(Node kernelNode, cl_uint index, size_t size,
+                        const void* value) {
+    const char* v = static_cast< const char* >(value);
+    tasks_[kernelNode].args.push_back(
+        std::make_pair(index, std::vector< char >(v, v + size)));
+}
+
+//------------------------------------------------------------------------------
+TaskGraph::Node TaskGraph::add_write(const std::string& name,
+                                     cl_mem buffer,
+                                     size_t offset,
+                                     size_t size,
+                                     const void* ptr,
+                                     const std::vector< Node >& deps) {
+    Task t = Task();
+    t.type = WRITE;
+    t.name = name;
+    t.deps = deps;
+    t.buffer = buffer;
+    t.offset = offset;
+    t.size = size;
+    t.ptr = const_cast< void* >(ptr);
+    return add(t);
+}
+
+//------------------------------------------------------------------------------
+TaskGraph::Node TaskGraph::add_read(const std::string& name,
+                                    cl_mem buffer,
+                                    size_t offset,
+                                    size_t size,
+                                    void* ptr,
+                                    const std::vector< Node >& deps) {
+    Task t = Task();
+    t.type = READ;
+    t.name = name;
+    t.deps = deps;
+    t.buffer = buffer;
+    t.offset = offset;
+    t.size = size;
+    t.ptr = ptr;
+    return add(t);
+}
+
+//------------------------------------------------------------------------------
+TaskGraph::Node TaskGraph::add_host(const std::string& name,
+                                    HostFunction f,
+                                    void* data,
+                                    const std::vector< Node >& deps) {
+    Task t = Task();
+    t.type = HOST;
+    t.name = name;
+    t.deps = deps;
+    t.f = f;
+    t.data = data;
+    return add(t);
+}
+
+//------------------------------------------------------------------------------
+//a node is placed on the queue whose last node is one of its dependencies,
+//if any, to avoid cross-queue synchronization; otherwise on the queue whose
+//last node has the lowest depth in the graph i.e. the queue most likely
+//to be idle when the node is ready
+void TaskGraph::assign_queues() {
+    const size_t NQ = clenv_.queues.empty() ? 1 : clenv_.queues.size();
+    std::vector< size_t > depth(tasks_.size(), 0);
+    std::vector< int > lastNode(NQ, -1);
+    std::vector< size_t > lastDepth(NQ, 0);
+    for(size_t n = 0; n != tasks_.size(); ++n) {
+        Task& t = tasks_[n];
+        for(std::vector< Node >::const_iterator d = t.deps.begin();
+            d != t.deps.end(); ++d) depth[n] = std::max(depth[n], depth[*d]);
+        ++depth[n];
+        if(t.type == HOST) continue;
+        int q = -1;
+        for(size_t i = 0; i != NQ && q < 0; ++i) {
+            if(lastNode[i] >= 0 && std::find(t.deps.begin(), t.deps.end(),
+                                   Node(lastNode[i])) != t.deps.end()) q = i;
+        }
+        if(q < 0) {
+            q = 0;
+            for(size_t i = 1; i != NQ; ++i) {
+                if(lastDepth[i] < lastDepth[q]) q = i;
+            }
+        }
+        t.queue = q;
+        lastNode[q] = n;
+        lastDepth[q] = depth[n];
+    }
+}
+
+//------------------------------------------------------------------------------
+void TaskGraph::enqueue(Node n) {
+    Task& t = tasks_[n];
+    std::vector< cl_event > waitList;
+    for(std::vector< Node >::const_iterator d = t.deps.begin();
+        d != t.deps.end(); ++d) waitList.push_back(tasks_[*d].event);
+    const cl_uint nwait = cl_uint(waitList.size());
+    const cl_event* wait = waitList.empty() ? 0 : &waitList[0];
+    cl_command_queue q = t.queue >= 0 ? clenv_.queues[t.queue] : 0;
+    cl_int status = CL_SUCCESS;
+    switch(t.type) {
+    case KERNEL:
+        for(size_t a = 0; a != t.args.size(); ++a) {
+            status = clSetKernelArg(t.kernel, t.args[a].first,
+                                    t.args[a].second.size(),
+                                    &t.args[a].second[0]);
+            check_cl_error(status, "clSetKernelArg");
+        }
+        status = clEnqueueNDRangeKernel(q, t.kernel, t.workDim, 0, t.global,
+                                        t.hasLocal ? t.local : 0,
+                                        nwait, wait, &t.event);
+        check_cl_error(status, "clEnqueueNDRangeKernel");
+        break;
+    case WRITE:
+        status = clEnqueueWriteBuffer(q, t.buffer, CL_FALSE, t.offset, t.size,
+                                      t.ptr, nwait, wait, &t.event);
+        check_cl_error(status, "clEnqueueWriteBuffer");
+        break;
+    case READ:
+        status = clEnqueueReadBuffer(q, t.buffer, CL_FALSE, t.offset, t.size,
+                                     t.ptr, nwait, wait, &t.event);
+        check_cl_error(status, "clEnqueueReadBuffer");
+        break;
+    case HOST: {
+        //completion of host nodes is signaled through user events
+        t.event = clCreateUserEvent(clenv_.context, &status);
+        check_cl_error(status, "clCreateUserEvent");
+        if(t.deps.empty()) {
+            run_host(n, CL_SUCCESS);
+            break;
+        }
+        HostContext* h = new HostContext;
+        h->graph = this;
+        h->node = n;
+        hostContexts_.push_back(h);
+        for(size_t d = 0; d != waitList.size(); ++d) {
+            status = clSetEventCallback(waitList[d], CL_COMPLETE,
+                                        host_dependency_callback, h);
+            check_cl_error(status, "clSetEventCallback");
+        }
+        break;
+    }
+    }
+}
+
+//------------------------------------------------------------------------------
+void TaskGraph::run_host(Node n, cl_int status) {
+    Task& t = tasks_[n];
+    t.start = monotonic_time_ns();
+    if(status == CL_SUCCESS) t.f(t.data);
+    t.end = monotonic_time_ns();
+    //failures propagate to dependent commands
+    clSetUserEventStatus(t.event, status == CL_SUCCESS ? CL_COMPLETE : status);
+}
+
+//------------------------------------------------------------------------------
+void CL_CALLBACK TaskGraph::host_dependency_callback(cl_event,
+                                                     cl_int status,
+                                                     void* data) {
+    HostContext* h = static_cast< HostContext* >(data);
+    TaskGraph* g = h->graph;
+    pthread_mutex_lock(&g->mutex_);
+    Task& t = g->tasks_[h->node];
+    if(status < 0) t.depStatus = status;
+    const bool ready = --t.pendingDeps == 0;
+    const cl_int depStatus = t.depStatus;
+    pthread_mutex_unlock(&g->mutex_);
+    if(ready) g->run_host(h->node, depStatus);
+}
+
+//------------------------------------------------------------------------------
+void TaskGraph::submit() {
+    if(clenv_.queues.empty()) clenv_.queues.push_back(clenv_.commandQueue);
+    assign_queues();
+    submitted_ = true;
+    submitTime_ = wall_time_ms();
+    for(Node n = 0; n != tasks_.size(); ++n) enqueue(n);
+    for(size_t q = 0; q != clenv_.queues.size(); ++q) {
+        check_cl_error(clFlush(clenv_.queues[q]), "clFlush");
+    }
+}
+
+//------------------------------------------------------------------------------
+double TaskGraph::wait() {
+    std::vector< cl_event > events;
+    for(std::vector< Task >::const_iterator t = tasks_.begin();
+        t != tasks_.end(); ++t) events.push_back(t->event);
+    if(!events.empty()) {
+        check_cl_error(clWaitForEvents(cl_uint(events.size()), &events[0]),
+                       "clWaitForEvents");
+    }
+    const double elapsed = wall_time_ms() - submitTime_;
+    completed_ = true;
+    for(std::vector< Task >::iterator t = tasks_.begin();
+        t != tasks_.end(); ++t) {
+        if(t->type == HOST) continue;
+        if(clGetEventProfilingInfo(t->event, CL_PROFILING_COMMAND_START,
+                                   sizeof(cl_ulong), &t->start, 0) != CL_SUCCESS
+           || clGetEventProfilingInfo(t->event, CL_PROFILING_COMMAND_END,
+                                   sizeof(cl_ulong), &t->end, 0) != CL_SUCCESS) {
+            t->start = 0;
+            t->end = 0;
+        }
+    }
+    return elapsed;
+}
+
+//------------------------------------------------------------------------------
+double TaskGraph::time(Node n) const {
+    return double(tasks_[n].end - tasks_[n].start) / 1E6;
+}
+
+//------------------------------------------------------------------------------
+int TaskGraph::queue(Node n) const {
+    return tasks_[n].queue;
+}
+
+//------------------------------------------------------------------------------
+std::vector< TaskGraph::Node > TaskGraph::critical_path() const {
+    std::vector< Node > path;
+    if(tasks_.empty()) return path;
+    //nodes are in topological order: longest path ending at each node
+    std::vector< double > dist(tasks_.size(), 0);
+    std::vector< int > pred(tasks_.size(), -1);
+    for(Node n = 0; n != tasks_.size(); ++n) {
+        const std::vector< Node >& deps = tasks_[n].deps;
+        for(std::vector< Node >::const_iterator d = deps.begin();
+            d != deps.end(); ++d) {
+            if(pred[n] < 0 || dist[*d] > dist[pred[n]]) pred[n] = int(*d);
+        }
+        dist[n] = time(n) + (pred[n] < 0 ? 0 : dist[pred[n]]);
+    }
+    int n = int(std::max_element(dist.begin(), dist.end()) - dist.begin());
+    for(; n >= 0; n = pred[n]) path.push_back(Node(n));
+    std::reverse(path.begin(), path.end());
+    return path;
+}
+
+//------------------------------------------------------------------------------
+double TaskGraph::critical_path_time() const {
+    const std::vector< Node > path = critical_path();
+    double t = 0;
+    for(std::vector< Node >::const_iterator n = path.begin();
+        n != path.end(); ++n) t += time(*n);
+    return t;
+}
+
+//------------------------------------------------------------------------------
+std::vector< double > TaskGraph::queue_idle_times() const {
+    //all the queues are on the same device: timestamps are comparable
+    cl_ulong first = ~cl_ulong(0);
+    cl_ulong last = 0;
+    std::vector< std::vector< std::pair< cl_ulong, cl_ulong > > >
+        intervals(clenv_.queues.size());
+    for(std::vector< Task >::const_iterator t = tasks_.begin();
+        t != tasks_.end(); ++t) {
+        if(t->queue < 0 || t->end == 0) continue;
+        first = std::min(first, t->start);
+        last = std::max(last, t->end);
+        intervals[t->queue].push_back(std::make_pair(t->start, t->end));
+    }
+    std::vector< double > idle(clenv_.queues.size(), 0);
+    if(last <= first) return idle;
+    for(size_t q = 0; q != intervals.size(); ++q) {
+        //length of the union of the execution intervals
+        std::vector< std::pair< cl_ulong, cl_ulong > >& i = intervals[q];
+        std::sort(i.begin(), i.end());
+        cl_ulong busy = 0;
+        cl_ulong end = first;
+        for(size_t k = 0; k != i.size(); ++k) {
+            const cl_ulong s = std::max(i[k].first, end);
+            if(i[k].second > s) busy += i[k].second - s;
+            end = std::max(end, i[k].second);
+        }
+        idle[q] = double(last - first - busy) / 1E6;
+    }
+    return idle;
+}
+
+//------------------------------------------------------------------------------
+void TaskGraph::report(std::ostream& os) const {
+    os << "node, queue, time(ms)\n";
+    for(Node n = 0; n != tasks_.size(); ++n) {
+        os << tasks_[n].name << ", ";
+        if(tasks_[n].queue < 0) os << "host";
+        else os << tasks_[n].queue;
+        os << ", " << time(n) << '\n';
+    }
+    const std::vector< Node > path = critical_path();
+    os << "critical path: ";
+    for(std::vector< Node >::const_iterator n = path.begin();
+        n != path.end(); ++n) {
+        os << (n == path.begin() ? "" : " -> ") << tasks_[*n].name;
+    }
+    os << " (" << critical_path_time() << " ms)\n";
+    const std::vector< double > idle = queue_idle_times();
+    os << "queue, idle(ms)\n";
+    for(size_t q = 0; q != idle.size(); ++q) os << q << ", " << idle[q] << '\n';
+    os.flush();
+}
+
+//------------------------------------------------------------------------------
+const ReduceOp CLReduce::SUM = {"x", "a + b", "0", false, false};
+const ReduceOp CLReduce::MIN = {"x", "fmin(a, b)", "INFINITY", false, false};
+const ReduceOp CLReduce::MAX = {"x", "fmax(a, b)", "-INFINITY", false, false};
+const ReduceOp CLReduce::ARGMIN = {"x", "a < b", "INFINITY", false, true};
+const ReduceOp CLReduce::ARGMAX = {"x", "a > b", "-INFINITY", false, true};
+const ReduceOp CLReduce::DOT = {"x * y", "a + b", "0", true, false};
+const ReduceOp CLReduce::SQUARED_NORM = {"x * x", "a + b", "0", false, false};
+
+//------------------------------------------------------------------------------
+CLReduce::CLReduce(const CLEnv& clenv,
+                   bool doublePrecision,
+                   int vecWidth,
+                   int blockSize,
+                   int groupsPerComputeUnit,
+                   const std::string& clSourcePath)
+    : context_(clenv.context), queue_(clenv.commandQueue),
+      device_(get_device_id(clenv.context)), double_(doublePrecision),
+      vecWidth_(vecWidth), partial_(0), partialIndex_(0) {
+    if(vecWidth != 1 && vecWidth != 2 && vecWidth != 4 && vecWidth != 8
+       && vecWidth != 16) {
+        std::cerr << "ERROR - invalid reduction vector width " << vecWidth
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    const std::string path = clSourcePath.empty()
+                             ? find_kernel_source("reduce.cl", "")
+                             : clSourcePath;
+    if(path.empty()) {
+        std::cerr << "ERROR - cannot find reduce.cl, set CLUTIL_KERNEL_DIR"
+                  << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    source_ = load_text(path.c_str());
+    size_t maxGroupSize = 1;
+    check_cl_error(clGetDeviceInfo(device_, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+                                   sizeof(size_t), &maxGroupSize, 0),
+                   "clGetDeviceInfo(CL_DEVICE_MAX_WORK_GROUP_SIZE)");
+    cl_uint computeUnits = 1;
+    check_cl_error(clGetDeviceInfo(device_, CL_DEVICE_MAX_COMPUTE_UNITS,
+                                   sizeof(cl_uint), &computeUnits, 0),
+                   "clGetDeviceInfo(CL_DEVICE_MAX_COMPUTE_UNITS)");
+    //the tree reduction requires a power of two
+    blockSize_ = 1;
+    while(2 * blockSize_ <= std::min(size_t(blockSize), maxGroupSize))
+        blockSize_ *= 2;
+    maxGroups_ = std::max(size_t(1), size_t(computeUnits)
+                                     * groupsPerComputeUnit);
+    cl_int status;
+    partial_ = clCreateBuffer(context_, CL_MEM_READ_WRITE,
+                              maxGroups_ * sizeof(cl_double), 0, &status);
+    check_cl_error(status, "clCreateBuffer");
+    partialIndex_ = clCreateBuffer(context_, CL_MEM_READ_WRITE,
+                                   maxGroups_ * sizeof(cl_int), 0, &status);
+    check_cl_error(status, "clCreateBuffer");
+}
+
+//------------------------------------------------------------------------------
+CLReduce::~CLReduce() {
+    for(std::map< std::string, Kernels >::iterator k = kernels_.begin();
+        k != kernels_.end(); ++k) {
+        clReleaseKernel(k->second.reduce);
+        clReleaseKernel(k->second.partials);
+        clReleaseProgram(k->second.program);
+    }
+    clReleaseMemObject(partial_);
+    clReleaseMemObject(partialIndex_);
+}
+
+//------------------------------------------------------------------------------
+const CLReduce::Kernels& CLReduce::kernels(const ReduceOp& op) {
+    std::ostringstream prefix;
+    if(double_) prefix << "#define DOUBLE\n";
+    if(op.index) prefix << "#define INDEX\n";
+    prefix << "#define BLOCK_SIZE " << blockSize_ << '\n'
+           << "#define VEC_WIDTH " << vecWidth_ << '\n'
+           << "#define MAP(x, y) (" << op.map << ")\n"
+           << "#define COMBINE(a, b) (" << op.combine << ")\n"
+           << "#define IDENTITY (" << op.identity << ")\n";
+    std::map< std::string, Kernels >::iterator k = kernels_.find(prefix.str());
+    if(k != kernels_.end()) return k->second;
+    Kernels kernels;
+    kernels.program = build_program(context_, device_,
+                                    prefix.str() + source_);
+    cl_int status;
+    kernels.reduce = clCreateKernel(kernels.program, "reduce", &status);
+    check_cl_error(status, "clCreateKernel(reduce)");
+    kernels.partials = clCreateKernel(kernels.program, "reduce_partials",
+                                      &status);
+    check_cl_error(status, "clCreateKernel(reduce_partials)");
+    return kernels_[prefix.str()] = kernels;
+}
+
+//------------------------------------------------------------------------------
+double CLReduce::reduce(const ReduceOp& op,
+                        cl_mem v1,
+                        cl_mem v2,
+                        size_t n,
+                        size_t* index) {
+    if(n == 0 || n > size_t(std::numeric_limits< cl_int >::max())
+       || (op.binary && v2 == 0)) {
+        std::cerr << "ERROR - invalid reduction arguments" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    const Kernels& k = kernels(op);
+    //MAP does not read the second input of unary operators
+    if(v2 == 0) v2 = v1;
+    const cl_int size = cl_int(n);
+    const size_t vecSize = n / vecWidth_;
+    const cl_int groups = cl_int(std::min(maxGroups_,
+                                          std::max(size_t(1),
+                                                   (vecSize + blockSize_ - 1)
+                                                   / blockSize_)));
+    check_cl_error(clSetKernelArg(k.reduce, 0, sizeof(cl_mem), &v1),
+                   "clSetKernelArg");
+    check_cl_error(clSetKernelArg(k.reduce, 1, sizeof(cl_mem), &v2),
+                   "clSetKernelArg");
+    check_cl_error(clSetKernelArg(k.reduce, 2, sizeof(cl_int), &size),
+                   "clSetKernelArg");
+    check_cl_error(clSetKernelArg(k.reduce, 3, sizeof(cl_mem), &partial_),
+                   "clSetKernelArg");
+    check_cl_error(clSetKernelArg(k.reduce, 4, sizeof(cl_mem), &partialIndex_),
+                   "clSetKernelArg");
+    check_cl_error(clSetKernelArg(k.partials, 0, sizeof(cl_mem), &partial_),
+                   "clSetKernelArg");
+    check_cl_error(clSetKernelArg(k.partials, 1, sizeof(cl_mem),
+                                  &partialIndex_), "clSetKernelArg");
+    check_cl_error(clSetKernelArg(k.partials, 2, sizeof(cl_int), &groups),
+                   "clSetKernelArg");
+    const size_t globalWorkSize[1] = {groups * blockSize_};
+    const size_t localWorkSize[1] = {blockSize_};
+    check_cl_error(clEnqueueNDRangeKernel(queue_, k.reduce, 1, 0,
+                                          globalWorkSize, localWorkSize,
+                                          0, 0, 0),
+                   "clEnqueueNDRangeKernel(reduce)");
+    check_cl_error(clEnqueueNDRangeKernel(queue_, k.partials, 1, 0,
+                                          localWorkSize, localWorkSize,
+                                          0, 0, 0),
+                   "clEnqueueNDRangeKernel(reduce_partials)");
+    double result = 0;
+    float resultf = 0;
+    check_cl_error(clEnqueueReadBuffer(queue_, partial_, CL_TRUE, 0,
+                                       double_ ? sizeof(double)
+                                               : sizeof(float),
+                                       double_ ? (void*) &result
+                                               : (void*) &resultf,
+                                       0, 0, 0), "clEnqueueReadBuffer");
+    if(!double_) result = resultf;
+    if(op.index && index != 0) {
+        cl_int i = 0;
+        check_cl_error(clEnqueueReadBuffer(queue_, partialIndex_, CL_TRUE, 0,
+                                           sizeof(cl_int), &i, 0, 0, 0),
+                       "clEnqueueReadBuffer");
+        *index = size_t(i);
+    }
+    return result;
+}
+
+//------------------------------------------------------------------------------
+size_t CLReduce::argmin(cl_mem v, size_t n) {
+    size_t index = 0;
+    reduce(ARGMIN, v, 0, n, &index);
+    return index;
+}
+
+//------------------------------------------------------------------------------
+size_t CLReduce::argmax(cl_mem v, size_t n) {
+    size_t index = 0;
+    reduce(ARGMAX, v, 0, n, &index);
+    return index;
+}
+
+//------------------------------------------------------------------------------
+double CLReduce::norm(cl_mem v, size_t n) {
+    return std::sqrt(reduce(SQUARED_NORM, v, 0, n));
+}
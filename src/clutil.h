@@ -2,6 +2,12 @@
 //OpenCL utility functions
 //Author: Ugo Varetto
 #include <string>
+#include <vector>
+#include <iosfwd>
+#include <list>
+#include <map>
+#include <stdexcept>
+#include <pthread.h>
 
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
@@ -17,19 +23,118 @@ struct CLEnv {
     cl_program program;
     cl_kernel kernel;
     cl_command_queue commandQueue;
+    //all the command queues created on the device, the first element
+    //is commandQueue
+    std::vector< cl_command_queue > queues;
+};
+
+//one environment per device; each device has its own context since the
+//selected devices might belong to different platforms
+struct CLMultiEnv {
+    std::vector< CLEnv > envs;
+    //relative weights used to split work among devices; initialized to 1
+    std::vector< double > weights;
+    //per-device number of work items and kernel time(ms) of last launch
+    std::vector< size_t > counts;
+    std::vector< double > times;
+};
+
+//work to be split among devices: enqueue is invoked once per device
+//with the range [offset, offset + count) of the split dimension assigned
+//to the device; implementations must only issue non-blocking commands
+//(including the read back of the results into the right portion of the
+//output) and return the event associated with the kernel launch, which
+//is released by the caller
+class SplitWork {
+public:
+    virtual cl_event enqueue(int device, const CLEnv& env,
+                             size_t offset, size_t count) = 0;
+    virtual ~SplitWork() {}
 };
 
 void check_cl_error(cl_int status, const char* msg);
+//exception thrown by throw_cl_error
+class CLError : public std::runtime_error {
+public:
+    CLError(cl_int status, const std::string& msg);
+    cl_int status() const { return status_; }
+    //true if the error is caused by lack of device or host resources
+    //(allocation failures, out of resources, buffer too large) and the
+    //operation can be retried with a smaller problem size
+    bool resource_exhausted() const;
+private:
+    cl_int status_;
+};
+//same as check_cl_error but throws a CLError instead of exiting: use
+//where failures must be recoverable
+void throw_cl_error(cl_int status, const char* msg);
+//releases the added memory objects on destruction, also when an exception
+//is thrown
+class CLMemGuard {
+public:
+    CLMemGuard() {}
+    ~CLMemGuard();
+    //returns m
+    cl_mem add(cl_mem m);
+private:
+    CLMemGuard(const CLMemGuard&);
+    CLMemGuard& operator=(const CLMemGuard&);
+    std::vector< cl_mem > mems_;
+};
+//work processed in chunks by process_in_chunks: process must handle the
+//range [offset, offset + count) and throw a CLError in case of failure
+//(e.g. through throw_cl_error), leaving no resources allocated
+class ChunkWork {
+public:
+    virtual void process(size_t offset, size_t count) = 0;
+    virtual ~ChunkWork() {}
+};
+//processes the range [0, total) in chunks of chunkSize elements, a multiple
+//of granularity; if processing a chunk fails because of resource exhaustion
+//(see CLError::resource_exhausted) the chunk size is halved and the chunk
+//processed again; other errors and failures with a chunk size equal to
+//granularity are rethrown; returns the final chunk size
+size_t process_in_chunks(size_t total,
+                         size_t chunkSize,
+                         size_t granularity,
+                         ChunkWork& work);
+//returns all devices of the requested type on the platform(s) matching
+//the platform name; use "all" as the platform name to search all platforms
+std::vector< cl_device_id > get_device_ids(const std::string& platformName,
+                                           const std::string& deviceTypeName);
+cl_context create_device_context(cl_device_id deviceID);
 cl_context create_cl_context(const std::string& platformName,
                              const std::string& deviceTypeName,
                              int deviceNum);
 std::string load_text(const char* filepath);
 cl_device_id get_device_id(cl_context ctx);
 void print_platforms();
+//returns string describing device: platform name, device name and
+//driver version; used as a key for caching per-device data
+std::string get_device_key(cl_device_id deviceID);
+//builds program for the specified device; binaries are cached on disk
+//under the directory pointed to by the CLUTIL_CACHE_DIR environment
+//variable (default: $HOME/.clutil-cache; set to "" to disable caching)
+//keyed by source, build options and device key; on a cache hit the
+//program is created through clCreateProgramWithBinary, on a miss or in case
+//of an invalid binary the program is built from source and its binary
+//stored in the cache
+cl_program build_program(cl_context context,
+                         cl_device_id deviceID,
+                         const std::string& programSource,
+                         const std::string& buildOptions = std::string());
+//same as build_program but returns 0 instead of exiting if the program fails
+//to build, e.g. to skip configurations the device compiler rejects
+cl_program try_build_program(cl_context context,
+                             cl_device_id deviceID,
+                             const std::string& programSource,
+                             const std::string& buildOptions = std::string());
 //the following function only fills the requested CLEnv fields:
 //context and command queue are always reaturned; program and
 //kernel are returned only if the source path and kernel name are
-//not NULL
+//not NULL; the program is built through build_program;
+//numQueues command queues are created on the device, with out-of-order
+//execution enabled if outOfOrder is true
 CLEnv create_clenv(const std::string& platformName,
                    const std::string& deviceType,
                    int deviceNum,
@@ -37,9 +142,44 @@ CLEnv create_clenv(const std::string& platformName,
                    const char* clSourcePath = 0,
                    const char* kernelName = 0, 
                    const std::string& clSourcePrefix = std::string(),
-                   const std::string& buildOptions = std::string());
+                   const std::string& buildOptions = std::string(),
+                   int numQueues = 1,
+                   bool outOfOrder = false);
 void release_clenv(CLEnv& e);
-//executes kernel synchronously and returns elapsed time in milliseconds
+//device ranking: create_cl_context and create_clenv accept "fastest" or
+//"fastest-for:<kernel>" as the device type, in which case the device number
+//is ignored and the best device among all the devices of the platform(s) is
+//selected according to short micro-benchmarks: host to device transfer and
+//device to device copy bandwidth and block_matmul (04_matrix_multiply.cl)
+//GFLOP/s. "fastest" ranks devices by the geometric mean of the scores
+//normalized to the best device; with "fastest-for:<kernel>" only the
+//benchmark matching the kernel is used: matmul and block_matmul use GFLOP/s,
+//dotprod, filter and filter_image device bandwidth, memcpy transfer
+//bandwidth. Results are cached per host and device in the file pointed to
+//by the CLUTIL_DEVICE_DB environment variable (default:
+//$HOME/.clutil-devices.db); the matrix multiply kernel is searched in
+//CLUTIL_KERNEL_DIR, the directory of the kernel source passed to
+//create_clenv and kernels, src/kernels, ../src/kernels
+struct DeviceScore {
+    cl_device_id id;
+    std::string key;
+    double transferGBs;
+    double copyGBs;
+    double gflops;
+};
+bool is_fastest_device_type(const std::string& deviceTypeName);
+//returns the scores of all the devices of the platform(s) matching
+//platformName, running the benchmarks on devices not found in the cache
+std::vector< DeviceScore > rank_devices(const std::string& platformName,
+                                        const std::string& kernelDir
+                                            = std::string());
+//prints the ranking and returns the best device according to criterion
+//("fastest" or "fastest-for:<kernel>")
+cl_device_id fastest_device(const std::string& platformName,
+                            const std::string& criterion,
+                            const std::string& kernelDir = std::string());
+//executes kernel synchronously and returns elapsed execution time
+//(START to END) in milliseconds; no other command in the queue is waited for
 double timeEnqueueNDRangeKernel(cl_command_queue command_queue,
                                 cl_kernel kernel,
                                 cl_uint work_dim,
@@ -48,4 +188,503 @@ double timeEnqueueNDRangeKernel(cl_command_queue command_queue,
                                 const size_t *local_work_size,
                                 cl_uint num_events_in_wait_list,
                                 const cl_event *event_wait_list);
+//profiling timestamps in nanoseconds of a completed command
+struct CLEventTimes {
+    cl_ulong queued;
+    cl_ulong submit;
+    cl_ulong start;
+    cl_ulong end;
+};
+CLEventTimes get_cl_event_times(cl_event ev);
+//returns time from QUEUED to END in milliseconds
 double get_cl_time(cl_event ev);
+
+//list of events used to chain commands across queues: events returned by
+//clEnqueue* functions through next() are passed as wait lists to commands
+//enqueued on other queues; the list owns the events and releases them
+//on destruction
+class CLEventList {
+public:
+    CLEventList() {}
+    ~CLEventList();
+    //returns a pointer to a new slot, to be passed as the event argument
+    //of a clEnqueue* function
+    cl_event* next();
+    //adds event to the list; the list takes ownership of the event
+    void add(cl_event ev);
+    //number of events and pointer to be passed as wait list (NULL if
+    //the list is empty)
+    cl_uint size() const { return cl_uint(events_.size()); }
+    const cl_event* data() const { return events_.empty() ? 0 : &events_[0]; }
+    const cl_event& back() const { return events_.back(); }
+    //blocks until all the events are complete
+    void wait() const;
+    void clear();
+private:
+    CLEventList(const CLEventList&);
+    CLEventList& operator=(const CLEventList&);
+    std::vector< cl_event > events_;
+};
+
+//commands enqueued in 'to' after this call are not executed before all the
+//commands enqueued so far in 'from' are complete; no host synchronization
+void chain_queues(cl_command_queue from, cl_command_queue to);
+
+//directed acyclic graph of commands: nodes are kernel launches, buffer
+//transfers or host functions, edges are dependencies expressed as event
+//wait lists. Nodes must be added after their dependencies; submit() enqueues
+//all the nodes without blocking, assigning independent nodes to different
+//queues of the environment, wait() is the only synchronization point.
+//After wait() the executor reports the critical path i.e. the chain of
+//dependent nodes with the longest total execution time and the idle time of
+//each queue; queues must be created with profiling enabled.
+//Host functions are invoked when all their dependencies are complete from
+//the thread delivering OpenCL event callbacks (from submit() if they have
+//no dependencies): they must not call blocking OpenCL functions
+class TaskGraph {
+public:
+    typedef size_t Node;
+    typedef void (*HostFunction)(void* data);
+    explicit TaskGraph(const CLEnv& clenv);
+    //waits for all the nodes to complete if submitted
+    ~TaskGraph();
+    //the global and local work sizes are copied; local may be NULL
+    Node add_kernel(const std::string& name,
+                    cl_kernel kernel,
+                    cl_uint workDim,
+                    const size_t* globalWorkSize,
+                    const size_t* localWorkSize,
+                    const std::vector< Node >& deps = std::vector< Node >());
+    //sets argument of kernel node; the value is copied and passed to
+    //clSetKernelArg right before the kernel is enqueued
+    void set_arg(Node kernelNode, cl_uint index, size_t size,
+                 const void* value);
+    Node add_write(const std::string& name,
+                   cl_mem buffer,
+                   size_t offset,
+                   size_t size,
+                   const void* ptr,
+                   const std::vector< Node >& deps = std::vector< Node >());
+    Node add_read(const std::string& name,
+                  cl_mem buffer,
+                  size_t offset,
+                  size_t size,
+                  void* ptr,
+                  const std::vector< Node >& deps = std::vector< Node >());
+    Node add_host(const std::string& name,
+                  HostFunction f,
+                  void* data,
+                  const std::vector< Node >& deps = std::vector< Node >());
+    //enqueues all the nodes and flushes the queues; returns immediately
+    void submit();
+    //blocks until all the nodes are complete; returns the wall clock
+    //time(ms) elapsed since submit()
+    double wait();
+    //execution time(ms) of node, END - START for device commands
+    double time(Node n) const;
+    //queue index of node, -1 for host nodes
+    int queue(Node n) const;
+    //nodes in the critical path, in execution order
+    std::vector< Node > critical_path() const;
+    double critical_path_time() const;
+    //per-queue time(ms) with no command executing between the first START
+    //and the last END of all the device commands in the graph
+    std::vector< double > queue_idle_times() const;
+    //prints per-node times, critical path and per-queue idle times
+    void report(std::ostream& os) const;
+private:
+    enum Type {KERNEL, WRITE, READ, HOST};
+    struct Task {
+        Type type;
+        std::string name;
+        std::vector< Node > deps;
+        cl_kernel kernel;
+        cl_uint workDim;
+        size_t global[3];
+        size_t local[3];
+        bool hasLocal;
+        std::vector< std::pair< cl_uint, std::vector< char > > > args;
+        cl_mem buffer;
+        size_t offset;
+        size_t size;
+        void* ptr;
+        HostFunction f;
+        void* data;
+        int queue;
+        cl_event event;
+        //device timestamps for commands, CLOCK_MONOTONIC for host nodes
+        cl_ulong start;
+        cl_ulong end;
+        size_t pendingDeps;
+        cl_int depStatus;
+    };
+    struct HostContext {
+        TaskGraph* graph;
+        Node node;
+    };
+    TaskGraph(const TaskGraph&);
+    TaskGraph& operator=(const TaskGraph&);
+    Node add(const Task& t);
+    void assign_queues();
+    void enqueue(Node n);
+    void run_host(Node n, cl_int status);
+    static void CL_CALLBACK host_dependency_callback(cl_event, cl_int, void*);
+    CLEnv clenv_;
+    std::vector< Task > tasks_;
+    std::vector< HostContext* > hostContexts_;
+    pthread_mutex_t mutex_;
+    bool submitted_;
+    bool completed_;
+    double submitTime_;
+};
+
+//collects profiling information of enqueued commands asynchronously
+//through event callbacks: commands are attached to the session after
+//being enqueued and their timestamps recorded as soon as they complete,
+//with no need to wait on the queue; statistics are grouped by label
+//the queues must be created with profiling enabled
+class ProfilingSession {
+public:
+    struct Sample {
+        std::string label;
+        CLEventTimes times;
+        cl_int status; //CL_COMPLETE or error code
+    };
+    //statistics on execution time(START to END) in milliseconds
+    struct Stats {
+        size_t count;
+        double min;
+        double median;
+        double p95;
+        double max;
+        double total;
+    };
+    ProfilingSession();
+    //waits for all the attached commands to complete
+    ~ProfilingSession();
+    //records timing information of the command associated with event when
+    //the command completes; the event and its command queue are retained by
+    //the session and can be released by the caller after this call
+    void attach(cl_event ev, const std::string& label);
+    //flushes the queues of the attached commands and blocks until all the
+    //attached commands have been recorded; user events attached to the
+    //session must be completed by the caller
+    void wait();
+    //number of attached commands not yet completed
+    size_t pending() const;
+    std::vector< Sample > samples() const;
+    Stats stats(const std::string& label) const;
+    //time(ms) from the earliest START to the latest END of all the
+    //recorded commands; when commands overlap it is less than the sum of
+    //the per-label totals; only meaningful for commands on the same device
+    double elapsed() const;
+    //prints count, min, median, p95, max and total time for each label
+    void report(std::ostream& os) const;
+    //removes all the recorded samples
+    void clear();
+private:
+    ProfilingSession(const ProfilingSession&);
+    ProfilingSession& operator=(const ProfilingSession&);
+    static void CL_CALLBACK event_callback(cl_event, cl_int, void*);
+    mutable pthread_mutex_t mutex_;
+    pthread_cond_t completed_;
+    size_t pending_;
+    std::vector< Sample > samples_;
+    std::vector< cl_command_queue > queues_;
+};
+
+//enqueues kernel and attaches the associated event to the session using
+//the kernel function name as label; if event is not NULL the event is
+//returned to the caller and must be released
+cl_int enqueue_ndrange_profiled(ProfilingSession& session,
+                                cl_command_queue command_queue,
+                                cl_kernel kernel,
+                                cl_uint work_dim,
+                                const size_t *global_work_offset,
+                                const size_t *global_work_size,
+                                const size_t *local_work_size,
+                                cl_uint num_events_in_wait_list = 0,
+                                const cl_event *event_wait_list = 0,
+                                cl_event* event = 0);
+//creates one CLEnv per device; deviceNums is either "all" or a comma
+//separated list of device numbers e.g. "0,2"; "fastest" device types are
+//not supported
+CLMultiEnv create_clmultienv(const std::string& platformName,
+                             const std::string& deviceType,
+                             const std::string& deviceNums,
+                             bool enableProfiling = false,
+                             const char* clSourcePath = 0,
+                             const char* kernelName = 0, 
+                             const std::string& clSourcePrefix = std::string(),
+                             const std::string& buildOptions = std::string());
+void release_clmultienv(CLMultiEnv& me);
+//splits total into per-device counts proportional to weights, all counts
+//except the last are multiples of granularity
+std::vector< size_t > split_range(size_t total,
+                                  size_t granularity,
+                                  const std::vector< double >& weights);
+//splits the range [0, total) of the slowest moving NDRange dimension
+//among devices according to me.weights, enqueues the work on all devices
+//and waits for completion; returns the elapsed wall clock time in
+//milliseconds; if adaptive is true the weights are updated with the
+//measured per-device throughput to be used by the next call
+double enqueue_split(CLMultiEnv& me,
+                     size_t total,
+                     size_t granularity,
+                     SplitWork& work,
+                     bool adaptive = false);
+
+//pool of device memory objects recycled across calls to avoid the cost of
+//creating and releasing buffers and images for each launch; buffers are
+//grouped in size classes (four classes per power of two), images are
+//matched by format and exact dimensions; memory flags must match as well.
+//Since pooled objects are reused, CL_MEM_COPY_HOST_PTR and
+//CL_MEM_USE_HOST_PTR are not supported: use clEnqueueWrite* to initialize
+//the content. When the total allocated size exceeds maxBytes the least
+//recently released idle objects are freed
+class CLBufferPool {
+public:
+    struct Stats {
+        size_t requests;
+        size_t hits;
+        size_t misses;
+        size_t trimmed;    //number of objects freed to honor the bound
+        size_t bytesHeld;  //bytes in idle objects
+        size_t bytesInUse; //bytes in acquired objects
+        size_t peakBytes;  //peak of bytesHeld + bytesInUse
+    };
+    //maxBytes == 0: no upper bound
+    CLBufferPool(cl_context context, size_t maxBytes = 0);
+    //releases all the memory objects, including the ones not returned
+    //to the pool
+    ~CLBufferPool();
+    cl_mem acquire(cl_mem_flags flags, size_t size);
+    cl_mem acquire_image2d(cl_mem_flags flags,
+                           const cl_image_format& format,
+                           size_t width,
+                           size_t height);
+    //returns memory object to the pool
+    void release(cl_mem m);
+    //frees idle objects until the allocated size is <= maxBytes
+    void trim(size_t maxBytes);
+    Stats stats() const { return stats_; }
+    void report(std::ostream& os) const;
+private:
+    struct Key {
+        cl_mem_object_type type;
+        cl_mem_flags flags;
+        size_t size; //size class for buffers, row size for images
+        size_t height;
+        cl_image_format format;
+        bool operator==(const Key& k) const;
+    };
+    struct Entry {
+        Key key;
+        cl_mem mem;
+        size_t bytes;
+    };
+    CLBufferPool(const CLBufferPool&);
+    CLBufferPool& operator=(const CLBufferPool&);
+    cl_mem acquire(const Key& key, size_t bytes);
+    cl_context context_;
+    size_t maxBytes_;
+    std::list< Entry > idle_; //most recently released first
+    std::map< cl_mem, Entry > inUse_;
+    Stats stats_;
+};
+
+//compile-time parameter to tune: a #define with a list of candidate values
+struct TuneParam {
+    std::string name;
+    std::vector< int > values;
+};
+
+//configuration selected by the autotuner: values of the compile-time
+//defines and local work size
+struct TuneConfig {
+    std::vector< std::pair< std::string, int > > defines;
+    cl_uint dims;
+    size_t local[3];
+    double time; //median kernel execution time(ms)
+    //returns the value of the define or defaultValue if not found
+    int value(const std::string& name, int defaultValue = 0) const;
+    //returns the text to prefix to the kernel source i.e. one
+    //"#define NAME value" line per define
+    std::string prefix() const;
+};
+
+//problem-specific part of the tuning process: for each candidate
+//configuration configure is invoked after the program has been built and
+//must set the kernel arguments and fill the global work size; returning
+//false skips the candidate e.g. when the global size is not evenly
+//divisible by the local size or the local size must match a define;
+//accept is invoked with the define values only, before the program is
+//built: returning false skips all the candidates with those values e.g.
+//when the local arrays they size exceed the device local memory
+class Tunable {
+public:
+    virtual bool accept(const TuneConfig& /*cfg*/) { return true; }
+    virtual bool configure(cl_kernel kernel,
+                           const TuneConfig& cfg,
+                           size_t globalWorkSize[3]) = 0;
+    virtual ~Tunable() {}
+};
+
+//searches all combinations of the define values and of the local work
+//sizes (powers of two in each dimension) allowed by CL_KERNEL_WORK_GROUP_SIZE
+//and CL_DEVICE_MAX_WORK_ITEM_SIZES; combinations which fail to build are
+//skipped; each candidate is launched once as a warm-up and timed on
+//'repetitions' launches through profiling events; returns the configuration
+//with the lowest median time; the command queue in clenv must have profiling
+//enabled
+TuneConfig autotune(const CLEnv& clenv,
+                    const char* clSourcePath,
+                    const char* kernelName,
+                    const std::string& clSourcePrefix,
+                    const std::string& buildOptions,
+                    const std::vector< TuneParam >& params,
+                    cl_uint dims,
+                    Tunable& tunable,
+                    int repetitions = 5);
+//tuning database: text file pointed to by the CLUTIL_TUNE_DB environment
+//variable (default: $HOME/.clutil-tune.db), one configuration per
+//device, kernel and problem shape
+bool tune_db_lookup(const std::string& deviceKey,
+                    const std::string& kernelKey,
+                    const std::string& shape,
+                    TuneConfig& cfg);
+void tune_db_store(const std::string& deviceKey,
+                   const std::string& kernelKey,
+                   const std::string& shape,
+                   const TuneConfig& cfg);
+//returns the configuration stored in the tuning database for the device in
+//clenv, kernel and shape; runs the autotuner and stores the result if no
+//configuration is found; kernel source, prefix and build options are part
+//of the database key
+TuneConfig get_tuned_config(const CLEnv& clenv,
+                            const char* clSourcePath,
+                            const char* kernelName,
+                            const std::string& clSourcePrefix,
+                            const std::string& buildOptions,
+                            const std::vector< TuneParam >& params,
+                            cl_uint dims,
+                            const std::string& shape,
+                            Tunable& tunable);
+
+//command tracing: if the CLUTIL_TRACE environment variable is set to a file
+//path, all the commands enqueued through clEnqueue{Read,Write}{Buffer,Image},
+//clEnqueueMapBuffer, clEnqueueUnmapMemObject, clEnqueueCopyBuffer and
+//clEnqueueNDRangeKernel are recorded together with their queue and
+//profiling timestamps; the time spent by the host in clFinish and
+//clWaitForEvents and the spans marked with TraceSpan are recorded as well.
+//At exit the timeline is written in Chrome trace event format (JSON), which
+//can be loaded in chrome://tracing or https://ui.perfetto.dev.
+//The OpenCL functions are interposed by clutil when clutil.cpp is compiled
+//with -DCLUTIL_ENABLE_TRACE (link with -ldl): any program linked with it is
+//traced with no code changes; profiling is enabled on all command queues
+//while tracing is active. Without the flag CLUTIL_TRACE is ignored
+bool trace_enabled();
+//records a host span; times are CLOCK_MONOTONIC nanoseconds
+void trace_host_span(const std::string& name,
+                     cl_ulong startNs,
+                     cl_ulong endNs);
+//records the lifetime of the object as a host span
+class TraceSpan {
+public:
+    TraceSpan(const std::string& name);
+    ~TraceSpan();
+private:
+    TraceSpan(const TraceSpan&);
+    TraceSpan& operator=(const TraceSpan&);
+    std::string name_;
+    cl_ulong start_;
+};
+
+//reduction operator for CLReduce: the expressions are injected in
+//kernels/reduce.cl as the MAP, COMBINE and IDENTITY macros
+struct ReduceOp {
+    //expression of the elements x of the first input and y of the second
+    //input e.g. "x * y"; must support vector types
+    std::string map;
+    //expression of the values a and b e.g. "a + b"; if index is true a
+    //boolean expression, true if a is preferred over b e.g. "a < b"
+    std::string combine;
+    //neutral element of combine e.g. "0"
+    std::string identity;
+    //true if map reads the second input
+    bool binary;
+    //true if the index of the selected element is computed
+    bool index;
+};
+
+//reductions over device buffers computed from the kernel template in
+//kernels/reduce.cl: a program is built through build_program the first time
+//an operator is used and cached for the lifetime of the object. Each
+//reduction runs in two launches: a fixed number of work groups, a multiple of
+//the number of compute units, loops over the input with a grid stride and
+//stores one partial result per work group, then a single work group combines
+//the partial results; only the final value and index are read back.
+//The kernel source is searched in the same directories used by the device
+//ranking (see DeviceScore) if no path is specified; the number of elements
+//must be less than 2^31
+class CLReduce {
+public:
+    static const ReduceOp SUM;
+    static const ReduceOp MIN;
+    static const ReduceOp MAX;
+    static const ReduceOp ARGMIN;
+    static const ReduceOp ARGMAX;
+    static const ReduceOp DOT;
+    //sum of squares
+    static const ReduceOp SQUARED_NORM;
+    //blockSize: local work size, reduced to the device maximum if needed
+    CLReduce(const CLEnv& clenv,
+             bool doublePrecision = false,
+             int vecWidth = 4,
+             int blockSize = 256,
+             int groupsPerComputeUnit = 4,
+             const std::string& clSourcePath = std::string());
+    ~CLReduce();
+    double sum(cl_mem v, size_t n) { return reduce(SUM, v, 0, n); }
+    double min(cl_mem v, size_t n) { return reduce(MIN, v, 0, n); }
+    double max(cl_mem v, size_t n) { return reduce(MAX, v, 0, n); }
+    //index of the first minimum or maximum element
+    size_t argmin(cl_mem v, size_t n);
+    size_t argmax(cl_mem v, size_t n);
+    double dot(cl_mem v1, cl_mem v2, size_t n) {
+        return reduce(DOT, v1, v2, n);
+    }
+    //L2 norm
+    double norm(cl_mem v, size_t n);
+    //reduces the first n elements of v1 and v2, v2 is only required by
+    //binary operators; for index operators the index of the selected
+    //element is returned in index if not NULL; blocks until the result is
+    //available, values are returned in double precision also when
+    //computed in single precision
+    double reduce(const ReduceOp& op,
+                  cl_mem v1,
+                  cl_mem v2,
+                  size_t n,
+                  size_t* index = 0);
+private:
+    struct Kernels {
+        cl_program program;
+        cl_kernel reduce;
+        cl_kernel partials;
+    };
+    CLReduce(const CLReduce&);
+    CLReduce& operator=(const CLReduce&);
+    const Kernels& kernels(const ReduceOp& op);
+    cl_context context_;
+    cl_command_queue queue_;
+    cl_device_id device_;
+    std::string source_;
+    bool double_;
+    int vecWidth_;
+    size_t blockSize_;
+    size_t maxGroups_;
+    cl_mem partial_;
+    cl_mem partialIndex_;
+    //kernels for each operator, keyed by source prefix
+    std::map< std::string, Kernels > kernels_;
+};
@@ -0,0 +1,92 @@
+#pragma once
+//Cache blocked, multi-threaded host matrix multiply used as reference for
+//the OpenCL kernels and as CPU baseline:
+//C (m x n) = A (m x k) x B (k x n), all matrices row major.
+//Threads are enabled by compiling with OpenMP (e.g. -fopenmp), vectorization
+//relies on the compiler: compile with optimizations and the target
+//instruction set enabled (e.g. -O3 -march=native)
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__) || defined(__INTEL_COMPILER)
+#define HOST_GEMM_RESTRICT __restrict__
+#else
+#define HOST_GEMM_RESTRICT
+#endif
+
+namespace host_gemm_detail {
+
+//block sizes: a KC x NC panel of B is shared by all the threads and
+//reused from the last level cache, the rows of A and C processed by the
+//micro kernel stay in the L1/L2 caches of each thread
+const int MC = 64;
+const int KC = 256;
+const int NC = 512;
+
+//------------------------------------------------------------------------------
+//C[0:ROWS][0:n] += A[0:ROWS][0:k] x B[0:k][0:n]: every element of the B panel
+//loaded is used for ROWS rows of C; the innermost loop is on contiguous
+//elements of B and C and is vectorized by the compiler
+template < int ROWS, typename T >
+void micro_kernel(const T* A, int lda,
+                  const T* B, int ldb,
+                  T* C, int ldc,
+                  int k, int n) {
+    for(int p = 0; p != k; ++p) {
+        const T* HOST_GEMM_RESTRICT b = B + p * ldb;
+        T a[ROWS];
+        for(int r = 0; r != ROWS; ++r) a[r] = A[r * lda + p];
+        for(int r = 0; r != ROWS; ++r) {
+            T* HOST_GEMM_RESTRICT c = C + r * ldc;
+            const T ar = a[r];
+            for(int j = 0; j != n; ++j) c[j] += ar * b[j];
+        }
+    }
+}
+
+} //namespace host_gemm_detail
+
+//------------------------------------------------------------------------------
+template < typename T >
+void host_gemm(int m, int k, int n, const T* A, const T* B, T* C) {
+    using namespace host_gemm_detail;
+    const int rowBlocks = (m + MC - 1) / MC;
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < m; ++i) std::fill(C + size_t(i) * n,
+                                         C + size_t(i + 1) * n, T(0));
+    for(int jc = 0; jc < n; jc += NC) {
+        const int nc = std::min(NC, n - jc);
+        for(int pc = 0; pc < k; pc += KC) {
+            const int kc = std::min(KC, k - pc);
+            //row blocks of C are independent: one block per thread at a time
+            #pragma omp parallel for schedule(dynamic)
+            for(int ib = 0; ib < rowBlocks; ++ib) {
+                const int i0 = ib * MC;
+                const int i1 = std::min(m, i0 + MC);
+                int i = i0;
+                for(; i + 4 <= i1; i += 4) {
+                    micro_kernel< 4 >(A + size_t(i) * k + pc, k,
+                                      B + size_t(pc) * n + jc, n,
+                                      C + size_t(i) * n + jc, n, kc, nc);
+                }
+                for(; i < i1; ++i) {
+                    micro_kernel< 1 >(A + size_t(i) * k + pc, k,
+                                      B + size_t(pc) * n + jc, n,
+                                      C + size_t(i) * n + jc, n, kc, nc);
+                }
+            }
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//number of threads used by host_gemm
+inline int host_gemm_threads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
@@ -0,0 +1,433 @@
+#pragma once
+//Host reduction engine used as CPU baseline by the dot product examples:
+//a persistent pool of threads pinned to the CPUs available to the process,
+//static partitioning of the input shared by first_touch and the reductions,
+//so that on NUMA systems each thread reads memory from its own node, and
+//SIMD kernels reading the input in place, with AVX-512 or AVX2 selected at
+//run time. The SIMD kernels are compiled through target attributes: no
+//-mavx2/-mavx512f flags are needed (gcc >= 4.9, clang); the
+//HOST_REDUCE_ISA environment variable (scalar, avx2 or avx512) limits the
+//instruction set used. Link with -pthread
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define HOST_REDUCE_X86
+#include <immintrin.h>
+#endif
+
+namespace host_reduce_detail {
+
+enum ISA {SCALAR, AVX2, AVX512};
+
+//------------------------------------------------------------------------------
+//four independent accumulators to hide the latency of the additions
+template < typename T >
+T dot_scalar(const T* x, const T* y, size_t n) {
+    T s0 = 0;
+    T s1 = 0;
+    T s2 = 0;
+    T s3 = 0;
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        s0 += x[i] * y[i];
+        s1 += x[i + 1] * y[i + 1];
+        s2 += x[i + 2] * y[i + 2];
+        s3 += x[i + 3] * y[i + 3];
+    }
+    for(; i < n; ++i) s0 += x[i] * y[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+#ifdef HOST_REDUCE_X86
+//------------------------------------------------------------------------------
+//unaligned loads directly from the input, four accumulators; the remainder
+//is processed one vector at a time, then one element at a time
+__attribute__((target("avx2,fma")))
+inline double dot_avx2(const double* x, const double* y, size_t n) {
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd();
+    __m256d s3 = _mm256_setzero_pd();
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        s0 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i),
+                             _mm256_loadu_pd(y + i), s0);
+        s1 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 4),
+                             _mm256_loadu_pd(y + i + 4), s1);
+        s2 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 8),
+                             _mm256_loadu_pd(y + i + 8), s2);
+        s3 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 12),
+                             _mm256_loadu_pd(y + i + 12), s3);
+    }
+    for(; i + 4 <= n; i += 4) {
+        s0 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i),
+                             _mm256_loadu_pd(y + i), s0);
+    }
+    s0 = _mm256_add_pd(_mm256_add_pd(s0, s1), _mm256_add_pd(s2, s3));
+    double r[4];
+    _mm256_storeu_pd(r, s0);
+    double s = (r[0] + r[1]) + (r[2] + r[3]);
+    for(; i < n; ++i) s += x[i] * y[i];
+    return s;
+}
+
+__attribute__((target("avx2,fma")))
+inline float dot_avx2(const float* x, const float* y, size_t n) {
+    __m256 s0 = _mm256_setzero_ps();
+    __m256 s1 = _mm256_setzero_ps();
+    __m256 s2 = _mm256_setzero_ps();
+    __m256 s3 = _mm256_setzero_ps();
+    size_t i = 0;
+    for(; i + 32 <= n; i += 32) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i),
+                             _mm256_loadu_ps(y + i), s0);
+        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8),
+                             _mm256_loadu_ps(y + i + 8), s1);
+        s2 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 16),
+                             _mm256_loadu_ps(y + i + 16), s2);
+        s3 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 24),
+                             _mm256_loadu_ps(y + i + 24), s3);
+    }
+    for(; i + 8 <= n; i += 8) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i),
+                             _mm256_loadu_ps(y + i), s0);
+    }
+    s0 = _mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3));
+    float r[8];
+    _mm256_storeu_ps(r, s0);
+    float s = ((r[0] + r[1]) + (r[2] + r[3]))
+              + ((r[4] + r[5]) + (r[6] + r[7]));
+    for(; i < n; ++i) s += x[i] * y[i];
+    return s;
+}
+
+//------------------------------------------------------------------------------
+//the remainder is processed with a single masked load
+__attribute__((target("avx512f")))
+inline double dot_avx512(const double* x, const double* y, size_t n) {
+    __m512d s0 = _mm512_setzero_pd();
+    __m512d s1 = _mm512_setzero_pd();
+    __m512d s2 = _mm512_setzero_pd();
+    __m512d s3 = _mm512_setzero_pd();
+    size_t i = 0;
+    for(; i + 32 <= n; i += 32) {
+        s0 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i),
+                             _mm512_loadu_pd(y + i), s0);
+        s1 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i + 8),
+                             _mm512_loadu_pd(y + i + 8), s1);
+        s2 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i + 16),
+                             _mm512_loadu_pd(y + i + 16), s2);
+        s3 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i + 24),
+                             _mm512_loadu_pd(y + i + 24), s3);
+    }
+    for(; i + 8 <= n; i += 8) {
+        s0 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i),
+                             _mm512_loadu_pd(y + i), s0);
+    }
+    if(i < n) {
+        const __mmask8 m = __mmask8((1u << (n - i)) - 1);
+        s1 = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, x + i),
+                             _mm512_maskz_loadu_pd(m, y + i), s1);
+    }
+    s0 = _mm512_add_pd(_mm512_add_pd(s0, s1), _mm512_add_pd(s2, s3));
+    double r[8];
+    _mm512_storeu_pd(r, s0);
+    for(int k = 4; k > 0; k /= 2)
+        for(int j = 0; j != k; ++j) r[j] += r[j + k];
+    return r[0];
+}
+
+__attribute__((target("avx512f")))
+inline float dot_avx512(const float* x, const float* y, size_t n) {
+    __m512 s0 = _mm512_setzero_ps();
+    __m512 s1 = _mm512_setzero_ps();
+    __m512 s2 = _mm512_setzero_ps();
+    __m512 s3 = _mm512_setzero_ps();
+    size_t i = 0;
+    for(; i + 64 <= n; i += 64) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i),
+                             _mm512_loadu_ps(y + i), s0);
+        s1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16),
+                             _mm512_loadu_ps(y + i + 16), s1);
+        s2 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 32),
+                             _mm512_loadu_ps(y + i + 32), s2);
+        s3 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 48),
+                             _mm512_loadu_ps(y + i + 48), s3);
+    }
+    for(; i + 16 <= n; i += 16) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i),
+                             _mm512_loadu_ps(y + i), s0);
+    }
+    if(i < n) {
+        const __mmask16 m = __mmask16((1u << (n - i)) - 1);
+        s1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, x + i),
+                             _mm512_maskz_loadu_ps(m, y + i), s1);
+    }
+    s0 = _mm512_add_ps(_mm512_add_ps(s0, s1), _mm512_add_ps(s2, s3));
+    float r[16];
+    _mm512_storeu_ps(r, s0);
+    for(int k = 8; k > 0; k /= 2)
+        for(int j = 0; j != k; ++j) r[j] += r[j + k];
+    return r[0];
+}
+#endif
+
+//------------------------------------------------------------------------------
+template < typename T >
+T dot(ISA isa, const T* x, const T* y, size_t n) {
+#ifdef HOST_REDUCE_X86
+    if(isa == AVX512) return dot_avx512(x, y, n);
+    if(isa == AVX2) return dot_avx2(x, y, n);
+#endif
+    return dot_scalar(x, y, n);
+}
+
+} //namespace host_reduce_detail
+
+//------------------------------------------------------------------------------
+//thread pool and reductions; the public functions must be called from a
+//single thread at a time
+class HostReduce {
+public:
+    //numThreads == 0: one thread per CPU available to the process; if pin
+    //is true thread i is bound to the i-th available CPU
+    explicit HostReduce(int numThreads = 0, bool pin = true);
+    //stops and joins the threads
+    ~HostReduce();
+    int threads() const { return int(workers_.size()); }
+    //instruction set used by the reductions: scalar, avx2 or avx512
+    const char* isa() const;
+    //allocates n elements aligned to a cache line without touching the
+    //memory, release with deallocate
+    template < typename T >
+    static T* allocate(size_t n);
+    static void deallocate(void* p) { free(p); }
+    //zero-fills the n elements of p, each thread writing the elements it
+    //processes in the reductions: on NUMA systems the pages of memory
+    //returned by allocate are placed on the node of the thread that first
+    //writes them
+    template < typename T >
+    void first_touch(T* p, size_t n);
+    //dot product of the first n elements of x and y; with pinned threads
+    //and first-touched inputs each thread reads memory local to its node
+    template < typename T >
+    T dot(const T* x, const T* y, size_t n);
+private:
+    //invoked by each thread with its index and the number of threads
+    typedef void (*Task)(void* data, int thread, int threads);
+    struct Worker {
+        HostReduce* pool;
+        int index;
+        int cpu; //-1: not pinned
+        pthread_t thread;
+    };
+    template < typename T >
+    struct FillTask {
+        T* p;
+        size_t n;
+    };
+    template < typename T >
+    struct DotTask {
+        const T* x;
+        const T* y;
+        size_t n;
+        host_reduce_detail::ISA isa;
+        std::vector< T > partial;
+    };
+    HostReduce(const HostReduce&);
+    HostReduce& operator=(const HostReduce&);
+    //range of elements processed by thread: contiguous chunks starting
+    //on a cache line boundary
+    template < typename T >
+    static void partition(size_t n, int thread, int threads,
+                          size_t& begin, size_t& end);
+    template < typename T >
+    static void fill_task(void* data, int thread, int threads);
+    template < typename T >
+    static void dot_task(void* data, int thread, int threads);
+    static void* worker(void* arg);
+    //runs task on all the threads and waits for completion
+    void run(Task task, void* data);
+    std::vector< Worker > workers_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t start_;
+    pthread_cond_t done_;
+    Task task_;
+    void* data_;
+    unsigned long generation_;
+    int pending_;
+    bool quit_;
+    host_reduce_detail::ISA isa_;
+};
+
+//------------------------------------------------------------------------------
+inline HostReduce::HostReduce(int numThreads, bool pin)
+    : task_(0), data_(0), generation_(0), pending_(0), quit_(false),
+      isa_(host_reduce_detail::SCALAR) {
+    using namespace host_reduce_detail;
+#ifdef HOST_REDUCE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) isa_ = AVX512;
+    else if(__builtin_cpu_supports("avx2")
+            && __builtin_cpu_supports("fma")) isa_ = AVX2;
+#endif
+    const char* env = getenv("HOST_REDUCE_ISA");
+    if(env != 0 && strcmp(env, "scalar") == 0) isa_ = SCALAR;
+    else if(env != 0 && strcmp(env, "avx2") == 0) isa_ = std::min(isa_, AVX2);
+    //CPUs available to the process, e.g. restricted by the job scheduler
+    std::vector< int > cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for(int c = 0; c != CPU_SETSIZE; ++c)
+            if(CPU_ISSET(c, &set)) cpus.push_back(c);
+    }
+#endif
+    if(numThreads <= 0) {
+        numThreads = cpus.empty() ? int(sysconf(_SC_NPROCESSORS_ONLN))
+                                  : int(cpus.size());
+        numThreads = std::max(1, numThreads);
+    }
+    pthread_mutex_init(&mutex_, 0);
+    pthread_cond_init(&start_, 0);
+    pthread_cond_init(&done_, 0);
+    workers_.resize(numThreads);
+    for(int i = 0; i != numThreads; ++i) {
+        workers_[i].pool = this;
+        workers_[i].index = i;
+        workers_[i].cpu = pin && !cpus.empty() ? cpus[i % cpus.size()] : -1;
+        pthread_create(&workers_[i].thread, 0, worker, &workers_[i]);
+    }
+}
+
+//------------------------------------------------------------------------------
+inline HostReduce::~HostReduce() {
+    pthread_mutex_lock(&mutex_);
+    quit_ = true;
+    pthread_cond_broadcast(&start_);
+    pthread_mutex_unlock(&mutex_);
+    for(size_t i = 0; i != workers_.size(); ++i)
+        pthread_join(workers_[i].thread, 0);
+    pthread_cond_destroy(&done_);
+    pthread_cond_destroy(&start_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+//------------------------------------------------------------------------------
+inline const char* HostReduce::isa() const {
+    const char* names[] = {"scalar", "avx2", "avx512"};
+    return names[isa_];
+}
+
+//------------------------------------------------------------------------------
+inline void* HostReduce::worker(void* arg) {
+    Worker* w = static_cast< Worker* >(arg);
+    HostReduce* pool = w->pool;
+#ifdef __linux__
+    if(w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+    unsigned long generation = 0;
+    pthread_mutex_lock(&pool->mutex_);
+    while(true) {
+        while(pool->generation_ == generation && !pool->quit_)
+            pthread_cond_wait(&pool->start_, &pool->mutex_);
+        if(pool->quit_) break;
+        generation = pool->generation_;
+        const Task task = pool->task_;
+        void* data = pool->data_;
+        pthread_mutex_unlock(&pool->mutex_);
+        task(data, w->index, pool->threads());
+        pthread_mutex_lock(&pool->mutex_);
+        if(--pool->pending_ == 0) pthread_cond_signal(&pool->done_);
+    }
+    pthread_mutex_unlock(&pool->mutex_);
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+inline void HostReduce::run(Task task, void* data) {
+    pthread_mutex_lock(&mutex_);
+    task_ = task;
+    data_ = data;
+    pending_ = threads();
+    ++generation_;
+    pthread_cond_broadcast(&start_);
+    while(pending_ > 0) pthread_cond_wait(&done_, &mutex_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+//------------------------------------------------------------------------------
+template < typename T >
+T* HostReduce::allocate(size_t n) {
+    void* p = 0;
+    if(posix_memalign(&p, 64, n * sizeof(T)) != 0) return 0;
+    return static_cast< T* >(p);
+}
+
+//------------------------------------------------------------------------------
+template < typename T >
+void HostReduce::partition(size_t n, int thread, int threads,
+                           size_t& begin, size_t& end) {
+    const size_t LINE = 64 / sizeof(T) > 0 ? 64 / sizeof(T) : 1;
+    const size_t lines = (n + LINE - 1) / LINE;
+    begin = std::min(n, lines * thread / threads * LINE);
+    end = std::min(n, lines * (thread + 1) / threads * LINE);
+}
+
+//------------------------------------------------------------------------------
+template < typename T >
+void HostReduce::fill_task(void* data, int thread, int threads) {
+    FillTask< T >* t = static_cast< FillTask< T >* >(data);
+    size_t begin = 0;
+    size_t end = 0;
+    partition< T >(t->n, thread, threads, begin, end);
+    std::fill(t->p + begin, t->p + end, T(0));
+}
+
+//------------------------------------------------------------------------------
+template < typename T >
+void HostReduce::first_touch(T* p, size_t n) {
+    FillTask< T > t = {p, n};
+    run(fill_task< T >, &t);
+}
+
+//------------------------------------------------------------------------------
+template < typename T >
+void HostReduce::dot_task(void* data, int thread, int threads) {
+    DotTask< T >* t = static_cast< DotTask< T >* >(data);
+    size_t begin = 0;
+    size_t end = 0;
+    partition< T >(t->n, thread, threads, begin, end);
+    t->partial[thread] = host_reduce_detail::dot(t->isa, t->x + begin,
+                                                 t->y + begin, end - begin);
+}
+
+//------------------------------------------------------------------------------
+template < typename T >
+T HostReduce::dot(const T* x, const T* y, size_t n) {
+    DotTask< T > t;
+    t.x = x;
+    t.y = y;
+    t.n = n;
+    t.isa = isa_;
+    t.partial.resize(threads());
+    run(dot_task< T >, &t);
+    return std::accumulate(t.partial.begin(), t.partial.end(), T(0));
+}
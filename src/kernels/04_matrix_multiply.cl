@@ -1,12 +1,15 @@
 //Matrix - matrix multiply: trivial and block version; #defines
 //have to be set from the driver program for this code to compile;
-//only square matrices supported
+//C (a_rows x b_columns) = A (a_rows x a_columns) x B (a_columns x b_columns)
+//with arbitrary sizes: work items outside the matrix bounds do not write
+//and elements outside A and B are read as zero
 //Author: Ugo Varetto
 
-//BLOCK_SIZE and DOUBLE are defined from outside the kernel
-//by prefixing this code with proper #define statements from within
+//BLOCK_SIZE, TM, TN, ACCUMULATE, HALF and DOUBLE are defined from outside
+//the kernel by prefixing this code with proper #define statements from within
 //the driver program;
-//launch with 2d grid = [size, size]
+//launch with 2d grid = [b_columns, a_rows] rounded up to a multiple of
+//the work group size
 //in order to take advantage of caching and coalescing the
 //elements which are contiguous in memory must map to the
 //fastest moving index i.e. for row major matrices the column
@@ -15,51 +18,96 @@
 #ifdef DOUBLE
 #pragma OPENCL EXTENSION cl_khr_fp64: enable
 typedef double real_t;
+typedef double4 real4_t;
 #else
 typedef float real_t;
+typedef float4 real4_t;
+#endif
+
+//if HALF is defined A and B are stored as 16 bit floating point numbers and
+//converted to float when loaded through vload_half, which does not require
+//the cl_khr_fp16 extension: memory footprint and traffic of the inputs are
+//halved, products are accumulated and C is stored in single precision;
+//the transpose kernel reads and writes half values
+#ifdef HALF
+#ifdef DOUBLE
+#error "HALF and DOUBLE cannot be both defined"
+#endif
+typedef half input_t;
+//async_work_group_copy does not accept half pointers without cl_khr_fp16:
+//half elements are copied as 16 bit integers
+typedef ushort copy_t;
+#define LOAD(m, i) vload_half((i), (m))
+#define STORE_INPUT(m, i, v) vstore_half((v), (i), (m))
+#else
+typedef real_t input_t;
+typedef real_t copy_t;
+#define LOAD(m, i) (m)[i]
+#define STORE_INPUT(m, i, v) (m)[i] = (v)
+#endif
+
+//if ACCUMULATE is defined the kernels compute C += A x B instead of
+//C = A x B, used to sum the contributions of tiles along the inner dimension
+#ifdef ACCUMULATE
+#define STORE(c, v) (c) += (v)
+#else
+#define STORE(c, v) (c) = (v)
+#endif
+
+//register tile size of block_matmul_reg
+#ifndef TM
+#define TM 1
+#endif
+#ifndef TN
+#define TN 1
 #endif
 
 
 //------------------------------------------------------------------------------
 //trivial matrix-matrix multiply one thread per output element 
-__kernel void matmul(__global const real_t* A,
-                     __global const real_t* B,
+__kernel void matmul(__global const input_t* A,
+                     __global const input_t* B,
                      __global real_t* C,
-                   int columns) {
+                     int a_rows,
+                     int a_columns,
+                     int b_columns) {
     const int col = get_global_id(0);
     const int row = get_global_id(1);
+    if(row >= a_rows || col >= b_columns) return;
     real_t e = 0;
-    for(int c = 0; c != columns; ++c) {
-         e +=  A[row * columns + c] * B[c * columns + col ]; 
+    for(int c = 0; c != a_columns; ++c) {
+         e += LOAD(A, row * a_columns + c) * LOAD(B, c * b_columns + col);
     }
-    C[row * columns + col] = e;
+    STORE(C[row * b_columns + col], e);
 }
 
 //------------------------------------------------------------------------------
 //return matrix element given matrix size, block size, block coordinates
-//and local (row,column) coordinates 
-real_t get_matrix_element(__global const real_t* m, //matrix
+//and local (row,column) coordinates; zero if outside the matrix
+real_t get_matrix_element(__global const input_t* m, //matrix
                           int blockSize,   //block size
                           int blockCol,    //column index of output block 
                           int blockRow,    //row index of output row
                           int col,         //local column index of block element
                           int row,         //local row index of block element 
+                          int num_rows,    //number of rows of matrix 'm'
                           int num_columns  //number of columns of matrix 'm'
                           ) {                                           
-  
-    return m[( blockRow * blockSize + row ) * num_columns
-           + blockCol * blockSize + col];
-
+    const int r = blockRow * blockSize + row;
+    const int c = blockCol * blockSize + col;
+    return r < num_rows && c < num_columns ? LOAD(m, r * num_columns + c) : 0;
 }
 
 //------------------------------------------------------------------------------
 //block matrix multiply; elements are first copied into local memory before
 //processing
 //work item size must be exactly BLOCK_SIZE x BLOCK_SIZE
-__kernel void block_matmul(__global const real_t* A,
-                           __global const real_t* B,
+__kernel void block_matmul(__global const input_t* A,
+                           __global const input_t* B,
                            __global real_t* C,
-                           int columns) {
+                           int a_rows,
+                           int a_columns,
+                           int b_columns) {
 
     const int row = get_local_id(1);
     const int col = get_local_id(0);
@@ -68,19 +116,22 @@ __kernel void block_matmul(__global const real_t* A,
 	__local real_t a[BLOCK_SIZE][BLOCK_SIZE];
 	__local real_t b[BLOCK_SIZE][BLOCK_SIZE]; 
     real_t out = 0;
-    //iterate over rows of blocks in a and columns of blocks in b
-    for( int blockId = 0; blockId < columns / BLOCK_SIZE; ++blockId ) {
+    //iterate over rows of blocks in a and columns of blocks in b; the last
+    //block is partially filled with zeros if a_columns is not a multiple
+    //of BLOCK_SIZE
+    const int blocks = (a_columns + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for( int blockId = 0; blockId < blocks; ++blockId ) {
     //copy data into shared memory
         a[row ][col] = 
     	   get_matrix_element(A, BLOCK_SIZE,
     	                      blockId, // <-- column id of block
     	                      blockRow,// <-- row id of block
-    	                      col, row, columns);
+    	                      col, row, a_rows, a_columns);
         b[row ][col] = 
     	   get_matrix_element(B, BLOCK_SIZE,
     	                      blockCol, // <-- column id of block
     	                      blockId,  // <-- row id of block
-    	                      col, row, columns );
+    	                      col, row, a_columns, b_columns);
         // barrier required to guarantee that data are computed before next step
         // where a thread accesses data computed by other threads
         barrier(CLK_LOCAL_MEM_FENCE); 
@@ -89,7 +140,228 @@ __kernel void block_matmul(__global const real_t* A,
         }
         barrier(CLK_LOCAL_MEM_FENCE);  
     }
-    C[(blockRow * BLOCK_SIZE + row) * columns
-       + blockCol * BLOCK_SIZE + col ] = out;     
+    //work items in edge blocks outside C take part in the copies but do
+    //not write
+    const int r = blockRow * BLOCK_SIZE + row;
+    const int c = blockCol * BLOCK_SIZE + col;
+    if(r < a_rows && c < b_columns) STORE(C[r * b_columns + c], out);     
+}
+
+//------------------------------------------------------------------------------
+//starts the asynchronous copy of the BLOCK_SIZE x BLOCK_SIZE block of m with
+//top left element (rowBase, colBase) into the local buffer dst, one
+//async_work_group_copy per row; the elements of edge blocks outside the
+//matrix are zeroed by the work items, and are visible to the other work
+//items after the next barrier; the block must contain at least one element
+//of the matrix, which is always the case for the blocks of A and B read by
+//block_matmul_async
+event_t copy_block_async(__local input_t* dst,
+                         __global const input_t* m,
+                         int rowBase,
+                         int colBase,
+                         int num_rows,
+                         int num_columns) {
+    const int rows = min(num_rows - rowBase, BLOCK_SIZE);
+    const int columns = min(num_columns - colBase, BLOCK_SIZE);
+    __local copy_t* d = (__local copy_t*) dst;
+    __global const copy_t* src =
+        (__global const copy_t*) m + rowBase * num_columns + colBase;
+    event_t e = async_work_group_copy(d, src, columns, 0);
+    for(int r = 1; r < rows; ++r) {
+        e = async_work_group_copy(d + r * BLOCK_SIZE, src + r * num_columns,
+                                  columns, e);
+    }
+    const int row = get_local_id(1);
+    const int col = get_local_id(0);
+    if(row >= rows || col >= columns) {
+        STORE_INPUT(dst, row * BLOCK_SIZE + col, (real_t)0);
+    }
+    return e;
+}
+
+//------------------------------------------------------------------------------
+//block matrix multiply with asynchronous prefetch: blocks are copied into two
+//local buffers per matrix with async_work_group_copy; the copy of the next
+//pair of blocks is started before multiplying the current pair and waited
+//for at the beginning of the next iteration, so that the transfer overlaps
+//the computation; a single barrier per iteration is required since the
+//buffers written by the prefetch were last read in the previous iteration
+//work item size must be exactly BLOCK_SIZE x BLOCK_SIZE
+__kernel void block_matmul_async(__global const input_t* A,
+                                 __global const input_t* B,
+                                 __global real_t* C,
+                                 int a_rows,
+                                 int a_columns,
+                                 int b_columns) {
+    const int row = get_local_id(1);
+    const int col = get_local_id(0);
+    const int rowBase = get_group_id(1) * BLOCK_SIZE;
+    const int colBase = get_group_id(0) * BLOCK_SIZE;
+    //copy_t: half is only allowed as a pointer type without cl_khr_fp16
+    __local copy_t a[2][BLOCK_SIZE * BLOCK_SIZE];
+    __local copy_t b[2][BLOCK_SIZE * BLOCK_SIZE];
+    event_t ea = copy_block_async((__local input_t*) a[0], A, rowBase, 0,
+                                  a_rows, a_columns);
+    event_t eb = copy_block_async((__local input_t*) b[0], B, 0, colBase,
+                                  a_columns, b_columns);
+    real_t out = 0;
+    const int blocks = (a_columns + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for(int blockId = 0; blockId < blocks; ++blockId) {
+        const int cur = blockId % 2;
+        wait_group_events(1, &ea);
+        wait_group_events(1, &eb);
+        //the current blocks are complete, including the zeroed elements,
+        //and all the work items are done with the other buffers
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if(blockId + 1 < blocks) {
+            const int k0 = (blockId + 1) * BLOCK_SIZE;
+            ea = copy_block_async((__local input_t*) a[1 - cur], A,
+                                  rowBase, k0, a_rows, a_columns);
+            eb = copy_block_async((__local input_t*) b[1 - cur], B,
+                                  k0, colBase, a_columns, b_columns);
+        }
+        for(int k = 0; k != BLOCK_SIZE; ++k) {
+            out += LOAD((__local input_t*) a[cur], row * BLOCK_SIZE + k)
+                   * LOAD((__local input_t*) b[cur], k * BLOCK_SIZE + col);
+        }
+    }
+    const int r = rowBase + row;
+    const int c = colBase + col;
+    if(r < a_rows && c < b_columns) STORE(C[r * b_columns + c], out);
+}
+
+//------------------------------------------------------------------------------
+//register blocked matrix multiply: each work item computes a TM x TN tile
+//of C kept in private memory, each work group a (BLOCK_SIZE * TM) x
+//(BLOCK_SIZE * TN) block; at each step a (BLOCK_SIZE * TM) x BLOCK_SIZE
+//block of A and a BLOCK_SIZE x (BLOCK_SIZE * TN) block of B are copied into
+//local memory and every element read from local memory is reused TN (A) or
+//TM (B) times from registers.
+//The elements of a tile are BLOCK_SIZE rows/columns apart so that work items
+//with consecutive ids access consecutive addresses.
+//work item size must be exactly BLOCK_SIZE x BLOCK_SIZE;
+//launch with 2d grid = [b_columns / TN, a_rows / TM] rounded up to a
+//multiple of BLOCK_SIZE
+__kernel void block_matmul_reg(__global const input_t* A,
+                               __global const input_t* B,
+                               __global real_t* C,
+                               int a_rows,
+                               int a_columns,
+                               int b_columns) {
+    const int row = get_local_id(1);
+    const int col = get_local_id(0);
+    const int rowBase = get_group_id(1) * BLOCK_SIZE * TM;
+    const int colBase = get_group_id(0) * BLOCK_SIZE * TN;
+    __local real_t a[BLOCK_SIZE * TM][BLOCK_SIZE];
+    __local real_t b[BLOCK_SIZE][BLOCK_SIZE * TN];
+    real_t out[TM][TN];
+    real_t bcol[TN];
+    for(int i = 0; i != TM; ++i) {
+        for(int j = 0; j != TN; ++j) out[i][j] = 0;
+    }
+    for(int k0 = 0; k0 < a_columns; k0 += BLOCK_SIZE) {
+        //copy data into shared memory: TM elements of A and TN elements
+        //of B per work item, zero outside the matrices
+        for(int i = 0; i != TM; ++i) {
+            const int r = rowBase + row + i * BLOCK_SIZE;
+            a[row + i * BLOCK_SIZE][col] =
+                r < a_rows && k0 + col < a_columns ?
+                LOAD(A, r * a_columns + k0 + col) : 0;
+        }
+        for(int j = 0; j != TN; ++j) {
+            const int c = colBase + col + j * BLOCK_SIZE;
+            b[row][col + j * BLOCK_SIZE] =
+                k0 + row < a_columns && c < b_columns ?
+                LOAD(B, (k0 + row) * b_columns + c) : 0;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for(int k = 0; k != BLOCK_SIZE; ++k) {
+            for(int j = 0; j != TN; ++j) bcol[j] = b[k][col + j * BLOCK_SIZE];
+            for(int i = 0; i != TM; ++i) {
+                const real_t e = a[row + i * BLOCK_SIZE][k];
+                for(int j = 0; j != TN; ++j) out[i][j] += e * bcol[j];
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    for(int i = 0; i != TM; ++i) {
+        const int r = rowBase + row + i * BLOCK_SIZE;
+        if(r >= a_rows) break;
+        for(int j = 0; j != TN; ++j) {
+            const int c = colBase + col + j * BLOCK_SIZE;
+            if(c < b_columns) STORE(C[r * b_columns + c], out[i][j]);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//pack kernel: out (columns x rows) = transpose of in (rows x columns);
+//the block is transposed in local memory so that both reads and writes
+//are contiguous; the extra column avoids local memory bank conflicts
+//work item size must be exactly BLOCK_SIZE x BLOCK_SIZE;
+//launch with 2d grid = [columns, rows] rounded up to a multiple of BLOCK_SIZE
+__kernel void transpose(__global const input_t* in,
+                        __global input_t* out,
+                        int rows,
+                        int columns) {
+    __local real_t t[BLOCK_SIZE][BLOCK_SIZE + 1];
+    const int row = get_local_id(1);
+    const int col = get_local_id(0);
+    const int blockRow = get_group_id(1) * BLOCK_SIZE;
+    const int blockCol = get_group_id(0) * BLOCK_SIZE;
+    if(blockRow + row < rows && blockCol + col < columns) {
+        t[row][col] = LOAD(in, (blockRow + row) * columns + blockCol + col);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    //row 'row' of the output block is column 'row' of the input block
+    if(blockCol + row < columns && blockRow + col < rows) {
+        STORE_INPUT(out, (blockCol + row) * rows + blockRow + col,
+                    t[col][row]);
+    }
 }
 
+//------------------------------------------------------------------------------
+//block matrix multiply with transposed B: Bt is b_columns x a_columns, i.e.
+//row i of Bt is column i of B, as generated by the transpose kernel;
+//both blocks are copied from rows of A and Bt, and the dot products in the
+//inner loop are computed on contiguous elements of the local blocks with
+//4-element vector loads if BLOCK_SIZE is a multiple of 4
+//work item size must be exactly BLOCK_SIZE x BLOCK_SIZE
+__kernel void block_matmul_tn(__global const input_t* A,
+                              __global const input_t* Bt,
+                              __global real_t* C,
+                              int a_rows,
+                              int a_columns,
+                              int b_columns) {
+    const int row = get_local_id(1);
+    const int col = get_local_id(0);
+    const int r = get_group_id(1) * BLOCK_SIZE + row;
+    const int c = get_group_id(0) * BLOCK_SIZE + col;
+    __local real_t a[BLOCK_SIZE][BLOCK_SIZE];
+    __local real_t bt[BLOCK_SIZE][BLOCK_SIZE];
+    //row of Bt copied by this work item
+    const int btRow = get_group_id(0) * BLOCK_SIZE + row;
+#if BLOCK_SIZE % 4 == 0
+    real4_t out4 = 0;
+#endif
+    real_t out = 0;
+    for(int k0 = 0; k0 < a_columns; k0 += BLOCK_SIZE) {
+        a[row][col] = r < a_rows && k0 + col < a_columns ?
+                      LOAD(A, r * a_columns + k0 + col) : 0;
+        bt[row][col] = btRow < b_columns && k0 + col < a_columns ?
+                       LOAD(Bt, btRow * a_columns + k0 + col) : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+#if BLOCK_SIZE % 4 == 0
+        for(int k = 0; k != BLOCK_SIZE / 4; ++k) {
+            out4 += vload4(k, &a[row][0]) * vload4(k, &bt[col][0]);
+        }
+#else
+        for(int k = 0; k != BLOCK_SIZE; ++k) out += a[row][k] * bt[col][k];
+#endif
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+#if BLOCK_SIZE % 4 == 0
+    out = out4.x + out4.y + out4.z + out4.w;
+#endif
+    if(r < a_rows && c < b_columns) STORE(C[r * b_columns + c], out);
+}
@@ -47,4 +47,67 @@ __kernel void dotprod(__global const real_t* v1,
     //local work item 0 takes care of copying the data into
     //the output buffer at position equal to this workgroup id
     if(cache_idx == 0) reduced[get_group_id(0)] = cache[0];
-}
\ No newline at end of file
+}
+
+//------------------------------------------------------------------------------
+//tree reduction of the BLOCK_SIZE elements of cache, result in cache[0];
+//cache must be up to date when called
+void reduce_cache(__local real_t* cache) {
+    const int cache_idx = get_local_id(0);
+    for(int step = BLOCK_SIZE / 2; step > 0; step /= 2) {
+        if(cache_idx < step) cache[cache_idx] += cache[cache_idx + step];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+//------------------------------------------------------------------------------
+//single pass dot product: each workgroup stores its partial dot product in
+//reduced; the last workgroup to complete, detected through an atomic counter,
+//sums all the partial dot products and stores the result in result[0].
+//counter must be zero before the first launch and is reset by the last
+//workgroup, so that the kernel can be launched again with no initialization.
+//Only compiled if 32 bit global atomics are available: core in OpenCL 1.1,
+//cl_khr_global_int32_base_atomics extension in OpenCL 1.0
+#if __OPENCL_VERSION__ >= 110 || defined(cl_khr_global_int32_base_atomics)
+#if __OPENCL_VERSION__ < 110
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics: enable
+#define atomic_inc atom_inc
+#endif
+__kernel void dotprod_single_pass(__global const real_t* v1,
+                                  __global const real_t* v2,
+                                  __global real_t* reduced,
+                                  __global real_t* result,
+                                  __global int* counter) {
+    __local real_t cache[BLOCK_SIZE];
+    __local int last;
+    const int cache_idx = get_local_id(0);
+    const int id = get_global_id(0);
+    cache[cache_idx] = v1[id] * v2[id];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    reduce_cache(cache);
+    if(cache_idx == 0) {
+        reduced[get_group_id(0)] = cache[0];
+        //the partial dot product must be visible to the other workgroups
+        //before the counter is incremented
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+        last = atomic_inc(counter) == (int) get_num_groups(0) - 1;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    //same value for all the work items: no divergent barriers
+    if(!last) return;
+    //last workgroup: each work item sums a strided subset of the partial
+    //dot products, read through a volatile pointer to bypass caches
+    volatile __global const real_t* partial = reduced;
+    real_t s = 0;
+    for(int i = cache_idx; i < (int) get_num_groups(0); i += BLOCK_SIZE) {
+        s += partial[i];
+    }
+    cache[cache_idx] = s;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    reduce_cache(cache);
+    if(cache_idx == 0) {
+        result[0] = cache[0];
+        *counter = 0;
+    }
+}
+#endif
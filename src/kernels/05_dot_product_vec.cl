@@ -94,4 +94,171 @@ __kernel void dotprod(__global const vec_real_t* v1,
     //local work item 0 takes care of copying the data into
     //the output buffer at position equal to this workgroup id
     if(cache_idx == 0) reduced[get_group_id(0)] = cache[0];
-}
\ No newline at end of file
+}
+
+//------------------------------------------------------------------------------
+//tree reduction of the BLOCK_SIZE elements of cache, result in cache[0];
+//cache must be up to date when called
+void reduce_cache(__local real_t* cache) {
+    const int cache_idx = get_local_id(0);
+    for(int step = BLOCK_SIZE / 2; step > 0; step /= 2) {
+        if(cache_idx < step) cache[cache_idx] += cache[cache_idx + step];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+//------------------------------------------------------------------------------
+//single pass dot product: each workgroup stores its partial dot product in
+//reduced; the last workgroup to complete, detected through an atomic counter,
+//sums all the partial dot products and stores the result in result[0].
+//counter must be zero before the first launch and is reset by the last
+//workgroup, so that the kernel can be launched again with no initialization.
+//Only compiled if 32 bit global atomics are available: core in OpenCL 1.1,
+//cl_khr_global_int32_base_atomics extension in OpenCL 1.0
+#if __OPENCL_VERSION__ >= 110 || defined(cl_khr_global_int32_base_atomics)
+#if __OPENCL_VERSION__ < 110
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics: enable
+#define atomic_inc atom_inc
+#endif
+__kernel void dotprod_single_pass(__global const vec_real_t* v1,
+                                  __global const vec_real_t* v2,
+                                  __global real_t* reduced,
+                                  __global real_t* result,
+                                  __global int* counter) {
+    __local real_t cache[BLOCK_SIZE];
+    __local int last;
+    const int cache_idx = get_local_id(0);
+    const int id = get_global_id(0);
+    const vec_real_t r = v1[id] * v2[id];
+    cache[cache_idx] = VEC_SUM(r);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    reduce_cache(cache);
+    if(cache_idx == 0) {
+        reduced[get_group_id(0)] = cache[0];
+        //the partial dot product must be visible to the other workgroups
+        //before the counter is incremented
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+        last = atomic_inc(counter) == (int) get_num_groups(0) - 1;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    //same value for all the work items: no divergent barriers
+    if(!last) return;
+    //last workgroup: each work item sums a strided subset of the partial
+    //dot products, read through a volatile pointer to bypass caches
+    volatile __global const real_t* partial = reduced;
+    real_t s = 0;
+    for(int i = cache_idx; i < (int) get_num_groups(0); i += BLOCK_SIZE) {
+        s += partial[i];
+    }
+    cache[cache_idx] = s;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    reduce_cache(cache);
+    if(cache_idx == 0) {
+        result[0] = cache[0];
+        *counter = 0;
+    }
+}
+#endif
+
+//------------------------------------------------------------------------------
+//grid stride dot product: launched with a fixed number of workgroups, a small
+//multiple of the number of compute units, independent of the input size;
+//each work item accumulates in private memory the products of elements
+//id, id + global size, id + 2 x global size... and the local reduction is
+//performed once per workgroup; n is the number of vector elements and does
+//not need to be a multiple of the global size
+__kernel void dotprod_grid_stride(__global const vec_real_t* v1,
+                                  __global const vec_real_t* v2,
+                                  __global real_t* reduced,
+                                  int n) {
+    __local real_t cache[BLOCK_SIZE];
+    const int cache_idx = get_local_id(0);
+    const int stride = get_global_size(0);
+    vec_real_t s = 0;
+    for(int i = get_global_id(0); i < n; i += stride) s += v1[i] * v2[i];
+    cache[cache_idx] = VEC_SUM(s);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    reduce_cache(cache);
+    if(cache_idx == 0) reduced[get_group_id(0)] = cache[0];
+}
+
+//------------------------------------------------------------------------------
+//compensated arithmetic: error free transformations, exact as long as the
+//program is not built with -cl-unsafe-math-optimizations or
+//-cl-fast-relaxed-math, which allow reassociation
+//s + e == a + b; s can be the same variable as a or b
+#define TWO_SUM(T, a, b, s, e) { \
+    const T a_ = (a); \
+    const T b_ = (b); \
+    const T s_ = a_ + b_; \
+    const T z_ = s_ - a_; \
+    e = (a_ - (s_ - z_)) + (b_ - z_); \
+    s = s_; \
+}
+//p + e == a * b; fma is emulated in software on devices with no hardware
+//support
+#define TWO_PRODUCT(a, b, p, e) { \
+    p = (a) * (b); \
+    e = fma(a, b, -p); \
+}
+
+//------------------------------------------------------------------------------
+//tree reduction of the BLOCK_SIZE (sum, compensation) pairs in local memory,
+//result in hi[0], lo[0]
+void reduce_cache_compensated(__local real_t* hi, __local real_t* lo) {
+    const int cache_idx = get_local_id(0);
+    for(int step = BLOCK_SIZE / 2; step > 0; step /= 2) {
+        if(cache_idx < step) {
+            real_t s;
+            real_t e;
+            TWO_SUM(real_t, hi[cache_idx], hi[cache_idx + step], s, e);
+            hi[cache_idx] = s;
+            lo[cache_idx] += lo[cache_idx + step] + e;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+//------------------------------------------------------------------------------
+//grid stride dot product with compensated summation (Ogita, Rump, Oishi
+//Dot2 algorithm): the rounding errors of products and sums are accumulated
+//separately and added to the result at the end, as if computed in twice
+//the working precision; the partial dot product of each workgroup is
+//stored as a (sum, compensation) pair at reduced[2 * group id] and
+//reduced[2 * group id + 1]; the pairs have to be added on the host with
+//compensated summation as well
+__kernel void dotprod_compensated(__global const vec_real_t* v1,
+                                  __global const vec_real_t* v2,
+                                  __global real_t* reduced,
+                                  int n) {
+    __local real_t hi[BLOCK_SIZE];
+    __local real_t lo[BLOCK_SIZE];
+    const int cache_idx = get_local_id(0);
+    const int stride = get_global_size(0);
+    vec_real_t s = 0;
+    vec_real_t c = 0;
+    for(int i = get_global_id(0); i < n; i += stride) {
+        vec_real_t p;
+        vec_real_t pe;
+        vec_real_t se;
+        TWO_PRODUCT(v1[i], v2[i], p, pe);
+        TWO_SUM(vec_real_t, s, p, s, se);
+        c += pe + se;
+    }
+    //vector elements added with compensated summation as well
+    real_t h = ((real_t*) &s)[0];
+    real_t l = ((real_t*) &c)[0];
+    for(int k = 1; k < VEC_WIDTH; ++k) {
+        real_t e;
+        TWO_SUM(real_t, h, ((real_t*) &s)[k], h, e);
+        l += ((real_t*) &c)[k] + e;
+    }
+    hi[cache_idx] = h;
+    lo[cache_idx] = l;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    reduce_cache_compensated(hi, lo);
+    if(cache_idx == 0) {
+        reduced[2 * get_group_id(0)] = hi[0];
+        reduced[2 * get_group_id(0) + 1] = lo[0];
+    }
+}
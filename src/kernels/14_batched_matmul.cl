@@ -0,0 +1,137 @@
+//Batched matrix - matrix multiply: many small matrices of the same size
+//multiplied in a single launch; #defines have to be set from the driver
+//program for this code to compile
+
+//ROWS, INNER, COLUMNS: C (ROWS x COLUMNS) = A (ROWS x INNER) x
+//B (INNER x COLUMNS), row major
+//MATS_PER_GROUP: number of matrices computed by each work group; small
+//matrices are packed into a single work group, large ones use a full work
+//group with each work item computing more than one element
+//LOCAL_STAGING: if defined A and B are copied into local memory before
+//processing; the driver defines it only if the matrices of a work group fit
+//in the available local memory
+//DOUBLE: use double precision
+//launch with 1d grid = [number of groups * local size], where number of
+//groups = batch size / MATS_PER_GROUP rounded up; a global offset which is
+//a multiple of the local size can be used to process a subset of the groups
+
+#ifdef DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64: enable
+typedef double real_t;
+#else
+typedef float real_t;
+#endif
+
+#define A_SIZE (ROWS * INNER)
+#define B_SIZE (INNER * COLUMNS)
+#define C_SIZE (ROWS * COLUMNS)
+
+#ifdef LOCAL_STAGING
+#define STAGING_A (MATS_PER_GROUP * A_SIZE)
+#define STAGING_B (MATS_PER_GROUP * B_SIZE)
+#else
+#define STAGING_A 1
+#define STAGING_B 1
+#endif
+
+//------------------------------------------------------------------------------
+//multiplies the 'count' matrices of the work group; element offsets of
+//matrix m in A, B and C are offA[m], offB[m] and offC[m]
+void group_matmul(__global const real_t* A,
+                  __global const real_t* B,
+                  __global real_t* C,
+                  const int* offA,
+                  const int* offB,
+                  const int* offC,
+                  int count,
+                  __local real_t* a,
+                  __local real_t* b) {
+    const int lid = get_local_id(0);
+    const int lsize = get_local_size(0);
+#ifdef LOCAL_STAGING
+    //all the work items take part in the copy of all the matrices
+    for(int e = lid; e < count * A_SIZE; e += lsize) {
+        a[e] = A[offA[e / A_SIZE] + e % A_SIZE];
+    }
+    for(int e = lid; e < count * B_SIZE; e += lsize) {
+        b[e] = B[offB[e / B_SIZE] + e % B_SIZE];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+#endif
+    //one C element per iteration; consecutive work items compute
+    //consecutive elements of the same row
+    for(int e = lid; e < count * C_SIZE; e += lsize) {
+        const int m = e / C_SIZE;
+        const int row = (e % C_SIZE) / COLUMNS;
+        const int col = e % COLUMNS;
+#ifdef LOCAL_STAGING
+        __local const real_t* pa = a + m * A_SIZE + row * INNER;
+        __local const real_t* pb = b + m * B_SIZE + col;
+#else
+        __global const real_t* pa = A + offA[m] + row * INNER;
+        __global const real_t* pb = B + offB[m] + col;
+#endif
+        real_t out = 0;
+        for(int k = 0; k != INNER; ++k) out += pa[k] * pb[k * COLUMNS];
+        C[offC[m] + row * COLUMNS + col] = out;
+    }
+}
+
+//------------------------------------------------------------------------------
+//index of the first matrix and number of matrices of the work group; the
+//group index is computed from the global id to take the global offset
+//into account
+int first_matrix() {
+    return get_global_id(0) / get_local_size(0) * MATS_PER_GROUP;
+}
+
+//------------------------------------------------------------------------------
+//strided batch: matrix i starts at element i * stride{A,B,C} of
+//the corresponding buffer
+__kernel void batched_matmul(__global const real_t* A,
+                             __global const real_t* B,
+                             __global real_t* C,
+                             int batch,
+                             int strideA,
+                             int strideB,
+                             int strideC) {
+    __local real_t a[STAGING_A];
+    __local real_t b[STAGING_B];
+    const int first = first_matrix();
+    const int count = min(MATS_PER_GROUP, batch - first);
+    int offA[MATS_PER_GROUP];
+    int offB[MATS_PER_GROUP];
+    int offC[MATS_PER_GROUP];
+    for(int m = 0; m < count; ++m) {
+        offA[m] = (first + m) * strideA;
+        offB[m] = (first + m) * strideB;
+        offC[m] = (first + m) * strideC;
+    }
+    group_matmul(A, B, C, offA, offB, offC, count, a, b);
+}
+
+//------------------------------------------------------------------------------
+//indexed batch: element offsets of matrix i are read from
+//offsets{A,B,C}[i]; replaces arrays of pointers, which cannot be passed to
+//OpenCL 1.x kernels
+__kernel void batched_matmul_indexed(__global const real_t* A,
+                                     __global const real_t* B,
+                                     __global real_t* C,
+                                     __global const int* offsetsA,
+                                     __global const int* offsetsB,
+                                     __global const int* offsetsC,
+                                     int batch) {
+    __local real_t a[STAGING_A];
+    __local real_t b[STAGING_B];
+    const int first = first_matrix();
+    const int count = min(MATS_PER_GROUP, batch - first);
+    int offA[MATS_PER_GROUP];
+    int offB[MATS_PER_GROUP];
+    int offC[MATS_PER_GROUP];
+    for(int m = 0; m < count; ++m) {
+        offA[m] = offsetsA[first + m];
+        offB[m] = offsetsB[first + m];
+        offC[m] = offsetsC[first + m];
+    }
+    group_matmul(A, B, C, offA, offB, offC, count, a, b);
+}
@@ -0,0 +1,166 @@
+//Generic parallel reduction: operators, element type and vector width are
+//injected by the host code through #defines prefixed to the source, see
+//CLReduce in clutil.h
+
+//MAP(x, y): expression mapping the elements x of the first input and y of
+//the second input to the value to reduce; y is only read if used in the
+//expression; applied to vectors of VEC_WIDTH elements, i.e. it must only
+//use operators and built-in functions supporting vector types
+//COMBINE(a, b): expression combining two values; if INDEX is defined it is
+//a boolean expression, true if a is preferred over b, and the index of the
+//selected element is computed as well; ties are resolved in favor of the
+//lowest index. Without INDEX it must support vector types
+//IDENTITY: neutral element of COMBINE
+//BLOCK_SIZE: local work size, power of two
+//VEC_WIDTH: number of elements per load: 1, 2, 4, 8 or 16
+//DOUBLE: use double precision
+//reduce stores one partial result per work group, reduce_partials combines
+//the partial results and is launched with a single work group
+
+#ifdef DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64: enable
+#define REAL double
+#else
+#define REAL float
+#endif
+
+#define CONCAT_(a, b) a##b
+#define CONCAT(a, b) CONCAT_(a, b)
+
+typedef REAL real_t;
+#if VEC_WIDTH == 1
+typedef real_t vec_real_t;
+#define LOAD(i, p) (p)[i]
+#else
+typedef CONCAT(REAL, VEC_WIDTH) vec_real_t;
+#define LOAD(i, p) CONCAT(vload, VEC_WIDTH)(i, p)
+#endif
+
+//k-th element of a private vector
+#define LANE(v, k) ((const real_t*) &(v))[k]
+
+#ifdef INDEX
+#define INDEX_SIZE BLOCK_SIZE
+//value a at index ai preferred over value b at index bi
+#define BETTER(a, ai, b, bi) \
+    (COMBINE(a, b) || (!(COMBINE(b, a)) && (ai) < (bi)))
+#else
+#define INDEX_SIZE 1
+#endif
+
+//------------------------------------------------------------------------------
+//tree reduction of the BLOCK_SIZE values, and indices, in local memory;
+//result in element 0
+void reduce_local(__local real_t* cache, __local int* index) {
+    const int lid = get_local_id(0);
+    for(int step = BLOCK_SIZE / 2; step > 0; step /= 2) {
+        if(lid < step) {
+#ifdef INDEX
+            if(BETTER(cache[lid + step], index[lid + step],
+                      cache[lid], index[lid])) {
+                cache[lid] = cache[lid + step];
+                index[lid] = index[lid + step];
+            }
+#else
+            cache[lid] = COMBINE(cache[lid], cache[lid + step]);
+#endif
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+//------------------------------------------------------------------------------
+//map and reduce of the first n elements of v1 and v2: each work item loops
+//over the input with a grid stride, accumulating in private memory, then the
+//values of the work group are reduced in local memory; the partial result
+//of each work group is stored in partial and, if INDEX is defined, the index
+//of the selected element in partialIndex. The n % VEC_WIDTH trailing
+//elements are processed by the first work items with scalar loads
+__kernel void reduce(__global const real_t* v1,
+                     __global const real_t* v2,
+                     int n,
+                     __global real_t* partial,
+                     __global int* partialIndex) {
+    __local real_t cache[BLOCK_SIZE];
+    __local int index[INDEX_SIZE];
+    const int lid = get_local_id(0);
+    const int stride = get_global_size(0);
+    const int vecSize = n / VEC_WIDTH;
+#ifdef INDEX
+    real_t best = IDENTITY;
+    int bestIndex = n;
+    for(int i = get_global_id(0); i < vecSize; i += stride) {
+        const vec_real_t m = MAP(LOAD(i, v1), LOAD(i, v2));
+        for(int k = 0; k != VEC_WIDTH; ++k) {
+            if(BETTER(LANE(m, k), i * VEC_WIDTH + k, best, bestIndex)) {
+                best = LANE(m, k);
+                bestIndex = i * VEC_WIDTH + k;
+            }
+        }
+    }
+    for(int i = vecSize * VEC_WIDTH + get_global_id(0); i < n; i += stride) {
+        const real_t m = MAP(v1[i], v2[i]);
+        if(BETTER(m, i, best, bestIndex)) {
+            best = m;
+            bestIndex = i;
+        }
+    }
+    cache[lid] = best;
+    index[lid] = bestIndex;
+#else
+    vec_real_t acc = (vec_real_t) (IDENTITY);
+    for(int i = get_global_id(0); i < vecSize; i += stride) {
+        acc = COMBINE(acc, MAP(LOAD(i, v1), LOAD(i, v2)));
+    }
+    real_t s = LANE(acc, 0);
+    for(int k = 1; k < VEC_WIDTH; ++k) s = COMBINE(s, LANE(acc, k));
+    for(int i = vecSize * VEC_WIDTH + get_global_id(0); i < n; i += stride) {
+        s = COMBINE(s, MAP(v1[i], v2[i]));
+    }
+    cache[lid] = s;
+#endif
+    barrier(CLK_LOCAL_MEM_FENCE);
+    reduce_local(cache, index);
+    if(lid == 0) {
+        partial[get_group_id(0)] = cache[0];
+#ifdef INDEX
+        partialIndex[get_group_id(0)] = index[0];
+#endif
+    }
+}
+
+//------------------------------------------------------------------------------
+//combines the n partial results, and indices, computed by reduce; launch
+//with a single work group: the result is stored in partial[0] and
+//partialIndex[0]
+__kernel void reduce_partials(__global real_t* partial,
+                              __global int* partialIndex,
+                              int n) {
+    __local real_t cache[BLOCK_SIZE];
+    __local int index[INDEX_SIZE];
+    const int lid = get_local_id(0);
+#ifdef INDEX
+    real_t best = IDENTITY;
+    int bestIndex = INT_MAX;
+    for(int i = lid; i < n; i += BLOCK_SIZE) {
+        if(BETTER(partial[i], partialIndex[i], best, bestIndex)) {
+            best = partial[i];
+            bestIndex = partialIndex[i];
+        }
+    }
+    cache[lid] = best;
+    index[lid] = bestIndex;
+#else
+    real_t s = IDENTITY;
+    for(int i = lid; i < n; i += BLOCK_SIZE) s = COMBINE(s, partial[i]);
+    cache[lid] = s;
+#endif
+    barrier(CLK_LOCAL_MEM_FENCE);
+    reduce_local(cache, index);
+    if(lid == 0) {
+        partial[0] = cache[0];
+#ifdef INDEX
+        partialIndex[0] = index[0];
+#endif
+    }
+}
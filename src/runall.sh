@@ -16,12 +16,46 @@ echo $'\n=== 04_matrix_multiply - block ==='
 $RUN $DIR/04_matrix_multiply "$PLATFORM" default 0 $CLSRC/04_matrix_multiply.cl block_matmul
 echo $'\n=== 05_dot_product ==='
 $RUN $DIR/05_dot_product "$PLATFORM" default 0 $CLSRC/05_dot_product.cl dotprod
+echo $'\n=== 05_dot_product - 16Mi elements in chunks of 4Mi ==='
+$RUN $DIR/05_dot_product "$PLATFORM" default 0 $CLSRC/05_dot_product.cl dotprod 16777216 4194304
 echo $'\n=== 06_matrix_multiply_timing ==='
 $RUN $DIR/06_matrix_multiply_timing "$PLATFORM" default 0 $CLSRC/04_matrix_multiply.cl matmul 256 16
 echo $'\n=== 06_matrix_multiply_timing - block ==='
 $RUN $DIR/06_matrix_multiply_timing "$PLATFORM" default 0 $CLSRC/04_matrix_multiply.cl block_matmul 256 16
+echo $'\n=== 06_matrix_multiply_timing - block, all devices ==='
+$RUN $DIR/06_matrix_multiply_timing all all all $CLSRC/04_matrix_multiply.cl block_matmul 256 16 --adaptive
+echo $'\n=== 06_matrix_multiply_timing - block, autotuned block size ==='
+$RUN $DIR/06_matrix_multiply_timing "$PLATFORM" default 0 $CLSRC/04_matrix_multiply.cl block_matmul 256 auto
+echo $'\n=== 06_matrix_multiply_timing - block, fastest device ==='
+$RUN $DIR/06_matrix_multiply_timing all fastest-for:block_matmul 0 $CLSRC/04_matrix_multiply.cl block_matmul 256 16
+echo $'\n=== 06_matrix_multiply_timing - register blocked ==='
+$RUN $DIR/06_matrix_multiply_timing "$PLATFORM" default 0 $CLSRC/04_matrix_multiply.cl block_matmul_reg 256 16 --tm=4 --tn=4
+echo $'\n=== 06_matrix_multiply_timing - register blocked, tall and skinny ==='
+$RUN $DIR/06_matrix_multiply_timing "$PLATFORM" default 0 $CLSRC/04_matrix_multiply.cl block_matmul_reg 4099x33x250 16 --tm=4 --tn=2
+echo $'\n=== 06_matrix_multiply_timing - transposed B, pack time reported separately ==='
+$RUN $DIR/06_matrix_multiply_timing "$PLATFORM" default 0 $CLSRC/04_matrix_multiply.cl block_matmul_tn 1024 16
+echo $'\n=== 06_matrix_multiply_timing - out-of-core, 512x512 tiles ==='
+$RUN $DIR/06_matrix_multiply_timing "$PLATFORM" default 0 $CLSRC/04_matrix_multiply.cl block_matmul 2048 16 --out-of-core=512
+echo $'\n=== 06_matrix_multiply_timing - async prefetch vs block, block sizes up to 32 ==='
+$RUN $DIR/06_matrix_multiply_timing "$PLATFORM" default 0 $CLSRC/04_matrix_multiply.cl block_matmul_async 1024 32 --block-sweep
+echo $'\n=== 06_matrix_multiply_timing - half precision storage, single precision accumulation ==='
+$RUN $DIR/06_matrix_multiply_timing "$PLATFORM" default 0 $CLSRC/04_matrix_multiply.cl block_matmul 1024 16 --half
+echo $'\n=== 06_matrix_multiply_timing - benchmark, size sweep, CSV ==='
+$RUN $DIR/06_matrix_multiply_timing "$PLATFORM" default 0 $CLSRC/04_matrix_multiply.cl block_matmul 256 16 --benchmark --sizes=256,512,1024,1000x300x700
+echo $'\n=== 06_matrix_multiply_timing - benchmark, JSON ==='
+$RUN $DIR/06_matrix_multiply_timing "$PLATFORM" default 0 $CLSRC/04_matrix_multiply.cl block_matmul_reg 1024 16 --tm=4 --tn=4 --benchmark --warmup=5 --reps=20 --json
+echo $'\n=== 06_matrix_multiply_timing - host baseline ==='
+$RUN $DIR/06_matrix_multiply_timing "$PLATFORM" default 0 $CLSRC/04_matrix_multiply.cl host 1024 16
 echo $'\n=== 07_convolution'
 $RUN $DIR/07_convolution "$PLATFORM" default 0 $CLSRC/07_stencil.cl filter 258 16 std
+echo $'\n=== 07_convolution - 100 iterations with buffer pool'
+$RUN $DIR/07_convolution "$PLATFORM" default 0 $CLSRC/07_stencil.cl filter 258 16 std --iterations=100
+echo $'\n=== 07_convolution - all devices'
+$RUN $DIR/07_convolution all all all $CLSRC/07_stencil.cl filter 258 16 std --adaptive
+echo $'\n=== 07_convolution - autotuned workgroup size'
+$RUN $DIR/07_convolution "$PLATFORM" default 0 $CLSRC/07_stencil.cl filter 258 auto std
+echo $'\n=== 07_convolution - pipelined, 4 strips'
+$RUN $DIR/07_convolution "$PLATFORM" default 0 $CLSRC/07_stencil.cl filter 1026 16 std --pipeline=4
 echo $'\n=== 07_convolution - read from images write to buffer'
 $RUN $DIR/07_convolution "$PLATFORM" default 0 $CLSRC/07_stencil.cl filter_image 258 16 image
 echo $'\n=== 07_convolution - read from images write to image'
@@ -31,3 +65,10 @@ $RUN $DIR/08_cpp 0 default $CLSRC/08_arrayset.cl arrayset
 echo $'\n=== 09_memcpy - if it fails try without page-locked switch'
 _128MB=134217728
 $RUN $DIR/09_memcpy 0 default 0 $_128MB page-locked 
+echo $'\n=== 14_batched_matmul - 8x8 and 64x64 matrices'
+$RUN $DIR/14_batched_matmul "$PLATFORM" default 0 $CLSRC/14_batched_matmul.cl 8
+$RUN $DIR/14_batched_matmul "$PLATFORM" default 0 $CLSRC/14_batched_matmul.cl 64 1,10,100,1000 --indexed
+echo $'\n=== 15_mpi_summa - 4 ranks, 2 x 2 process grid'
+$RUN -n 4 -N 1 $DIR/15_mpi_summa "$PLATFORM" default 0 $CLSRC/04_matrix_multiply.cl 1024 16
+echo $'\n=== 16_reduce - 16Mi elements'
+$RUN $DIR/16_reduce "$PLATFORM" default 0 $CLSRC/reduce.cl 16777216 4